@@ -22,6 +22,10 @@
 #define IP_LOG_FILE STACX_LOG_FILE
 #endif
 
+#ifndef IP_POOR_RSSI
+#define IP_POOR_RSSI -80
+#endif
+
 #ifndef IP_ENABLE_OTA
 #define IP_ENABLE_OTA false
 #endif
@@ -67,6 +71,10 @@ struct _ota_context {
 #ifndef IP_TCP_KEEPALIVE_COUNT
 #define IP_TCP_KEEPALIVE_COUNT 1
 #endif
+// how long a released connection is kept open for reuse (0=close on release)
+#ifndef IP_TCP_POOL_IDLE_SEC
+#define IP_TCP_POOL_IDLE_SEC 30
+#endif
 
 
 //
@@ -98,6 +106,7 @@ public:
 #if USE_IP_TCPCLIENT
     for (int i=0; i<CLIENT_SESSION_MAX; i++) {
       this->ip_clients[i] = NULL;
+      this->ip_client_idle_since[i] = 0;
     }
 #endif // USE_IP_TCPCLIENT
   }
@@ -119,6 +128,12 @@ public:
   virtual void setIpAddress(String address_str) { ip_addr_str = address_str; }
   virtual String ipAddressString() { return ip_addr_str; }
   virtual int getRssi() { return 0; }
+  // Signal strength for periodic checks, which may be refreshed in the background
+  virtual int ipPollRssi() { return getRssi(); }
+  // True if traffic on this link is costly (eg. cellular), so should be grouped
+  virtual bool ipIsMetered() { return false; }
+  // True if the signal strength reported by getRssi is poor for this link type
+  virtual bool ipSignalIsPoor(int rssi) { return (rssi < 0) && (rssi < ip_poor_rssi); }
   virtual String getApName() {return ip_ap_name;}
   virtual int getConnectCount() { return ip_connect_count; }
   virtual int getConnectAttemptCount() { return ip_connect_attempt_count; }
@@ -138,6 +153,7 @@ public:
   virtual bool ipPullUpdate(String url, bool noaction=false) {return false;}
   virtual void ipRollbackUpdate(String url) {}
   virtual bool ftpPut(String host, String user, String pass, String path, const char *buf, int buf_len) { return false; }
+  virtual bool ftpPutFile(String host, String user, String pass, String path, fs::FS *fs, String filename) { return false; }
   virtual int ftpGet(String host, String user, String pass, String path, char *buf, int buf_max) { return -1; }
   virtual void ipCommsState(enum comms_state s, codepoint_t where=undisclosed_location)
   {
@@ -167,9 +183,15 @@ public:
 
 #if USE_IP_TCPCLIENT
   virtual Client *tcpConnect(String host, int port, int *slot_r=NULL);
-  virtual void tcpRelease(Client *client);
+  // keep=true leaves an open connection in the pool for a later tcpConnect to the same host:port
+  virtual void tcpRelease(Client *client, bool keep=false);
   // subclasses that implement stream connections must override this method (eg see abstract_ip_lte.h)
   virtual Client *newClient(int slot){return NULL;};
+  // Guard removal from ip_clients[] against another task that walks it
+  // (eg. a modem service task, see AbstractIpModemLeaf).  Lock returns
+  // true if there is something for unlock to release.
+  virtual bool tcpSlotLock() { return false; }
+  virtual void tcpSlotUnlock(bool release) {}
 #endif // USE_IP_TCPCLIENT
   int getTimeSource() { return
       ip_time_source; }
@@ -220,8 +242,16 @@ protected:
   bool ip_enable_ssl = false;
   bool ip_enable_ota = IP_ENABLE_OTA;
   int ip_rssi=0;
+  int ip_poor_rssi = IP_POOR_RSSI;
 #if USE_IP_TCPCLIENT
   Client *ip_clients[CLIENT_SESSION_MAX];
+  String ip_client_dest[CLIENT_SESSION_MAX];                // host:port
+  unsigned long ip_client_idle_since[CLIENT_SESSION_MAX];   // 0=in use
+  int ip_tcp_pool_idle_sec = IP_TCP_POOL_IDLE_SEC;
+  int ip_tcp_pool_reuse_count = 0;
+  int ip_tcp_pool_open_count = 0;
+
+  void tcpPoolExpire(unsigned long now, bool all=false);
 public:
   bool ip_tcp_keepalive_enable = IP_TCP_KEEPALIVE_ENABLE;
   int ip_tcp_keepalive_idle = IP_TCP_KEEPALIVE_IDLE_SEC;
@@ -301,11 +331,42 @@ void AbstractIpLeaf::ipOnDisconnect(){
 Client *AbstractIpLeaf::tcpConnect(String host, int port, int *slot_r) {
   LEAF_ENTER(L_NOTICE);
 
+  String dest = host+":"+String(port);
   int slot;
+
+  // Use an idle pooled connection to the same place if it is still good
+  for (slot = 0; slot < CLIENT_SESSION_MAX; slot++) {
+    Client *client = ip_clients[slot];
+    if (!client || !ip_client_idle_since[slot] || (ip_client_dest[slot] != dest)) continue;
+    if (client->connected() && !client->available()) {
+      LEAF_NOTICE("Reuse idle TCP client at slot %d for %s", slot, dest.c_str());
+      ip_client_idle_since[slot] = 0;
+      ++ip_tcp_pool_reuse_count;
+      if (slot_r) *slot_r=slot;
+      LEAF_RETURN(client);
+    }
+    // closed by the peer, or holding data nobody asked for
+    LEAF_NOTICE("Discard stale idle TCP client at slot %d", slot);
+    client->stop();
+    tcpRelease(client);
+  }
+
+  int oldest = -1;
   for (slot = 0; slot < CLIENT_SESSION_MAX; slot++) {
     if (ip_clients[slot] == NULL) {
       break;
     }
+    if (ip_client_idle_since[slot] &&
+	((oldest < 0) || (ip_client_idle_since[slot] < ip_client_idle_since[oldest]))) {
+      oldest = slot;
+    }
+  }
+  if ((slot >= CLIENT_SESSION_MAX) && (oldest >= 0)) {
+    // all slots taken, make room by closing the longest idle connection
+    LEAF_NOTICE("Close idle TCP client at slot %d (%s) to make room", oldest, ip_client_dest[oldest].c_str());
+    ip_clients[oldest]->stop();
+    tcpRelease(ip_clients[oldest]);
+    slot = oldest;
   }
   if (slot >= CLIENT_SESSION_MAX) {
     LEAF_ALERT("No free slots for TCP connection");
@@ -317,13 +378,17 @@ Client *AbstractIpLeaf::tcpConnect(String host, int port, int *slot_r) {
     LEAF_RETURN(NULL);
   }
   LEAF_NOTICE("New TCP client at slot %d", slot);
+  ip_client_dest[slot] = dest;
+  ip_client_idle_since[slot] = 0;
 
   int conn_result = client->connect(host.c_str(), port);
   if (conn_result==1) {
     LEAF_WARN("TCP client %d connected", slot);
+    ++ip_tcp_pool_open_count;
   }
   else if (conn_result==2) {
     LEAF_WARN("TCP client %d connection pending", slot);
+    ++ip_tcp_pool_open_count;
   }
   else {
     LEAF_ALERT("TCP client %d connect failed", slot);
@@ -335,14 +400,23 @@ Client *AbstractIpLeaf::tcpConnect(String host, int port, int *slot_r) {
   LEAF_RETURN(client);
 }
 
-void AbstractIpLeaf::tcpRelease(Client *client)
+void AbstractIpLeaf::tcpRelease(Client *client, bool keep)
 {
   LEAF_ENTER_PTR(L_NOTICE, client);
   bool found = false;
+  bool release = tcpSlotLock();
   for (int slot=0; slot < CLIENT_SESSION_MAX ; slot++) {
     if (ip_clients[slot] == client) {
+      if (keep && ip_tcp_pool_idle_sec && client->connected()) {
+	LEAF_NOTICE("Keep TCP slot %d (%s) for reuse", slot, ip_client_dest[slot].c_str());
+	ip_client_idle_since[slot] = millis()|1;
+	tcpSlotUnlock(release);
+	LEAF_VOID_RETURN;
+      }
       LEAF_NOTICE("Release TCP slot %d", slot);
       ip_clients[slot] = NULL;
+      ip_client_dest[slot] = "";
+      ip_client_idle_since[slot] = 0;
       found = true;
       break;
     }
@@ -354,9 +428,25 @@ void AbstractIpLeaf::tcpRelease(Client *client)
     LEAF_ALERT("Did not find connection slot matching client %p", client);
   }
   delete client;
+  tcpSlotUnlock(release);
 
   LEAF_LEAVE;
 }
+
+// Close pooled connections that have sat idle too long (or all of them)
+void AbstractIpLeaf::tcpPoolExpire(unsigned long now, bool all)
+{
+  for (int slot=0; slot < CLIENT_SESSION_MAX ; slot++) {
+    Client *client = ip_clients[slot];
+    if (!client || !ip_client_idle_since[slot]) continue;
+    if (all || !client->connected() ||
+	((now - ip_client_idle_since[slot]) >= (ip_tcp_pool_idle_sec * 1000UL))) {
+      LEAF_NOTICE("Close idle TCP client at slot %d (%s)", slot, ip_client_dest[slot].c_str());
+      client->stop();
+      tcpRelease(client);
+    }
+  }
+}
 #endif // USE_IP_TCPCLIENT
 
 const char *AbstractIpLeaf::timeSourceName(int s)
@@ -439,6 +529,7 @@ void AbstractIpLeaf::setup()
     registerUlongValue("ip_disconnect_time", &ip_connect_time, "IP disconnection time", ACL_GET_ONLY, VALUE_NO_SAVE);
     registerUlongValue("ip_report_interval_sec", &ip_report_interval_sec, "Reporting interval for ip status (0=disable)");
 
+    registerIntValue("ip_poor_rssi", &ip_poor_rssi, "Signal strength (dBm) below which the link is considered poor");
     registerBoolValue("ip_enable_ota", &ip_enable_ota, "Support over-the-air firmware update");
 
 
@@ -453,6 +544,7 @@ void AbstractIpLeaf::setup()
     registerIntValue("ip_tcp_keepalive_idle", &ip_tcp_keepalive_idle);
     registerIntValue("ip_tcp_keepalive_interval", &ip_tcp_keepalive_interval);
     registerIntValue("ip_tcp_keepalive_count", &ip_tcp_keepalive_count);
+    registerIntValue("ip_tcp_pool_idle_sec", &ip_tcp_pool_idle_sec, "Keep released TCP connections open this long for reuse (0=close on release)");
 #endif
 
     if (ip_log_connect) do_log=true;
@@ -477,6 +569,11 @@ void AbstractIpLeaf::loop()
     }
   }
 
+#if USE_IP_TCPCLIENT
+  // pooled connections do not outlive the link
+  tcpPoolExpire(millis(), !ip_connected);
+#endif
+
   if (ip_do_notify && (ip_connect_notified != ip_connected)) {
     if (ip_connected) {
       LEAF_INFO("Announcing IP connection, ip=%s", ip_addr_str.c_str());
@@ -567,6 +664,8 @@ void AbstractIpLeaf::ipClientStatus()
     ++count;
   }
   mqtt_publish(String("status/")+getName()+"_client_count", String(count));
+  snprintf(status, sizeof(status), "opened=%d reused=%d", ip_tcp_pool_open_count, ip_tcp_pool_reuse_count);
+  mqtt_publish(String("status/")+getName()+"_client_pool", status);
 
   for (int i=0; i<CLIENT_SESSION_MAX; i++) {
     if (ip_clients[i] == NULL) continue;
@@ -574,6 +673,8 @@ void AbstractIpLeaf::ipClientStatus()
     mqtt_publish(String("status/")+getName()+"_client/"+String(i),
 		 (ip_clients[i]->connected()?"connected":"disconnected")
       );
+    mqtt_publish(String("status/")+getName()+"_client_dest/"+String(i),
+		 ip_client_dest[i] + (ip_client_idle_since[i]?" idle":""));
   }
 }
 #endif
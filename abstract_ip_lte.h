@@ -2,7 +2,61 @@
 #include "abstract_ip_modem.h"
 
 #include "ip_client_lte.h"
+#include "gnss_track.h"
 #include <StreamString.h>
+#include <LittleFS.h>
+#include <base64.h>
+
+#ifndef IP_LTE_EMULATOR
+#define IP_LTE_EMULATOR 0
+#endif
+
+#if IP_LTE_EMULATOR
+#include "modem_emulator.h"
+#endif
+
+#ifndef IP_LTE_SMS_BATCH_MAX
+#define IP_LTE_SMS_BATCH_MAX 32
+#endif
+#ifndef IP_LTE_BENCH_LINES_MAX
+#define IP_LTE_BENCH_LINES_MAX 64
+#endif
+
+#ifndef IP_LTE_GPS_TRACK_PUBLISH_MAX
+#define IP_LTE_GPS_TRACK_PUBLISH_MAX 640
+#endif
+
+// GNSS times before this are a receiver's default date, not a fix
+#ifndef IP_LTE_GPS_CLOCK_MIN_YEAR
+#define IP_LTE_GPS_CLOCK_MIN_YEAR 2024
+#endif
+
+// Upload windows (0=publish as readings arrive)
+#ifndef IP_LTE_UPLOAD_INTERVAL_SEC
+#define IP_LTE_UPLOAD_INTERVAL_SEC 0
+#endif
+
+#ifndef IP_LTE_UPLOAD_WINDOW_SEC
+#define IP_LTE_UPLOAD_WINDOW_SEC 20
+#endif
+
+// Estimated modem current (microamps) in each radio state, for energy accounting
+#ifndef IP_LTE_RADIO_UA
+#define IP_LTE_RADIO_UA "0,60000,90000,1500,10"
+#endif
+
+enum lte_radio_state {
+  LTE_RADIO_OFF = 0,     // modem powered down
+  LTE_RADIO_UNATTACHED,  // modem on, no IP (searching, or GPS only)
+  LTE_RADIO_ACTIVE,      // connected and exchanging data
+  LTE_RADIO_IDLE,        // attached, paging (DRX/eDRX)
+  LTE_RADIO_PSM,         // power saving mode, unreachable
+  LTE_RADIO_STATE_COUNT
+};
+
+static const char * const lte_radio_state_name[LTE_RADIO_STATE_COUNT] = {
+  "off", "unattached", "active", "idle", "psm"
+};
 
 //
 //@************************* class AbstractIpLTELeaf ***************************
@@ -26,6 +80,10 @@
 #define IP_LTE_AP_NAME "telstra.m2m"
 #endif
 
+#ifndef IP_LTE_POOR_CSQ
+#define IP_LTE_POOR_CSQ 10
+#endif
+
 #ifndef IP_LTE_DELAY_CONNECT
 #define IP_LTE_DELAY_CONNECT 0
 #endif
@@ -56,7 +114,20 @@ public:
   virtual void config_pub();
 
 
+#if IP_LTE_EMULATOR
+  SimcomModemEmulator *ipLteEmulator() { return ip_lte_emulator; }
+#endif
   virtual int getRssi();
+  virtual int ipPollRssi();
+  virtual bool ipIsMetered() { return true; }
+  // getRssi gives the negated CSQ value, where 99 means unknown
+  virtual bool ipSignalIsPoor(int rssi) { return (rssi != -99) && (-rssi < IP_LTE_POOR_CSQ); }
+  virtual void ipCommsState(enum comms_state s, codepoint_t where=undisclosed_location)
+  {
+    // the radio stays connected for a while after each exchange (see ip_lte_rrc_tail_sec)
+    if (s == TRANSACTION) ip_lte_last_transfer = millis();
+    AbstractIpModemLeaf::ipCommsState(s, where);
+  }
   virtual bool getNetStatus();
   virtual bool gpsConnected() { return gps_fix; }
 
@@ -73,10 +144,20 @@ public:
   virtual bool ipLinkDown() { return modemSendCmd(HERE, "AT+CNACT=0"); }
   virtual bool ipLinkStatus(bool force_correction=false);
   virtual Client *newClient(int slot);
+  virtual void ipClientStatus();
+  void ipClientsReceive();
 
 protected:
+  IpRxArena *ipRxArena()
+  {
+    if (!ip_rx_arena) ip_rx_arena = new IpRxArena(IP_RX_ARENA_BLOCK, IP_CLIENT_LTE_RX_BLOCKS);
+    return ip_rx_arena;
+  }
+
   virtual void ipOnConnect();
   bool ipProcessSMS(int index=-1);
+  int ipProcessSMSBacklog();
+  bool ipProcessSMSMessage(String sender, String msg);
   bool ipProcessNetworkTime(String Time);
   bool ipCheckTime();
   bool ipCheckGPS(bool log=false);
@@ -84,8 +165,22 @@ protected:
   bool ipGPSPowerStatus();
   bool ipDisableGPS(bool resumeIp=false);
   bool ipPollGPS(bool force=false);
+  bool ipPollGPSQueued();
+  static void ipGPSPollDone(struct ModemCommand *c, void *ctx);
+  static void ipRssiPollDone(struct ModemCommand *c, void *ctx);
   bool ipPollNetworkTime();
   void ipEnableGPSOnly(bool enable=true) { ip_enable_gps_only=enable; }
+  bool ipLteConfigurePower();
+  static String ipLteTimerBits(unsigned long sec, bool active_timer);
+  static int ipLteEdrxCode(unsigned long ms);
+  void ipLteSchedule(unsigned long now);
+  void ipLteWindowOpen(unsigned long now);
+  void ipLteWindowClose(unsigned long now);
+  void ipLteSendHold();
+  void ipLteSetPsm(bool in_psm);
+  void ipLteRadioAccount(unsigned long now);
+  void ipLtePowerStatsReset();
+  void ipLtePowerStatsPub();
 
   bool ipLocationWarm()
   {
@@ -118,7 +213,15 @@ protected:
   }
 
   virtual bool parseNetworkTime(String datestr);
-  virtual bool parseGPS(String gps);
+  virtual bool parseGPS(ModemToken gps);
+  virtual bool ipGPSFix(const GnssFix &fix);
+  int ipUploadGPSTrack();
+  bool ipGatherGPSTrack(const String &pending);
+  bool ipPublishGPSTrack(const uint8_t *buf, int len);
+  void ipConfirmGPSTrack();
+  bool parseSMSHeader(ModemToken hdr, String *sender_r, int *length_r);
+  void modemParseBench(int iterations, String path="");
+  void modemCopyBench(int bytes);
   virtual bool modemProcessURC(String Message);
 
   bool ip_simultaneous_gps = true;
@@ -145,10 +248,58 @@ protected:
   time_t ip_location_timestamp = 0;
   time_t ip_location_fail_timestamp = 0;
   bool ip_gps_active = false;
+  // periodic polls go through the modem command queue, their replies are
+  // picked up by loop()
+  volatile bool ip_gps_poll_pending = false;
+  volatile bool ip_gps_poll_done = false;
+  char ip_gps_poll_buf[160];
+  int ip_gps_poll_len = 0;
+  volatile bool ip_rssi_poll_pending = false;
+  bool ip_gps_track = false;
+  int ip_gps_track_upload_sec = 900;
+  unsigned long ip_gps_track_last_upload = 0;
+  bool ip_gps_track_unconfirmed = false;  // the uploaded log awaits delivery
+  int ip_gps_track_lost = 0;              // pubsubDropCount() when it was uploaded
+  int ip_lte_sms_drain_count = 0;       // size and duration of the last SMS drain
+  unsigned long ip_lte_sms_drain_ms = 0;
+
+  // PSM/eDRX and upload windows
+  bool ip_lte_psm = false;
+  int ip_lte_psm_tau_sec = 3600;      // requested periodic TAU (T3412)
+  int ip_lte_psm_active_sec = 20;     // requested active time before PSM (T3324)
+  bool ip_lte_edrx = false;
+  int ip_lte_edrx_ms = 81920;
+  int ip_lte_edrx_act = 4;            // access technology, 4=LTE-M 5=NB-IoT
+  int ip_lte_upload_interval_sec = IP_LTE_UPLOAD_INTERVAL_SEC;
+  int ip_lte_upload_window_sec = IP_LTE_UPLOAD_WINDOW_SEC;
+  int ip_lte_gps_lead_sec = 120;
+  int ip_lte_rrc_tail_sec = 10;
+  String ip_lte_radio_ua = IP_LTE_RADIO_UA;
+  bool ip_lte_in_psm = false;
+  bool ip_lte_psm_probe_saved = false;
+  int ip_lte_hold_level = 0;          // 0=none 1=telemetry held 2=everything held
+  bool ip_lte_window_open = false;
+  unsigned long ip_lte_window_start = 0;
+  unsigned long ip_lte_window_next = 0;
+  unsigned long ip_lte_window_count = 0;
+  unsigned long ip_lte_window_batch = 0;    // publishes released by windows
+  unsigned long ip_lte_window_ms = 0;
+  unsigned long ip_lte_psm_wake_count = 0;
+  unsigned long ip_lte_last_transfer = 0;
+  int ip_lte_radio_state = LTE_RADIO_OFF;
+  unsigned long ip_lte_radio_since = 0;
+  unsigned long ip_lte_radio_ms[LTE_RADIO_STATE_COUNT] = {0};
+  unsigned long ip_lte_radio_entries[LTE_RADIO_STATE_COUNT] = {0};
+  unsigned long ip_lte_stats_since = 0;
+  unsigned long ip_lte_stats_readings = 0;  // telemetry count when stats were reset
+  IpRxArena *ip_rx_arena = NULL;            // receive buffers shared by all sockets
+  int ip_rx_next_slot = 0;                  // where the next round of socket reads begins
   unsigned long ip_gps_active_timestamp = 0;
   unsigned long ip_gps_acquire_duration = 0;
   int ip_lte_connect_attempt_max = 0;
   int ip_ftp_timeout_sec = 30;
+  int ip_ftp_last_bytes = 0;       // size and duration of the last FTP transfer
+  unsigned long ip_ftp_last_ms = 0;
 
   bool ip_abort_no_service = false;
   bool ip_abort_no_signal = true;
@@ -168,10 +319,24 @@ protected:
   unsigned long last_sms_check = 0;
   unsigned long last_gps_fix_check = 0;
   bool gps_fix = false;
+  GnssParser gnss_parser;     // loop task only: fed by parseGPS and by NMEA URCs, see modemDispatchURC
+  GnssFixFilter gnss_filter;
+  GnssTrackLog gnss_track;
+  GnssFix gnss_location;      // the fix last copied to latitude, longitude etc.
+#if IP_LTE_EMULATOR
+  SimcomModemEmulator *ip_lte_emulator = NULL;
+#endif
 
 };
 
 void AbstractIpLTELeaf::setup(void) {
+#if IP_LTE_EMULATOR
+    if (!modem_stream) {
+      // stand-in modem, for exercising the modem stack without hardware
+      ip_lte_emulator = new SimcomModemEmulator();
+      modemSetStream(ip_lte_emulator);
+    }
+#endif
     AbstractIpModemLeaf::setup();
     LEAF_ENTER(L_INFO);
 
@@ -206,6 +371,27 @@ void AbstractIpLTELeaf::setup(void) {
     registerIntValue("gps_check_interval", &gps_check_interval, "Interval for location checks (when doing continuous gps)");
     registerIntValue("ip_ftp_timeout_sec", &ip_ftp_timeout_sec, "Timeout (in seconds) for FTP operations");
 
+    registerBoolValue("ip_gps_track", &ip_gps_track, "Record filtered GPS fixes to a track log in flash for batch upload, instead of publishing each fix");
+    registerIntValue("ip_gps_track_upload_sec", &ip_gps_track_upload_sec, "Interval between uploads of the GPS track log (0=on command only)");
+    registerIntValue("ip_gps_track_max_bytes", &gnss_track.max_bytes, "Size at which the GPS track log is rotated");
+    registerIntValue("ip_gps_filter_hdop", &gnss_filter.max_hdop, "Ignore GPS fixes with HDOP above this (x100, 0=no limit)");
+    registerIntValue("ip_gps_filter_distance", &gnss_filter.min_distance, "Movement in metres needed to record a GPS fix");
+    registerIntValue("ip_gps_filter_speed", &gnss_filter.min_speed, "Speed (km/h x100) at which the receiver is taken to be moving");
+    registerIntValue("ip_gps_filter_heartbeat_sec", &gnss_filter.heartbeat_sec, "Record a GPS fix at least this often when stationary");
+    gnss_track.fs = &LittleFS;
+
+    registerBoolValue("ip_lte_psm", &ip_lte_psm, "Request power saving mode (PSM) from the network");
+    registerIntValue("ip_lte_psm_tau_sec", &ip_lte_psm_tau_sec, "Requested PSM periodic update interval (T3412)");
+    registerIntValue("ip_lte_psm_active_sec", &ip_lte_psm_active_sec, "Requested time to remain reachable before entering PSM (T3324)");
+    registerBoolValue("ip_lte_edrx", &ip_lte_edrx, "Request extended discontinuous reception (eDRX) from the network");
+    registerIntValue("ip_lte_edrx_ms", &ip_lte_edrx_ms, "Requested eDRX cycle in milliseconds (5120 to 10485760)");
+    registerIntValue("ip_lte_edrx_act", &ip_lte_edrx_act, "Access technology for eDRX (4=LTE-M, 5=NB-IoT)");
+    registerIntValue("ip_lte_upload_interval_sec", &ip_lte_upload_interval_sec, "Hold telemetry for upload windows this far apart (0=publish immediately)");
+    registerIntValue("ip_lte_upload_window_sec", &ip_lte_upload_window_sec, "Minimum duration of an upload window");
+    registerIntValue("ip_lte_gps_lead_sec", &ip_lte_gps_lead_sec, "When using upload windows, refresh location this long before a window");
+    registerIntValue("ip_lte_rrc_tail_sec", &ip_lte_rrc_tail_sec, "Time the radio is assumed to stay active after a transfer");
+    registerStrValue("ip_lte_radio_ua", &ip_lte_radio_ua, "Estimated modem current in uA when off,unattached,active,idle,psm");
+
     // if set ip_lte_ap* overrids ip_ap_* for LTE modem
     registerStrValue("ip_lte_ap_name", &ip_ap_name, "LTE Access point name");
     registerStrValue("ip_lte_ap_user", &ip_ap_user, "LTE Access point username");
@@ -244,8 +430,20 @@ void AbstractIpLTELeaf::setup(void) {
     registerCommand(HERE,"ip_ping", "Send an ICMP echo (PING) packet train, for link testing");
     registerCommand(HERE,"ip_dns", "Peform a DNS lookup, for IP testing");
     registerCommand(HERE,"ip_tcp_connect", "Establish a TCP connection");
+    registerCommand(HERE,"ip_tcp_release", "Return a TCP connection (payload is slot) to the pool for reuse");
     registerCommand(HERE,"sms", "Send an SMS message (payload is number,msg)");
+    registerCommand(HERE,"ftp_put_file", "Upload a LittleFS file via FTP (payload is host,user,pass,remote_path,local_file)");
     registerCommand(HERE,"gps_config", "Report on configuration an status of gps");
+    registerCommand(HERE,"gps_track_upload", "Publish the GPS track log to status/gps_track, and clear it once delivered");
+    registerCommand(HERE,"gps_track_status", "Report GPS filter and track log counters");
+    registerCommand(HERE,"ip_lte_power_stats", "Publish time in each radio state and estimated energy per reading (payload reset=clear counters)");
+    registerCommand(HERE,"ip_lte_power_config", "Apply and report PSM/eDRX settings");
+    registerCommand(HERE,"ip_lte_window", "Open an upload window now");
+#if IP_LTE_EMULATOR
+    registerCommand(HERE,"sms_backlog_bench", "Time draining a backlog of SMS from the emulated modem (payload is count)");
+#endif
+    registerCommand(HERE,"modem_parse_bench", "Time the receive ring and response parsers over a recorded modem transcript (payload is iterations[,file])");
+    registerCommand(HERE,"modem_copy_bench", "Time copying a bulk payload from a stream into a socket rx queue, direct and through a staging block, in KB/s, with no modem involved (payload is bytes)");
 
     LEAF_LEAVE;
   }
@@ -301,6 +499,11 @@ void AbstractIpLTELeaf::ipStatus(String status_topic)
   }
 
   AbstractIpModemLeaf::ipStatus(status_topic);
+  if (ip_lte_sms_drain_count) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "{\"count\":%d,\"ms\":%lu}", ip_lte_sms_drain_count, ip_lte_sms_drain_ms);
+    mqtt_publish("status/sms_drain", buf);
+  }
   LEAF_LEAVE;
 
 }
@@ -329,11 +532,29 @@ void AbstractIpLTELeaf::loop(void)
   AbstractIpModemLeaf::loop();
   LEAF_ENTER(L_TRACE);
 
+  ipLteRadioAccount(millis());
   if (!canRun() || !modemIsPresent()) {
     //LEAF_NOTICE("Modem not ready");
     LEAF_VOID_RETURN;
   }
 
+  ipLteSchedule(millis());
+  if (ip_lte_in_psm) {
+    // the modem will not answer until woken for the next upload window
+    LEAF_VOID_RETURN;
+  }
+
+  if (ip_gps_poll_done) {
+    // a queued position poll has been answered
+    ip_gps_poll_done = false;
+    if (ip_gps_poll_len) {
+      parseGPS(ModemToken(ip_gps_poll_buf, ip_gps_poll_len));
+    }
+    else {
+      LEAF_ALERT("Did not get GPS response");
+    }
+  }
+
   // Check if it is time to (re-)enable GPS and look for a fix
   if (ip_enable_gps) {
     if (!ip_gps_active) {
@@ -345,14 +566,14 @@ void AbstractIpLTELeaf::loop(void)
 	// If GPS is already enabled, and has a fix, check for a change of location infrequently
 	if (now >= (last_gps_check + gps_check_interval)) {
 	  last_gps_check = now;
-	  ipPollGPS();
+	  ipPollGPSQueued();
 	}
       }
       else {
 	// GPS is enabled but has no fix, check for a fix frequently (so that if
 	// simultaneous GPS is not supported, we can resume IP)
 	if (now >= (last_gps_fix_check + ip_modem_gps_fix_check_interval)) {
-	  ipPollGPS();
+	  ipPollGPSQueued();
 	  last_gps_fix_check = millis();
 	}
 
@@ -375,6 +596,16 @@ void AbstractIpLTELeaf::loop(void)
     } // endif !ip_gps_active
   } // endif ip_enable_gps
 
+  if (ip_gps_track && ip_gps_track_upload_sec &&
+      (millis() >= (ip_gps_track_last_upload + ip_gps_track_upload_sec*1000UL)) &&
+      isConnected() && pubsubLeaf && (pubsubLeaf->getIpComms()==this) && pubsubLeaf->isConnected()) {
+    ip_gps_track_last_upload = millis();
+    ipUploadGPSTrack();
+  }
+  if (ip_gps_track_unconfirmed) {
+    ipConfirmGPSTrack();
+  }
+
   if (ip_enable_sms) {
     if (millis() >= (last_sms_check+sms_check_interval)) {
       last_sms_check=millis();
@@ -420,9 +651,16 @@ bool AbstractIpLTELeaf::getNetStatus() {
 bool AbstractIpLTELeaf::ipLinkStatus(bool force_correction) {
   bool status = AbstractIpModemLeaf::ipLinkStatus(force_correction);
   if (status) {
-    String status_str = modemQuery("AT+CNACT?", "+CNACT: ",10*modem_timeout_default, HERE);
-    LEAF_NOTICE("Connection status %s", status_str.c_str());
-    status = (status_str.toInt()==1);
+    ModemFieldTokenizer fields(modem_response_buf, 0);
+    modemWaitBufferMutex(HERE);
+    if (modemQueryFields("AT+CNACT?", "+CNACT: ", &fields, 10*modem_timeout_default, HERE)) {
+      LEAF_NOTICE("Connection status %s", modem_response_buf);
+      status = (fields.nextInt()==1);
+    }
+    else {
+      status = false;
+    }
+    modemReleaseBufferMutex(HERE);
   }
   if (force_correction) {
     if (force_correction) {
@@ -446,7 +684,12 @@ bool AbstractIpLTELeaf::ipLinkStatus(bool force_correction) {
 int AbstractIpLTELeaf::getRssi(void)
 {
   int rssi = -99;
+  bool release;
 
+  if (!modemWaitPortForPoll(HERE, &release)) {
+    LEAF_NOTICE("Modem is busy, reporting last known RSSI");
+    return ip_rssi;
+  }
   if (modemSendExpectInt("AT+CSQ","+CSQ: ", &rssi, -1, HERE)) {
     rssi = 0 - rssi;
     //LEAF_INFO("Got RSSI %d", rssi);
@@ -455,10 +698,38 @@ int AbstractIpLTELeaf::getRssi(void)
   else {
     LEAF_ALERT("Modem CSQ (rssi) query failed");
   }
+  if (release) modemReleasePortMutex(HERE);
 
   return rssi;
 }
 
+//
+// Refresh the signal strength by way of the command queue, without
+// waiting.  Returns the last known value.
+//
+int AbstractIpLTELeaf::ipPollRssi()
+{
+  if (!modemIsPresent()) return ip_rssi;
+  if (!ip_rssi_poll_pending) {
+    ip_rssi_poll_pending = true;
+    if (!modemCommandSubmit("AT+CSQ", ipRssiPollDone, this)) {
+      ip_rssi_poll_pending = false;
+    }
+  }
+  return ip_rssi;
+}
+
+// runs in the modem polling task
+void AbstractIpLTELeaf::ipRssiPollDone(struct ModemCommand *c, void *ctx)
+{
+  AbstractIpLTELeaf *leaf = (AbstractIpLTELeaf *)ctx;
+  int pos = c->ok()?c->response.indexOf("+CSQ: "):-1;
+  if (pos >= 0) {
+    leaf->ip_rssi = 0 - ModemToken(c->response.c_str()+pos+6).toInt(99);
+  }
+  leaf->ip_rssi_poll_pending = false;
+}
+
 void AbstractIpLTELeaf::ipOnConnect()
 {
   AbstractIpModemLeaf::ipOnConnect();
@@ -474,6 +745,9 @@ void AbstractIpLTELeaf::ipOnConnect()
     ipPollNetworkTime();
   }
   getRssi();
+  if (ip_lte_psm || ip_lte_edrx) {
+    ipLteConfigurePower();
+  }
   LEAF_VOID_RETURN;
 }
 
@@ -484,6 +758,12 @@ bool AbstractIpLTELeaf::valueChangeHandler(String topic, Value *v) {
       ip_connect_attempt_max=VALUE_AS_INT(v);
       LEAF_NOTICE("IP (wifi) connect limit", ip_connect_attempt_max);
   })
+  ELSEWHENPREFIX("ip_lte_psm", {
+      if (modemIsPresent()) ipLteConfigurePower();
+  })
+  ELSEWHENPREFIX("ip_lte_edrx", {
+      if (modemIsPresent()) ipLteConfigurePower();
+  })
   else {
     handled = AbstractIpModemLeaf::valueChangeHandler(topic, v);
   }
@@ -502,6 +782,29 @@ bool AbstractIpLTELeaf::commandHandler(String type, String name, String topic, S
   ELSEWHEN("gps_enable", ipEnableGPS())
   ELSEWHEN("gps_disable", ipDisableGPS(payload.toInt()))
   ELSEWHEN("gps_poll", ipPollGPS(true))
+#if IP_LTE_EMULATOR
+  ELSEWHEN("sms_backlog_bench",{
+      int n = payload.length()?payload.toInt():30;
+      if (ip_lte_emulator) {
+	for (int i=0; i<n; i++) {
+	  ip_lte_emulator->addSMS("+61400000000", "cmd/ping "+String(i), false);
+	}
+	unsigned long start = millis();
+	int count = ipProcessSMSBacklog();
+	unsigned long elapsed = millis() - start;
+	char buf[80];
+	snprintf(buf, sizeof(buf), "{\"queued\":%d,\"drained\":%d,\"ms\":%lu,\"ms_each\":%lu}", n, count, elapsed, (count>0)?elapsed/count:0);
+	mqtt_publish("status/sms_backlog_bench", buf);
+      }
+    })
+#endif
+  ELSEWHEN("modem_parse_bench",{
+      // payload is iterations[,transcript_file]
+      int comma = payload.indexOf(',');
+      int iterations = payload.length()?payload.toInt():1000;
+      modemParseBench(iterations, (comma<0)?"":payload.substring(comma+1));
+    })
+  ELSEWHEN("modem_copy_bench", modemCopyBench(payload.length()?payload.toInt():262144))
   ELSEWHEN("ip_lte_status",{
       getRssi();
       ipStatus("ip_lte_status");
@@ -574,7 +877,17 @@ bool AbstractIpLTELeaf::commandHandler(String type, String name, String topic, S
 	}
       }
     })
-    ELSEWHEN("ip_lte_modem_info",{
+    ELSEWHEN("ip_tcp_release",{
+      // keep the connection open for the next ip_tcp_connect to the same place
+      int slot = payload.toInt();
+      if ((slot >= 0) && (slot < CLIENT_SESSION_MAX) && ip_clients[slot]) {
+	tcpRelease(ip_clients[slot], true);
+      }
+      else {
+	LEAF_ALERT("No TCP client in slot %d", slot);
+      }
+    })
+  ELSEWHEN("ip_lte_modem_info",{
 	config_pub();
     })
   ELSEWHEN("ip_lte_signal",{
@@ -587,6 +900,60 @@ bool AbstractIpLTELeaf::commandHandler(String type, String name, String topic, S
       String rsp = modemQuery("AT+CPSI?","+CPSI: ",-1,HERE);
       mqtt_publish("status/ip_lte_network", rsp);
     })
+  ELSEWHEN("ftp_put_file",{
+      String args[5];
+      int n = 0;
+      int pos = 0;
+      while ((n < 4) && (pos >= 0)) {
+	int comma = payload.indexOf(',', pos);
+	if (comma < 0) break;
+	args[n++] = payload.substring(pos, comma);
+	pos = comma+1;
+      }
+      args[n++] = payload.substring(pos);
+      if (n < 5) {
+	LEAF_ALERT("ftp_put_file needs host,user,pass,remote_path,local_file");
+      }
+      else {
+	ip_ftp_last_bytes = 0;
+	ip_ftp_last_ms = 0;
+	bool ok = ftpPutFile(args[0], args[1], args[2], args[3], &LittleFS, args[4]);
+	unsigned long ms = ip_ftp_last_ms?ip_ftp_last_ms:1;
+	char status_buf[80];
+	snprintf(status_buf, sizeof(status_buf), "%s %d bytes %lums %lu.%01lu KB/s",
+		 ok?"ok":"fail", ip_ftp_last_bytes, ip_ftp_last_ms,
+		 (unsigned long)((uint64_t)ip_ftp_last_bytes*1000/1024/ms),
+		 (unsigned long)((uint64_t)ip_ftp_last_bytes*10000/1024/ms)%10);
+	mqtt_publish("status/ftp_put_file", status_buf);
+      }
+    })
+  ELSEWHEN("ip_lte_power_stats",{
+      ipLtePowerStatsPub();
+      if (payload == "reset") ipLtePowerStatsReset();
+    })
+  ELSEWHEN("ip_lte_power_config",{
+      ipLteConfigurePower();
+      mqtt_publish("status/ip_lte_psm", modemQuery("AT+CPSMS?", "+CPSMS: ", -1, HERE));
+      mqtt_publish("status/ip_lte_edrx", modemQuery("AT+CEDRXRDP", "+CEDRXRDP: ", -1, HERE));
+    })
+  ELSEWHEN("ip_lte_window",{
+      if (!ip_lte_window_open) ipLteWindowOpen(millis());
+    })
+  ELSEWHEN("gps_track_upload",{
+      ipUploadGPSTrack();
+    })
+  ELSEWHEN("gps_track_status",{
+      fs::File file = LittleFS.open(gnss_track.path, "r");
+      int bytes = file?file.size():0;
+      if (file) file.close();
+      char status_buf[256];
+      snprintf(status_buf, sizeof(status_buf),
+	       "{\"bytes\":%d,\"records\":%lu,\"rotations\":%lu,\"accepted\":%lu,\"nofix\":%lu,\"hdop\":%lu,\"still\":%lu,\"sentences\":%lu,\"checksum_errors\":%lu}",
+	       bytes, gnss_track.records, gnss_track.rotations,
+	       gnss_filter.accepted, gnss_filter.rejected_nofix, gnss_filter.rejected_hdop, gnss_filter.rejected_still,
+	       gnss_parser.sentences, gnss_parser.checksum_errors);
+      mqtt_publish("status/gps_track", status_buf);
+    })
   ELSEWHEN("sms_status",{
       int count = getSMSCount();
       mqtt_publish("status/sms_count", String(count));
@@ -696,10 +1063,14 @@ String AbstractIpLTELeaf::getSMSText(int msg_index)
 
   int sms_len;
   snprintf(modem_command_buf, modem_command_max, "AT+CMGR=%d", msg_index);
-  if (!modemSendExpectIntField(modem_command_buf, "+CMGR: ", 11, &sms_len, ',', -1, HERE)) {
+  modemWaitBufferMutex(HERE);
+  if (!modemSendExpect(modem_command_buf, "+CMGR: ", modem_response_buf, modem_response_max, -1, 1, HERE, MODEM_REPLY_NO_FLUSH) ||
+      !parseSMSHeader(ModemToken(modem_response_buf), NULL, &sms_len)) {
+    modemReleaseBufferMutex(HERE);
     LEAF_ALERT("Error requesting message %d", msg_index);
     LEAF_STR_RETURN(result);
   }
+  modemReleaseBufferMutex(HERE);
   if (sms_len >= modem_response_max) {
     LEAF_ALERT("SMS message length (%d) too long", sms_len);
     LEAF_STR_RETURN(result);
@@ -726,13 +1097,297 @@ String AbstractIpLTELeaf::getSMSSender(int msg_index)
     return "";
   }
 
-  int sms_len;
+  String result = "";
   snprintf(modem_command_buf, modem_command_max, "AT+CMGR=%d", msg_index);
-  String result = modemSendExpectQuotedField(modem_command_buf, "+CMGR: ", 2, ',', -1, HERE);
+  modemWaitBufferMutex(HERE);
+  if (modemSendExpect(modem_command_buf, "+CMGR: ", modem_response_buf, modem_response_max, -1, 1, HERE)) {
+    parseSMSHeader(ModemToken(modem_response_buf), &result, NULL);
+  }
+  modemReleaseBufferMutex(HERE);
   modemFlushInput();
   return result;
 }
 
+//
+// Pick apart a text-mode SMS header (with AT+CSDH=1), eg
+//
+// "REC READ","+61412345678","","24/01/31,10:22:07+40",145,4,0,0,"+61418706700",145,5
+//
+// <stat>,<oa>[,<alpha>],<scts>[,<tooa>,<fo>,<pid>,<dcs>,<sca>,<tosca>,<length>]
+//
+bool AbstractIpLTELeaf::parseSMSHeader(ModemToken hdr, String *sender_r, int *length_r)
+{
+  ModemFieldTokenizer fields(hdr);
+  ModemToken field;
+  int count = 0;
+  while (fields.next(&field)) {
+    ++count;
+    if ((count == 2) && sender_r) *sender_r = field.toString();
+  }
+  if (count < 2) {
+    LEAF_WARN("Malformed SMS header [%.*s]", hdr.len, hdr.ptr);
+    return false;
+  }
+  if (length_r) {
+    // length is the last field, but only present with the detailed header
+    if (count < 10) {
+      LEAF_WARN("SMS header lacks length (need AT+CSDH=1)");
+      return false;
+    }
+    *length_r = field.toInt(-1);
+    if (*length_r < 0) return false;
+  }
+  return true;
+}
+
+//
+// A session recorded from a SIM7080G: registration, MQTT connect and
+// publish, a position poll, an SMS listing and some unsolicited chatter.
+//
+static const char ip_lte_bench_transcript[] =
+  "\r\nRDY\r\n"
+  "\r\n+CFUN: 1\r\n"
+  "\r\n+CPIN: READY\r\n"
+  "\r\nSMS Ready\r\n"
+  "\r\nOK\r\n"
+  "\r\n+CSQ: 21,99\r\n\r\nOK\r\n"
+  "\r\n+CREG: 0,5\r\n\r\nOK\r\n"
+  "\r\n+CEREG: 0,5\r\n\r\nOK\r\n"
+  "\r\n+COPS: 0,0,\"Telstra Mobile\",7\r\n\r\nOK\r\n"
+  "\r\n+CPSI: LTE CAT-M1,Online,505-01,0x3004,135963923,312,EUTRAN-BAND28,9410,3,3,-11,-97,-66,13\r\n\r\nOK\r\n"
+  "\r\nOK\r\n\r\n+APP PDP: 0,ACTIVE\r\n"
+  "\r\n+CNACT: 0,1,\"10.170.24.33\"\r\n+CNACT: 1,0,\"0.0.0.0\"\r\n\r\nOK\r\n"
+  "\r\n*PSUTTZ: 24/01/31,00:22:07\",\"+40\",0\r\n"
+  "\r\nDST: 0\r\n"
+  "\r\n+CCLK: \"24/01/31,10:22:08+40\"\r\n\r\nOK\r\n"
+  "\r\n+SMSTATE: 1\r\n\r\nOK\r\n"
+  "\r\nOK\r\n"
+  "\r\nOK\r\n"
+  "\r\n+SMSUB: \"devices/lte1/cmd/status\",\"\"\r\n"
+  "\r\n+CGNSINF: 1,1,20240131102207.000,-27.565879,152.936990,16.700,0.00,103.8,1,,0.6,0.9,0.7,,25,9,3,,,34,,\r\n\r\nOK\r\n"
+  "\r\n+CMTI: \"SM\",3\r\n"
+  "\r\n+CMGL: 3,\"REC UNREAD\",\"+61412345678\",\"\",\"24/01/31,10:22:07+40\",145,17\r\ncmd/status +check\r\n"
+  "\r\n+CMGL: 4,\"REC UNREAD\",\"+61412345678\",\"\",\"24/01/31,10:23:41+40\",145,5\r\nreset\r\n\r\nOK\r\n"
+  "\r\n+CMGR: \"REC UNREAD\",\"+61412345678\",\"\",\"24/01/31,10:22:07+40\",145,4,0,0,\"+61418706700\",145,5\r\nhello\r\n\r\nOK\r\n"
+  "\r\n+CASTATE: 0,1\r\n"
+  "\r\n+CAOPEN: 0,0\r\n\r\nOK\r\n"
+  "\r\n+CARECV: 5,hello\r\n\r\nOK\r\n"
+  "\r\n+CADATAIND: 0\r\n"
+  "\r\n+CSQ: 19,99\r\n\r\nOK\r\n"
+  "\r\n+CPSMSTATUS: \"Enter PSM\"\r\n";
+
+//
+// Compare the in-place tokenizer against the String based field
+// splitting it replaced, over a recorded modem transcript: the session
+// above, or a capture from the filesystem (received lines only, as
+// written to the chat log with a leading '<').  The transcript is fed
+// through a line ring the way modemRxPoll receives it.
+//
+void AbstractIpLTELeaf::modemParseBench(int iterations, String path)
+{
+  LEAF_ENTER_INT(L_NOTICE, iterations);
+  if (iterations <= 0) iterations = 1;
+  long sink = 0;
+
+  String raw;
+  if (path.length()) {
+    File file = LittleFS.open(path, "r");
+    if (!file) {
+      LEAF_ALERT("Cannot open transcript %s", path.c_str());
+      LEAF_VOID_RETURN;
+    }
+    while (file.available()) {
+      String l = file.readStringUntil('\n');
+      int rx = l.indexOf('<');
+      if (rx < 0) continue;
+      raw += "\r\n" + l.substring(rx+1) + "\r\n";
+    }
+    file.close();
+  }
+  else {
+    raw = ip_lte_bench_transcript;
+  }
+
+  // Receive path: the line ring, filled from a stream (the first pass
+  // also keeps the lines for the parsers below)
+  String transcript[IP_LTE_BENCH_LINES_MAX];
+  int lines = 0;
+  ModemLineRing ring(MODEM_RX_LINE_MAX);
+  unsigned long start_ring = 0;
+  for (int n=0; n<=iterations; n++) {
+    StreamString in;
+    in.print(raw);
+    ring.clear();
+    ModemToken line;
+    while (1) {
+      ring.fill(&in, -1, true);
+      if (!ring.getLine(&line)) break;
+      if (line.len == 0) continue;
+      if (n == 0) {
+	if (lines < IP_LTE_BENCH_LINES_MAX) transcript[lines++] = line.toString();
+      }
+      else {
+	sink += line.len;
+      }
+    }
+    if (n == 0) start_ring = micros();
+  }
+  unsigned long ring_us = micros() - start_ring;
+
+  unsigned long start = micros();
+  for (int n=0; n<iterations; n++) {
+    for (int i=0; i<lines; i++) {
+      String line(transcript[i]);
+      line.remove(0, line.indexOf(' ')+1);
+      while (line.length()) {
+	String word;
+	int pos = line.indexOf(',');
+	if (pos < 0) {
+	  word = line;
+	  line = "";
+	}
+	else {
+	  word = line.substring(0,pos);
+	  line.remove(0,pos+1);
+	}
+	sink += word.toInt();
+      }
+    }
+  }
+  unsigned long string_us = micros() - start;
+
+  start = micros();
+  for (int n=0; n<iterations; n++) {
+    for (int i=0; i<lines; i++) {
+      ModemToken line(transcript[i].c_str(), transcript[i].length());
+      for (int p=0; p<line.len; p++) {
+	if (line.ptr[p]==' ') {
+	  line = line.sub(p+1);
+	  break;
+	}
+      }
+      ModemFieldTokenizer words(line);
+      ModemToken word;
+      while (words.next(&word)) {
+	sink += word.toInt();
+      }
+    }
+  }
+  unsigned long token_us = micros() - start;
+
+  // the position reports alone, through the fixed point GNSS parser
+  GnssParser gnss;
+  start = micros();
+  for (int n=0; n<iterations; n++) {
+    for (int i=0; i<lines; i++) {
+      ModemToken loc = ModemToken(transcript[i].c_str(), transcript[i].length()).after("+CGNSINF: ");
+      if (loc.isEmpty()) continue;
+      gnss.put(loc.ptr, loc.len);
+      gnss.end();
+      sink += gnss.fix.lat;
+    }
+  }
+  unsigned long gnss_us = micros() - start;
+
+  char buf[192];
+  snprintf(buf, sizeof(buf), "{\"iterations\":%d,\"lines\":%d,\"bytes\":%d,\"ring_us\":%lu,\"string_us\":%lu,\"token_us\":%lu,\"gnss_us\":%lu,\"sink\":%ld}",
+	   iterations, lines, (int)raw.length(), ring_us, string_us, token_us, gnss_us, sink);
+  LEAF_NOTICE("modem parse bench %s", buf);
+  mqtt_publish("status/modem_parse_bench", buf);
+  LEAF_LEAVE;
+}
+
+//
+// A stream that produces a fixed number of bytes as fast as it is read,
+// standing in for the modem in modemCopyBench.
+//
+class IpLteBenchStream: public Stream
+{
+public:
+  size_t left = 0;
+
+  int available() { return left; }
+  int read() { if (!left) return -1; --left; return 0x55; }
+  int peek() { return left?0x55:-1; }
+  size_t readBytes(char *buffer, size_t length)
+  {
+    if (length > left) length = left;
+    memset(buffer, 0x55, length);
+    left -= length;
+    return length;
+  }
+  size_t write(uint8_t c) { return 1; }
+  size_t write(const uint8_t *buffer, size_t size) { return size; }
+  void flush() {}
+};
+
+//
+// A copy benchmark: time moving a payload from a stream into an rx queue,
+// the way modemReadToBuffer does it (straight into the queue's blocks)
+// and the way it used to (through a 256 byte stack block).  The modem is
+// replaced by a stream that never waits, so this measures only the
+// memory copies, not a CARECV read (which is bound by the UART and the
+// modem's response time).
+//
+void AbstractIpLTELeaf::modemCopyBench(int bytes)
+{
+  LEAF_ENTER_INT(L_NOTICE, bytes);
+  if (bytes <= 0) bytes = 262144;
+  if (!modemWaitPortMutex(HERE)) {
+    LEAF_ALERT("Modem is busy");
+    LEAF_VOID_RETURN;
+  }
+  Stream *saved = modem_stream;
+  IpLteBenchStream bench;
+  modem_stream = &bench;
+  IpRxArena arena(IP_RX_ARENA_BLOCK, 4);
+  IpRxQueue queue(&arena, 4);
+
+  bench.left = bytes;
+  unsigned long start = micros();
+  while (bench.left) {
+    int got = modemReadToBuffer(&queue, bench.left, HERE);
+    if (got <= 0) break;
+    queue.flush();
+  }
+  unsigned long direct_us = micros() - start;
+
+  bench.left = bytes;
+  start = micros();
+  while (bench.left) {
+    char block[256];
+    int n = (bench.left > sizeof(block))?sizeof(block):bench.left;
+    n = modemReadBulk((uint8_t *)block, n, -1, HERE);
+    if (n <= 0) break;
+    int put = 0;
+    while (put < n) {
+      uint8_t *p;
+      int room = queue.reserve(&p);
+      if (room == 0) {
+	queue.flush();
+	continue;
+      }
+      if (room > n-put) room = n-put;
+      memcpy(p, block+put, room);
+      queue.commit(room);
+      put += room;
+    }
+  }
+  unsigned long staged_us = micros() - start;
+
+  modem_stream = saved;
+  modemReleasePortMutex(HERE);
+
+  unsigned long direct_kbps = direct_us?(unsigned long)((uint64_t)bytes*1000000/1024/direct_us):0;
+  unsigned long staged_kbps = staged_us?(unsigned long)((uint64_t)bytes*1000000/1024/staged_us):0;
+  char buf[160];
+  snprintf(buf, sizeof(buf), "{\"bytes\":%d,\"direct_us\":%lu,\"staged_us\":%lu,\"direct_kbps\":%lu,\"staged_kbps\":%lu}",
+	   bytes, direct_us, staged_us, direct_kbps, staged_kbps);
+  LEAF_NOTICE("modem copy bench %s", buf);
+  mqtt_publish("status/modem_copy_bench", buf);
+  LEAF_LEAVE;
+}
+
 bool AbstractIpLTELeaf::cmdSendSMS(String rcpt, String msg)
 {
   LEAF_ENTER(L_NOTICE);
@@ -782,7 +1437,6 @@ bool AbstractIpLTELeaf::cmdDeleteSMS(int msg_index)
 bool AbstractIpLTELeaf::ipProcessSMS(int msg_index)
 {
   LEAF_ENTER_INT((msg_index<0)?L_INFO:L_NOTICE, msg_index);
-  int first,last;
 
   if (ip_modem_probe_at_sms || !modemIsPresent()) {
     LEAF_NOTICE("Probing for modem");
@@ -796,118 +1450,278 @@ bool AbstractIpLTELeaf::ipProcessSMS(int msg_index)
   }
 
   if (msg_index < 0) {
-    // process all unread sms
-    first = 0;
-    last = getSMSCount();
-    LEAF_INFO("Modem holds %d SMS messages", last);
-    if (last > 0) {
-      ACTION("SMS rcvd %d", last);
-      fslog(HERE, IP_LOG_FILE, "sms rcvd %d", last);
+    // process everything the modem holds, in one listing
+    LEAF_BOOL_RETURN(ipProcessSMSBacklog() >= 0);
+  }
+
+  String msg = getSMSText(msg_index);
+  if (!msg) {
+    LEAF_BOOL_RETURN(false);
+  }
+  String sender = getSMSSender(msg_index);
+  LEAF_NOTICE("SMS message %d is from %s", msg_index, sender.c_str());
+  fslog(HERE, IP_LOG_FILE, "sms process %d %s [%s]", msg_index, sender.c_str(), msg.c_str());
+  // Delete the SMS *BEFORE* processing, else we might end up in a
+  // reboot loop forever.   DAMHIKT.
+  cmdDeleteSMS(msg_index);
+
+  LEAF_BOOL_RETURN(ipProcessSMSMessage(sender, msg));
+}
+
+//
+// Fetch every stored message with a single AT+CMGL listing, delete them
+// all with a single AT+CMGD, and only then act on each of them.
+//
+// Returns the number of messages processed, or -1 if the modem could not
+// be asked.
+//
+int AbstractIpLTELeaf::ipProcessSMSBacklog()
+{
+  LEAF_ENTER(L_INFO);
+  unsigned long start = millis();
+  String senders[IP_LTE_SMS_BATCH_MAX];
+  String texts[IP_LTE_SMS_BATCH_MAX];
+  int indices[IP_LTE_SMS_BATCH_MAX];
+  int count = 0;
+  int oversize[IP_LTE_SMS_BATCH_MAX];
+  int oversize_count = 0;
+  bool overflow = false;
+  bool listed = false;
+
+  if (!modemSendCmd(HERE, "AT+CMGF=1")) {
+    // maybe the modem fell asleep
+    fslog(HERE, IP_LOG_FILE, "modem probe ipProcessSMSBacklog");
+    if (!modemProbe(HERE) || !modemSendCmd(HERE, "AT+CMGF=1")) {
+      LEAF_ALERT("SMS format command not accepted");
+      fslog(HERE, IP_LOG_FILE, "sms error noanswer");
+      LEAF_INT_RETURN(-1);
     }
   }
-  else {
-    first=msg_index;
-    last=msg_index+1;
+  // the detailed header gives the body length, so bodies may contain line breaks
+  if (!modemSendCmd(HERE, "AT+CSDH=1")) {
+    LEAF_WARN("SMS header format command not accepted");
   }
 
-  for (msg_index = first; msg_index < last; msg_index++) {
+  if (!modemWaitPortMutex(HERE)) {
+    LEAF_ALERT("Cannot obtain modem mutex");
+    LEAF_INT_RETURN(-1);
+  }
+  modemWaitBufferMutex(HERE);
+  modemFlushInput(HERE);
+  modemSend("AT+CMGL=\"ALL\"", HERE);
+
+  char line[256];
+  int timeout = modem_timeout_default*4;
+  while (1) {
+    int len = modemGetLineOrPrompt(line, sizeof(line), timeout, HERE);
+    if (len == 0) {
+      LEAF_WARN("SMS listing timed out");
+      break;
+    }
+    ModemToken l(line, len);
+    if (l.equals("OK")) {
+      listed = true;
+      break;
+    }
+    if (l.startsWith("ERROR") || l.startsWith("+CMS ERROR")) {
+      LEAF_WARN("SMS listing failed: %s", line);
+      break;
+    }
+    if (!l.startsWith("+CMGL: ")) {
+      // unsolicited, it is dispatched once we let go of the modem
+      LEAF_INFO("Hold unsolicited response during SMS listing [%s]", line);
+      modemStashURC(line);
+      continue;
+    }
 
-    String msg = getSMSText(msg_index);
-    if (!msg) continue;
-    String sender = getSMSSender(msg_index);
-    LEAF_NOTICE("SMS message %d is from %s", msg_index, sender.c_str());
-    fslog(HERE, IP_LOG_FILE, "sms process %d %s [%s]", msg_index, sender.c_str(), msg.c_str());
+    // <index>,<stat>,<oa>,[<alpha>],[<scts>][,<tooa>,<length>]
+    ModemFieldTokenizer fields(l.after("+CMGL: "));
+    ModemToken stat, sender, field;
+    int index = fields.nextInt(-1);
+    fields.next(&stat);
+    fields.next(&sender);
+    int nfields = 3;
+    while (fields.next(&field)) ++nfields;
+    int body_len = (nfields >= 7)?field.toInt(-1):-1;
+    bool received = stat.startsWith("REC");
+    String sender_str = sender.toString();
+
+    String body;
+    if (body_len >= modem_response_max) {
+      // read past it so the rest of the listing stays in step, and
+      // delete it so it doesn't hold up every later pass
+      LEAF_ALERT("SMS message %d length (%d) too long, discarding", index, body_len);
+      fslog(HERE, IP_LOG_FILE, "sms oversize %d %d", index, body_len);
+      int left = body_len;
+      while (left > 0) {
+	int chunk = (left < modem_response_max)?left:(modem_response_max-1);
+	int got = modemGetReplyOfSize(modem_response_buf, chunk, timeout);
+	if (got <= 0) break;
+	left -= got;
+      }
+      if (oversize_count < IP_LTE_SMS_BATCH_MAX) oversize[oversize_count++] = index;
+      continue;
+    }
+    else if (body_len >= 0) {
+      int got = modemGetReplyOfSize(modem_response_buf, body_len, timeout);
+      body = ModemToken(modem_response_buf, got).toString();
+    }
+    else {
+      // no length given, the body is the next line
+      len = modemGetLineOrPrompt(line, sizeof(line), timeout, HERE);
+      body = ModemToken(line, len).toString();
+    }
+
+    if (!received) {
+      LEAF_INFO("Skip stored outgoing SMS %d", index);
+      continue;
+    }
+    if (count >= IP_LTE_SMS_BATCH_MAX) {
+      // the remainder are left for the next pass
+      overflow = true;
+      continue;
+    }
+    indices[count] = index;
+    senders[count] = sender_str;
+    texts[count] = body;
+    ++count;
+  }
+  modemReleaseBufferMutex(HERE);
+  modemReleasePortMutex(HERE);
+
+  if (!listed && !count && !oversize_count) {
+    LEAF_INT_RETURN(-1);
+  }
+  if (count) {
+    ACTION("SMS rcvd %d", count);
+    fslog(HERE, IP_LOG_FILE, "sms rcvd %d", count);
+  }
+  if (count || oversize_count) {
     // Delete the SMS *BEFORE* processing, else we might end up in a
     // reboot loop forever.   DAMHIKT.
-    cmdDeleteSMS(msg_index);
-
-    String reply = "";
-    String command = "";
-    String password = "";
-    String topic;
-    String payload;
-    int sep;
-
-    if (ip_lte_sms_password.length()) {
-      if ((sep = msg.indexOf("\r\n")) >= 0) {
-	password = msg.substring(0,sep);
-	msg.remove(0,sep+2);
-      }
-      else if ((sep = msg.indexOf(" ")) >= 0) {
-	password = msg.substring(0,sep);
-	msg.remove(0,sep+1);
+    if (listed && !overflow) {
+      // everything listed is now marked read
+      modemSendCmd(HERE, "AT+CMGD=0,1");
+    }
+    else {
+      for (int i=0; i<count; i++) {
+	modemSendCmd(HERE, "AT+CMGD=%03d", indices[i]);
       }
-      if (password != ip_lte_sms_password) {
-	fslog(HERE, IP_LOG_FILE, "sms reject password");
-	LEAF_ALERT("Invalid SMS password");
-	LEAF_BOOL_RETURN(false);
+      for (int i=0; i<oversize_count; i++) {
+	modemSendCmd(HERE, "AT+CMGD=%03d", oversize[i]);
       }
     }
+  }
 
-    // Process each line of the SMS by treating it as MQTT input
-    do {
-      if ((sep = msg.indexOf("\r\n")) >= 0) {
-	command = msg.substring(0,sep);
-	msg.remove(0,sep+2);
-      }
-      else {
-	command = msg;
-	msg = "";
-      }
-      LEAF_NOTICE("Processing one line of SMS as a Bogo-MQTT: %s", command.c_str());
-      if (!command.length()) continue;
+  for (int i=0; i<count; i++) {
+    LEAF_NOTICE("SMS message %d is from %s", indices[i], senders[i].c_str());
+    fslog(HERE, IP_LOG_FILE, "sms process %d %s [%s]", indices[i], senders[i].c_str(), texts[i].c_str());
+    ipProcessSMSMessage(senders[i], texts[i]);
+  }
 
-      if ((sep = command.indexOf(' ')) >= 0) {
-	topic = command.substring(0,sep);
-	payload = command.substring(sep+1);
-      }
-      else {
-	topic = command;
-	payload = "1";
-      }
+  unsigned long elapsed = millis() - start;
+  if (count) {
+    LEAF_NOTICE("Drained %d SMS in %lums (%lums each)%s", count, elapsed, elapsed/count, overflow?" (more remain)":"");
+    fslog(HERE, IP_LOG_FILE, "sms drain %d %lums", count, elapsed);
+    ip_lte_sms_drain_count = count;
+    ip_lte_sms_drain_ms = elapsed;
+  }
+  LEAF_INT_RETURN(count);
+}
 
-      if (!pubsubLeaf) {
-	continue;
-      }
+//
+// Act on one SMS, treating each line as an MQTT command, and send any
+// results back to the sender
+//
+bool AbstractIpLTELeaf::ipProcessSMSMessage(String sender, String msg)
+{
+  LEAF_ENTER(L_NOTICE);
+  String reply = "";
+  String command = "";
+  String password = "";
+  String topic;
+  String payload;
+  int sep;
+
+  if (ip_lte_sms_password.length()) {
+    if ((sep = msg.indexOf("\r\n")) >= 0) {
+      password = msg.substring(0,sep);
+      msg.remove(0,sep+2);
+    }
+    else if ((sep = msg.indexOf(" ")) >= 0) {
+      password = msg.substring(0,sep);
+      msg.remove(0,sep+1);
+    }
+    if (password != ip_lte_sms_password) {
+      fslog(HERE, IP_LOG_FILE, "sms reject password");
+      LEAF_ALERT("Invalid SMS password");
+      LEAF_BOOL_RETURN(false);
+    }
+  }
 
-      if (pubsubLeaf->hasPriority()) {
-	topic = pubsubLeaf->getPriority() + "/" + topic;
-      }
+  // Process each line of the SMS by treating it as MQTT input
+  do {
+    if ((sep = msg.indexOf("\r\n")) >= 0) {
+      command = msg.substring(0,sep);
+      msg.remove(0,sep+2);
+    }
+    else {
+      command = msg;
+      msg = "";
+    }
+    LEAF_NOTICE("Processing one line of SMS as a Bogo-MQTT: %s", command.c_str());
+    if (!command.length()) continue;
 
-      StreamString result;
-      fslog(HERE, IP_LOG_FILE, "sms inject %s <= %s", topic.c_str(), payload.c_str());
-      pubsubLeaf->enableLoopback(&result);
-      pubsubLeaf->_mqtt_route(topic, payload);
-      pubsubLeaf->cancelLoopback();
-      reply += result+"\r\n";
-    } while (msg.length());
-
-    // We have now accumulated results in reply
-    if (sender.length()) {
-      const int sms_max = 140;
-      if (reply.length() < 140) {
-	LEAF_NOTICE("Send SMS reply %s <= %s", sender.c_str(), reply.c_str());
-	fslog(HERE, IP_LOG_FILE, "sms reply %s <= %s", sender.c_str(), reply.c_str());
-	cmdSendSMS(sender, reply);
-      }
-      else {
-	LEAF_NOTICE("Send Chunked SMS reply %s <= %s", sender.c_str(), reply.c_str());
-	String chunk;
-	int n=1;
-	while (reply.length() > 0) {
-	  if (reply.length() > 140) {
-	    chunk = reply.substring(0,140);
-	    reply.remove(0,140);
-	  }
-	  else {
-	    chunk = reply;
-	    reply = "";
-	  }
-	  LEAF_INFO("Send SMS chunk %d %s", n, chunk);
-	  fslog(HERE, IP_LOG_FILE, "sms reply chunk %d: %s <= %s", n, sender.c_str(), reply.c_str());
-	  cmdSendSMS(sender, chunk);
-	  ++n;
+    if ((sep = command.indexOf(' ')) >= 0) {
+      topic = command.substring(0,sep);
+      payload = command.substring(sep+1);
+    }
+    else {
+      topic = command;
+      payload = "1";
+    }
+
+    if (!pubsubLeaf) {
+      continue;
+    }
+
+    if (pubsubLeaf->hasPriority()) {
+      topic = pubsubLeaf->getPriority() + "/" + topic;
+    }
+
+    StreamString result;
+    fslog(HERE, IP_LOG_FILE, "sms inject %s <= %s", topic.c_str(), payload.c_str());
+    pubsubLeaf->enableLoopback(&result);
+    pubsubLeaf->_mqtt_route(topic, payload);
+    pubsubLeaf->cancelLoopback();
+    reply += result+"\r\n";
+  } while (msg.length());
+
+  // We have now accumulated results in reply
+  if (sender.length()) {
+    const int sms_max = 140;
+    if (reply.length() < 140) {
+      LEAF_NOTICE("Send SMS reply %s <= %s", sender.c_str(), reply.c_str());
+      fslog(HERE, IP_LOG_FILE, "sms reply %s <= %s", sender.c_str(), reply.c_str());
+      cmdSendSMS(sender, reply);
+    }
+    else {
+      LEAF_NOTICE("Send Chunked SMS reply %s <= %s", sender.c_str(), reply.c_str());
+      String chunk;
+      int n=1;
+      while (reply.length() > 0) {
+	if (reply.length() > 140) {
+	  chunk = reply.substring(0,140);
+	  reply.remove(0,140);
+	}
+	else {
+	  chunk = reply;
+	  reply = "";
 	}
+	LEAF_INFO("Send SMS chunk %d %s", n, chunk);
+	fslog(HERE, IP_LOG_FILE, "sms reply chunk %d: %s <= %s", n, sender.c_str(), reply.c_str());
+	cmdSendSMS(sender, chunk);
+	++n;
       }
     }
   }
@@ -979,6 +1793,17 @@ bool AbstractIpLTELeaf::modemProcessURC(String Message)
       ipProcessSMS(msg_id);
     }
   }
+  else if (Message.startsWith("+CPSMSTATUS: ")) {
+    // "ENTER PSM" or "EXIT PSM"
+    ipLteSetPsm(Message.indexOf("ENTER") >= 0);
+  }
+  else if (Message.startsWith("$G")) {
+    // NMEA output from the receiver (AT+CGNSTST=1)
+    gnss_parser.put(Message.c_str(), Message.length());
+    if (gnss_parser.end()) {
+      ipGPSFix(gnss_parser.fix);
+    }
+  }
   else if (Message == "CONNECT OK") {
     //LEAF_INFO("Ignore CONNECT OK");
   }
@@ -1039,14 +1864,66 @@ bool AbstractIpLTELeaf::ipPollGPS(bool force)
     timeout = ip_modem_gps_fix_check_interval;
   }
 
-  String loc = modemQuery("AT+CGNSINF", "+CGNSINF: ", timeout,HERE);
-  if (loc.length()) {
-    LEAF_BOOL_RETURN(parseGPS(loc));
+  // Copy the response out of the shared buffer so that parseGPS is free
+  // to publish (which may need the modem)
+  char loc[160];
+  int loc_len = 0;
+  bool release;
+  if (!modemWaitPortForPoll(HERE, &release)) {
+    LEAF_NOTICE("Modem is busy, GPS poll deferred");
+    LEAF_BOOL_RETURN(false);
+  }
+  modemWaitBufferMutex(HERE);
+  if (modemSendExpect("AT+CGNSINF", "+CGNSINF: ", modem_response_buf, modem_response_max, timeout, 1, HERE)) {
+    loc_len = ModemToken(modem_response_buf).copyTo(loc, sizeof(loc));
+  }
+  modemReleaseBufferMutex(HERE);
+  if (release) modemReleasePortMutex(HERE);
+  if (loc_len) {
+    LEAF_BOOL_RETURN(parseGPS(ModemToken(loc, loc_len)));
   }
   LEAF_ALERT("Did not get GPS response");
   LEAF_BOOL_RETURN(false);
 }
 
+//
+// Ask for a position by way of the command queue, the reply is parsed by
+// loop().  Falls back to a synchronous poll when the modem needs waking
+// or GPS needs enabling first.
+//
+bool AbstractIpLTELeaf::ipPollGPSQueued()
+{
+  if (ip_gps_poll_pending) return true;
+  if (ip_modem_probe_at_gps || !modemIsPresent() || !ip_gps_active) {
+    return ipPollGPS();
+  }
+  int timeout = 10000;
+  if (ip_modem_gps_fix_check_interval < (unsigned long)timeout) {
+    timeout = ip_modem_gps_fix_check_interval;
+  }
+  ip_gps_poll_pending = true;
+  if (!modemCommandSubmit("AT+CGNSINF", ipGPSPollDone, this, timeout)) {
+    ip_gps_poll_pending = false;
+    return ipPollGPS();
+  }
+  return true;
+}
+
+// runs in the modem polling task, so only keeps the reply
+void AbstractIpLTELeaf::ipGPSPollDone(struct ModemCommand *c, void *ctx)
+{
+  AbstractIpLTELeaf *leaf = (AbstractIpLTELeaf *)ctx;
+  int pos = c->ok()?c->response.indexOf("+CGNSINF: "):-1;
+  leaf->ip_gps_poll_len = 0;
+  if (pos >= 0) {
+    const char *loc = c->response.c_str()+pos+10;
+    const char *eol = strchr(loc, '\n');
+    leaf->ip_gps_poll_len = ModemToken(loc, eol?(eol-loc):strlen(loc)).copyTo(leaf->ip_gps_poll_buf, sizeof(leaf->ip_gps_poll_buf));
+  }
+  leaf->ip_gps_poll_pending = false;
+  leaf->ip_gps_poll_done = true;
+}
+
 bool AbstractIpLTELeaf::ipPollNetworkTime()
 {
   char date_buf[40];
@@ -1150,181 +2027,614 @@ bool AbstractIpLTELeaf::parseNetworkTime(String datestr)
 }
 
 
-bool AbstractIpLTELeaf::parseGPS(String gps)
+bool AbstractIpLTELeaf::parseGPS(ModemToken gps)
+{
+  LEAF_ENTER(L_INFO);
+
+  /*
+   * eg 1,1,20201012004322.000,-27.565879,152.936990,16.700,0.00,103.8,1,,0.6,0.9,0.7,,25,9,3,,,34,,
+   *
+   *  1<GNSS run status>,
+   *  2<Fix status>,
+   *  3<UTC date & Time>,
+   *  4<Latitude>,
+   *  5<Longitude>,
+   *  6<MSL Altitude>,
+   *  7<Speed Over Ground>,
+   *  8<Course Over Ground>,
+   *  9<Fix Mode>
+   * 10<Reserved1>
+   * 11<HDOP>
+   * 12<PDOP>
+   * 13<VDOP>
+   * 14<Reserved2>
+   * 15<GNSS Satellites in View>
+   * 16<GNSS Satellites Used>
+   * 17<GLONASS Satellites Used>
+   * 18<Reserved3>
+   * 19<C/N0 max>
+   * 20<HPA>
+   * 21<VPA>
+   */
+  if (modemOnServiceTask()) {
+    // gnss_parser belongs to the loop task (queued polls hand their
+    // reply to loop(), see ipGPSPollDone)
+    LEAF_ALERT("GPS report parsed on the modem service task, ignored");
+    LEAF_BOOL_RETURN(false);
+  }
+  gnss_parser.reset();
+  gnss_parser.put(gps.ptr, gps.len);
+  gnss_parser.end();
+  const GnssFix &fix = gnss_parser.fix;
+
+  if (!fix.run || !fix.has(GNSS_HAVE_POS)) {
+    LEAF_NOTICE("No GPS fix (%.*s)", gps.len, gps.ptr);
+    LEAF_BOOL_RETURN(false);
+  }
+
+  LEAF_NOTICE("GPS %s fix %.*s", fix.fix?"full":"partial", gps.len, gps.ptr);
+  if (ip_modem_publish_gps_raw) {
+    mqtt_publish("status/gps", gps.toString(), 0, false, L_NOTICE, HERE);
+  }
+  LEAF_BOOL_RETURN(ipGPSFix(fix));
+}
+
+//
+// Act on a position report, from a CGNSINF poll or from NMEA output
+//
+bool AbstractIpLTELeaf::ipGPSFix(const GnssFix &fix)
 {
   LEAF_ENTER(L_INFO);
   bool result = false;
-  bool partial = false;
-  int fix = 0;
 
-  if (gps.startsWith("1,1,") || gps.startsWith("1,,")) {
-    if (gps.startsWith("1,,")) {
-      partial=true;
-    }
-    LEAF_NOTICE("GPS %s fix %s", partial?"partial":"full", gps.c_str());
-    if (ip_modem_publish_gps_raw) {
-      mqtt_publish("status/gps", gps.c_str(), 0, false, L_NOTICE, HERE);
-    }
-    /*
-     * eg 1,1,20201012004322.000,-27.565879,152.936990,16.700,0.00,103.8,1,,0.6,0.9,0.7,,25,9,3,,,34,,
-     *
-     *  1<GNSS run status>,
-     *  2<Fix status>,
-     *  3<UTC date & Time>,
-     *  4<Latitude>,
-     *  5<Longitude>,
-     *  6<MSL Altitude>,
-     *  7<Speed Over Ground>,
-     *  8<Course Over Ground>,
-     *  9<Fix Mode>
-     * 10<Reserved1>
-     * 11<HDOP>
-     * 12<PDOP>
-     * 13<VDOP>
-     * 14<Reserved2>
-     * 15<GNSS Satellites in View>
-     * 16<GNSS Satellites Used>
-     * 17<GLONASS Satellites Used>
-     * 18<Reserved3>
-     * 19<C/N0 max>
-     * 20<HPA>
-     * 21<VPA>
-     */
-    int wordno = 0;
-    String word;
-    float fv;
-    bool locChanged = false;
+  if (fix.fix && fix.has(GNSS_HAVE_TIME) && (fix.year >= IP_LTE_GPS_CLOCK_MIN_YEAR)) {
+    // (a void fix, or a receiver that has not yet heard the almanac,
+    // reports its default date)
     struct tm tm;
     struct timeval tv;
     struct timezone tz;
     time_t now;
     char ctimbuf[32];
-    char ctimbuftu[32];
-
-    while (gps.length()) {
-      ++wordno;
-      int pos = gps.indexOf(',');
-      if (pos < 0) {
-	word = gps;
-	gps = "";
-      }
-      else {
-	word = gps.substring(0,pos);
-	gps.remove(0,pos+1);
-      }
 
-      if (word == "") {
-	// this word is blank, skip it
-	continue;
-      }
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = fix.year-1900;
+    tm.tm_mon = fix.month-1;
+    tm.tm_mday = fix.day;
+    tm.tm_hour = fix.hour;
+    tm.tm_min = fix.minute;
+    tm.tm_sec = fix.second;
+    tv.tv_sec = mktime(&tm);
+    tv.tv_usec = fix.msec*1000;
+    tz.tz_minuteswest = -(ip_clock_zone*15);
+    tz.tz_dsttime = ip_clock_dst?1:0;
+    time(&now);
+    if (abs(now - tv.tv_sec)>=2) {
+      settimeofday(&tv, &tz);
+      strftime(ctimbuf, sizeof(ctimbuf), "%FT%T", &tm);
+      LEAF_NOTICE("Clock differs from GPS by %d sec, set time to %s.%06d", (int)abs(now-tv.tv_sec), ctimbuf, tv.tv_usec);
+      setTimeSource(TIME_SOURCE_GPS);
+    }
+  }
 
-      switch (wordno) {
-      case 1: // run
-	break;
-      case 2: // fix
-	fix = word.toInt();
-	break;
-      case 3: // date
-	tm.tm_year = word.substring(0,4).toInt()-1900;
-	tm.tm_mon = word.substring(4,6).toInt()-1;
-	tm.tm_mday = word.substring(6,8).toInt();
-	tm.tm_hour = word.substring(8,10).toInt();
-	tm.tm_min = word.substring(10,12).toInt();
-	tm.tm_sec = word.substring(12).toInt();
-	tv.tv_sec = mktime(&tm);
-	tv.tv_usec = word.substring(14).toInt()*1000;
-	tz.tz_minuteswest = -(ip_clock_zone*15);
-	tz.tz_dsttime = ip_clock_dst?1:0;
-	time(&now);
-	if (abs(now - tv.tv_sec)>=2) {
-	  settimeofday(&tv, &tz);
-	  strftime(ctimbuf, sizeof(ctimbuf), "%FT%T", &tm);
-	  LEAF_NOTICE("Clock differs from GPS by %d sec, set time to %s.%06d", (int)abs(now-tv.tv_sec), ctimbuf, tv.tv_usec);
-	  setTimeSource(TIME_SOURCE_GPS);
-	}
-	break;
-      case 4: // lat
-	if (!fix && word == "0.000000") break;
-	fv = word.toFloat();
-	if (fv != latitude) {
-	  latitude = fv;
-	  //LEAF_INFO("Set latitude %f",latitude);
-	  locChanged = true;
-	}
-	break;
-      case 5: // lon
-	if (!fix && word == "0.000000") break;
-	fv = word.toFloat();
-	if (fv != longitude) {
-	  longitude = fv;
-	  //LEAF_INFO("Set longitude %f",longitude);
-	  locChanged = true;
-	}
-	break;
-      case 6: // alt
-	fv = word.toFloat();
-	if (fv != altitude) {
-	  altitude = fv;
-	  //LEAF_INFO("Set altitude %f",altitude);
-	}
-	break;
-      case 7: // speed
-	fv = word.toFloat();
-	if (fv != speed_kph) {
-	  speed_kph = fv;
-	  //LEAF_INFO("Set speed %fkm/h",speed_kph);
-	}
-	break;
-      case 8: // course
-	fv = word.toFloat();
-	if (fv != heading) {
-	  heading = word.toFloat();
-	  //LEAF_INFO("Set heading %f",heading);
-	}
-	break;
-      default: // dont care about rest
+  if (!fix.has(GNSS_HAVE_POS)) {
+    LEAF_BOOL_RETURN(false);
+  }
+
+  bool locChanged = !gnss_location.has(GNSS_HAVE_POS) ||
+    (fix.lat != gnss_location.lat) || (fix.lon != gnss_location.lon);
+  latitude = fix.lat / 1e7;
+  longitude = fix.lon / 1e7;
+  if (fix.has(GNSS_HAVE_ALT)) altitude = fix.alt / 100.0;
+  if (fix.has(GNSS_HAVE_SPEED)) speed_kph = fix.speed / 100.0;
+  if (fix.has(GNSS_HAVE_COURSE)) heading = fix.course / 100.0;
+  gnss_location = fix;
+
+  if (ip_gps_track) {
+    // Keep only the fixes that tell us something, and send them in bulk later
+    if (gnss_filter.accept(fix) && gnss_track.append(fix)) {
+      LEAF_NOTICE("GPS fix recorded to track (%lu records)", gnss_track.records);
+      result = true;
+    }
+  }
+  else if (locChanged || ip_modem_publish_location_always) {
+    String msg("");
+
+    msg += isnan(latitude)?"":String(latitude,6);
+    msg += ",";
+    msg += isnan(longitude)?"":String(longitude,6);
+    msg += ",";
+    msg += isnan(altitude)?"":String(altitude,3);
+    msg += ",";
+    msg += isnan(speed_kph)?"":String(speed_kph,3);
+    msg += ",";
+    msg += isnan(heading)?"":String(heading,1);
+
+    publish("status/location", msg, L_NOTICE, HERE);
+    ACTION("GPS %s", msg.c_str());
+    result = true;
+  }
+  if (locChanged) {
+    setGPSFix(true);
+  }
+
+  if (fix.fix) {
+    //LEAF_INFO("Recording acquisition of stable GPS fix");
+    gps_fix = true;
+    ip_gps_acquire_duration = millis()-ip_gps_active_timestamp;
+    if (!ip_enable_gps_always) {
+      mqtt_publish("status/gps_acquire_duration_ms", String(ip_gps_acquire_duration));
+      LEAF_NOTICE("Disable GPS after obtaining fix (acquisition took %dms)", ip_gps_acquire_duration);
+      ipDisableGPS(true);
+    }
+  }
+
+  LEAF_BOOL_RETURN(result);
+}
+
+//
+// Move the track log (the rotated file, then the current one) into a
+// single file that is kept until its upload has been delivered.  Later
+// fixes begin a new log.  False if there is nothing to upload.
+//
+bool AbstractIpLTELeaf::ipGatherGPSTrack(const String &pending)
+{
+  String paths[2] = { gnss_track.rotatedPath(), String(gnss_track.path) };
+  fs::File out;
+
+  for (int i=0; i<2; i++) {
+    fs::File in = LittleFS.open(paths[i], "r");
+    if (!in) continue;
+    if (!out) out = LittleFS.open(pending, "w");
+    if (!out) {
+      LEAF_ALERT("Cannot create %s", pending.c_str());
+      in.close();
+      return false;
+    }
+    uint8_t block[128];
+    int n;
+    bool ok = true;
+    while ((n = in.read(block, sizeof(block))) > 0) {
+      if (out.write(block, n) != (size_t)n) {
+	ok = false;
 	break;
       }
     }
+    in.close();
+    if (!ok) {
+      LEAF_ALERT("Short write to %s, track log left in place", pending.c_str());
+      out.close();
+      LittleFS.remove(pending);
+      return false;
+    }
+  }
+  if (!out) return false;
+  out.close();
+  LittleFS.remove(paths[0]);
+  LittleFS.remove(paths[1]);
+  // the next record begins a new file
+  gnss_track.restart();
+  return true;
+}
 
-    if (locChanged || ip_modem_publish_location_always) {
-      String msg("");
-
-      msg += isnan(latitude)?"":String(latitude,6);
-      msg += ",";
-      msg += isnan(longitude)?"":String(longitude,6);
-      msg += ",";
-      msg += isnan(altitude)?"":String(altitude,3);
-      msg += ",";
-      msg += isnan(speed_kph)?"":String(speed_kph,3);
-      msg += ",";
-      msg += isnan(heading)?"":String(heading,1);
+//
+// Publish the track log as base64 to status/gps_track, in messages of
+// at most IP_LTE_GPS_TRACK_PUBLISH_MAX bytes before encoding.  The
+// records are re-encoded so that every message begins with a keyframe
+// and can be decoded on its own.  Returns the number of records sent.
+//
+// The log is gathered into <path>.sent, which is removed only once the
+// messages have been delivered (see ipConfirmGPSTrack).  Until then it
+// is sent again by each upload (a repeat is harmless), but no new
+// upload starts while one is still awaiting delivery.
+//
+int AbstractIpLTELeaf::ipUploadGPSTrack()
+{
+  LEAF_ENTER(L_NOTICE);
+  int sent = 0;
+  if (!pubsubLeaf || !pubsubLeaf->isConnected()) {
+    LEAF_WARN("Not connected, GPS track upload deferred");
+    LEAF_INT_RETURN(0);
+  }
+  if (ip_gps_track_unconfirmed) {
+    LEAF_NOTICE("Previous GPS track upload not yet delivered, upload deferred");
+    LEAF_INT_RETURN(0);
+  }
+  String pending = String(gnss_track.path)+".sent";
+  if (!LittleFS.exists(pending) && !ipGatherGPSTrack(pending)) {
+    LEAF_NOTICE("No GPS track to upload");
+    LEAF_INT_RETURN(0);
+  }
 
-      publish("status/location", msg, L_NOTICE, HERE);
-      ACTION("GPS %s", msg.c_str());
-      if (locChanged) {
-	setGPSFix(true);
-      }
+  fs::File file = LittleFS.open(pending, "r");
+  if (!file) {
+    LEAF_ALERT("Cannot open %s", pending.c_str());
+    LEAF_INT_RETURN(0);
+  }
+  size_t size = file.size();
+  uint8_t *buf = size?(uint8_t *)malloc(size):NULL;
+  if (size && !buf) {
+    LEAF_ALERT("No memory to upload %s (%d bytes)", pending.c_str(), (int)size);
+    file.close();
+    LEAF_INT_RETURN(0);
+  }
+  size_t got = size?file.read(buf, size):0;
+  file.close();
+  if (got < size) {
+    LEAF_WARN("Short read of %s (%d of %d bytes)", pending.c_str(), (int)got, (int)size);
+    size = got;
+  }
+
+  int lost = pubsubLeaf->pubsubDropCount();
+  bool ok = true;
+  GnssTrackLog chunk;
+  GnssFix state;
+  uint8_t out[IP_LTE_GPS_TRACK_PUBLISH_MAX];
+  int out_len = 0;
+  int pos = 0;
+  while (pos < (int)size) {
+    int n = GnssTrackLog::decode(buf+pos, size-pos, &state);
+    if (!n) {
+      LEAF_WARN("Track log %s unreadable after offset %d, remainder discarded", pending.c_str(), pos);
+      break;
     }
+    pos += n;
+    if (out_len + GnssTrackLog::RECORD_MAX > (int)sizeof(out)) {
+      ok = ipPublishGPSTrack(out, out_len);
+      if (!ok) break;
+      out_len = 0;
+      chunk.restart();
+    }
+    out_len += chunk.encode(state, out+out_len);
+    ++sent;
+  }
+  if (ok && out_len) {
+    ok = ipPublishGPSTrack(out, out_len);
+  }
+  if (buf) free(buf);
 
-    if (!partial) {
-      //LEAF_INFO("Recording acquisition of stable GPS fix");
-      gps_fix = true;
-      ip_gps_acquire_duration = millis()-ip_gps_active_timestamp;
-      if (!ip_enable_gps_always) {
-	mqtt_publish("status/gps_acquire_duration_ms", String(ip_gps_acquire_duration));
-	LEAF_NOTICE("Disable GPS after obtaining fix (acquisition took %dms)", ip_gps_acquire_duration);
-	ipDisableGPS(true);
-      }
+  if (ok) {
+    // remove the file once the messages are delivered
+    ip_gps_track_unconfirmed = true;
+    ip_gps_track_lost = lost;
+  }
+  else {
+    // it is sent again in full next time
+    LEAF_WARN("GPS track publish failed, %s kept for the next upload", pending.c_str());
+  }
+  LEAF_NOTICE("Uploaded %d GPS track records%s", sent, ok?"":" (incomplete)");
+  LEAF_INT_RETURN(sent);
+}
+
+//
+// Publish one message of track log (acknowledged).  It counts as handed
+// over if the link stayed up and no publish was lost meanwhile.
+//
+bool AbstractIpLTELeaf::ipPublishGPSTrack(const uint8_t *buf, int len)
+{
+  int lost = pubsubLeaf->pubsubDropCount();
+  mqtt_publish("status/gps_track", base64::encode(buf, len), 1, false, L_NOTICE, HERE);
+  return pubsubLeaf->isConnected() && (pubsubLeaf->pubsubDropCount() == lost);
+}
+
+//
+// Remove an uploaded track log once nothing of it is left queued or
+// unacknowledged.  If any publish was lost meanwhile the log is kept,
+// and sent again by the next upload.
+//
+void AbstractIpLTELeaf::ipConfirmGPSTrack()
+{
+  if (!ip_gps_track_unconfirmed || !pubsubLeaf) return;
+  if (pubsubLeaf->pubsubDropCount() != ip_gps_track_lost) {
+    LEAF_WARN("Publishes were lost during the GPS track upload, it is kept to send again");
+    ip_gps_track_unconfirmed = false;
+    return;
+  }
+  if (!pubsubLeaf->pubsubDrained()) return;
+  LEAF_NOTICE("GPS track upload delivered");
+  LittleFS.remove(String(gnss_track.path)+".sent");
+  ip_gps_track_unconfirmed = false;
+}
+
+//
+// Encode a duration as a 3GPP GPRS timer octet, given as the string of
+// binary digits that AT+CPSMS wants.  The top three bits select a unit
+// and the low five a multiplier, the finest unit that can express the
+// duration (rounding up) is used.
+//
+// active_timer selects the T3324 (GPRS Timer 2) units, otherwise the
+// T3412 extended (GPRS Timer 3) units are used.
+//
+String AbstractIpLTELeaf::ipLteTimerBits(unsigned long sec, bool active_timer)
+{
+  static const unsigned long tau_unit[] = {2, 30, 60, 600, 3600, 36000, 1152000};
+  static const uint8_t tau_code[] = {3, 4, 5, 0, 1, 2, 6};
+  static const unsigned long active_unit[] = {2, 60, 360};
+  static const uint8_t active_code[] = {0, 1, 2};
+  const unsigned long *unit = active_timer?active_unit:tau_unit;
+  const uint8_t *code = active_timer?active_code:tau_code;
+  int units = active_timer?3:7;
+
+  int u;
+  unsigned long v = 31;
+  for (u=0; u<units; u++) {
+    v = (sec + unit[u] - 1) / unit[u];
+    if (v <= 31) break;
+  }
+  if (u >= units) {
+    u = units-1;
+    v = 31;
+  }
+  uint8_t octet = (code[u]<<5) | v;
+  char bits[9];
+  for (int b=0; b<8; b++) {
+    bits[b] = (octet & (0x80>>b))?'1':'0';
+  }
+  bits[8]='\0';
+  return String(bits);
+}
+
+// The longest eDRX cycle (as a 4 bit code) that does not exceed ms
+int AbstractIpLTELeaf::ipLteEdrxCode(unsigned long ms)
+{
+  static const unsigned long cycle_ms[16] = {
+    5120, 10240, 20480, 40960, 61440, 81920, 102400, 122880,
+    143360, 163840, 327680, 655360, 1310720, 2621440, 5242880, 10485760
+  };
+  int code = 0;
+  while ((code < 15) && (cycle_ms[code+1] <= ms)) ++code;
+  return code;
+}
+
+bool AbstractIpLTELeaf::ipLteConfigurePower()
+{
+  LEAF_ENTER(L_NOTICE);
+  bool result = true;
+
+  if (ip_lte_psm) {
+    String tau = ipLteTimerBits(ip_lte_psm_tau_sec, false);
+    String active = ipLteTimerBits(ip_lte_psm_active_sec, true);
+    LEAF_NOTICE("Request PSM, TAU %ds (%s) active %ds (%s)",
+		ip_lte_psm_tau_sec, tau.c_str(), ip_lte_psm_active_sec, active.c_str());
+    result = modemSendCmd(HERE, "AT+CPSMS=1,,,\"%s\",\"%s\"", tau.c_str(), active.c_str()) && result;
+    // report entry to and exit from PSM
+    modemSendCmd(HERE, "AT+CPSMSTATUS=1");
+  }
+  else {
+    result = modemSendCmd(HERE, "AT+CPSMS=0") && result;
+  }
+
+  if (ip_lte_edrx) {
+    int code = ipLteEdrxCode(ip_lte_edrx_ms);
+    char bits[5];
+    for (int b=0; b<4; b++) {
+      bits[b] = (code & (0x8>>b))?'1':'0';
     }
+    bits[4]='\0';
+    LEAF_NOTICE("Request eDRX cycle of %dms (%s)", ip_lte_edrx_ms, bits);
+    result = modemSendCmd(HERE, "AT+CEDRXS=1,%d,\"%s\"", ip_lte_edrx_act, bits) && result;
   }
   else {
-    LEAF_NOTICE("No GPS fix (%s)", gps.c_str());
+    result = modemSendCmd(HERE, "AT+CEDRXS=0") && result;
   }
 
+  if (!result) {
+    LEAF_WARN("Power saving configuration was not accepted");
+  }
   LEAF_BOOL_RETURN(result);
 }
 
+void AbstractIpLTELeaf::ipLteSetPsm(bool in_psm)
+{
+  if (in_psm == ip_lte_in_psm) return;
+  LEAF_NOTICE("Modem %s power saving mode", in_psm?"entered":"left");
+  ip_lte_in_psm = in_psm;
+  if (in_psm) {
+    // don't mistake a sleeping modem for a dead one
+    ip_lte_psm_probe_saved = modem_probe_at_urc;
+    modem_probe_at_urc = false;
+  }
+  else {
+    modem_probe_at_urc = ip_lte_psm_probe_saved;
+  }
+  ipLteSendHold();
+}
+
+//
+// Hold back publishes to suit the radio: telemetry waits for the next
+// upload window, and while the modem is in PSM everything waits.
+//
+void AbstractIpLTELeaf::ipLteSendHold()
+{
+#ifdef ESP32
+  if (!pubsubLeaf || (pubsubLeaf->getIpComms() != this)) return;
+  int level = 0;
+  if (!ip_lte_window_open) {
+    if (ip_lte_in_psm) {
+      level = 2;
+    }
+    else if (ip_lte_upload_interval_sec) {
+      level = 1;
+    }
+  }
+  if (level == ip_lte_hold_level) return;
+  LEAF_INFO("Publish hold level %d => %d", ip_lte_hold_level, level);
+  ip_lte_hold_level = level;
+  if (level > 0) {
+    // a hold lasts a whole upload interval, more than the send queue
+    // holds, so the overflow goes to flash
+    pubsubLeaf->pubsubSpoolEnable(&LittleFS);
+  }
+  pubsubLeaf->pubsubSendHold(level > 0, level > 1);
+#endif
+}
+
+//
+// Open an upload window every ip_lte_upload_interval_sec, or early if
+// the modem is in PSM and there is something urgent to send.
+//
+// A window stays open for at least ip_lte_upload_window_sec, and until
+// the send queue is empty (but not more than four times that).
+//
+void AbstractIpLTELeaf::ipLteSchedule(unsigned long now)
+{
+  if (!ip_lte_window_open) {
+    bool due = ip_lte_upload_interval_sec && (now >= ip_lte_window_next);
+#ifdef ESP32
+    if (ip_lte_in_psm && pubsubLeaf && (pubsubLeaf->getIpComms() == this)) {
+      int waiting = ip_lte_upload_interval_sec?pubsubLeaf->sendQueueUrgentCount():pubsubLeaf->sendQueueCount();
+      if (waiting) due = true;
+    }
+#endif
+    if (due && isConnected()) {
+      ipLteWindowOpen(now);
+    }
+  }
+  else {
+    unsigned long elapsed = now - ip_lte_window_start;
+    unsigned long min_ms = ip_lte_upload_window_sec * 1000UL;
+    bool drained = true;
+#ifdef ESP32
+    if (pubsubLeaf && (pubsubLeaf->getIpComms() == this)) {
+      drained = (pubsubLeaf->sendQueueReady() == 0);
+    }
+#endif
+    if (((elapsed >= min_ms) && drained) || (elapsed >= 4*min_ms)) {
+      ipLteWindowClose(now);
+    }
+  }
+  ipLteSendHold();
+}
+
+void AbstractIpLTELeaf::ipLteWindowOpen(unsigned long now)
+{
+  LEAF_ENTER(L_NOTICE);
+
+  if (ip_lte_in_psm) {
+    // The modem does not answer in PSM.  A probe that gets no answer
+    // presses the power key, which wakes it.
+    LEAF_NOTICE("Waking modem from PSM");
+    ++ip_lte_psm_wake_count;
+    if (!modemProbe(HERE, MODEM_PROBE_QUICK, true)) {
+      LEAF_WARN("Modem did not wake from PSM");
+    }
+    ipLteSetPsm(false);
+  }
+
+  ip_lte_window_open = true;
+  ip_lte_window_start = now;
+  if (now >= ip_lte_window_next) {
+    ip_lte_window_next = now + ip_lte_upload_interval_sec*1000UL;
+  }
+  ++ip_lte_window_count;
+  ipLteSendHold();
+
+#ifdef ESP32
+  if (pubsubLeaf && (pubsubLeaf->getIpComms() == this)) {
+    int queued = pubsubLeaf->sendQueueCount();
+    LEAF_NOTICE("Upload window opens with %d queued", queued);
+    ip_lte_window_batch += queued;
+    pubsubLeaf->flushSendQueue();
+  }
+#endif
+
+  // heartbeats ride along in the same window rather than waking the radio
+  // separately (only those that go out over this link)
+  for (int i=0; pubsubLeaf && leaves[i]; i++) {
+    if (leaves[i]->getPubsubComms() != pubsubLeaf) continue;
+    leaves[i]->heartbeatSync(now);
+  }
+  LEAF_LEAVE;
+}
+
+void AbstractIpLTELeaf::ipLteWindowClose(unsigned long now)
+{
+  LEAF_NOTICE("Upload window closes after %lums", now - ip_lte_window_start);
+  ip_lte_window_open = false;
+  ip_lte_window_ms += now - ip_lte_window_start;
+  ipLteSendHold();
+}
+
+// Charge the time since the last call to the radio state we were in
+void AbstractIpLTELeaf::ipLteRadioAccount(unsigned long now)
+{
+  int state;
+  if (!modemIsPresent()) {
+    state = LTE_RADIO_OFF;
+  }
+  else if (ip_lte_in_psm) {
+    state = LTE_RADIO_PSM;
+  }
+  else if (!isConnected()) {
+    state = LTE_RADIO_UNATTACHED;
+  }
+  else if (ip_lte_window_open ||
+	   (ip_lte_last_transfer && ((now - ip_lte_last_transfer) < (ip_lte_rrc_tail_sec * 1000UL)))) {
+    state = LTE_RADIO_ACTIVE;
+  }
+  else {
+    state = LTE_RADIO_IDLE;
+  }
+
+  if (ip_lte_radio_since) {
+    ip_lte_radio_ms[ip_lte_radio_state] += now - ip_lte_radio_since;
+  }
+  else {
+    ip_lte_stats_since = now;
+  }
+  ip_lte_radio_since = now;
+  if (state != ip_lte_radio_state) {
+    LEAF_INFO("Radio %s => %s", lte_radio_state_name[ip_lte_radio_state], lte_radio_state_name[state]);
+    ip_lte_radio_state = state;
+    ++ip_lte_radio_entries[state];
+  }
+}
+
+void AbstractIpLTELeaf::ipLtePowerStatsReset()
+{
+  unsigned long now = millis();
+  ipLteRadioAccount(now);
+  memset(ip_lte_radio_ms, 0, sizeof(ip_lte_radio_ms));
+  memset(ip_lte_radio_entries, 0, sizeof(ip_lte_radio_entries));
+  ip_lte_stats_since = now;
+  ip_lte_window_count = ip_lte_window_batch = ip_lte_window_ms = 0;
+  ip_lte_psm_wake_count = 0;
+  ip_lte_stats_readings = pubsubLeaf?pubsubLeaf->pubsubTelemetryCount():0;
+}
+
+//
+// Time in each radio state, and the energy that implies given the
+// currents in ip_lte_radio_ua, in total and per reading published
+// (so that power saving settings can be compared on the same workload)
+//
+void AbstractIpLTELeaf::ipLtePowerStatsPub()
+{
+  LEAF_ENTER(L_NOTICE);
+  unsigned long now = millis();
+  ipLteRadioAccount(now);
+
+  ModemFieldTokenizer currents(ip_lte_radio_ua.c_str());
+  uint64_t ua_ms = 0;
+  for (int i=0; i<LTE_RADIO_STATE_COUNT; i++) {
+    unsigned long ua = currents.nextInt(0);
+    ua_ms += (uint64_t)ua * ip_lte_radio_ms[i];
+    mqtt_publish(String("status/lte_power/")+lte_radio_state_name[i]+"_ms", String(ip_lte_radio_ms[i]));
+    mqtt_publish(String("status/lte_power/")+lte_radio_state_name[i]+"_count", String(ip_lte_radio_entries[i]));
+  }
+  unsigned long readings = pubsubLeaf?(pubsubLeaf->pubsubTelemetryCount() - ip_lte_stats_readings):0;
+  unsigned long nah = ua_ms / 3600;   // nanoamp-hours
+  mqtt_publish("status/lte_power/elapsed_ms", String(now - ip_lte_stats_since));
+  mqtt_publish("status/lte_power/windows", String(ip_lte_window_count));
+  mqtt_publish("status/lte_power/window_ms", String(ip_lte_window_ms));
+  mqtt_publish("status/lte_power/window_batch", String(ip_lte_window_batch));
+  mqtt_publish("status/lte_power/psm_wakes", String(ip_lte_psm_wake_count));
+  mqtt_publish("status/lte_power/readings", String(readings));
+  mqtt_publish("status/lte_power/uah", String(nah/1000.0, 3));
+  if (readings) {
+    mqtt_publish("status/lte_power/uah_per_reading", String((float)nah/1000.0/readings, 3));
+  }
+  LEAF_LEAVE;
+}
+
 bool AbstractIpLTELeaf::ipGPSPowerStatus()
 {
   int i;
@@ -1426,6 +2736,11 @@ bool AbstractIpLTELeaf::ipCheckGPS(bool log)
       refresh_interval &&
       (age_of_fix > refresh_interval)
     ) {
+    if (ip_lte_upload_interval_sec && !ip_lte_window_open && ip_lte_window_next &&
+	((long)(ip_lte_window_next - millis()) > (long)(ip_lte_gps_lead_sec*1000UL))) {
+      // refresh just ahead of the next upload window, so the fix goes out fresh
+      LEAF_BOOL_RETURN(false);
+    }
     LEAF_NOTICE("GPS location is stale (age %d > %d), seeking a new fix", (int)age_of_fix, (int)refresh_interval);
     gps_fix = false; // don't call SetGPSFix() here, we don't want to affect the timestamps
     ipEnableGPS();
@@ -1490,7 +2805,43 @@ bool AbstractIpLTELeaf::ipDisconnect(bool retry)
 }
 
 Client *AbstractIpLTELeaf::newClient(int slot) {
-  return (Client *)(new IpClientLTE(this, slot));
+  return (Client *)(new IpClientLTE(this, slot, ipRxArena()));
+}
+
+//
+// Fetch data waiting at the modem for any socket, one block per socket
+// per round, so that a busy socket does not hold up the others.  Each
+// round starts one slot further on than the last.
+//
+// Caller holds the port mutex.
+//
+void AbstractIpLTELeaf::ipClientsReceive()
+{
+  LEAF_ENTER(L_INFO);
+  bool progress = true;
+  while (progress) {
+    progress = false;
+    for (int n=0; n<CLIENT_SESSION_MAX; n++) {
+      int slot = (ip_rx_next_slot + n) % CLIENT_SESSION_MAX;
+      IpClientLTE *client = (IpClientLTE *)ip_clients[slot];
+      if (!client || !client->receivePending()) continue;
+      if (client->receiveBlock() > 0) progress = true;
+    }
+    ip_rx_next_slot = (ip_rx_next_slot + 1) % CLIENT_SESSION_MAX;
+  }
+  LEAF_LEAVE;
+}
+
+void AbstractIpLTELeaf::ipClientStatus()
+{
+  AbstractIpLeaf::ipClientStatus();
+  if (ip_rx_arena) {
+    char status[64];
+    snprintf(status, sizeof(status), "free=%d/%d low=%d exhausted=%lu",
+	     ip_rx_arena->blocksFree(), ip_rx_arena->block_count,
+	     ip_rx_arena->lowWater(), ip_rx_arena->exhaustedCount());
+    mqtt_publish(String("status/")+getName()+"_rx_arena", status);
+  }
 }
 
 // local Variables:
@@ -104,6 +104,20 @@ public:
   }
   virtual bool commandHandler(String type, String name, String topic, String payload);
   virtual bool valueChangeHandler(String topic, Value *v);
+#if USE_IP_TCPCLIENT
+  // the modem service task reads sockets into ip_clients[] with the port
+  // mutex held (see AbstractIpLTELeaf::ipClientsReceive)
+  virtual bool tcpSlotLock()
+  {
+    if (modemPortIsMine()) return false;
+    if (!modemWaitPortMutex(HERE)) {
+      LEAF_WARN("Modem port unavailable, releasing TCP slot regardless");
+      return false;
+    }
+    return true;
+  }
+  virtual void tcpSlotUnlock(bool release) { if (release) modemReleasePortMutex(HERE); }
+#endif
 
 
   virtual void ipModemSetNeedsReboot() {
@@ -261,6 +275,8 @@ void AbstractIpModemLeaf::setup(void) {
   registerCommand(HERE,"modem_status", "Get the modem status");
   registerCommand(HERE,"modem_at", "Send a single AT command and report the response");
   registerCommand(HERE,"modem_http_get", "Fetch a file via http");
+  registerCommand(HERE,"modem_mutex_stats", "Publish modem port mutex contention by codepoint (payload reset=clear counters)");
+  registerCommand(HERE,"modem_service_stats", "Publish the cost of servicing the modem (payload reset=clear counters)");
 
   registerBoolValue("ip_modem_trace", &ip_modem_trace, "print trace of modem exchanges to console");
 
@@ -290,6 +306,16 @@ void AbstractIpModemLeaf::setup(void) {
   registerIntValue("ip_modem_reboots", &ip_modem_reboot_count, "Number of unexpected modem reboots");
   registerIntValue("ip_modem_connectfail_threshold", &ip_modem_connectfail_threshold, "Reboot modem after N failed connect attempts");
   registerIntValue("ip_modem_urc_check_interval_msec", &ip_modem_urc_check_interval_msec, "Interval between modem URC checks");
+  registerIntValue("ip_modem_poll_wait_msec", &modem_port_poll_wait_ms, "How long GPS and signal polls wait for the modem before skipping");
+#ifdef ESP32
+  registerBoolValue("ip_modem_service_task", &modem_service_task, "Service the modem from a task woken by modem input, not by polling from loop (takes effect at restart)");
+  registerIntValue("ip_modem_service_idle_msec", &modem_service_idle_msec, "Longest the modem service task sleeps when nothing wakes it");
+  registerIntValue("ip_modem_service_poll_msec", &modem_service_poll_msec, "Modem service interval when the modem stream has no receive event");
+
+  if (canRun() && modem_service_task) {
+    modemServiceStart();
+  }
+#endif
 
   LEAF_LEAVE_SLOW(2000);
 }
@@ -445,7 +471,16 @@ void AbstractIpModemLeaf::loop()
     ipConnect("initial");
   }
 
-  if (ip_modem_use_urc && modemIsPresent()) {
+  if (modemServiceRunning()) {
+    // the service task is woken by the modem and stashes what it hears,
+    // URC handlers run here
+    modemDispatchURC();
+  }
+  else if (modemIsPresent() && modemCommandPending()) {
+    // queued AT commands are advanced every loop
+    modemPoll();
+  }
+  else if (ip_modem_use_urc && modemIsPresent()) {
     unsigned long now = millis();
     if (now >= (ip_modem_last_urc_check + ip_modem_urc_check_interval_msec)) {
       ip_modem_last_urc_check = now;
@@ -527,6 +562,47 @@ bool AbstractIpModemLeaf::commandHandler(String type, String name, String topic,
   ELSEWHEN("modem_status",{
     mqtt_publish("status/modem", TRUTH_lc(modemIsPresent()));
   })
+  ELSEWHEN("modem_service_stats",{
+      unsigned long elapsed = millis() - modem_stats_since;
+      mqtt_publish("status/modem_service/mode", modemServiceRunning()?(modem_rx_event?"event":"task"):"loop");
+      mqtt_publish("status/modem_service/elapsed_ms", String(elapsed));
+      mqtt_publish("status/modem_service/wake_rx", String(modem_wake_rx));
+      mqtt_publish("status/modem_service/wake_ri", String(modem_wake_ri));
+      mqtt_publish("status/modem_service/wake_timeout", String(modem_wake_timeout));
+      mqtt_publish("status/modem_service/polls", String(modem_poll_count));
+      mqtt_publish("status/modem_service/polls_busy", String(modem_poll_busy));
+      mqtt_publish("status/modem_service/probes", String(modem_probe_count));
+      mqtt_publish("status/modem_service/poll_us", String(modem_poll_us));
+      mqtt_publish("status/modem_service/hold_us", String(modem_poll_hold_us));
+      if (elapsed) {
+	// normalised so that loop and event driven runs can be compared
+	mqtt_publish("status/modem_service/poll_us_per_sec", String((unsigned long)((uint64_t)modem_poll_us*1000/elapsed)));
+	mqtt_publish("status/modem_service/hold_us_per_sec", String((unsigned long)((uint64_t)modem_poll_hold_us*1000/elapsed)));
+      }
+      if (payload == "reset") modemServiceStatsReset();
+  })
+  ELSEWHEN("modem_mutex_stats",{
+      // histogram buckets are <1ms, <4ms, <16ms ... <4096ms, longer
+      char buf[256];
+      for (int i=0; i<modem_port_stats_count; i++) {
+	struct ModemMutexStats *s = modem_port_stats+i;
+	int len = snprintf(buf, sizeof(buf), "acq=%lu busy=%lu defer=%lu waiting=%d wait_max=%lums hold_max=%lums hold_total=%lums wait=",
+			   s->acquires, s->busy, s->deferred, s->waiting,
+			   s->wait_max_us/1000, s->hold_max_us/1000, s->hold_total_ms);
+	for (int b=0; b<MODEM_MUTEX_HIST_BUCKETS; b++) {
+	  len += snprintf(buf+len, sizeof(buf)-len, "%s%lu", b?"/":"", s->wait_hist[b]);
+	}
+	len += snprintf(buf+len, sizeof(buf)-len, " hold=");
+	for (int b=0; b<MODEM_MUTEX_HIST_BUCKETS; b++) {
+	  len += snprintf(buf+len, sizeof(buf)-len, "%s%lu", b?"/":"", s->hold_hist[b]);
+	}
+	mqtt_publish(String("status/modem_mutex/")+s->func+"/"+String(s->line), buf);
+      }
+      if (modem_port_holder.file && modemPortIsHeld()) {
+	mqtt_publish("status/modem_mutex/holder", String(modem_port_holder.func)+":"+String(modem_port_holder.line));
+      }
+      if (payload == "reset") modemPortStatsReset();
+  })
   ELSEWHEN("modem_at",{
     if (!modemWaitPortMutex()) {
       LEAF_ALERT("Cannot take modem mutex");
@@ -1,6 +1,10 @@
 #pragma once
 #include "abstract_ip_lte.h"
 
+#ifndef IP_SIMCOM_FTP_GET_CHUNK
+#define IP_SIMCOM_FTP_GET_CHUNK 1024
+#endif
+
 //
 //@************************* class AbstractIpSimcomLeaf ***************************
 //
@@ -28,12 +32,18 @@ public:
 
   virtual bool ipSetApName(String apn) { return modemSendCmd(HERE, "AT+CNACT=1,\"%s\"", apn.c_str()); }
   virtual bool ipGetAddress(bool link_test=true) {
-    String response = modemQuery("AT+CNACT?","+CNACT: ", 10*modem_timeout_default,HERE);
-    if (response && response.startsWith("1,")) {
-      ip_addr_str = response.substring(1,response.length()-1);
-      return true;
+    // response is <status>,<address>
+    ModemFieldTokenizer fields(modem_response_buf, 0);
+    ModemToken addr;
+    bool result = false;
+    modemWaitBufferMutex(HERE);
+    if (modemQueryFields("AT+CNACT?","+CNACT: ", &fields, 10*modem_timeout_default,HERE) &&
+	(fields.nextInt()==1) && fields.next(&addr)) {
+      ip_addr_str = addr.toString();
+      result = true;
     }
-    return false;
+    modemReleaseBufferMutex(HERE);
+    return result;
   }
   virtual bool modemCarrierStatus() {
     LEAF_ENTER(L_DEBUG);
@@ -80,6 +90,7 @@ public:
 
 
   virtual bool modemFtpPut(const char *host, const char *user, const char *pass, const char *path, const char *buf, int buf_len, int bearer=1);
+  virtual bool modemFtpPutFile(const char *host, const char *user, const char *pass, const char *path, fs::File &file, int bearer=1);
   virtual int modemFtpGet(const char *host, const char *user, const char *pass, const char *path, char *buf, int buf_max, int bearer=1);
 
   virtual bool ftpPut(String host, String user, String pass, String path, const char *buf, int buf_len)
@@ -89,6 +100,19 @@ public:
     bool result = modemFtpPut(host.c_str(), user.c_str(), pass.c_str(), path.c_str(), buf, buf_len);
     LEAF_RETURN(result);
   }
+  virtual bool ftpPutFile(String host, String user, String pass, String path, fs::FS *fs, String filename)
+  {
+    LEAF_ENTER(L_NOTICE);
+    fs::File file = fs->open(filename, "r");
+    if (!file) {
+      LEAF_ALERT("Cannot open %s", filename.c_str());
+      LEAF_BOOL_RETURN(false);
+    }
+    LEAF_NOTICE("Uploading %s from %s of size %d", path.c_str(), filename.c_str(), (int)file.size());
+    bool result = modemFtpPutFile(host.c_str(), user.c_str(), pass.c_str(), path.c_str(), file);
+    file.close();
+    LEAF_BOOL_RETURN(result);
+  }
 #if 0
   virtual bool httpPost(char *url, const uint8_t *data, int len, const char *type="application/octet-stream");
 #endif
@@ -103,6 +127,7 @@ protected:
   virtual bool modemFtpBegin(const char *host, const char *user, const char *pass, int bearer=1);
 
   virtual bool modemFtpEnd(int bearer=1);
+  bool modemFtpPutData(const char *host, const char *user, const char *pass, const char *path, const char *buf, fs::File *file, int len, int bearer);
 
 };
 
@@ -481,6 +506,24 @@ bool AbstractIpSimcomLeaf::modemFtpEnd(int bearer)
 }
 
 bool AbstractIpSimcomLeaf::modemFtpPut(const char *host, const char *user, const char *pass, const char *path, const char *buf, int buf_len, int bearer)
+{
+  return modemFtpPutData(host, user, pass, path, buf, NULL, buf_len, bearer);
+}
+
+//
+// Upload straight from a (LittleFS or SD) file, a modem-sized chunk at a
+// time, so that the file need never be held in RAM.
+//
+bool AbstractIpSimcomLeaf::modemFtpPutFile(const char *host, const char *user, const char *pass, const char *path, fs::File &file, int bearer)
+{
+  return modemFtpPutData(host, user, pass, path, NULL, &file, file.size(), bearer);
+}
+
+//
+// Upload from either a buffer or a file.  Each chunk is written to the
+// modem in one block, as large as the modem will accept.
+//
+bool AbstractIpSimcomLeaf::modemFtpPutData(const char *host, const char *user, const char *pass, const char *path, const char *buf, fs::File *file, int buf_len, int bearer)
 {
   int state,err;
   int retry = 0;
@@ -543,20 +586,36 @@ ftp_dns_retry:
   }
 
   int sent = 0;
+  unsigned long start = millis();
+  uint8_t *chunk_buf = NULL;
+  int chunk_buf_size = 0;
 
   while (sent < buf_len) {
     int remain = buf_len - sent;
     int thischunk = (remain > chunk) ? chunk : remain;
+    if (file && (chunk_buf_size < thischunk)) {
+      // one staging buffer for file data, grown if the modem offers more
+      free(chunk_buf);
+      chunk_buf = (uint8_t *)malloc(thischunk);
+      chunk_buf_size = chunk_buf?thischunk:0;
+      if (!chunk_buf) {
+	LEAF_ALERT("FTP chunk buffer allocation failed");
+	modemFtpEnd(bearer);
+	LEAF_BOOL_RETURN(false);
+      }
+    }
 
     LEAF_NOTICE("Sending chunk of %d bytes from remaining size %d", thischunk, remain);
     snprintf(modem_command_buf, modem_command_max, "AT+FTPPUT=2,%d", thischunk);
     if (!modemSendExpectIntPair(modem_command_buf, "+FTPPUT: ",&err,&thischunk,ip_ftp_timeout_sec*1000, 2, HERE)) {
       LEAF_ALERT("FTP data put failed");
+      free(chunk_buf);
       modemFtpEnd(bearer);
       LEAF_BOOL_RETURN(false);
     }
     if (err != 2) {
       LEAF_ALERT("FTP data put rejected");
+      free(chunk_buf);
       modemFtpEnd(bearer);
       LEAF_BOOL_RETURN(false);
     }
@@ -565,22 +624,46 @@ ftp_dns_retry:
       delay(500);
       continue;
     }
-    modem_stream->write((const uint8_t *)buf+sent, thischunk);
+    if (file) {
+      // the modem may have granted less than we asked, read only that much
+      if (thischunk > chunk_buf_size) thischunk = chunk_buf_size;
+      int got = file->read(chunk_buf, thischunk);
+      if (got != thischunk) {
+	LEAF_ALERT("FTP source file read failed (%d/%d)", got, thischunk);
+	free(chunk_buf);
+	modemFtpEnd(bearer);
+	LEAF_BOOL_RETURN(false);
+      }
+      modemSendRaw(chunk_buf, thischunk, HERE);
+    }
+    else {
+      modemSendRaw((const uint8_t *)buf+sent, thischunk, HERE);
+    }
     sent += thischunk;
-    LEAF_NOTICE("Wrote %d bytes, total so far %d of %d", thischunk, sent, buf_len);
+    LEAF_INFO("Wrote %d bytes, total so far %d of %d", thischunk, sent, buf_len);
 
     if (!modemSendExpectIntPair(NULL, "+FTPPUT: 1,",&err,&chunk,ip_ftp_timeout_sec*1000,4,HERE)) {
       LEAF_NOTICE("FTP continuation message not parsed");
+      free(chunk_buf);
       modemFtpEnd(bearer);
       LEAF_BOOL_RETURN(false);
     }
     if (err != 1) {
       LEAF_ALERT("FTP state machine did not invite continuation");
+      free(chunk_buf);
       modemFtpEnd(bearer);
       LEAF_BOOL_RETURN(false);
     }
-    LEAF_NOTICE("FTP invites us to continue, next chunk size is %d",chunk);
+    LEAF_INFO("FTP invites us to continue, next chunk size is %d",chunk);
   }
+  free(chunk_buf);
+  unsigned long elapsed = millis() - start;
+  if (elapsed == 0) elapsed = 1;
+  ip_ftp_last_bytes = sent;
+  ip_ftp_last_ms = elapsed;
+  LEAF_NOTICE("FTP sent %d bytes in %lums (%lu.%01lu KB/s)", sent, elapsed,
+	      (unsigned long)((uint64_t)sent*1000/1024/elapsed),
+	      (unsigned long)((uint64_t)sent*10000/1024/elapsed)%10);
 
   // give tcp a little time to drain
   delay(500);
@@ -643,7 +726,8 @@ int AbstractIpSimcomLeaf::modemFtpGet(const char *host, const char *user, const
     return -1;
   }
 
-  int chunk_max = 200;
+  int chunk_max = IP_SIMCOM_FTP_GET_CHUNK;
+  unsigned long start = millis();
   snprintf(modem_command_buf, modem_command_max, "AT+FTPGET=2,%d", chunk_max);
   state = 2;
   while (state == 2) {
@@ -701,7 +785,13 @@ int AbstractIpSimcomLeaf::modemFtpGet(const char *host, const char *user, const
   }
 
   modemFtpEnd(bearer);
-  LEAF_NOTICE("ftpGet complete");
+  unsigned long elapsed = millis() - start;
+  if (elapsed == 0) elapsed = 1;
+  ip_ftp_last_bytes = size;
+  ip_ftp_last_ms = elapsed;
+  LEAF_NOTICE("ftpGet complete, %d bytes in %lums (%lu.%01lu KB/s)", size, elapsed,
+	      (unsigned long)((uint64_t)size*1000/1024/elapsed),
+	      (unsigned long)((uint64_t)size*10000/1024/elapsed)%10);
   return size;
 }
 
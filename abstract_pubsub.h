@@ -13,15 +13,38 @@
 #ifdef ESP32
 #include "esp_app_format.h"
 #include "esp_ota_ops.h"
+#include "pubsub_spool.h"
 #endif
 
 
 bool pubsub_loopback = false;
 bool pubsub_service = false;
+// Set by pubsub_publish_bench: every pubsub leaf (primary, service and
+// fan-out) stops short of its transport or send queue
+bool pubsub_bench_dry_run = false;
+
+#ifndef PUBSUB_FANOUT_MAX
+#define PUBSUB_FANOUT_MAX 4
+#endif
+// A fan-out target receives every copy through its send queue, so it
+// needs room for a burst from all leaves (eg. a status dump on connect)
+#ifndef PUBSUB_FANOUT_QUEUE_SIZE
+#define PUBSUB_FANOUT_QUEUE_SIZE 50
+#endif
+
+// Additional active pubsub leaves that receive copies of publishes (see stacxAddComms)
+class AbstractPubsubLeaf;
+AbstractPubsubLeaf *pubsub_fanout[PUBSUB_FANOUT_MAX];
+int pubsub_fanout_count = 0;
+
+// The pubsub leaf whose reporting policy is consulted by leaves that do not
+// know their pubsub leaf (eg. via the Pollable trait)
+AbstractPubsubLeaf *pubsub_policy_leaf = NULL;
 
 #define PUBSUB_LOOPBACK 1
 #define PUBSUB_SHELL 2
 #define PUBSUB_SERVICE 4
+#define PUBSUB_REPLAY 8
 
 #ifndef PUBSUB_HOST_DEFAULT
 #define PUBSUB_HOST_DEFAULT "mqtt.lan"
@@ -51,6 +74,88 @@ bool pubsub_service = false;
 #ifndef PUBSUB_SEND_QUEUE_SIZE
 #define PUBSUB_SEND_QUEUE_SIZE 10
 #endif
+#ifndef PUBSUB_SEND_QUEUE_PRIORITY_SIZE
+#define PUBSUB_SEND_QUEUE_PRIORITY_SIZE 5
+#endif
+// How long a publisher waits for room in a full send queue that the
+// drain task is emptying
+#ifndef PUBSUB_SEND_QUEUE_WAIT_MS
+#define PUBSUB_SEND_QUEUE_WAIT_MS 2000
+#endif
+#ifndef PUBSUB_SPOOL_MAX_BYTES
+#define PUBSUB_SPOOL_MAX_BYTES 32768
+#endif
+#ifndef PUBSUB_CLASS_BURST
+#define PUBSUB_CLASS_BURST 20
+#endif
+
+#ifndef PUBSUB_RECEIVE_MAX
+#define PUBSUB_RECEIVE_MAX 8192
+#endif
+
+// a streamed message with no new fragment for this long is abandoned
+#ifndef PUBSUB_STREAM_TIMEOUT_MS
+#define PUBSUB_STREAM_TIMEOUT_MS 10000
+#endif
+
+#ifndef PUBSUB_SUBSCRIBE_MINIMISE
+#define PUBSUB_SUBSCRIBE_MINIMISE false
+#endif
+
+#ifndef PUBSUB_SUBSCRIBE_COVER_DEPTH
+#define PUBSUB_SUBSCRIBE_COVER_DEPTH 1
+#endif
+
+#ifndef PUBSUB_INFLIGHT_MAX
+#define PUBSUB_INFLIGHT_MAX 16
+#endif
+
+#ifndef PUBSUB_INFLIGHT_WINDOW
+#define PUBSUB_INFLIGHT_WINDOW 4
+#endif
+
+#ifndef PUBSUB_BATCH_JSON
+#define PUBSUB_BATCH_JSON false
+#endif
+
+#ifndef PUBSUB_REPORT_POLICY
+#define PUBSUB_REPORT_POLICY false
+#endif
+#ifndef PUBSUB_POLICY_WINDOW_SEC
+#define PUBSUB_POLICY_WINDOW_SEC 15
+#endif
+#ifndef PUBSUB_POLICY_POOR_FACTOR
+#define PUBSUB_POLICY_POOR_FACTOR 4
+#endif
+#ifndef PUBSUB_POLICY_QUEUE_HIGH
+#define PUBSUB_POLICY_QUEUE_HIGH 50
+#endif
+#ifndef PUBSUB_POLICY_RSSI_INTERVAL_SEC
+#define PUBSUB_POLICY_RSSI_INTERVAL_SEC 60
+#endif
+
+//
+// Decisions of the reporting policy (see pubsubReportPolicy)
+//
+enum pubsub_report_decision {
+  PUBSUB_REPORT_NOW,      // publish now
+  PUBSUB_REPORT_DEFER,    // hold the report and ask again later
+  PUBSUB_REPORT_SUPPRESS  // skip this report altogether
+};
+
+#ifndef PUBSUB_SESSION_PERSIST
+#define PUBSUB_SESSION_PERSIST false
+#endif
+#ifndef PUBSUB_SESSION_BUF_SIZE
+#define PUBSUB_SESSION_BUF_SIZE 1024
+#endif
+
+#ifndef PUBSUB_PROBE_INTERVAL_SEC
+#define PUBSUB_PROBE_INTERVAL_SEC 0
+#endif
+#ifndef PUBSUB_PROBE_SAMPLES
+#define PUBSUB_PROBE_SAMPLES 32
+#endif
 
 #ifndef PUBSUB_LOG_CONNECT
 #define PUBSUB_LOG_CONNECT false
@@ -64,6 +169,24 @@ bool pubsub_service = false;
 #define PUBSUB_LOG_FILE STACX_LOG_FILE
 #endif
 
+// Send queue drain budget per pass (bytes of topic+payload, milliseconds)
+#ifndef PUBSUB_DRAIN_BYTES
+#define PUBSUB_DRAIN_BYTES 4096
+#endif
+
+#ifndef PUBSUB_DRAIN_MS
+#define PUBSUB_DRAIN_MS 20
+#endif
+
+// Drain the send queue from a dedicated task, so that publishers only ever enqueue
+#ifndef PUBSUB_DRAIN_TASK
+#define PUBSUB_DRAIN_TASK false
+#endif
+
+#ifndef PUBSUB_DRAIN_STACK_SIZE
+#define PUBSUB_DRAIN_STACK_SIZE 4096
+#endif
+
 #ifndef PUBSUB_REPORT_INTERVAL_SEC
 #ifdef  IP_REPORT_INTERVAL_SEC
 #define PUBSUB_REPORT_INTERVAL_SEC IP_REPORT_INTERVAL_SEC
@@ -101,10 +224,243 @@ struct PubsubSendQueueMessage
   String *payload;
   byte qos;
   bool retain;
+  byte topic_class;
+};
+
+//
+// Receives a copy of each message passing through a pubsub leaf, in either
+// direction (see leaf_pubsub_capture.h).  Called from whichever task is
+// publishing, so must not block.
+//
+class PubsubCaptureSink
+{
+public:
+  virtual void pubsubCapture(bool outbound, const char *topic, size_t topic_len,
+			     const char *payload, size_t payload_len, int qos, bool retain) = 0;
+};
+
+//
+// A QoS1 publish that has been sent but not yet acknowledged
+//
+struct PubsubInflight
+{
+  uint16_t msg_id; // zero means slot is free
+  uint8_t retries;
+  bool retain;
+  bool restored;   // saved across sleep, to be sent once more whatever the retry limit
+  int8_t topic_class;
+  unsigned long sent_ms;
+  String *topic;
+  String *payload;
+};
+
+#ifdef ESP32
+//
+// Broker session state kept in RTC memory across deep sleep, so that a
+// persistent (clean-session false) broker session can be resumed on wake
+// without resubscribing.
+//
+// The buffer holds a sequence of records:
+//   S <qos> topic NUL                     a subscription
+//   R <qos> topic NUL                     a leaf subscription request (when minimising)
+//   P <retain> topic NUL payload NUL      an unacknowledged QoS1 publish
+//
+#define PUBSUB_SESSION_MAGIC 0x53455354
+
+struct PubsubRtcSession
+{
+  uint32_t magic;
+  uint32_t signature; // hash of broker and base topic, to detect configuration change
+  uint16_t sub_count;
+  uint16_t pub_count;
+  uint16_t covered;   // pubsub_subscribe_covered
+  uint16_t len;
+  char buf[PUBSUB_SESSION_BUF_SIZE];
+};
+
+RTC_DATA_ATTR struct PubsubRtcSession pubsub_rtc_session;
+#endif
+
+// FNV-1a hash
+uint32_t pubsubHash(const char *s, uint32_t h=2166136261UL)
+{
+  while (*s) {
+    h ^= (uint8_t)*s++;
+    h *= 16777619UL;
+  }
+  return h;
+}
+
+// Upper bounds (ms) of the PUBACK round trip histogram buckets, the last
+// bucket catches everything slower
+#define PUBSUB_RTT_BUCKETS 8
+const unsigned long pubsub_rtt_bucket_ms[PUBSUB_RTT_BUCKETS] = {50,100,200,500,1000,2000,5000,0};
+
+//
+// Rolling latency samples (microseconds) for the pubsub latency probe.
+// Each probe is split into the time from publish to arrival in the
+// transport callback, time waiting in the receive queue, and time spent
+// routing to the handler.
+//
+enum pubsub_probe_split {
+  PUBSUB_PROBE_TOTAL,
+  PUBSUB_PROBE_TRANSPORT,
+  PUBSUB_PROBE_QUEUE,
+  PUBSUB_PROBE_ROUTE,
+  PUBSUB_PROBE_SPLITS
 };
 
+const char *pubsub_probe_split_names[] = {
+  "total",
+  "transport",
+  "queue",
+  "route"
+};
+
+struct PubsubLatencySamples
+{
+  int count;
+  int next;
+  uint32_t us[PUBSUB_PROBE_SAMPLES];
+};
+
+void pubsubLatencyRecord(struct PubsubLatencySamples *s, uint32_t us)
+{
+  s->us[s->next] = us;
+  s->next = (s->next+1)%PUBSUB_PROBE_SAMPLES;
+  if (s->count < PUBSUB_PROBE_SAMPLES) ++s->count;
+}
+
+// Return the given percentile (0-100) of the retained samples
+uint32_t pubsubLatencyPercentile(struct PubsubLatencySamples *s, int percentile)
+{
+  if (s->count == 0) return 0;
+  uint32_t sorted[PUBSUB_PROBE_SAMPLES];
+  memcpy(sorted, s->us, s->count * sizeof(uint32_t));
+  // insertion sort, the sample set is small
+  for (int i=1; i<s->count; i++) {
+    uint32_t v = sorted[i];
+    int j;
+    for (j=i; (j>0) && (sorted[j-1] > v); j--) sorted[j] = sorted[j-1];
+    sorted[j] = v;
+  }
+  int index = (percentile * (s->count-1) + 50) / 100;
+  return sorted[index];
+}
+
 extern bool check_bod();
 
+//
+// Allocate a buffer for an inbound message, preferring PSRAM when
+// present (large payloads would otherwise fragment internal heap).
+// Release with free().
+//
+char *pubsub_receive_alloc(size_t size)
+{
+#ifdef ESP32
+  if (psramFound()) {
+    char *buf = (char *)heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+    if (buf) return buf;
+  }
+#endif
+  return (char *)malloc(size);
+}
+
+//
+// A received message, held in one allocation (topic and payload are
+// each NUL terminated) which is passed by reference from the network
+// callback, through the receive queue, to the router and to leaves.
+//
+// The creator holds the first reference.  A leaf that wants to keep the
+// message beyond its handler takes another with pubsubMessageRef(), and
+// the storage is freed when the last holder calls pubsubMessageRelease().
+//
+// For fragments of an oversize message, index is the offset of this
+// payload within a message of length total.
+//
+struct PubsubMessageBuffer
+{
+  int refs;
+  size_t topic_len;
+  size_t payload_len;
+  size_t index;
+  size_t total;
+  uint8_t qos;
+  bool retain;
+  unsigned long rx_us; // time of arrival in the network callback
+  char data[];
+
+  const char *topic() { return data; }
+  char *payload() { return data+topic_len+1; }
+};
+
+//
+// Test whether an MQTT topic filter (which may contain + and #
+// wildcards) matches a topic
+//
+bool pubsubTopicMatch(const char *filter, const char *topic)
+{
+  while (*filter) {
+    if (*filter == '#') {
+      return true;
+    }
+    if (*filter == '+') {
+      // consume one level of topic
+      while (*topic && (*topic != '/')) ++topic;
+      ++filter;
+      continue;
+    }
+    if (*filter != *topic) {
+      // "a/b/#" also matches the parent "a/b"
+      return ((*topic == '\0') && (filter[0] == '/') && (filter[1] == '#') && (filter[2] == '\0'));
+    }
+    ++filter;
+    ++topic;
+  }
+  return (*topic == '\0');
+}
+
+PubsubMessageBuffer *pubsubMessageAlloc(const char *topic, size_t topic_len, size_t payload_size)
+{
+  PubsubMessageBuffer *msg = (PubsubMessageBuffer *)pubsub_receive_alloc(sizeof(PubsubMessageBuffer)+topic_len+payload_size+2);
+  if (!msg) return NULL;
+  msg->refs = 1;
+  msg->topic_len = topic_len;
+  msg->payload_len = 0;
+  msg->index = 0;
+  msg->total = payload_size;
+  msg->qos = 0;
+  msg->retain = false;
+  msg->rx_us = micros();
+  memcpy(msg->data, topic, topic_len);
+  msg->data[topic_len] = '\0';
+  msg->payload()[0] = '\0';
+  return msg;
+}
+
+// Copy (part of) the payload into place, at offset within the payload
+void pubsubMessageFill(PubsubMessageBuffer *msg, size_t offset, const char *data, size_t len)
+{
+  memcpy(msg->payload()+offset, data, len);
+  if (offset+len > msg->payload_len) {
+    msg->payload_len = offset+len;
+    msg->payload()[msg->payload_len] = '\0';
+  }
+}
+
+PubsubMessageBuffer *pubsubMessageRef(PubsubMessageBuffer *msg)
+{
+  if (msg) __atomic_add_fetch(&msg->refs, 1, __ATOMIC_ACQ_REL);
+  return msg;
+}
+
+void pubsubMessageRelease(PubsubMessageBuffer *msg)
+{
+  if (msg && (__atomic_sub_fetch(&msg->refs, 1, __ATOMIC_ACQ_REL) == 0)) {
+    free(msg);
+  }
+}
+
 
 class AbstractPubsubLeaf : public Leaf
 {
@@ -203,24 +559,126 @@ public:
   virtual void pubsubStatus() { status_pub(); }
   virtual void status_pub();
   virtual void config_pub();
+  virtual void stats_pub();
   virtual void setClientId(String id) { pubsub_client_id=id; }
   virtual bool valueChangeHandler(String topic, Value *v);
   virtual bool commandHandler(String type, String name, String topic, String payload);
   virtual void flushSendQueue(int count = 0, bool drop=false);
+  // publishes lost so far, from a full send queue or abandoned unacknowledged
+  int pubsubDropCount() { return pubsub_send_queue_drop_count + pubsub_inflight_expire_count; }
+  // true once every publish so far has left the send queue (and spool),
+  // and any that need acknowledgement have been acknowledged
+  bool pubsubDrained()
+  {
+#ifdef ESP32
+    if (sendQueueCount()) return false;
+#endif
+    return pubsub_inflight_count == 0;
+  }
 #ifdef ESP32
   virtual int sendQueueCount()
   {
-    return (int)uxQueueMessagesWaiting(send_queue);
+    int count = pubsub_spool.pending();
+    if (send_queue) count += (int)uxQueueMessagesWaiting(send_queue);
+    if (send_queue_priority) count += (int)uxQueueMessagesWaiting(send_queue_priority);
+    return count;
+  }
+  int sendQueueUrgentCount() { return send_queue_priority?(int)uxQueueMessagesWaiting(send_queue_priority):0; }
+  // queued publishes that may be sent now (see pubsubSendHold)
+  int sendQueueReady()
+  {
+    int count = 0;
+    if (send_queue && !pubsub_send_hold) count += (int)uxQueueMessagesWaiting(send_queue) + pubsub_spool.pending();
+    if (!pubsub_send_hold_urgent) count += sendQueueUrgentCount();
+    return count;
+  }
+  bool sendQueueReceive(struct PubsubSendQueueMessage *msg, TickType_t wait=0)
+  {
+    // urgent messages overtake bulk traffic
+    if (send_queue_priority && !pubsub_send_hold_urgent && xQueueReceive(send_queue_priority, msg, 0)) return true;
+    return send_queue && !pubsub_send_hold && xQueueReceive(send_queue, msg, wait);
+  }
+  // While held, telemetry and status are queued rather than sent (eg. until
+  // the next radio upload window).  Alerts and events still go at once,
+  // unless urgent is also set (eg. while the radio is unreachable in PSM).
+  void pubsubSendHold(bool hold, bool urgent=false)
+  {
+    pubsub_send_hold = hold;
+    pubsub_send_hold_urgent = hold && urgent;
+    if (!hold) pubsubDrainWake();
+  }
+  bool pubsubSendHeld() { return pubsub_send_hold; }
+  int pubsubDrainSendQueue(size_t byte_budget, unsigned long ms_budget);
+  void pubsubDrain();
+  void pubsubDrainWake() { if (pubsub_drain_handle) xTaskNotifyGive(pubsub_drain_handle); }
+  void pubsubSpoolEnable(fs::FS *fs, int max_bytes=PUBSUB_SPOOL_MAX_BYTES);
+  void pubsubSpoolRefill();
+  // True if a publish from this task should only be queued: it is sent by
+  // the drain task, or (when there is none) by the loop, never by the
+  // publisher.  With a manual drain (pubsub_dequeue_delay 0) publishes go
+  // straight to the transport.
+  bool pubsubPublishAsync()
+  {
+    if (pubsub_drain_handle) return (xTaskGetCurrentTaskHandle() != pubsub_drain_handle);
+    return send_queue && pubsub_dequeue_delay && !pubsub_dequeuing;
   }
 #endif
 
+  // True if the publish was sent, queued or held.  The message id (for a
+  // QoS1 publish that went straight to the transport) is given separately,
+  // as zero is a valid result for QoS0.
+  bool pubsubPublish(const String &topic, const String &payload, int qos=0, bool retain=false, int topic_class=PUBSUB_CLASS_TELEMETRY, uint16_t *msg_id_r=NULL) {
+    return pubsubPublish(topic.c_str(), topic.length(), payload, qos, retain, topic_class, msg_id_r);
+  }
+  bool pubsubPublish(const char *topic, size_t topic_len, const String &payload, int qos=0, bool retain=false, int topic_class=PUBSUB_CLASS_TELEMETRY, uint16_t *msg_id_r=NULL);
+  int pubsubTopicClass(Leaf *leaf, String &topic);
+  bool pubsubRateCheck(struct LeafTokenBucket *leaf_limit, int topic_class);
+  bool pubsubIsRouting() { return pubsub_route_depth > 0; }
+  int pubsubPublishBatch(struct PubsubBatch *batch);
+  virtual int _mqtt_publish_batch(struct PubsubBatch *batch);
+  int pubsubReportPolicy(Leaf *leaf, int topic_class=PUBSUB_CLASS_TELEMETRY, bool retry=false);
+  unsigned long pubsubReportInterval(unsigned long interval);
+  unsigned long pubsubTelemetryCount() { return pubsub_telemetry_count; }
+  bool pubsubReportWindowIsOpen(Leaf *leaf, unsigned long now);
+  virtual void pre_sleep(int duration=0);
+  virtual void post_sleep();
+  void pubsubSessionSave();
+  bool pubsubSessionRestore();
+  void pubsubSetFanoutClasses(int mask) { pubsub_fanout_classes = mask; }
+  void pubsubFanoutPrepare(int mask);
+  bool pubsubIsFanoutTarget() { return pubsub_fanout_target; }
+  bool pubsubFanoutEnqueue(String &topic, String &payload, int qos, bool retain, int topic_class);
+  static void pubsubFanout(AbstractPubsubLeaf *primary, String &topic, String &payload, int qos, bool retain, int topic_class);
+  void pubsubProbeSend();
+  void pubsubProbeReceive(String &payload);
+  void pubsubProbePub();
   virtual uint16_t _mqtt_publish(String topic, String payload, int qos=0, bool retain=false)=0;
-  virtual bool _mqtt_queue_publish(String topic, String payload, int qos=0, bool retain=false);
+  // Publish from a (NUL terminated) topic buffer.  Transports that can send
+  // straight from a char buffer should override this and have
+  // _mqtt_publish call it, the default makes Strings (of the given
+  // lengths) and calls _mqtt_publish.
+  //
+  // Returns true if the transport took the message, the message id (if
+  // any) is stored at msg_id_r.
+  virtual bool _mqtt_publish_raw(const char *topic, size_t topic_len, const char *payload, size_t payload_len, int qos, bool retain, uint16_t *msg_id_r=NULL) {
+    uint16_t msg_id = _mqtt_publish(String(topic, topic_len), String(payload, payload_len), qos, retain);
+    if (msg_id_r) *msg_id_r = msg_id;
+    // (such transports give no id for QoS0, only a QoS1 failure shows)
+    return (qos == 0) || (msg_id != 0);
+  }
+  virtual bool _mqtt_queue_publish(String topic, String payload, int qos=0, bool retain=false, int topic_class=-1);
   virtual void _mqtt_subscribe(String topic, int qos=0, codepoint_t where=undisclosed_location)=0;
 
   virtual void _mqtt_unsubscribe(String topic, int level=L_NOTICE)=0;
+  void pubsubSubscribe(String topic, int qos=0, codepoint_t where=undisclosed_location);
+  bool pubsubWantsTopic(const char *topic);
+  bool pubsubWantsTopic(String &topic) { return pubsubWantsTopic(topic.c_str()); }
   virtual bool wants_topic(String type, String name, String topic);
   virtual void _mqtt_route(String topic, String payload, int flags = 0);
+  virtual void _mqtt_route(const char *topic, size_t topic_len, const char *payload, size_t payload_len, int flags = 0);
+  virtual bool _mqtt_route_chunk(String topic, const char *chunk, size_t len, size_t index, size_t total);
+  virtual void _mqtt_route_message(PubsubMessageBuffer *msg, int flags = 0);
+  PubsubMessageBuffer *pubsubCurrentMessage() { return pubsub_current_message; }
   virtual bool mqtt_receive(String type, String name, String topic, String payload, bool direct=false);
   virtual void initiate_sleep_ms(int ms);
   virtual void pubsubSetSessionPresent(bool p) { pubsub_session_present = p; };
@@ -229,7 +687,11 @@ public:
   virtual void cancelLoopback() { pubsub_loopback = ::pubsub_loopback = false;;}
   virtual void setLoopbackStream(Stream *s) { loopback_stream=s; }
   virtual bool isLoopback() { return pubsub_loopback; }
-  virtual void sendLoopback(String &topic, String &payload) { if (loopback_stream) { loopback_stream->printf("%s %s\r\n", topic.c_str(), payload.c_str()); }}
+  virtual void sendLoopback(String &topic, String &payload) {
+    if (pubsub_capture) pubsub_capture->pubsubCapture(true, topic.c_str(), topic.length(), payload.c_str(), payload.length(), 0, false);
+    if (loopback_stream) { loopback_stream->printf("%s %s\r\n", topic.c_str(), payload.c_str()); }
+  }
+  void pubsubSetCapture(PubsubCaptureSink *sink) { pubsub_capture = sink; }
 
 
   // deprecated methods
@@ -280,11 +742,64 @@ protected:
   bool pubsub_subscribe_allcall = false;
   bool pubsub_subscribe_mac = false;
   bool pubsub_ignore_retain = false;
+  int pubsub_receive_max = PUBSUB_RECEIVE_MAX;
+  int pubsub_receive_drop_count = 0;
+  PubsubMessageBuffer *pubsub_current_message = NULL;
+
+  // the streamed (oversize) message being routed in fragments, if any
+  String pubsub_stream_topic = "";
+  size_t pubsub_stream_next = 0;
+  size_t pubsub_stream_total = 0;     // 0=none in progress
+  unsigned long pubsub_stream_last_ms = 0;
+  int pubsub_stream_abort_count = 0;
+  void pubsubStreamAbort();
+
+  // subscription minimisation: the topics that leaves requested, and
+  // the covering set that was actually sent to the broker
+  SimpleMap<String,int> *pubsub_subscribe_requests = NULL;
+  bool pubsub_subscribe_minimise = PUBSUB_SUBSCRIBE_MINIMISE;
+  int pubsub_subscribe_cover_depth = PUBSUB_SUBSCRIBE_COVER_DEPTH;
+  int pubsub_subscribe_cover_min = 2;
+  bool pubsub_subscribe_collecting = false;
+  int pubsub_subscribe_covered = 0;
+  int pubsub_overdelivery_count = 0;
+
+  String pubsubCoverPrefix(String &topic);
+  void pubsubSubscribeMinimised();
+
+  // QoS1 in-flight window.  Subclasses whose _mqtt_publish returns before
+  // the broker acknowledges (and later call pubsubInflightAck) should
+  // override pubsubHasAsyncAck.  For synchronous transports the duration
+  // of the publish call is taken as the round trip time.
+  struct PubsubInflight pubsub_inflight[PUBSUB_INFLIGHT_MAX];
+  int pubsub_inflight_window = PUBSUB_INFLIGHT_WINDOW;
+  int pubsub_inflight_count = 0;
+  int pubsub_inflight_timeout_ms = 10000;
+  int pubsub_inflight_retry_max = 3;
+  int pubsub_retransmit_count = 0;
+  int pubsub_inflight_expire_count = 0;
+  int pubsub_inflight_untracked_count = 0;   // not retransmitted (retry max 0)
+  int pubsub_inflight_resend_retries = 0;    // retries to record for the publish being resent
+  int pubsub_paced_count = 0;
+  unsigned long pubsub_puback_count = 0;
+  unsigned long pubsub_puback_total_ms = 0;
+  unsigned long pubsub_puback_hist[PUBSUB_RTT_BUCKETS];
+
+  virtual bool pubsubHasAsyncAck() { return false; }
+  bool pubsubInflightFull()
+  {
+    return pubsubHasAsyncAck() && (pubsub_inflight_count >= pubsub_inflight_window);
+  }
+  void pubsubInflightAdd(uint16_t msg_id, const char *topic, const String &payload, bool retain, bool restored=false, int topic_class=PUBSUB_CLASS_TELEMETRY);
+  void pubsubInflightAck(uint16_t msg_id);
+  void pubsubInflightCheck(bool resend_all=false);
+  void pubsubRecordRtt(unsigned long ms);
   size_t heap_free_prev = 0;
 
   bool pubsub_use_ssl_client_cert = false;
   bool pubsub_loopback = false;
   Stream *loopback_stream = NULL;
+  PubsubCaptureSink *pubsub_capture = NULL;
   int pubsub_connect_timeout_ms = 10000;
   int pubsub_connect_count = 0;
   int pubsub_connect_attempt_count = 0;
@@ -301,23 +816,126 @@ protected:
 
 #ifdef ESP32
   int pubsub_send_queue_size = PUBSUB_SEND_QUEUE_SIZE;
+  int pubsub_send_queue_priority_size = PUBSUB_SEND_QUEUE_PRIORITY_SIZE;
   QueueHandle_t send_queue = NULL;
+  QueueHandle_t send_queue_priority = NULL;
+#endif
+  int pubsub_send_queue_drop_count = 0;
+#ifdef ESP32
+  int pubsub_send_queue_wait_ms = PUBSUB_SEND_QUEUE_WAIT_MS;
+  unsigned long pubsub_send_queue_wait_count = 0;
+  // overflow of send_queue to flash (once a filesystem is offered)
+  PubsubSpool pubsub_spool;
+  SemaphoreHandle_t pubsub_spool_mutex = NULL;
+  // inflight table, publish class and dequeuing state are shared by the
+  // drain task and the loop
+  SemaphoreHandle_t pubsub_publish_mutex = NULL;
+  void pubsubLock() { if (pubsub_publish_mutex) xSemaphoreTakeRecursive(pubsub_publish_mutex, portMAX_DELAY); }
+  void pubsubUnlock() { if (pubsub_publish_mutex) xSemaphoreGiveRecursive(pubsub_publish_mutex); }
+  bool pubsubSpoolAppend(const String &topic, const String &payload, int qos, bool retain, int topic_class);
+  int pubsub_drain_bytes = PUBSUB_DRAIN_BYTES;
+  int pubsub_drain_ms = PUBSUB_DRAIN_MS;
+  bool pubsub_drain_task = PUBSUB_DRAIN_TASK;
+  TaskHandle_t pubsub_drain_handle = NULL;
+#else
+  void pubsubLock() {}
+  void pubsubUnlock() {}
 #endif
+  unsigned long pubsub_drain_count = 0;
+  unsigned long pubsub_drain_budget_count = 0;
+  bool pubsub_send_hold = false;
+  bool pubsub_send_hold_urgent = false;
+  bool pubsub_dequeuing = false;    // publishes are coming from the send queue
+  unsigned long pubsub_held_count = 0;
+  unsigned long pubsub_telemetry_count = 0;   // readings offered for publication
+
+  // time publishers spend waiting on the transport
+  unsigned long pubsub_publish_block_count = 0;
+  unsigned long pubsub_publish_block_us = 0;
+  unsigned long pubsub_publish_block_max_us = 0;
+
+  // per topic-class publish limits, and the class of the publish in progress
+  // (consulted by _mqtt_queue_publish, guarded by pubsubLock)
+  struct LeafTokenBucket pubsub_class_limit[PUBSUB_CLASS_MAX];
+  int pubsub_publish_class = PUBSUB_CLASS_TELEMETRY;
+  int pubsub_route_depth = 0;
+
+  // latency probe
+  int pubsub_probe_interval_sec = PUBSUB_PROBE_INTERVAL_SEC;
+  unsigned long pubsub_probe_last = 0;
+  int pubsub_probe_seq = 0;
+  int pubsub_probe_sent = 0;
+  int pubsub_probe_received = 0;
+  int pubsub_probe_burst_remain = 0;
+  unsigned long pubsub_route_rx_us = 0;
+  unsigned long pubsub_route_start_us = 0;
+  struct PubsubLatencySamples pubsub_latency[PUBSUB_PROBE_SPLITS];
   unsigned long pubsub_dequeue_delay = 500;
+  unsigned long pubsub_last_dequeue = 0;
+  bool pubsub_batch_json = PUBSUB_BATCH_JSON;
+
+  // session persistence across deep sleep, and wake-to-publish timing
+  bool pubsub_session_persist = PUBSUB_SESSION_PERSIST;
+  bool pubsub_session_restore_due = false;
+  bool pubsub_session_resumed = false;
+  unsigned long pubsub_wake_connect_ms = 0;
+  unsigned long pubsub_wake_ready_ms = 0;
+  unsigned long pubsub_wake_publish_ms = 0;
+
+  // reporting policy
+  bool pubsub_policy_enable = PUBSUB_REPORT_POLICY;
+  int pubsub_policy_window_sec = PUBSUB_POLICY_WINDOW_SEC;
+  int pubsub_policy_poor_factor = PUBSUB_POLICY_POOR_FACTOR;
+  int pubsub_policy_queue_high = PUBSUB_POLICY_QUEUE_HIGH;
+  int pubsub_policy_rssi_interval_sec = PUBSUB_POLICY_RSSI_INTERVAL_SEC;
+  unsigned long pubsub_policy_rssi_last = 0;
+  bool pubsub_policy_poor_signal = false;
+  unsigned long pubsub_policy_defer_count = 0;
+  unsigned long pubsub_policy_suppress_count = 0;
+  void pubsubPolicySignalCheck(unsigned long now);
+
+  // bitmask of topic classes (1<<PUBSUB_CLASS_x) carried when this leaf is a fan-out target
+  int pubsub_fanout_classes = (1<<PUBSUB_CLASS_MAX)-1;
+  unsigned long pubsub_fanout_queued_count = 0;
+  bool pubsub_fanout_target = false;
   bool pubsub_always_queue = false;
 
 
   
 };
 
+#ifdef ESP32
+//
+// Send queue drain task.  Publishers enqueue and wake us, we send within
+// the drain budget and yield before carrying on with any backlog.
+//
+static void pubsub_drain_loop(void *args)
+{
+  AbstractPubsubLeaf *leaf = (AbstractPubsubLeaf *)args;
+  while (1) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+    leaf->pubsubDrain();
+  }
+}
+#endif
+
 void AbstractPubsubLeaf::setup(void)
 {
   Leaf::setup();
   LEAF_ENTER(L_INFO);
+  if (!::pubsub_policy_leaf && !hasPriority()) {
+    ::pubsub_policy_leaf = this;
+  }
   LEAF_NOTICE("Pubsub client will %s use device-topic", pubsubUseDeviceTopic()?"use":"not use");
 
+  memset(pubsub_inflight, 0, sizeof(pubsub_inflight));
+  memset(pubsub_latency, 0, sizeof(pubsub_latency));
+  memset(pubsub_puback_hist, 0, sizeof(pubsub_puback_hist));
+  if (pubsub_inflight_window > PUBSUB_INFLIGHT_MAX) pubsub_inflight_window = PUBSUB_INFLIGHT_MAX;
+
 #ifndef ESP8266
   pubsub_subscriptions = new SimpleMap<String,int>(_compareStringKeys);
+  pubsub_subscribe_requests = new SimpleMap<String,int>(_compareStringKeys);
 #endif
 
 #ifdef ESP32
@@ -325,8 +943,22 @@ void AbstractPubsubLeaf::setup(void)
     LEAF_NOTICE("Create pubsub send queue of size %d", pubsub_send_queue_size);
     send_queue = xQueueCreate(pubsub_send_queue_size, sizeof(struct PubsubSendQueueMessage));
   }
+  if (pubsub_send_queue_size && pubsub_send_queue_priority_size) {
+    send_queue_priority = xQueueCreate(pubsub_send_queue_priority_size, sizeof(struct PubsubSendQueueMessage));
+  }
+  // the drain task and publishers share the in-flight table, the publish
+  // class and the transport's buffers
+  if (!pubsub_publish_mutex) pubsub_publish_mutex = xSemaphoreCreateRecursiveMutex();
+  if (!pubsub_spool_mutex) pubsub_spool_mutex = xSemaphoreCreateMutex();
+  registerIntValue("pubsub_send_queue_wait_ms", &pubsub_send_queue_wait_ms, "How long a publisher waits for room in a full send queue (0=don't wait)");
 #endif
 
+  for (int c=0; c<PUBSUB_CLASS_MAX; c++) {
+    pubsub_class_limit[c] = {0, PUBSUB_CLASS_BURST, 0, 0, 0};
+    registerIntValue(String("pubsub_rate_")+pubsub_topic_class_names[c], &pubsub_class_limit[c].rate, "Maximum publishes per minute of this class (0=unlimited)");
+    registerIntValue(String("pubsub_burst_")+pubsub_topic_class_names[c], &pubsub_class_limit[c].burst, "Number of publishes of this class permitted in a burst above the rate");
+  }
+
   registerCommand(HERE,"setup", "enter wifi setup mode");
   registerCommand(HERE,"reboot", "reboot the device");
   registerCommand(HERE,"pubsub_connect", "initiate (re-) connection to pubsub broker");
@@ -374,6 +1006,12 @@ void AbstractPubsubLeaf::setup(void)
   registerCommand(HERE,"brownout_enable", "Enable the brownout-detector");
   registerCommand(HERE,"brownout_status", "Report the status of the brownout-detector");
   registerCommand(HERE,"memstat", "print memory usage statistics");
+  registerCommand(HERE,"pubsub_stats", "publish pubsub statistics");
+  registerCommand(HERE,"pubsub_publish_bench", "Measure publishes per second up to the transport (payload is count)");
+  registerCommand(HERE,"pubsub_batch_bench", "Compare single and batched publish time (payload is topic count)");
+  registerCommand(HERE,"pubsub_probe", "Latency probe (sent to ourself)");
+  registerCommand(HERE,"pubsub_probe_burst", "Send a burst of latency probes (payload is count)");
+  registerCommand(HERE,"pubsub_latency", "Publish latency probe percentiles");
 
 #if USE_WDT
   registerCommand(HERE,"starve", "Deliberately trigger watchdog timer)");
@@ -401,6 +1039,26 @@ void AbstractPubsubLeaf::setup(void)
   registerBoolValue("pubsub_onconnect_mac", &pubsub_onconnect_mac, "Publish device's MAC address upon connection");
   registerBoolValue("pubsub_subscribe_allcall", &pubsub_subscribe_allcall, "Subscribe to all-call topic (*/#)");
   registerBoolValue("pubsub_subscribe_mac", &pubsub_subscribe_mac, "Subscribe to a backup topic based on last 6 digits of mac address");
+  registerBoolValue("pubsub_subscribe_minimise", &pubsub_subscribe_minimise, "At connect, merge leaf subscriptions into a covering set of wildcards");
+  registerIntValue("pubsub_subscribe_cover_depth", &pubsub_subscribe_cover_depth, "Levels below the device topic at which subscriptions may be merged (lower means fewer subscriptions but more unwanted traffic)");
+  registerIntValue("pubsub_subscribe_cover_min", &pubsub_subscribe_cover_min, "Minimum number of subscriptions that will be merged into one wildcard");
+  registerBoolValue("pubsub_policy_enable", &pubsub_policy_enable, "Adapt reporting to link type, signal and queue depth");
+  registerIntValue("pubsub_policy_window_sec", &pubsub_policy_window_sec, "On metered links, status reports are held for a window of this long after each heartbeat");
+  registerIntValue("pubsub_policy_poor_factor", &pubsub_policy_poor_factor, "Reporting intervals are multiplied by this while signal is poor");
+  registerIntValue("pubsub_policy_queue_high", &pubsub_policy_queue_high, "Send queue fullness (percent) at which telemetry is suppressed");
+  registerIntValue("pubsub_policy_rssi_interval_sec", &pubsub_policy_rssi_interval_sec, "Interval between signal strength checks for the reporting policy");
+  registerBoolValue("pubsub_session_persist", &pubsub_session_persist, "Keep the broker session (and subscriptions) across deep sleep");
+  registerUlongValue("pubsub_wake_connect_ms", &pubsub_wake_connect_ms, "Time from boot to broker connection", ACL_GET_ONLY, VALUE_NO_SAVE);
+  registerUlongValue("pubsub_wake_ready_ms", &pubsub_wake_ready_ms, "Time from boot to subscriptions complete", ACL_GET_ONLY, VALUE_NO_SAVE);
+  registerUlongValue("pubsub_wake_publish_ms", &pubsub_wake_publish_ms, "Time from boot to first publish from another leaf", ACL_GET_ONLY, VALUE_NO_SAVE);
+  registerBoolValue("pubsub_batch_json", &pubsub_batch_json, "Send publish batches as one JSON document to <base>/batch");
+  registerIntValue("pubsub_fanout_classes", &pubsub_fanout_classes, "Topic classes carried as a fan-out broker (bitmask 1=alert 2=event 4=status 8=telemetry)");
+  registerIntValue("pubsub_probe_interval_sec", &pubsub_probe_interval_sec, "Interval between round-trip latency probes (0=off)");
+  registerIntValue("pubsub_inflight_window", &pubsub_inflight_window, "Maximum number of unacknowledged QoS1 publishes (further publishes are queued)");
+  registerIntValue("pubsub_inflight_timeout_ms", &pubsub_inflight_timeout_ms, "Time to wait for acknowledgement of a QoS1 publish before retransmitting");
+  registerIntValue("pubsub_inflight_retry_max", &pubsub_inflight_retry_max, "Number of retransmits of an unacknowledged QoS1 publish before giving up");
+  registerIntValue("pubsub_inflight_count", &pubsub_inflight_count, "Number of unacknowledged QoS1 publishes", ACL_GET_ONLY, VALUE_NO_SAVE);
+  registerIntValue("pubsub_overdelivery_count", &pubsub_overdelivery_count, "Number of received messages discarded because no leaf subscribed to them", ACL_GET_ONLY, VALUE_NO_SAVE);
   registerStrValue("pubsub_broker_heartbeat_topic", &pubsub_broker_heartbeat_topic, "Broker heartbeat topic (disconnect if this topic is not seen after pubsub_broker_keepalive_sec)");
   registerIntValue("pubsub_broker_keepalive_sec", &pubsub_broker_keepalive_sec, "Duration of no message to pubsub_broker_heartbeat_topic after which broker connection is considered dead");
   registerUlongValue("pubsub_broker_heartbeat_last", &last_broker_heartbeat, "Time of the last seen heartbeat from the broker", ACL_GET_ONLY, VALUE_NO_SAVE);
@@ -428,12 +1086,37 @@ void AbstractPubsubLeaf::setup(void)
   registerBoolValue("pubsub_warn_noconn", &pubsub_warn_noconn, "Log a warning if unable to publish due to no connection");
   registerIntValue("pubsub_connect_attempt_limit", &pubsub_connect_attempt_limit);
   registerIntValue("pubsub_connect_attempt_count", &pubsub_connect_attempt_count,"",ACL_GET_ONLY, VALUE_NO_SAVE);
+  registerIntValue("pubsub_receive_max", &pubsub_receive_max, "Largest inbound message that will be reassembled (larger messages are passed to stream handlers in chunks)");
+  registerIntValue("pubsub_receive_drop_count", &pubsub_receive_drop_count, "Number of inbound messages or fragments discarded", ACL_GET_ONLY, VALUE_NO_SAVE);
+  registerIntValue("pubsub_stream_abort_count", &pubsub_stream_abort_count, "Number of streamed inbound messages abandoned for lost fragments", ACL_GET_ONLY, VALUE_NO_SAVE);
 
 
 #ifdef ESP32
   registerIntValue("pubsub_send_queue_size", &pubsub_send_queue_size);
+  registerIntValue("pubsub_send_queue_priority_size", &pubsub_send_queue_priority_size, "Size of the send queue for alerts and events, which is drained first");
   registerBoolValue("pubsub_always_queue", &pubsub_always_queue);
-  registerUlongValue("pubsub_dequeue_delay", &pubsub_dequeue_delay, "Speed of mqtt queue drain 0=manual, 1=instant else=milliseconds");
+  registerUlongValue("pubsub_dequeue_delay", &pubsub_dequeue_delay, "Send queue drain from loop 0=manual, 1=every pass, else=milliseconds to wait after a pass that leaves a backlog");
+  registerIntValue("pubsub_drain_bytes", &pubsub_drain_bytes, "Bytes drained from the send queue per pass (0=unlimited)");
+  registerIntValue("pubsub_drain_ms", &pubsub_drain_ms, "Milliseconds spent draining the send queue per pass (0=unlimited)");
+  registerBoolValue("pubsub_drain_task", &pubsub_drain_task, "Drain the send queue from a separate task, publishers never wait on the network (takes effect at restart)");
+#endif
+
+  if (pubsub_session_persist && pubsub_use_clean_session) {
+    LEAF_NOTICE("Session persistence requires a persistent broker session, disabling clean session");
+    pubsub_use_clean_session = false;
+  }
+
+#ifdef ESP32
+  if (pubsub_drain_task && send_queue && !pubsub_drain_handle) {
+    char task_name[32];
+    snprintf(task_name, sizeof(task_name), "%s_drain", leaf_name.c_str());
+    LEAF_NOTICE("Create send queue drain task %s", task_name);
+    if (xTaskCreateUniversal(&pubsub_drain_loop, task_name, PUBSUB_DRAIN_STACK_SIZE, this, 1,
+			     &pubsub_drain_handle, ARDUINO_RUNNING_CORE) != pdPASS) {
+      LEAF_ALERT("Drain task create failed, publishing synchronously");
+      pubsub_drain_handle = NULL;
+    }
+  }
 #endif
 
   LEAF_NOTICE("Pubsub settings host=[%s] port=%d user=[%s] auto=%s", pubsub_host.c_str(), pubsub_port, pubsub_user.c_str(), TRUTH_lc(pubsub_autoconnect));
@@ -526,6 +1209,68 @@ void AbstractPubsubLeaf::status_pub()
   mqtt_publish("status/connect_time", String(pubsub_connect_time));
   mqtt_publish("status/disconnect_time", String(pubsub_connect_time));
   mqtt_publish("status/connect_attempt_count", String(pubsub_connect_attempt_count));
+  if (pubsub_probe_received) {
+    pubsubProbePub();
+  }
+  LEAF_LEAVE;
+}
+
+void AbstractPubsubLeaf::stats_pub()
+{
+  Leaf::stats_pub();
+  LEAF_ENTER(L_NOTICE);
+
+  mqtt_publish("stats/inflight_count", String(pubsub_inflight_count));
+  mqtt_publish("stats/retransmit_count", String(pubsub_retransmit_count));
+  mqtt_publish("stats/inflight_expire_count", String(pubsub_inflight_expire_count));
+  mqtt_publish("stats/inflight_untracked_count", String(pubsub_inflight_untracked_count));
+  mqtt_publish("stats/paced_count", String(pubsub_paced_count));
+  mqtt_publish("stats/send_queue_drop_count", String(pubsub_send_queue_drop_count));
+  mqtt_publish("stats/stream_abort_count", String(pubsub_stream_abort_count));
+  mqtt_publish("stats/drain_count", String(pubsub_drain_count));
+  mqtt_publish("stats/drain_budget_count", String(pubsub_drain_budget_count));
+#ifdef ESP32
+  mqtt_publish("stats/send_queue_wait_count", String(pubsub_send_queue_wait_count));
+  if (pubsub_spool.ready()) {
+    mqtt_publish("stats/spool_pending", String(pubsub_spool.pending()));
+    mqtt_publish("stats/spool_count", String(pubsub_spool.spooled));
+    mqtt_publish("stats/spool_refused_count", String(pubsub_spool.refused));
+  }
+#endif
+  mqtt_publish("stats/publish_block_count", String(pubsub_publish_block_count));
+  mqtt_publish("stats/publish_block_ms", String(pubsub_publish_block_us/1000));
+  mqtt_publish("stats/publish_block_max_us", String(pubsub_publish_block_max_us));
+  if (pubsub_wake_ready_ms) {
+    mqtt_publish("stats/wake_ready_ms", String(pubsub_wake_ready_ms));
+    mqtt_publish("stats/wake_publish_ms", String(pubsub_wake_publish_ms));
+  }
+  mqtt_publish("stats/policy_defer_count", String(pubsub_policy_defer_count));
+  mqtt_publish("stats/policy_suppress_count", String(pubsub_policy_suppress_count));
+  if (pubsub_fanout_queued_count) {
+    mqtt_publish("stats/fanout_queued_count", String(pubsub_fanout_queued_count));
+  }
+  for (int c=0; c<PUBSUB_CLASS_MAX; c++) {
+    mqtt_publish(String("stats/rate_drop_")+pubsub_topic_class_names[c], String(pubsub_class_limit[c].drop_count));
+  }
+  mqtt_publish("stats/puback_count", String(pubsub_puback_count));
+  if (pubsub_puback_count) {
+    mqtt_publish("stats/puback_mean_ms", String(pubsub_puback_total_ms/pubsub_puback_count));
+  }
+
+  // histogram as a list of bucket=count, eg "50=12,100=3,...,>5000=0"
+  String hist = "";
+  for (int b=0; b<PUBSUB_RTT_BUCKETS; b++) {
+    if (b) hist += ",";
+    if (pubsub_rtt_bucket_ms[b]) {
+      hist += String(pubsub_rtt_bucket_ms[b]);
+    }
+    else {
+      hist += ">" + String(pubsub_rtt_bucket_ms[b-1]);
+    }
+    hist += "=" + String(pubsub_puback_hist[b]);
+  }
+  mqtt_publish("stats/puback_rtt_hist", hist);
+
   LEAF_LEAVE;
 }
 
@@ -569,6 +1314,19 @@ void AbstractPubsubLeaf::pubsubOnConnect(bool do_subscribe)
 
   pubsub_connect_time=millis();
   pubsub_connect_attempt_count=0;
+  if (pubsub_wake_connect_ms == 0) {
+    pubsub_wake_connect_ms = pubsub_connect_time;
+  }
+
+  if (pubsub_session_restore_due) {
+    pubsub_session_restore_due = false;
+    // the broker must still hold our session, else subscribe as normal
+    if (pubsub_session_present && pubsubSessionRestore()) {
+      LEAF_NOTICE("Resumed broker session, skipping subscriptions");
+      pubsub_session_resumed = true;
+      do_subscribe = false;
+    }
+  }
 
 
   publish("_pubsub_connect",String(1));
@@ -601,9 +1359,16 @@ void AbstractPubsubLeaf::pubsubOnConnect(bool do_subscribe)
     // we skip this if the modem told us "already connected, dude", which
     // can happen after sleep.
 
+    if (pubsub_subscribe_minimise && pubsub_subscribe_requests) {
+      // gather up all the subscription requests, to be sent at the end
+      pubsub_subscribe_requests->clear();
+      pubsub_subscribe_collecting = true;
+    }
+    pubsub_subscribe_covered = 0;
+
     if (pubsub_broker_heartbeat_topic.length() > 0) {
       // subscribe to broker heartbeats
-      _mqtt_subscribe(pubsub_broker_heartbeat_topic, 0, HERE);
+      pubsubSubscribe(pubsub_broker_heartbeat_topic, 0, HERE);
       // consider the broker online as of now
       last_broker_heartbeat = millis();
     }
@@ -650,34 +1415,57 @@ void AbstractPubsubLeaf::pubsubOnConnect(bool do_subscribe)
     }
 
     if (pubsub_subscribe_allcall) {
-      _mqtt_subscribe(_ROOT_TOPIC+"*/#", 0, HERE);
+      pubsubSubscribe(_ROOT_TOPIC+"*/#", 0, HERE);
     }
     if (pubsub_subscribe_mac) {
-      _mqtt_subscribe(_ROOT_TOPIC+mac_short+"/#", 0, HERE);
+      pubsubSubscribe(_ROOT_TOPIC+mac_short+"/#", 0, HERE);
+    }
+
+    if (pubsub_probe_interval_sec) {
+      mqtt_subscribe("cmd/pubsub_probe", HERE);
     }
 
     //LEAF_INFO("Set up leaf subscriptions");
-    for (int i=0; leaves[i]; i++) {
+    for (int i=0; !pubsub_fanout_target && leaves[i]; i++) {
+      // (leaves subscribe via their own pubsub leaf, so a fan-out target
+      // would only repeat the primary's subscriptions, see pubsubFanout)
       Leaf *leaf = leaves[i];
       //LEAF_INFO("Initiate subscriptions for %s", leaf->getName().c_str());
       leaf->mqtt_do_subscribe();
     }
+
+    if (pubsub_subscribe_collecting) {
+      pubsub_subscribe_collecting = false;
+      pubsubSubscribeMinimised();
+    }
   }
 
-#ifdef ESP32
-  struct PubsubSendQueueMessage msg;
+  // anything left unacknowledged by the previous session must be sent again
+  pubsubInflightCheck(true);
 
-  while (send_queue && !pubsub_always_queue && xQueueReceive(send_queue, &msg, 10)) {
-    LEAF_NOTICE("Re send queued publish %s < %s", msg.topic->c_str(), msg.payload->c_str());
-    _mqtt_publish(*msg.topic, *msg.payload, msg.qos, msg.retain);
-    delete msg.topic;
-    delete msg.payload;
+#ifdef ESP32
+  if (pubsub_drain_handle) {
+    pubsubDrainWake();
+  }
+  else if (!pubsub_always_queue && sendQueueReady()) {
+    LEAF_NOTICE("Re send %d queued publishes", sendQueueReady());
+    pubsubDrainSendQueue(0, 0);
   }
 #endif
 
   publish("_pubsub_connect", pubsub_host.c_str());
   last_external_input = millis();
 
+  if (pubsub_wake_ready_ms == 0) {
+    // time from boot (or wake) until we are ready to publish readings
+    unsigned long ready = millis();
+    char buf[96];
+    snprintf(buf, sizeof(buf), "{\"connect_ms\":%lu,\"ready_ms\":%lu,\"resumed\":%s}",
+	     pubsub_wake_connect_ms, ready, TRUTH_lc(pubsub_session_resumed));
+    mqtt_publish("status/wake_latency", buf);
+    pubsub_wake_ready_ms = ready;
+  }
+
   LEAF_LEAVE;
 }
 
@@ -686,6 +1474,11 @@ void AbstractPubsubLeaf::loop()
 {
   unsigned long now_sec = millis()/1000;
 
+  if (pubsub_stream_total && ((millis() - pubsub_stream_last_ms) >= PUBSUB_STREAM_TIMEOUT_MS)) {
+    // the rest of a streamed message was lost (or never sent)
+    pubsubStreamAbort();
+  }
+
   if (isConnected() &&
       (pubsub_broker_heartbeat_topic.length() > 0) &&
       (pubsub_broker_keepalive_sec > 0) &&
@@ -723,16 +1516,28 @@ void AbstractPubsubLeaf::loop()
   }
 
 
+  if (pubsub_inflight_count && isConnected()) {
+    pubsubInflightCheck();
+  }
+
+  if (pubsub_probe_interval_sec && isConnected() &&
+      (millis() >= (pubsub_probe_last + pubsub_probe_interval_sec*1000UL))) {
+    pubsubProbeSend();
+  }
+
 #ifdef ESP32
-  static unsigned long last_dequeue = 0;
   unsigned long now = millis();
-  if (pubsub_dequeue_delay > 0) {
-    if (isConnected() && (now > (last_dequeue+pubsub_dequeue_delay))) {
-      if (sendQueueCount()) {
-	LEAF_NOTICE("Releasing one message from send queue");
-	flushSendQueue(1);
-      }
-      last_dequeue = now;
+  if (pubsub_drain_handle) {
+    // the drain task does the work
+  }
+  else if (pubsub_dequeue_delay > 0) {
+    // Publishes are only queued, the loop sends them within the byte and
+    // time budget.  After a pass that leaves a backlog, wait
+    // pubsub_dequeue_delay (if more than 1) before the next.
+    if (isConnected() && !pubsub_always_queue && !pubsubInflightFull() && sendQueueReady() &&
+	((pubsub_dequeue_delay == 1) || (now >= (pubsub_last_dequeue+pubsub_dequeue_delay)))) {
+      pubsubDrainSendQueue(pubsub_drain_bytes, pubsub_drain_ms);
+      pubsub_last_dequeue = sendQueueReady()?now:0;
     }
   }
 #endif
@@ -749,6 +1554,54 @@ void AbstractPubsubLeaf::loop()
 
 void pubsubReconnectTimerCallback(AbstractPubsubLeaf *leaf) { leaf->pubsubSetReconnectDue(); }
 
+#ifdef ESP32
+
+void AbstractPubsubLeaf::pubsubDrain()
+{
+  pubsubSpoolRefill();
+  while (isConnected() && !pubsub_always_queue && !pubsubInflightFull() && sendQueueReady()) {
+    pubsubDrainSendQueue(pubsub_drain_bytes, pubsub_drain_ms);
+    // let other tasks of our priority run between passes
+    vTaskDelay(1);
+  }
+}
+
+//
+// Send queued publishes until the queue is empty, the in-flight window is
+// full, or the byte or time budget (zero for unlimited) is spent.  Never
+// waits on the queue.
+//
+int AbstractPubsubLeaf::pubsubDrainSendQueue(size_t byte_budget, unsigned long ms_budget)
+{
+  struct PubsubSendQueueMessage msg;
+  unsigned long start = millis();
+  size_t bytes = 0;
+  int n = 0;
+
+  pubsubLock();
+  pubsub_dequeuing = true;
+  pubsubSpoolRefill();
+  while (!pubsubInflightFull() && sendQueueReceive(&msg)) {
+    LEAF_INFO("Transmit queued publish %s < %s", msg.topic->c_str(), msg.payload->c_str());
+    bytes += msg.topic->length() + msg.payload->length();
+    pubsubPublish(*msg.topic, *msg.payload, msg.qos, msg.retain, msg.topic_class);
+    delete msg.topic;
+    delete msg.payload;
+    ++n;
+    pubsubSpoolRefill();
+    if ((byte_budget && (bytes >= byte_budget)) ||
+	(ms_budget && ((millis() - start) >= ms_budget))) {
+      if (sendQueueReady()) ++pubsub_drain_budget_count;
+      break;
+    }
+  }
+  pubsub_dequeuing = false;
+  pubsub_drain_count += n;
+  pubsubUnlock();
+  return n;
+}
+#endif
+
 void AbstractPubsubLeaf::pubsubScheduleReconnect()
 {
   LEAF_ENTER(L_INFO);
@@ -775,27 +1628,80 @@ void AbstractPubsubLeaf::pubsubScheduleReconnect()
 }
 
 
-bool AbstractPubsubLeaf::_mqtt_queue_publish(String topic, String payload, int qos, bool retain)
+//
+// Put a publish on the send queue (alerts and events on the priority
+// queue).  If the queue is full:
+//
+//   - a publisher on another task waits (up to pubsub_send_queue_wait_ms)
+//     for the drain task to make room (without a drain task nobody else
+//     would make room, so there is no waiting),
+//   - bulk messages go to the flash spool, if there is one (and keep
+//     going there until it is empty, so that order is kept),
+//
+// and only as a last resort is the oldest message dropped.
+//
+bool AbstractPubsubLeaf::_mqtt_queue_publish(String topic, String payload, int qos, bool retain, int topic_class)
 {
 #ifdef ESP32
-  if (send_queue && pubsub_send_queue_size) {
-    struct PubsubSendQueueMessage msg={.topic=new String(topic), .payload=new String(payload), .qos=(byte)qos, .retain=retain};
-    int free = uxQueueSpacesAvailable(send_queue);
-    if (free == 0) {
-      LEAF_ALERT("Send queue overflow");
+  if (topic_class < 0) topic_class = pubsub_publish_class;
+  QueueHandle_t queue = send_queue;
+  int queue_size = pubsub_send_queue_size;
+  bool held = pubsub_send_hold;
+  if (send_queue_priority && (topic_class <= PUBSUB_CLASS_EVENT)) {
+    queue = send_queue_priority;
+    queue_size = pubsub_send_queue_priority_size;
+    held = pubsub_send_hold_urgent;
+  }
+
+  if (queue && queue_size) {
+    if ((queue == send_queue) && pubsub_spool.pending() &&
+	pubsubSpoolAppend(topic, payload, qos, retain, topic_class)) {
+      LEAF_INFO("Spooled (%d): %s", pubsub_spool.pending(), topic.c_str());
+      return true;
+    }
+
+    struct PubsubSendQueueMessage msg={.topic=new String(topic), .payload=new String(payload), .qos=(byte)qos, .retain=retain, .topic_class=(byte)topic_class};
+    int free = uxQueueSpacesAvailable(queue);
+    bool queued = false;
+
+    if (free) {
+      queued = (xQueueGenericSend(queue, (void *)&msg, (TickType_t)0, queueSEND_TO_BACK)==pdPASS);
+    }
+    else if (pubsub_drain_handle && pubsubPublishAsync() && isConnected() && !held && pubsub_send_queue_wait_ms) {
+      pubsubDrainWake();
+      ++pubsub_send_queue_wait_count;
+      queued = (xQueueGenericSend(queue, (void *)&msg, pdMS_TO_TICKS(pubsub_send_queue_wait_ms), queueSEND_TO_BACK)==pdPASS);
+    }
+
+    if (!queued && (queue == send_queue) && pubsubSpoolAppend(topic, payload, qos, retain, topic_class)) {
+      LEAF_NOTICE("Send queue full, spooled %s", topic.c_str());
+      delete msg.topic;
+      delete msg.payload;
+      return true;
+    }
+
+    if (!queued) {
       // drop the oldest message
-      flushSendQueue(1);
-      free++;
+      struct PubsubSendQueueMessage old;
+      if (xQueueReceive(queue, &old, 0)) {
+	LEAF_ALERT("Send queue overflow, drop %s", old.topic->c_str());
+	++pubsub_send_queue_drop_count;
+	delete old.topic;
+	delete old.payload;
+      }
+      queued = (xQueueGenericSend(queue, (void *)&msg, (TickType_t)0, queueSEND_TO_BACK)==pdPASS);
     }
 
-    if (xQueueGenericSend(send_queue, (void *)&msg, (TickType_t)0, queueSEND_TO_BACK)==pdPASS) {
-      LEAF_NOTICE("Queued (%d/%d): %s < %s",
-		pubsub_send_queue_size-free, pubsub_send_queue_size,
-		topic.c_str(), payload.c_str());
+    if (queued) {
+      LEAF_NOTICE("Queued (%d/%d%s): %s < %s",
+		  queue_size-(int)uxQueueSpacesAvailable(queue), queue_size, (queue==send_queue_priority)?" priority":"",
+		  topic.c_str(), payload.c_str());
       return true;
     }
     else {
       LEAF_WARN("Send queue store failed for %s", topic.c_str());
+      delete msg.topic;
+      delete msg.payload;
     }
   }
   // all failures in the above block fall thru to false below
@@ -803,8 +1709,783 @@ bool AbstractPubsubLeaf::_mqtt_queue_publish(String topic, String payload, int q
   return false;
 }
 
-
-bool AbstractPubsubLeaf::wants_topic(String type, String name, String topic)
+#ifdef ESP32
+//
+// Offer a filesystem on which send queue overflow may be spooled.  A
+// spool left from before a reset is taken up and sent.
+//
+void AbstractPubsubLeaf::pubsubSpoolEnable(fs::FS *fs, int max_bytes)
+{
+  if (!pubsub_spool_mutex) pubsub_spool_mutex = xSemaphoreCreateMutex();
+  xSemaphoreTake(pubsub_spool_mutex, portMAX_DELAY);
+  if (!pubsub_spool.ready()) {
+    pubsub_spool.max_bytes = max_bytes;
+    pubsub_spool.begin(fs);
+    if (pubsub_spool.pending()) {
+      LEAF_NOTICE("Found %d spooled publishes", pubsub_spool.pending());
+    }
+  }
+  xSemaphoreGive(pubsub_spool_mutex);
+}
+
+bool AbstractPubsubLeaf::pubsubSpoolAppend(const String &topic, const String &payload, int qos, bool retain, int topic_class)
+{
+  if (!pubsub_spool_mutex || !pubsub_spool.ready()) return false;
+  xSemaphoreTake(pubsub_spool_mutex, portMAX_DELAY);
+  bool result = pubsub_spool.append(topic.c_str(), topic.length(), payload.c_str(), payload.length(), qos, retain, topic_class);
+  xSemaphoreGive(pubsub_spool_mutex);
+  return result;
+}
+
+// Move spooled publishes into the send queue as room allows
+void AbstractPubsubLeaf::pubsubSpoolRefill()
+{
+  if (!pubsub_spool_mutex || !send_queue || !pubsub_spool.pending()) return;
+  xSemaphoreTake(pubsub_spool_mutex, portMAX_DELAY);
+  String topic;
+  String payload;
+  int qos;
+  bool retain;
+  int topic_class;
+  while (pubsub_spool.pending() && uxQueueSpacesAvailable(send_queue)) {
+    if (!pubsub_spool.next(topic, payload, &qos, &retain, &topic_class)) break;
+    struct PubsubSendQueueMessage msg={.topic=new String(topic), .payload=new String(payload), .qos=(byte)qos, .retain=retain, .topic_class=(byte)topic_class};
+    if (xQueueGenericSend(send_queue, (void *)&msg, (TickType_t)0, queueSEND_TO_BACK)!=pdPASS) {
+      // a publisher took the last slot
+      LEAF_ALERT("Send queue refill failed, drop %s", topic.c_str());
+      ++pubsub_send_queue_drop_count;
+      delete msg.topic;
+      delete msg.payload;
+      break;
+    }
+  }
+  xSemaphoreGive(pubsub_spool_mutex);
+}
+#endif
+
+//
+// Classify a (leaf-relative) topic for rate limiting and queue priority
+//
+int AbstractPubsubLeaf::pubsubTopicClass(Leaf *leaf, String &topic)
+{
+  if (pubsubIsRouting() || topic.startsWith("alert/") || topic.startsWith("change/")) {
+    // replies to commands are as urgent as alerts
+    return PUBSUB_CLASS_ALERT;
+  }
+  if (topic.startsWith("event/")) {
+    return PUBSUB_CLASS_EVENT;
+  }
+  String type = leaf->getType();
+  if ((type == "pubsub") || (type == "ip") || (type == "storage")) {
+    return PUBSUB_CLASS_STATUS;
+  }
+  return PUBSUB_CLASS_TELEMETRY;
+}
+
+//
+// Apply the per-leaf and per-class token buckets.  Alerts are subject only
+// to their class limit, so that a leaf at its limit can still raise one.
+//
+bool AbstractPubsubLeaf::pubsubRateCheck(struct LeafTokenBucket *leaf_limit, int topic_class)
+{
+  if ((topic_class != PUBSUB_CLASS_ALERT) && leaf_limit && !leafTokenTake(leaf_limit)) {
+    return false;
+  }
+  return leafTokenTake(&pubsub_class_limit[topic_class]);
+}
+
+//
+// Send a batch of publishes collected by Leaf::mqtt_publish_begin/commit.
+//
+// When pubsub_batch_json is set the batch becomes a single JSON object
+// (topics relative to the publishing leaf) sent to <leaf-base>/batch, for
+// brokers that are configured to split it out again.  The document goes
+// at the highest QoS of its members, and is retained only if they all
+// are.  Otherwise the transport sends the individual messages in one go.
+// Acknowledged publishes are sent individually so that in-flight
+// tracking still applies.
+//
+int AbstractPubsubLeaf::pubsubPublishBatch(struct PubsubBatch *batch)
+{
+  LEAF_ENTER_INT(L_DEBUG, batch->count);
+  int pos = 0;
+  int sent = 0;
+  String topic;
+  String payload;
+  int qos;
+  bool retain;
+
+  if (pubsub_batch_json) {
+    String doc = "{";
+    doc.reserve(batch->buf.length() + 4*batch->count + 2);
+    while (pubsubBatchNext(batch, &pos, topic, payload)) {
+      if (topic.startsWith(batch->prefix)) topic.remove(0, batch->prefix.length());
+      if (sent++) doc += ",";
+      doc += "\"" + topic + "\":\"";
+      for (unsigned int i=0; i<payload.length(); i++) {
+	char c = payload[i];
+	if ((c=='"') || (c=='\\')) {
+	  doc += '\\';
+	  doc += c;
+	}
+	else if ((unsigned char)c < ' ') {
+	  char esc[8];
+	  snprintf(esc, sizeof(esc), "\\u%04x", (unsigned int)c);
+	  doc += esc;
+	}
+	else {
+	  doc += c;
+	}
+      }
+      doc += "\"";
+    }
+    doc += "}";
+    pubsubPublish(batch->prefix + "batch", doc, batch->qos_max, batch->retain_all, batch->topic_class);
+    LEAF_INT_RETURN(sent);
+  }
+
+  bool one_by_one = (batch->qos_max > 0) || !pubsub_connected || pubsub_send_hold;
+#ifdef ESP32
+  // publishers only queue, so each member goes through the send queue
+  if (pubsubPublishAsync() && !pubsub_loopback) one_by_one = true;
+#endif
+  if (one_by_one) {
+    // one at a time, so that each can be paced, queued or held
+    while (pubsubBatchNext(batch, &pos, topic, payload, &qos, &retain)) {
+      pubsubPublish(topic, payload, qos, retain, batch->topic_class);
+      ++sent;
+    }
+  }
+  else {
+    pubsubLock();
+    int class_was = pubsub_publish_class;
+    pubsub_publish_class = batch->topic_class;
+    if (pubsub_capture) {
+      while (pubsubBatchNext(batch, &pos, topic, payload, &qos, &retain)) {
+	pubsub_capture->pubsubCapture(true, topic.c_str(), topic.length(), payload.c_str(), payload.length(), qos, retain);
+      }
+    }
+    sent = _mqtt_publish_batch(batch);
+    pubsub_publish_class = class_was;
+    pubsubUnlock();
+  }
+  LEAF_INT_RETURN(sent);
+}
+
+// Transports that hold a lock per publish should override this to hold it once
+int AbstractPubsubLeaf::_mqtt_publish_batch(struct PubsubBatch *batch)
+{
+  int pos = 0;
+  int sent = 0;
+  String topic;
+  String payload;
+  int qos;
+  bool retain;
+  while (pubsubBatchNext(batch, &pos, topic, payload, &qos, &retain)) {
+    _mqtt_publish(topic, payload, qos, retain);
+    ++sent;
+  }
+  return sent;
+}
+
+//
+// Reporting policy, consulted by leaves before a periodic or on-change
+// report (alerts, events and command replies are never held back).
+//
+// While the link is down reports are deferred rather than piling stale
+// readings into the send queue.  If the send queue is backing up,
+// telemetry is dropped.  On a metered (cellular) link, status is deferred
+// until the window that follows each heartbeat, so that reports go out
+// together rather than each waking the radio.  Each leaf has its own
+// window, opened by its own heartbeat (reports from code that is not a
+// leaf follow the pubsub leaf's heartbeat).
+//
+// A caller asking again about a report it was already told to defer sets
+// retry, so that the deferral is counted once.
+//
+int AbstractPubsubLeaf::pubsubReportPolicy(Leaf *leaf, int topic_class, bool retry)
+{
+  if (!pubsub_policy_enable || (topic_class <= PUBSUB_CLASS_EVENT) || pubsubIsRouting()) {
+    return PUBSUB_REPORT_NOW;
+  }
+  unsigned long now = millis();
+  int decision = PUBSUB_REPORT_NOW;
+
+  if (!isConnected() ||
+      ((stacx_comms_state != UNDEFINED) && (stacx_comms_state < ONLINE))) {
+    decision = PUBSUB_REPORT_DEFER;
+  }
+#ifdef ESP32
+  else if (pubsub_send_queue_size && pubsub_policy_queue_high &&
+	   (sendQueueCount()*100 >= pubsub_send_queue_size*pubsub_policy_queue_high)) {
+    decision = (topic_class == PUBSUB_CLASS_TELEMETRY)?PUBSUB_REPORT_SUPPRESS:PUBSUB_REPORT_DEFER;
+  }
+#endif
+  else if (ipLeaf && ipLeaf->ipIsMetered() && !pubsubReportWindowIsOpen(leaf, now)) {
+    decision = PUBSUB_REPORT_DEFER;
+  }
+
+  if ((decision == PUBSUB_REPORT_DEFER) && !retry) {
+    ++pubsub_policy_defer_count;
+  }
+  else if (decision == PUBSUB_REPORT_SUPPRESS) {
+    ++pubsub_policy_suppress_count;
+  }
+  if (decision != PUBSUB_REPORT_NOW) {
+    LEAF_DEBUG("Report policy for %s: %s", leaf?leaf->getNameStr():"?",
+	       (decision==PUBSUB_REPORT_DEFER)?"defer":"suppress");
+  }
+  return decision;
+}
+
+// Scale a reporting interval, stretching it while the signal is poor
+unsigned long AbstractPubsubLeaf::pubsubReportInterval(unsigned long interval)
+{
+  if (!pubsub_policy_enable) return interval;
+  pubsubPolicySignalCheck(millis());
+  if (pubsub_policy_poor_signal && (pubsub_policy_poor_factor > 1)) {
+    return interval * pubsub_policy_poor_factor;
+  }
+  return interval;
+}
+
+bool AbstractPubsubLeaf::pubsubReportWindowIsOpen(Leaf *leaf, unsigned long now)
+{
+  unsigned long *window_start = (leaf?leaf:this)->reportWindow();
+  unsigned long period = pubsubReportInterval(::heartbeat_interval_seconds) * 1000UL;
+  if ((*window_start == 0) || (now - *window_start) >= period) {
+    // no heartbeat seen lately, keep our own schedule
+    *window_start = now;
+  }
+  return (now - *window_start) < (pubsub_policy_window_sec * 1000UL);
+}
+
+// Sample signal strength now and then (on a modem this is an AT command)
+void AbstractPubsubLeaf::pubsubPolicySignalCheck(unsigned long now)
+{
+  if (!ipLeaf || !ipLeaf->isConnected()) return;
+  if (pubsub_policy_rssi_last &&
+      ((now - pubsub_policy_rssi_last) < (pubsub_policy_rssi_interval_sec * 1000UL))) {
+    return;
+  }
+  pubsub_policy_rssi_last = now;
+  bool poor = ipLeaf->ipSignalIsPoor(ipLeaf->ipPollRssi());
+  if (poor != pubsub_policy_poor_signal) {
+    LEAF_NOTICE("Signal is now %s, reporting intervals %s", poor?"poor":"ok", poor?"stretched":"restored");
+    pubsub_policy_poor_signal = poor;
+  }
+}
+
+void AbstractPubsubLeaf::pre_sleep(int duration)
+{
+  Leaf::pre_sleep(duration);
+  if (pubsub_session_persist) {
+    pubsubSessionSave();
+  }
+}
+
+void AbstractPubsubLeaf::post_sleep()
+{
+  Leaf::post_sleep();
+  if (pubsub_session_persist) {
+    // the session is restored once we know the broker kept it (see pubsubOnConnect)
+    pubsub_session_restore_due = true;
+  }
+}
+
+//
+// Save subscriptions and unacknowledged publishes to RTC memory before
+// sleep.  Publishes that do not fit are lost (as they would be without
+// persistence).
+//
+void AbstractPubsubLeaf::pubsubSessionSave()
+{
+#ifdef ESP32
+  LEAF_ENTER(L_NOTICE);
+  struct PubsubRtcSession *rtc = &pubsub_rtc_session;
+  rtc->magic = 0;
+  rtc->sub_count = rtc->pub_count = 0;
+  rtc->covered = 0;
+  rtc->len = 0;
+
+  for (int i=0; pubsub_subscriptions && (i<pubsub_subscriptions->size()); i++) {
+    String topic = pubsub_subscriptions->getKey(i);
+    size_t need = 2 + topic.length() + 1;
+    if (rtc->len + need > sizeof(rtc->buf)) {
+      LEAF_WARN("No room to save subscriptions, session will not be resumed");
+      LEAF_VOID_RETURN;
+    }
+    char *p = rtc->buf + rtc->len;
+    *p++ = 'S';
+    *p++ = '0' + pubsub_subscriptions->getData(i);
+    memcpy(p, topic.c_str(), topic.length()+1);
+    rtc->len += need;
+    ++rtc->sub_count;
+  }
+
+  if (pubsub_subscribe_minimise && pubsub_subscribe_covered && pubsub_subscribe_requests) {
+    // the original requests filter what the merged wildcards overdeliver
+    for (int i=0; i<pubsub_subscribe_requests->size(); i++) {
+      String topic = pubsub_subscribe_requests->getKey(i);
+      size_t need = 2 + topic.length() + 1;
+      if (rtc->len + need > sizeof(rtc->buf)) {
+	LEAF_WARN("No room to save subscription requests, session will not be resumed");
+	LEAF_VOID_RETURN;
+      }
+      char *p = rtc->buf + rtc->len;
+      *p++ = 'R';
+      *p++ = '0' + pubsub_subscribe_requests->getData(i);
+      memcpy(p, topic.c_str(), topic.length()+1);
+      rtc->len += need;
+    }
+    rtc->covered = pubsub_subscribe_covered;
+  }
+
+  for (int i=0; i<PUBSUB_INFLIGHT_MAX; i++) {
+    struct PubsubInflight *m = pubsub_inflight+i;
+    if (!m->msg_id) continue;
+    size_t need = 2 + m->topic->length() + 1 + m->payload->length() + 1;
+    if (rtc->len + need > sizeof(rtc->buf)) {
+      LEAF_WARN("No room to save unacknowledged publish %s", m->topic->c_str());
+      continue;
+    }
+    char *p = rtc->buf + rtc->len;
+    *p++ = 'P';
+    *p++ = m->retain?'1':'0';
+    memcpy(p, m->topic->c_str(), m->topic->length()+1);
+    p += m->topic->length()+1;
+    memcpy(p, m->payload->c_str(), m->payload->length()+1);
+    rtc->len += need;
+    ++rtc->pub_count;
+  }
+
+  rtc->signature = pubsubHash(base_topic.c_str(), pubsubHash(pubsub_host.c_str()));
+  rtc->magic = PUBSUB_SESSION_MAGIC;
+  LEAF_NOTICE("Saved session: %d subscriptions, %d unacknowledged publishes (%d bytes)",
+	      (int)rtc->sub_count, (int)rtc->pub_count, (int)rtc->len);
+  LEAF_LEAVE;
+#endif
+}
+
+//
+// Restore the session saved by pubsubSessionSave.  The subscription set
+// (and, if it was minimised, the requests it covers) is recorded as if we
+// had subscribed, and unacknowledged publishes are put back in flight to
+// be retransmitted once, even by transports that otherwise leave
+// retransmission to their client library.
+//
+bool AbstractPubsubLeaf::pubsubSessionRestore()
+{
+#ifdef ESP32
+  LEAF_ENTER(L_NOTICE);
+  struct PubsubRtcSession *rtc = &pubsub_rtc_session;
+  if (rtc->magic != PUBSUB_SESSION_MAGIC) {
+    LEAF_NOTICE("No saved session");
+    LEAF_BOOL_RETURN(false);
+  }
+  // a saved session is only good once
+  rtc->magic = 0;
+  if (rtc->signature != pubsubHash(base_topic.c_str(), pubsubHash(pubsub_host.c_str()))) {
+    LEAF_WARN("Saved session is for a different broker or topic, ignored");
+    LEAF_BOOL_RETURN(false);
+  }
+  if (rtc->len > sizeof(rtc->buf)) {
+    LEAF_BOOL_RETURN(false);
+  }
+
+  size_t pos = 0;
+  int restored_pubs = 0;
+  while (pos < rtc->len) {
+    char kind = rtc->buf[pos];
+    char flag = rtc->buf[pos+1];
+    const char *topic = rtc->buf + pos + 2;
+    pos += 2 + strlen(topic) + 1;
+    if (kind == 'S') {
+      if (pubsub_subscriptions) {
+	pubsub_subscriptions->put(String(topic), flag-'0');
+      }
+    }
+    else if (kind == 'R') {
+      if (pubsub_subscribe_requests) {
+	pubsub_subscribe_requests->put(String(topic), flag-'0');
+      }
+    }
+    else if (kind == 'P') {
+      const char *payload = rtc->buf + pos;
+      pos += strlen(payload) + 1;
+      // stand-in message ids, these are all resent (with new ids) on connect
+      pubsubInflightAdd(0xFFFF - restored_pubs, topic, String(payload), flag=='1', true);
+      ++restored_pubs;
+    }
+    else {
+      LEAF_ALERT("Corrupt saved session");
+      LEAF_BOOL_RETURN(false);
+    }
+  }
+  pubsub_subscribe_covered = rtc->covered;
+  LEAF_NOTICE("Restored session: %d subscriptions, %d unacknowledged publishes", (int)rtc->sub_count, restored_pubs);
+  LEAF_BOOL_RETURN(true);
+#else
+  return false;
+#endif
+}
+
+// Reporting policy for code that is not a Leaf (eg. the Pollable trait)
+int pubsub_report_policy(int topic_class=PUBSUB_CLASS_TELEMETRY, bool retry=false)
+{
+  if (!pubsub_policy_leaf) return PUBSUB_REPORT_NOW;
+  return pubsub_policy_leaf->pubsubReportPolicy(NULL, topic_class, retry);
+}
+
+unsigned long pubsub_report_interval(unsigned long interval)
+{
+  if (!pubsub_policy_leaf) return interval;
+  return pubsub_policy_leaf->pubsubReportInterval(interval);
+}
+
+//
+// Copy a publish made via the primary pubsub leaf to each additional
+// active pubsub leaf whose class mask carries this topic class.
+//
+// Copies are placed on the target leaf's own send queue, which the
+// target drains from its own loop (and reconnect state machine), so a slow
+// or disconnected broker never blocks delivery via the primary leaf.
+//
+// Fan-out targets are publish-only as far as leaves are concerned: a
+// target subscribes to its own device command topics (cmd/get/set), but
+// leaf subscriptions are made only via the primary.
+//
+void AbstractPubsubLeaf::pubsubFanout(AbstractPubsubLeaf *primary, String &topic, String &payload, int qos, bool retain, int topic_class)
+{
+  for (int i=0; i<pubsub_fanout_count; i++) {
+    AbstractPubsubLeaf *target = pubsub_fanout[i];
+    if ((target == primary) || !target->canRun()) continue;
+    if (!(target->pubsub_fanout_classes & (1<<topic_class))) continue;
+    target->pubsubFanoutEnqueue(topic, payload, qos, retain, topic_class);
+  }
+}
+
+//
+// Make this leaf ready to act as a fan-out target.  The send queue is
+// enlarged to PUBSUB_FANOUT_QUEUE_SIZE (if it is still empty) and drained
+// within the byte/time budget on every loop pass, without waiting
+// pubsub_dequeue_delay between passes, since every leaf's publishes
+// arrive by it.
+//
+void AbstractPubsubLeaf::pubsubFanoutPrepare(int mask)
+{
+  pubsub_fanout_classes = mask;
+  pubsub_fanout_target = true;
+  if (pubsub_dequeue_delay > 1) pubsub_dequeue_delay = 1;
+#ifdef ESP32
+  if (pubsub_send_queue_size >= PUBSUB_FANOUT_QUEUE_SIZE) return;
+  if (send_queue && uxQueueMessagesWaiting(send_queue)) {
+    LEAF_WARN("Send queue not empty, fan-out queue stays at %d", pubsub_send_queue_size);
+    return;
+  }
+  pubsub_send_queue_size = PUBSUB_FANOUT_QUEUE_SIZE;
+  if (send_queue) {
+    // setup already ran, replace the queue
+    vQueueDelete(send_queue);
+    send_queue = xQueueCreate(pubsub_send_queue_size, sizeof(struct PubsubSendQueueMessage));
+  }
+  LEAF_NOTICE("Fan-out send queue size %d", pubsub_send_queue_size);
+#endif
+}
+
+bool AbstractPubsubLeaf::pubsubFanoutEnqueue(String &topic, String &payload, int qos, bool retain, int topic_class)
+{
+  if (pubsub_bench_dry_run) return true;
+  bool result = _mqtt_queue_publish(topic, payload, qos, retain, topic_class);
+  if (result) {
+    ++pubsub_fanout_queued_count;
+  }
+#ifndef ESP32
+  else if (isConnected()) {
+    // no send queues here, so send it now
+    _mqtt_publish(topic, payload, qos, retain);
+    result = true;
+  }
+#endif
+  else {
+    LEAF_INFO("Fan-out publish not queued %s", topic.c_str());
+  }
+  return result;
+}
+
+//
+// Publish a latency probe to our own command topic.  The payload carries
+// the send time, which pubsubProbeReceive compares to the arrival time.
+//
+void AbstractPubsubLeaf::pubsubProbeSend()
+{
+  if (!isConnected()) return;
+  pubsub_probe_last = millis();
+  String topic = "cmd/pubsub_probe";
+  if (use_flat_topic) topic.replace("/","-");
+  char payload[32];
+  snprintf(payload, sizeof(payload), "%d:%lu", ++pubsub_probe_seq, (unsigned long)micros());
+  ++pubsub_probe_sent;
+  _mqtt_publish(base_topic + topic, String(payload));
+}
+
+void AbstractPubsubLeaf::pubsubProbeReceive(String &payload)
+{
+  unsigned long now = micros();
+  int pos = payload.indexOf(':');
+  if (pos < 0) {
+    LEAF_WARN("Malformed latency probe [%s]", payload.c_str());
+    return;
+  }
+  unsigned long sent = strtoul(payload.c_str()+pos+1, NULL, 10);
+  // transports that do not record arrival time are counted as zero queue time
+  unsigned long rx = pubsub_route_rx_us?pubsub_route_rx_us:pubsub_route_start_us;
+
+  ++pubsub_probe_received;
+  pubsubLatencyRecord(&pubsub_latency[PUBSUB_PROBE_TOTAL], now - sent);
+  pubsubLatencyRecord(&pubsub_latency[PUBSUB_PROBE_TRANSPORT], rx - sent);
+  pubsubLatencyRecord(&pubsub_latency[PUBSUB_PROBE_QUEUE], pubsub_route_start_us - rx);
+  pubsubLatencyRecord(&pubsub_latency[PUBSUB_PROBE_ROUTE], now - pubsub_route_start_us);
+  LEAF_NOTICE("Latency probe %s: total=%luus transport=%luus queue=%luus route=%luus",
+	      payload.substring(0,pos).c_str(),
+	      now-sent, rx-sent, pubsub_route_start_us-rx, now-pubsub_route_start_us);
+
+  if (pubsub_probe_burst_remain && (--pubsub_probe_burst_remain == 0)) {
+    pubsubProbePub();
+  }
+}
+
+void AbstractPubsubLeaf::pubsubProbePub()
+{
+  LEAF_ENTER(L_INFO);
+  mqtt_publish("status/latency/count", String(pubsub_probe_received)+"/"+String(pubsub_probe_sent));
+  for (int i=0; i<PUBSUB_PROBE_SPLITS; i++) {
+    struct PubsubLatencySamples *s = &pubsub_latency[i];
+    if (!s->count) continue;
+    char buf[64];
+    snprintf(buf, sizeof(buf), "p50=%.1f p90=%.1f p99=%.1f",
+	     pubsubLatencyPercentile(s, 50)/1000.0,
+	     pubsubLatencyPercentile(s, 90)/1000.0,
+	     pubsubLatencyPercentile(s, 99)/1000.0);
+    mqtt_publish(String("status/latency/")+pubsub_probe_split_names[i]+"_ms", buf);
+  }
+  LEAF_LEAVE;
+}
+
+//
+// Publish a (full) topic on behalf of a leaf, subject to the QoS1
+// in-flight window.  When the window is full the message is deferred to
+// the send queue, which is released as acknowledgements arrive.
+//
+bool AbstractPubsubLeaf::pubsubPublish(const char *topic, size_t topic_len, const String &payload, int qos, bool retain, int topic_class, uint16_t *msg_id_r)
+{
+  if (msg_id_r) *msg_id_r = 0;
+#ifdef ESP32
+  if (pubsubPublishAsync() && !pubsub_loopback && !pubsub_bench_dry_run) {
+    // The drain task (or failing that the loop) will send it, subject to
+    // any hold and the in-flight window.  Publishers never touch the
+    // transport or the in-flight table.
+    if (_mqtt_queue_publish(String(topic), payload, qos, retain, topic_class)) {
+      if (topic_class > PUBSUB_CLASS_EVENT) ++pubsub_telemetry_count;
+      if (pubsub_send_hold && (pubsub_send_hold_urgent || (topic_class > PUBSUB_CLASS_EVENT))) ++pubsub_held_count;
+      pubsubDrainWake();
+      return true;
+    }
+  }
+#endif
+
+  pubsubLock();
+  int class_was = pubsub_publish_class;
+  pubsub_publish_class = topic_class;
+  if ((topic_class > PUBSUB_CLASS_EVENT) && !pubsub_dequeuing) ++pubsub_telemetry_count;
+
+  if ((qos > 0) && pubsubInflightFull() && !pubsub_loopback) {
+#ifdef ESP32
+    if (_mqtt_queue_publish(String(topic), payload, qos, retain, topic_class)) {
+      ++pubsub_paced_count;
+      pubsub_publish_class = class_was;
+      pubsubUnlock();
+      return true;
+    }
+#endif
+    LEAF_WARN("In-flight window full (%d), publishing %s anyway", pubsub_inflight_count, topic);
+  }
+
+  if (pubsub_bench_dry_run) {
+    // publish benchmark measures everything up to the transport
+    pubsub_publish_class = class_was;
+    pubsubUnlock();
+    return true;
+  }
+  if (pubsub_capture) {
+    pubsub_capture->pubsubCapture(true, topic, topic_len, payload.c_str(), payload.length(), qos, retain);
+  }
+
+#ifdef ESP32
+  if (pubsub_send_hold && !pubsub_dequeuing && !pubsub_loopback &&
+      (pubsub_send_hold_urgent || (topic_class > PUBSUB_CLASS_EVENT)) &&
+      _mqtt_queue_publish(String(topic), payload, qos, retain, topic_class)) {
+    // waits for the hold to be lifted
+    ++pubsub_held_count;
+    pubsub_publish_class = class_was;
+    pubsubUnlock();
+    return true;
+  }
+#endif
+
+  unsigned long start = millis();
+  if (!pubsub_wake_publish_ms && pubsub_wake_ready_ms) {
+    pubsub_wake_publish_ms = start;
+  }
+  unsigned long start_us = micros();
+  uint16_t msg_id = 0;
+  bool ok = _mqtt_publish_raw(topic, topic_len, payload.c_str(), payload.length(), qos, retain, &msg_id);
+#ifdef ESP32
+  if (xTaskGetCurrentTaskHandle() != pubsub_drain_handle)
+#endif
+  {
+    // a publisher (rather than the drain task) waited on the transport
+    unsigned long blocked = micros() - start_us;
+    ++pubsub_publish_block_count;
+    pubsub_publish_block_us += blocked;
+    if (blocked > pubsub_publish_block_max_us) pubsub_publish_block_max_us = blocked;
+  }
+  if (ok && (qos > 0) && msg_id && pubsub_connected && !pubsub_loopback) {
+    if (pubsubHasAsyncAck()) {
+      pubsubInflightAdd(msg_id, topic, payload, retain, false, topic_class);
+    }
+    else {
+      pubsubRecordRtt(millis()-start);
+    }
+  }
+  pubsub_publish_class = class_was;
+  pubsubUnlock();
+  if (msg_id_r) *msg_id_r = msg_id;
+  return ok;
+}
+
+void AbstractPubsubLeaf::pubsubRecordRtt(unsigned long ms)
+{
+  int b;
+  for (b=0; (b<PUBSUB_RTT_BUCKETS-1) && (ms > pubsub_rtt_bucket_ms[b]); b++);
+  ++pubsub_puback_hist[b];
+  ++pubsub_puback_count;
+  pubsub_puback_total_ms += ms;
+}
+
+void AbstractPubsubLeaf::pubsubInflightAdd(uint16_t msg_id, const char *topic, const String &payload, bool retain, bool restored, int topic_class)
+{
+  for (int i=0; i<PUBSUB_INFLIGHT_MAX; i++) {
+    struct PubsubInflight *m = pubsub_inflight+i;
+    if (m->msg_id) continue;
+    m->msg_id = msg_id;
+    m->retries = pubsub_inflight_resend_retries;
+    m->retain = retain;
+    m->restored = restored;
+    m->topic_class = topic_class;
+    m->sent_ms = millis();
+    m->topic = new String(topic);
+    m->payload = new String(payload);
+    ++pubsub_inflight_count;
+    LEAF_DEBUG("In-flight %d/%d: id=%d %s", pubsub_inflight_count, pubsub_inflight_window, (int)msg_id, topic);
+    return;
+  }
+  LEAF_WARN("No in-flight slot for message %d, it will not be tracked", (int)msg_id);
+}
+
+void AbstractPubsubLeaf::pubsubInflightAck(uint16_t msg_id)
+{
+  pubsubLock();
+  for (int i=0; i<PUBSUB_INFLIGHT_MAX; i++) {
+    struct PubsubInflight *m = pubsub_inflight+i;
+    if (m->msg_id != msg_id) continue;
+    unsigned long rtt = millis() - m->sent_ms;
+    LEAF_INFO("PUBACK id=%d after %lums (retries=%d)", (int)msg_id, rtt, (int)m->retries);
+    pubsubRecordRtt(rtt);
+    delete m->topic;
+    delete m->payload;
+    m->msg_id = 0;
+    --pubsub_inflight_count;
+    pubsubUnlock();
+    return;
+  }
+  pubsubUnlock();
+  LEAF_DEBUG("Acknowledgement for untracked message %d", (int)msg_id);
+}
+
+//
+// Retransmit publishes whose acknowledgement is overdue (or all of them, after
+// a reconnect), abandoning those that have exhausted their retries.
+//
+// A retransmit goes through pubsubPublish like any other publish (so it is
+// captured, and waits out a send hold), and is tracked afresh under its
+// new message id.
+//
+void AbstractPubsubLeaf::pubsubInflightCheck(bool resend_all)
+{
+  unsigned long now = millis();
+  bool due[PUBSUB_INFLIGHT_MAX];
+
+  pubsubLock();
+  // decide first, so that the entries made by the resends are not revisited
+  for (int i=0; i<PUBSUB_INFLIGHT_MAX; i++) {
+    struct PubsubInflight *m = pubsub_inflight+i;
+    due[i] = m->msg_id && (resend_all || ((now - m->sent_ms) >= (unsigned long)pubsub_inflight_timeout_ms));
+  }
+
+  for (int i=0; i<PUBSUB_INFLIGHT_MAX; i++) {
+    if (!due[i]) continue;
+    struct PubsubInflight *m = pubsub_inflight+i;
+
+    if ((pubsub_inflight_retry_max == 0) && !m->restored) {
+      // retransmission is turned off, stop waiting for this one
+      LEAF_INFO("No PUBACK for id=%d %s, not retried", (int)m->msg_id, m->topic->c_str());
+      ++pubsub_inflight_untracked_count;
+      delete m->topic;
+      delete m->payload;
+      m->msg_id = 0;
+      --pubsub_inflight_count;
+      continue;
+    }
+    if ((m->retries >= pubsub_inflight_retry_max) && !m->restored) {
+      LEAF_WARN("Abandon unacknowledged publish id=%d %s", (int)m->msg_id, m->topic->c_str());
+      ++pubsub_inflight_expire_count;
+      delete m->topic;
+      delete m->payload;
+      m->msg_id = 0;
+      --pubsub_inflight_count;
+      continue;
+    }
+
+    // free the slot for the resend to be tracked in
+    struct PubsubInflight was = *m;
+    m->msg_id = 0;
+    --pubsub_inflight_count;
+    uint16_t msg_id = 0;
+    pubsub_inflight_resend_retries = was.retries + 1;
+    bool ok = pubsubPublish(was.topic->c_str(), was.topic->length(), *was.payload, 1, was.retain, was.topic_class, &msg_id);
+    pubsub_inflight_resend_retries = 0;
+    if (!ok) {
+      // try again next time
+      if (!m->msg_id) {
+	*m = was;
+	++pubsub_inflight_count;
+	continue;
+      }
+      LEAF_WARN("No in-flight slot to retry id=%d %s, abandoned", (int)was.msg_id, was.topic->c_str());
+      ++pubsub_inflight_expire_count;
+    }
+    else {
+      LEAF_NOTICE("Retransmit publish id=%d as id=%d %s", (int)was.msg_id, (int)msg_id, was.topic->c_str());
+      ++pubsub_retransmit_count;
+    }
+    delete was.topic;
+    delete was.payload;
+  }
+  pubsubUnlock();
+}
+
+bool AbstractPubsubLeaf::wants_topic(String type, String name, String topic)
 {
   LEAF_ENTER_STR(L_DEBUG, topic);
 
@@ -852,22 +2533,46 @@ void AbstractPubsubLeaf::flushSendQueue(int count, bool drop)
   struct PubsubSendQueueMessage msg;
   int n =0;
 
-  while (send_queue && xQueueReceive(send_queue, &msg, 10)) {
+  if (!drop && pubsub_drain_handle) {
+    // sending is the drain task's job
+    pubsubDrainWake();
+    LEAF_VOID_RETURN;
+  }
+
+  // dropping clears held messages too
+  bool held = pubsub_send_hold;
+  bool held_urgent = pubsub_send_hold_urgent;
+  pubsubLock();
+  if (drop) pubsub_send_hold = pubsub_send_hold_urgent = false;
+  if (drop && !count && pubsub_spool.ready()) {
+    xSemaphoreTake(pubsub_spool_mutex, portMAX_DELAY);
+    LEAF_NOTICE("Drop %d spooled publishes", pubsub_spool.pending());
+    pubsub_spool.clear();
+    xSemaphoreGive(pubsub_spool_mutex);
+  }
+  pubsub_dequeuing = true;
+  pubsubSpoolRefill();
+  while ((drop || !pubsubInflightFull()) && sendQueueReceive(&msg)) {
     if (drop) {
       LEAF_NOTICE("Drop queued publish %s < %s", msg.topic->c_str(), msg.payload->c_str());
     }
     else {
       LEAF_NOTICE("Transmit queued publish %s < %s", msg.topic->c_str(), msg.payload->c_str());
-      _mqtt_publish(*msg.topic, *msg.payload, msg.qos, msg.retain);
+      pubsubPublish(*msg.topic, *msg.payload, msg.qos, msg.retain, msg.topic_class);
     }
     delete msg.topic;
     delete msg.payload;
     n++;
+    pubsubSpoolRefill();
 
     // a count of zero means drop all, otherwise drop the first {count} messages
     if (count && n>=count) break;
-    if (pubsub_dequeue_delay > 1) delay(pubsub_dequeue_delay);
   }
+  pubsub_dequeuing = false;
+  pubsub_send_hold = held;
+  pubsub_send_hold_urgent = held_urgent;
+  pubsub_drain_count += drop?0:n;
+  pubsubUnlock();
 #endif
   LEAF_LEAVE;
 }
@@ -913,10 +2618,86 @@ bool AbstractPubsubLeaf::commandHandler(String type, String name, String topic,
       pubsubConnect();
       pubsub_use_clean_session = was;
   })
+  ELSEWHEN("pubsub_stats",{
+      stats_pub();
+  })
+  ELSEWHEN("pubsub_publish_bench",{
+      int count = payload.toInt();
+      if (count <= 0) count = 1000;
+      String value = "42";
+
+      // the old way, for comparison: base topic plus suffix by String concatenation
+      unsigned long start = micros();
+      for (int i=0; i<count; i++) {
+	String full_topic = base_topic + "status/bench";
+	if (full_topic.length() == 0) break;
+      }
+      unsigned long concat_us = micros()-start;
+
+      pubsub_bench_dry_run = true;
+      start = micros();
+      for (int i=0; i<count; i++) {
+	mqtt_publish("status/bench", value);
+      }
+      unsigned long publish_us = micros()-start;
+      pubsub_bench_dry_run = false;
+
+      if (publish_us == 0) publish_us = 1;
+      if (concat_us == 0) concat_us = 1;
+      // the service and fan-out copies are part of the cost, say if there were any
+      char buf[160];
+      snprintf(buf, sizeof(buf), "{\"count\":%d,\"publish_us\":%lu,\"per_sec\":%lu,\"concat_us\":%lu,\"service\":%d,\"fanout\":%d}",
+	       count, publish_us, (unsigned long)(count*1000000ULL/publish_us), concat_us,
+	       (::pubsub_service && pubsubServiceLeaf)?1:0, pubsub_fanout_count);
+      mqtt_publish("status/publish_bench", buf);
+  })
+  ELSEWHEN("pubsub_batch_bench",{
+      int count = payload.toInt();
+      if (count <= 0) count = 20;
+      unsigned long start = micros();
+      for (int i=0; i<count; i++) {
+	mqtt_publish("status/bench/"+String(i), String(i));
+      }
+      unsigned long single_us = micros()-start;
+      start = micros();
+      mqtt_publish_begin();
+      for (int i=0; i<count; i++) {
+	mqtt_publish_add("status/bench/"+String(i), String(i));
+      }
+      mqtt_publish_commit();
+      unsigned long batch_us = micros()-start;
+      char buf[80];
+      snprintf(buf, sizeof(buf), "{\"count\":%d,\"single_us\":%lu,\"batch_us\":%lu}", count, single_us, batch_us);
+      mqtt_publish("status/batch_bench", buf);
+  })
+  ELSEWHEN("pubsub_probe",{
+      pubsubProbeReceive(payload);
+  })
+  ELSEWHEN("pubsub_probe_burst",{
+      int count = payload.toInt();
+      if (count <= 0) count = 10;
+      if (!pubsub_probe_interval_sec) {
+	// the probe topic is not otherwise subscribed
+	mqtt_subscribe("cmd/pubsub_probe", HERE);
+      }
+      LEAF_NOTICE("Sending burst of %d latency probes", count);
+      pubsub_probe_burst_remain = count;
+      for (int i=0; i<count; i++) {
+	pubsubProbeSend();
+      }
+  })
+  ELSEWHEN("pubsub_latency",{
+      pubsubProbePub();
+  })
   ELSEWHEN("pubsub_subscribe",{
-      _mqtt_subscribe(payload);
+      pubsubSubscribe(payload);
   })
   ELSEWHEN("pubsub_unsubscribe",{
+      if (pubsub_subscribe_requests) {
+	// forget it, so that a merged wildcard no longer lets it through
+	int i = pubsub_subscribe_requests->getIndex(payload);
+	if (i >= 0) pubsub_subscribe_requests->remove(i);
+      }
       _mqtt_unsubscribe(payload);
   })
   ELSEWHENEITHER("update", "update_test", {
@@ -1291,6 +3072,12 @@ bool AbstractPubsubLeaf::commandHandler(String type, String name, String topic,
 	free = uxQueueSpacesAvailable(send_queue);
       }
       mqtt_publish("status/pubsub_send_queue_free", String(free));
+      if (pubsub_send_hold || pubsub_held_count) {
+	mqtt_publish("status/pubsub_send_queue_held", String(pubsub_held_count));
+      }
+      if (send_queue_priority) {
+	mqtt_publish("status/pubsub_send_queue_priority_free", String(uxQueueSpacesAvailable(send_queue_priority)));
+      }
     })
 #endif //ESP32
   else handled = Leaf::commandHandler(type, name, topic, payload);
@@ -1298,16 +3085,264 @@ bool AbstractPubsubLeaf::commandHandler(String type, String name, String topic,
   LEAF_HANDLER_END;
 }
 
+//
+// Subscribe to a (full) topic on behalf of a leaf.
+//
+// When minimisation is enabled the request is recorded, so that the router
+// can discard over-delivered messages.  During connect requests are only
+// collected here and are sent by pubsubSubscribeMinimised().
+//
+void AbstractPubsubLeaf::pubsubSubscribe(String topic, int qos, codepoint_t where)
+{
+  if (pubsub_subscribe_minimise && pubsub_subscribe_requests) {
+    pubsub_subscribe_requests->put(topic, qos);
+  }
+  if (pubsub_subscribe_collecting) {
+    __LEAF_DEBUG_AT__(CODEPOINT(where), L_INFO, "Collect subscription %s", topic.c_str());
+    return;
+  }
+  _mqtt_subscribe(topic, qos, CODEPOINT(where));
+}
+
+//
+// Return the prefix (ending in slash) at which topic could be merged with
+// its siblings, or an empty string if the topic is not a candidate.
+//
+// Only concrete topics beneath our own device topic are merged, at a
+// depth of pubsub_subscribe_cover_depth levels.
+//
+String AbstractPubsubLeaf::pubsubCoverPrefix(String &topic)
+{
+  if (!topic.startsWith(base_topic) ||
+      (topic.indexOf('#') >= 0) ||
+      (topic.indexOf('+') >= 0) ||
+      (pubsub_subscribe_cover_depth < 1)) {
+    return "";
+  }
+
+  int pos = base_topic.length();
+  for (int level = 0; level < pubsub_subscribe_cover_depth; level++) {
+    pos = topic.indexOf('/', pos);
+    if (pos < 0) return "";
+    ++pos;
+  }
+  return topic.substring(0, pos);
+}
+
+//
+// Send the smallest set of subscriptions that covers everything that was
+// requested during connect.  Groups of at least pubsub_subscribe_cover_min
+// topics that share a prefix become a single prefix/# wildcard, everything
+// else is subscribed individually.
+//
+void AbstractPubsubLeaf::pubsubSubscribeMinimised()
+{
+  LEAF_ENTER(L_NOTICE);
+  unsigned long start = millis();
+  int requested = pubsub_subscribe_requests->size();
+  int sent = 0;
+  SimpleMap<String,int> groups(_compareStringKeys);
+
+  for (int i=0; i<requested; i++) {
+    String topic = pubsub_subscribe_requests->getKey(i);
+    String prefix = pubsubCoverPrefix(topic);
+    if (prefix.length()) {
+      groups.put(prefix, groups.has(prefix)?groups.get(prefix)+1:1);
+    }
+  }
+
+  for (int g=0; g<groups.size(); g++) {
+    if (groups.getData(g) < pubsub_subscribe_cover_min) continue;
+    String prefix = groups.getKey(g);
+    int qos = 0;
+    for (int i=0; i<requested; i++) {
+      if (pubsub_subscribe_requests->getKey(i).startsWith(prefix) &&
+	  (pubsub_subscribe_requests->getData(i) > qos)) {
+	qos = pubsub_subscribe_requests->getData(i);
+      }
+    }
+    LEAF_INFO("Cover %d subscriptions with %s#", groups.getData(g), prefix.c_str());
+    _mqtt_subscribe(prefix+"#", qos, HERE);
+    ++pubsub_subscribe_covered;
+    ++sent;
+  }
+
+  for (int i=0; i<requested; i++) {
+    String topic = pubsub_subscribe_requests->getKey(i);
+    String prefix = pubsubCoverPrefix(topic);
+    if (prefix.length() && (groups.get(prefix) >= pubsub_subscribe_cover_min)) {
+      continue;
+    }
+    _mqtt_subscribe(topic, pubsub_subscribe_requests->getData(i), HERE);
+    ++sent;
+  }
+
+  LEAF_NOTICE("Subscribed to %d topics using %d subscriptions in %lums",
+	      requested, sent, millis()-start);
+  LEAF_LEAVE;
+}
+
+//
+// When subscriptions have been merged, the broker will send us topics that
+// no leaf asked for.  Test a received topic against the original requests.
+//
+bool AbstractPubsubLeaf::pubsubWantsTopic(const char *topic)
+{
+  if (!pubsub_subscribe_covered || !pubsub_subscribe_requests) {
+    return true;
+  }
+  for (int i=0; i<pubsub_subscribe_requests->size(); i++) {
+    if (pubsubTopicMatch(pubsub_subscribe_requests->getKey(i).c_str(), topic)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+//
+// Offer one fragment of an oversize inbound message to any leaves that
+// have asked to consume that topic as a stream.  Fragments are delivered
+// in order, index is the offset of this chunk within a message of
+// length total.
+//
+bool AbstractPubsubLeaf::_mqtt_route_chunk(String Topic, const char *chunk, size_t len, size_t index, size_t total)
+{
+  LEAF_ENTER_STR(L_DEBUG, Topic);
+  bool handled = false;
+
+  for (int i=0; leaves[i]; i++) {
+    Leaf *leaf = leaves[i];
+    if (leaf->canRun() && leaf->wants_topic_chunks(Topic)) {
+      LEAF_INFO("Routing chunk %lu+%lu of %lu for [%s] to leaf %s",
+		(unsigned long)index, (unsigned long)len, (unsigned long)total,
+		Topic.c_str(), leaf->describe().c_str());
+      if (leaf->mqtt_receive_chunk(Topic, chunk, len, index, total)) {
+	handled = true;
+      }
+    }
+  }
+
+  LEAF_BOOL_RETURN(handled);
+}
+
+//
+// Tell the stream handlers that the message they are receiving will not
+// be completed.
+//
+void AbstractPubsubLeaf::pubsubStreamAbort()
+{
+  LEAF_WARN("Streamed message for %s cut short at %lu of %lu bytes", pubsub_stream_topic.c_str(),
+	    (unsigned long)pubsub_stream_next, (unsigned long)pubsub_stream_total);
+  ++pubsub_stream_abort_count;
+  for (int i=0; leaves[i]; i++) {
+    Leaf *leaf = leaves[i];
+    if (leaf->canRun() && leaf->wants_topic_chunks(pubsub_stream_topic)) {
+      leaf->mqtt_receive_chunk_abort(pubsub_stream_topic, pubsub_stream_next, pubsub_stream_total);
+    }
+  }
+  pubsub_stream_topic = "";
+  pubsub_stream_next = pubsub_stream_total = 0;
+}
+
+//
+// Route a message received from the network.  While the message is being
+// routed, leaves may use pubsubLeaf->pubsubCurrentMessage() to see the
+// raw buffer (for binary payloads, or to keep it with pubsubMessageRef).
+//
+// The caller retains its own reference and releases it afterward.
+//
+void AbstractPubsubLeaf::_mqtt_route_message(PubsubMessageBuffer *msg, int flags)
+{
+  LEAF_ENTER(L_DEBUG);
+  PubsubMessageBuffer *was = pubsub_current_message;
+  pubsub_current_message = msg;
+  pubsub_route_rx_us = msg->rx_us;
+
+  if (pubsub_stream_total &&
+      ((msg->index != pubsub_stream_next) || (msg->total != pubsub_stream_total) ||
+       (pubsub_stream_topic != msg->topic()))) {
+    // a fragment of the streamed message went missing (messages arrive in
+    // order, so anything else means it will not be completed)
+    pubsubStreamAbort();
+  }
+
+  if ((msg->index == 0) && (msg->payload_len == msg->total)) {
+    // routed straight from the buffer, the length is explicit so that
+    // binary payloads survive
+    _mqtt_route(msg->topic(), msg->topic_len, msg->payload(), msg->payload_len, flags);
+  }
+  else if ((msg->index != 0) && !pubsub_stream_total) {
+    // the start of this message was lost, or it was abandoned above
+    LEAF_INFO("Discard fragment %lu+%lu of abandoned message for %s",
+	      (unsigned long)msg->index, (unsigned long)msg->payload_len, msg->topic());
+  }
+  else {
+    LEAF_INFO("MQTT fragment from server %s <= %lu+%lu of %lu",
+	      msg->topic(), (unsigned long)msg->index, (unsigned long)msg->payload_len, (unsigned long)msg->total);
+    if (msg->index == 0) {
+      pubsub_stream_topic = msg->topic();
+      pubsub_stream_total = msg->total;
+    }
+    pubsub_stream_next = msg->index + msg->payload_len;
+    pubsub_stream_last_ms = millis();
+    if (pubsub_stream_next >= pubsub_stream_total) {
+      // complete
+      pubsub_stream_topic = "";
+      pubsub_stream_next = pubsub_stream_total = 0;
+    }
+    if (!_mqtt_route_chunk(String(msg->topic()), msg->payload(), msg->payload_len, msg->index, msg->total) &&
+	(msg->index == 0)) {
+      LEAF_WARN("Oversize message (%lu bytes) for %s has no stream handler, discarded",
+		(unsigned long)msg->total, msg->topic());
+    }
+  }
+
+  pubsub_current_message = was;
+  pubsub_route_rx_us = 0;
+  LEAF_LEAVE;
+}
+
 void AbstractPubsubLeaf::_mqtt_route(String Topic, String Payload, int flags)
+{
+  _mqtt_route(Topic.c_str(), Topic.length(), Payload.c_str(), Payload.length(), flags);
+}
+
+//
+// Route a message given as views of its topic (NUL terminated) and
+// payload.  Strings are made only of the parts of the topic that leaves
+// are offered, the payload goes down to the leaves as a view (see
+// Leaf::mqtt_receive_view).
+//
+void AbstractPubsubLeaf::_mqtt_route(const char *topic, size_t topic_len, const char *payload, size_t payload_len, int flags)
 {
   LEAF_ENTER(L_DEBUG);
-  LEAF_NOTICE("AbstractPubsubLeaf ROUTE %s <= %s %s", this->describe().c_str(), Topic.c_str(), Payload.c_str());
+  LEAF_NOTICE("AbstractPubsubLeaf ROUTE %s <= %s %.*s", this->describe().c_str(), topic, (int)payload_len, payload);
 
   bool handled = false;
   bool isShell = flags&PUBSUB_SHELL;
 
+  if (pubsub_capture && !(flags & (PUBSUB_SHELL|PUBSUB_REPLAY))) {
+    PubsubMessageBuffer *m = pubsub_current_message;
+    pubsub_capture->pubsubCapture(false, topic, topic_len, payload, payload_len,
+				  m?m->qos:0, m?m->retain:false);
+  }
+
+  if (!isShell && !pubsubWantsTopic(topic)) {
+    // delivered via a merged wildcard subscription, but nobody wants it
+    ++pubsub_overdelivery_count;
+    LEAF_INFO("Discard unrequested topic %s", topic);
+    LEAF_VOID_RETURN;
+  }
+
+  // publishes made while we are routing are replies, and get priority
+  if (pubsub_route_depth++ == 0) {
+    pubsub_route_start_us = micros();
+  }
+
   do {
-    int pos, lastPos;
+    const char *end = topic + topic_len;
+    const char *p;
+    const char *slash;
     String device_type;
     String device_name;
     String device_target;
@@ -1317,56 +3352,58 @@ void AbstractPubsubLeaf::_mqtt_route(String Topic, String Payload, int flags)
     // When the shell is used to inject fake messages (pubsub_loopback) we do not do this
     if (pubsubUseDeviceTopic() && !isShell) {
       LEAF_INFO("Parsing device topic...");
-      if (Topic.startsWith(_ROOT_TOPIC+"devices/")) {
-	lastPos = _ROOT_TOPIC.length()+strlen("devices/");
+      size_t root_len = _ROOT_TOPIC.length();
+      if ((topic_len >= root_len+8) &&
+	  (strncmp(topic, _ROOT_TOPIC.c_str(), root_len) == 0) &&
+	  (strncmp(topic+root_len, "devices/", 8) == 0)) {
+	p = topic+root_len+8;
       }
       else {
 	// the topic does not begin with "devices/"
-	LEAF_WARN("Cannot find device header in topic %s", Topic.c_str());
+	LEAF_WARN("Cannot find device header in topic %s", topic);
 	// it might be an external topic subscribed to by a leaf
 	break;
       }
 
-      pos = Topic.indexOf('/', lastPos);
-      if (pos < 0) {
-	LEAF_ALERT("Cannot find device id in topic %s", Topic.c_str());
+      slash = (const char *)memchr(p, '/', end-p);
+      if (!slash) {
+	LEAF_ALERT("Cannot find device id in topic %s", topic);
 	break;
       }
 
-      device_target = Topic.substring(lastPos, pos);
-      LEAF_INFO("Parsed device ID [%s] from topic at %d:%d", device_target.c_str(), lastPos, pos);
-      lastPos = pos+1;
+      device_target = String(p, slash-p);
+      LEAF_INFO("Parsed device ID [%s] from topic at %d:%d", device_target.c_str(), (int)(p-topic), (int)(slash-topic));
+      p = slash+1;
 
-      pos = Topic.indexOf('/', lastPos);
-      if (pos < 0) {
-	LEAF_ALERT("Cannot find device type in topic %s", Topic.c_str());
+      slash = (const char *)memchr(p, '/', end-p);
+      if (!slash) {
+	LEAF_ALERT("Cannot find device type in topic %s", topic);
 	break;
       }
-      device_type = Topic.substring(lastPos, pos);
 
       // special case devices/foo/{cmd,get,set}/# is shorthand for devices/foo/*/*/cmd etc
-      if ((device_type=="cmd") || (device_type=="get") || (device_type=="set")) {
+      if (((slash-p) == 3) &&
+	  ((strncmp(p, "cmd", 3)==0) || (strncmp(p, "get", 3)==0) || (strncmp(p, "set", 3)==0))) {
 	device_type="*";
 	device_name="*";
-	device_topic = Topic.substring(lastPos);
-	LEAF_INFO("Special case global cmd/get/set device_topic<=[%s]", device_topic);
+	device_topic = String(p, end-p);
+	LEAF_INFO("Special case global cmd/get/set device_topic<=[%s]", device_topic.c_str());
       }
       else {
+	device_type = String(p, slash-p);
+	LEAF_INFO("Parsed device type [%s] from topic at %d:%d", device_type.c_str(), (int)(p-topic), (int)(slash-topic));
+	p = slash+1;
 
-
-	LEAF_INFO("Parsed device type [%s] from topic at %d:%d", device_type.c_str(), lastPos, pos)
-	lastPos = pos+1;
-
-	pos = Topic.indexOf('/', lastPos);
-	if (pos < 0) {
-	  LEAF_ALERT("Cannot find device name in topic %s", Topic.c_str());
+	slash = (const char *)memchr(p, '/', end-p);
+	if (!slash) {
+	  LEAF_ALERT("Cannot find device name in topic %s", topic);
 	  break;
 	}
 
-	device_name = Topic.substring(lastPos, pos);
-	LEAF_INFO("Parsed device name [%s] from topic at %d:%d", device_name.c_str(), lastPos, pos);
+	device_name = String(p, slash-p);
+	LEAF_INFO("Parsed device name [%s] from topic at %d:%d", device_name.c_str(), (int)(p-topic), (int)(slash-topic));
 
-	device_topic = Topic.substring(pos+1);
+	device_topic = String(slash+1, end-(slash+1));
 	LEAF_INFO("Parsed device topic [%s] from topic", device_topic.c_str());
       }
     }
@@ -1376,7 +3413,7 @@ void AbstractPubsubLeaf::_mqtt_route(String Topic, String Payload, int flags)
       device_type="*";
       device_name="*";
       device_target="*";
-      device_topic = Topic;
+      device_topic = String(topic, topic_len);
       if (device_topic.startsWith(base_topic)) {
 	LEAF_DEBUG("Snip base topic [%s] from [%s]", base_topic.c_str(), device_topic.c_str());
 	device_topic.remove(0, base_topic.length());
@@ -1413,7 +3450,7 @@ void AbstractPubsubLeaf::_mqtt_route(String Topic, String Payload, int flags)
     {
       LEAF_INFO("Testing backplane patterns with device_type=%s device_target=%s device_id=%s device_topic=%s",
 		device_type.c_str(), device_target.c_str(), device_id, device_topic.c_str());
-      handled = this->mqtt_receive(device_type, device_target, device_topic, Payload, false);
+      handled = this->mqtt_receive_view(device_type, device_target, device_topic, payload, payload_len, false);
       if (handled) {
 	LEAF_DEBUG("Topic %s was handed as a backplane topic", device_topic.c_str());
       }
@@ -1443,7 +3480,7 @@ void AbstractPubsubLeaf::_mqtt_route(String Topic, String Payload, int flags)
 	  }
 #endif
 	  LEAF_INFO("Routing topic=[%s] to leaf %s", device_topic.c_str(), leaf->describe().c_str());
-	  bool h = leaf->mqtt_receive(device_type, device_name, device_topic, Payload);
+	  bool h = leaf->mqtt_receive_view(device_type, device_name, device_topic, payload, payload_len);
 #if 0
 	  if (!ipLeaf->isPrimaryComms()) {
 	    // Turn off service-routing if it was us that turned it on
@@ -1470,6 +3507,7 @@ void AbstractPubsubLeaf::_mqtt_route(String Topic, String Payload, int flags)
 
   if (!handled) {
     // Leaves can also subscribe to raw topics, so try that
+    String Topic(topic);
     for (int i=0; leaves[i]; i++) {
       Leaf *leaf = leaves[i];
       if (leaf->canRun() && leaf->wants_raw_topic(Topic)) {
@@ -1478,7 +3516,7 @@ void AbstractPubsubLeaf::_mqtt_route(String Topic, String Payload, int flags)
 	  // receved a command on the service interface, force any result to same interface
 	  ::pubsub_service = true;
 	}
-	handled |= leaf->mqtt_receive_raw(Topic, Payload);
+	handled |= leaf->mqtt_receive_raw(Topic, String(payload, payload_len));
 	if (!ipLeaf->isPrimaryComms()) {
 	  // Turn off service-routing if it was us that turned it on
 	  ::pubsub_service = service_was;
@@ -1488,9 +3526,10 @@ void AbstractPubsubLeaf::_mqtt_route(String Topic, String Payload, int flags)
   }
 
   if (!handled) {
-    LEAF_ALERT("Nobody handled topic %s", Topic.c_str());
+    LEAF_ALERT("Nobody handled topic %s", topic);
   }
 
+  --pubsub_route_depth;
   LEAF_LEAVE_SLOW(1000);
 }
 
@@ -18,6 +18,23 @@
 #define PUBSUB_MODEM_CONNECT_ATTEMPT_LIMIT 0
 #endif
 
+// Number of AT+SMPUB publishes that may await completion at once (1=synchronous)
+#ifndef PUBSUB_PIPELINE_DEPTH
+#define PUBSUB_PIPELINE_DEPTH 4
+#endif
+
+// Unsolicited responses held while publishing, handled once the port is released
+#ifndef PUBSUB_PIPELINE_URC_MAX
+#define PUBSUB_PIPELINE_URC_MAX 8
+#endif
+
+enum smpub_event {
+  SMPUB_TIMEOUT=0,
+  SMPUB_PROMPT,
+  SMPUB_OK,
+  SMPUB_ERROR
+};
+
 
 //
 //@********************** class AbstractPubsubSimcomLeaf ***********************
@@ -45,6 +62,7 @@ public:
   virtual void start();
   virtual void status_pub(void);
   virtual uint16_t _mqtt_publish(String topic, String payload, int qos=0, bool retain=false);
+  virtual int _mqtt_publish_batch(struct PubsubBatch *batch);
   virtual void _mqtt_subscribe(String topic, int qos=0, codepoint_t where=undisclosed_location);
   virtual void _mqtt_unsubscribe(String topic, int level = L_NOTICE);
   virtual void mqtt_do_subscribe();
@@ -54,19 +72,32 @@ public:
   virtual void pubsubDisconnect(bool deliberate=true);
   void pubsubOnConnect(bool do_subscribe);
   virtual void pre_sleep(int duration=0);
+  virtual bool commandHandler(String type, String name, String topic, String payload);
 
 
 protected:
+  bool _mqtt_smpub(String &topic, String &payload, int qos, bool retain);
+  int _mqtt_smpub_pipeline(struct PubsubBatch *batch, int depth);
+  int smpubEvent(int timeout);
+  void smpubDispatchURC();
+  void pipelineBench(int count);
   //
   // Network resources
   //
   AbstractIpSimcomLeaf *modem_leaf = NULL;
+  int pubsub_smstate = 0; // last +SMSTATE (0=disconnected 1=connected 2=connected, session present)
   bool pubsub_reboot_modem = false;
   int pubsub_modem_connect_attempt_limit = PUBSUB_MODEM_CONNECT_ATTEMPT_LIMIT;
   bool pubsub_onconnect_imei = PUBSUB_ONCONNECT_IMEI;
   bool pubsub_onconnect_modemfw = PUBSUB_ONCONNECT_MODEMFW;
   bool pubsub_onconnect_iccid = PUBSUB_ONCONNECT_ICCID;
 
+  // publish pipelining
+  int pubsub_pipeline_depth = PUBSUB_PIPELINE_DEPTH;
+  bool pubsub_pipeline_ok = true; // cleared if the modem refuses overlapped commands
+  String pubsub_pipeline_urc[PUBSUB_PIPELINE_URC_MAX];
+  int pubsub_pipeline_urc_count = 0;
+
 
   bool install_cert();
 
@@ -101,6 +132,9 @@ void AbstractPubsubSimcomLeaf::setup()
 
   registerBoolValue("pubsub_reboot_modem", &pubsub_reboot_modem, "Reboot LTE modem if connect fails");
   registerIntValue("pubsub_modem_connect_attempt_limit", &pubsub_modem_connect_attempt_limit, "Number of failed connections to trigger modem reboot");
+  registerIntValue("pubsub_pipeline_depth", &pubsub_pipeline_depth, "Number of batched publishes that may await completion by the modem (1=synchronous)");
+  registerBoolValue("pubsub_pipeline_ok", &pubsub_pipeline_ok, "Modem accepts pipelined publishes (cleared automatically if it does not)", ACL_GET_ONLY, VALUE_NO_SAVE);
+  registerCommand(HERE,"pubsub_pipeline_bench", "Compare synchronous and pipelined publish rate over the modem (payload is message count)");
 
   LEAF_VOID_RETURN;
 }
@@ -132,6 +166,7 @@ bool AbstractPubsubSimcomLeaf::pubsubConnectStatus()
     LEAF_ALERT("Cannot get connected status");
     i = 0;
   }
+  pubsub_smstate = i;
   bool result = (i!=0);
   LEAF_BOOL_RETURN(result);
 }
@@ -383,6 +418,9 @@ bool AbstractPubsubSimcomLeaf::pubsubConnect() {
 
     if (modem_leaf->modemSendCmd(pubsub_connect_timeout_ms, HERE, "AT+SMCONN")) {
       LEAF_NOTICE("Connection succeeded");
+      // SMSTATE 2 means the broker kept our session (CLEANSS=0)
+      pubsubConnectStatus();
+      pubsubSetSessionPresent(pubsub_smstate == 2);
       pubsubSetConnected();
       break;
     }
@@ -475,24 +513,13 @@ uint16_t AbstractPubsubSimcomLeaf::_mqtt_publish(String topic, String payload, i
       }
     }
 
-    if (!modem_leaf->modemWaitPortMutex(HERE)) {
+    if (!modem_leaf->modemWaitPortMutex(HERE, false, 0, MODEM_PORT_PRIO_DATA)) {
       LEAF_ALERT("Could not acquire port mutex");
       LEAF_INT_RETURN(0);
     }
 
     modem_leaf->ipCommsState(TRANSACTION, HERE);
-    char smpub_cmd[512+64];
-    snprintf(smpub_cmd, sizeof(smpub_cmd), "AT+SMPUB=\"%s\",%d,%d,%d",
-	     topic.c_str(), payload.length(), (int)qos, (int)retain);
-    if (!modem_leaf->modemSendExpectPrompt(smpub_cmd, 10000, HERE)) {
-      LEAF_ALERT("publish prompt not seen");
-      modem_leaf->modemReleasePortMutex(HERE);
-      modem_leaf->ipCommsState(REVERT, HERE);
-      LEAF_INT_RETURN(0);
-    }
-
-    if (!modem_leaf->modemSendCmd(20000, HERE, payload.c_str())) {
-      LEAF_ALERT("publish response not seen");
+    if (!_mqtt_smpub(topic, payload, qos, retain)) {
       modem_leaf->ipCommsState(REVERT, HERE);
       modem_leaf->modemReleasePortMutex(HERE);
       LEAF_INT_RETURN(0);
@@ -516,6 +543,315 @@ uint16_t AbstractPubsubSimcomLeaf::_mqtt_publish(String topic, String payload, i
   LEAF_RETURN_SLOW(2000,1);
 }
 
+// Send one publish, the caller must hold the port mutex
+bool AbstractPubsubSimcomLeaf::_mqtt_smpub(String &topic, String &payload, int qos, bool retain)
+{
+  char smpub_cmd[512+64];
+  snprintf(smpub_cmd, sizeof(smpub_cmd), "AT+SMPUB=\"%s\",%d,%d,%d",
+	   topic.c_str(), payload.length(), (int)qos, (int)retain);
+  if (!modem_leaf->modemSendExpectPrompt(smpub_cmd, 10000, HERE)) {
+    LEAF_ALERT("publish prompt not seen");
+    return false;
+  }
+
+  if (!modem_leaf->modemSendCmd(20000, HERE, payload.c_str())) {
+    LEAF_ALERT("publish response not seen");
+    return false;
+  }
+  return true;
+}
+
+//
+// Send a batch of publishes holding the modem port (and transaction
+// state) once, rather than once per message.
+//
+int AbstractPubsubSimcomLeaf::_mqtt_publish_batch(struct PubsubBatch *batch)
+{
+  LEAF_ENTER_INT(L_DEBUG, batch->count);
+  if (pubsub_loopback || !pubsub_connected) {
+    LEAF_INT_RETURN(AbstractPubsubLeaf::_mqtt_publish_batch(batch));
+  }
+
+  if (!modem_leaf->modemWaitPortMutex(HERE, false, 0, MODEM_PORT_PRIO_DATA)) {
+    LEAF_ALERT("Could not acquire port mutex");
+    LEAF_INT_RETURN(0);
+  }
+
+  modem_leaf->ipCommsState(TRANSACTION, HERE);
+  int sent = _mqtt_smpub_pipeline(batch, pubsub_pipeline_ok?pubsub_pipeline_depth:1);
+  if (isConnected()) {
+    modem_leaf->ipCommsState(REVERT, HERE);
+  }
+  else {
+    modem_leaf->ipCommsState(WAIT_PUBSUB, HERE);
+  }
+  modem_leaf->modemReleasePortMutex(HERE);
+  smpubDispatchURC();
+
+  if (sent < batch->count) {
+    LEAF_WARN("Batch publish stopped after %d of %d messages", sent, batch->count);
+  }
+  LEAF_RETURN_SLOW(2000, sent);
+}
+
+//
+// Read the next response to a publish (prompt, completion or error).
+// Unsolicited responses seen meanwhile are held for smpubDispatchURC,
+// because their handlers may themselves need the modem port.
+//
+// precondition: hold port mutex
+//
+int AbstractPubsubSimcomLeaf::smpubEvent(int timeout)
+{
+  char buf[512];
+  while (1) {
+    int len = modem_leaf->modemGetLineOrPrompt(buf, sizeof(buf), timeout, HERE);
+    if (len == 0) return SMPUB_TIMEOUT;
+    if ((len == 1) && (buf[0] == '>')) return SMPUB_PROMPT;
+    if (strcmp(buf, "OK") == 0) return SMPUB_OK;
+    if ((strcmp(buf, "ERROR") == 0) || (strncmp(buf, "+CME ERROR", 10) == 0)) return SMPUB_ERROR;
+    if ((buf[0] == '\0') || (strncmp(buf, "AT", 2) == 0) || (strncmp(buf, "+SMPUB", 6) == 0)) {
+      // blank line, command echo or our own response, not a URC
+      continue;
+    }
+    if (pubsub_pipeline_urc_count < PUBSUB_PIPELINE_URC_MAX) {
+      pubsub_pipeline_urc[pubsub_pipeline_urc_count++] = String(buf);
+    }
+    else {
+      LEAF_WARN("No room to hold unsolicited response [%s]", buf);
+    }
+  }
+}
+
+void AbstractPubsubSimcomLeaf::smpubDispatchURC()
+{
+  for (int i=0; i<pubsub_pipeline_urc_count; i++) {
+    LEAF_INFO("Unsolicited response held during publish: [%s]", pubsub_pipeline_urc[i].c_str());
+    modem_leaf->modemProcessURC(pubsub_pipeline_urc[i]);
+    pubsub_pipeline_urc[i] = "";
+  }
+  pubsub_pipeline_urc_count = 0;
+}
+
+//
+// Send a batch of publishes, issuing each AT+SMPUB as soon as the modem
+// gives a prompt rather than waiting for the previous one to complete.
+// Completions arrive in order, so are matched by counting, up to depth
+// outstanding at once.
+//
+// Some firmware refuses a command while a publish is still completing.
+// That shows as an ERROR, where we expected a prompt, after all earlier
+// publishes have completed.  In that case we fall back to synchronous
+// publishing (and remember not to pipeline again).  An ERROR followed by
+// a prompt, or by another ERROR, is instead a failure of an earlier
+// publish.
+//
+// Returns the number of publishes completed.
+//
+// precondition: hold port mutex
+//
+int AbstractPubsubSimcomLeaf::_mqtt_smpub_pipeline(struct PubsubBatch *batch, int depth)
+{
+  LEAF_ENTER_INT(L_DEBUG, depth);
+  const int prompt_timeout = 10000;
+  const int complete_timeout = 20000;
+  char smpub_cmd[512+64];
+  String topic;
+  String payload;
+  int pos = 0;
+  int qos = 0;
+  bool retain = false;
+  int outstanding = 0;
+  int sent = 0;
+  int failed = 0;
+  bool have_message = false;
+  bool abort = false;
+
+  if (depth < 1) depth = 1;
+  modem_leaf->modemFlushInput(HERE);
+
+  while (!abort && (have_message || pubsubBatchNext(batch, &pos, topic, payload, &qos, &retain))) {
+    have_message = false;
+
+    // keep no more than depth publishes awaiting completion
+    while (outstanding >= depth) {
+      int ev = smpubEvent(complete_timeout);
+      if (ev == SMPUB_OK) {
+	--outstanding;
+	++sent;
+      }
+      else if (ev == SMPUB_ERROR) {
+	--outstanding;
+	++failed;
+      }
+      else if (ev == SMPUB_TIMEOUT) {
+	LEAF_ALERT("Publish completion not seen");
+	failed += outstanding;
+	outstanding = 0;
+	abort = true;
+      }
+    }
+    if (abort) break;
+
+    LEAF_INFO("PUB %s => [%s] (%s)", topic.c_str(), payload.c_str(), (depth>1)?"pipelined":"batch");
+    snprintf(smpub_cmd, sizeof(smpub_cmd), "AT+SMPUB=\"%s\",%d,%d,%d",
+	     topic.c_str(), payload.length(), qos, (int)retain);
+    modem_leaf->modemSend(smpub_cmd, HERE);
+
+    bool overlapped = (outstanding > 0);
+    bool prompted = false;
+    bool refused = false;
+    while (!prompted) {
+      int ev = smpubEvent(prompt_timeout);
+      if (ev == SMPUB_PROMPT) {
+	if (refused) {
+	  // the error was an earlier publish failing
+	  refused = false;
+	  --outstanding;
+	  ++failed;
+	}
+	prompted = true;
+      }
+      else if (ev == SMPUB_OK) {
+	// an earlier publish completed
+	if (outstanding) {
+	  --outstanding;
+	  ++sent;
+	}
+      }
+      else if (ev == SMPUB_ERROR) {
+	if (refused && outstanding) {
+	  // a second error, so the first was an earlier publish failing
+	  --outstanding;
+	  ++failed;
+	}
+	refused = true;
+	if (outstanding == 0) {
+	  // nothing earlier left to fail, this publish was refused
+	  break;
+	}
+      }
+      else {
+	LEAF_ALERT("publish prompt not seen");
+	abort = true;
+	break;
+      }
+      if (refused && (outstanding == 0)) break;
+    }
+
+    if (!prompted) {
+      if (refused && overlapped) {
+	// an error after all earlier publishes completed: this command was
+	// refused because it overlapped them
+	while (outstanding) {
+	  int ev = smpubEvent(complete_timeout);
+	  if (ev == SMPUB_OK) { --outstanding; ++sent; }
+	  else if (ev == SMPUB_ERROR) { --outstanding; ++failed; }
+	  else if (ev == SMPUB_TIMEOUT) { failed += outstanding; outstanding = 0; }
+	}
+	LEAF_WARN("Modem does not accept pipelined publishes, reverting to synchronous");
+	pubsub_pipeline_ok = false;
+	depth = 1;
+	have_message = true; // send this one again
+	continue;
+      }
+      ++failed;
+      continue;
+    }
+
+    modem_leaf->modemSendRaw((const uint8_t *)payload.c_str(), payload.length(), HERE);
+    ++outstanding;
+  }
+
+  // collect the remaining completions
+  while (outstanding) {
+    int ev = smpubEvent(complete_timeout);
+    if (ev == SMPUB_OK) {
+      --outstanding;
+      ++sent;
+    }
+    else if (ev == SMPUB_ERROR) {
+      --outstanding;
+      ++failed;
+    }
+    else if (ev == SMPUB_TIMEOUT) {
+      LEAF_ALERT("Publish completion not seen for %d messages", outstanding);
+      failed += outstanding;
+      outstanding = 0;
+    }
+  }
+
+  if (failed) {
+    LEAF_WARN("%d of %d batched publishes failed", failed, batch->count);
+  }
+  LEAF_INT_RETURN(sent);
+}
+
+//
+// Publish count messages synchronously and then pipelined, and report
+// the message rate of each
+//
+void AbstractPubsubSimcomLeaf::pipelineBench(int count)
+{
+  LEAF_ENTER_INT(L_NOTICE, count);
+  if (!pubsub_connected || !modem_leaf) {
+    LEAF_WARN("Not connected");
+    LEAF_VOID_RETURN;
+  }
+
+  float rate[2] = {0,0};
+  for (int pass=0; pass<2; pass++) {
+    struct PubsubBatch batch;
+    batch.depth = 1;
+    batch.count = 0;
+    batch.qos = 0;
+    batch.retain = false;
+    batch.qos_max = 0;
+    batch.retain_all = false;
+    batch.topic_class = PUBSUB_CLASS_TELEMETRY;
+    batch.prefix = base_topic;
+    String topic = base_topic + "status/pipeline_bench";
+    for (int i=0; i<count; i++) {
+      String payload(i);
+      pubsubBatchAdd(&batch, topic.c_str(), payload, PUBSUB_CLASS_TELEMETRY);
+    }
+
+    if (!modem_leaf->modemWaitPortMutex(HERE, false, 0, MODEM_PORT_PRIO_DATA)) {
+      LEAF_ALERT("Could not acquire port mutex");
+      LEAF_VOID_RETURN;
+    }
+    unsigned long start = millis();
+    int sent = _mqtt_smpub_pipeline(&batch, pass?pubsub_pipeline_depth:1);
+    unsigned long elapsed = millis() - start;
+    modem_leaf->modemReleasePortMutex(HERE);
+    smpubDispatchURC();
+    rate[pass] = elapsed?(sent * 1000.0 / elapsed):0;
+    LEAF_NOTICE("%s: %d messages in %lums", pass?"pipelined":"synchronous", sent, elapsed);
+  }
+
+  char buf[128];
+  snprintf(buf, sizeof(buf), "{\"count\":%d,\"depth\":%d,\"sync_mps\":%.1f,\"pipeline_mps\":%.1f,\"pipeline_ok\":%s}",
+	   count, pubsub_pipeline_depth, rate[0], rate[1], TRUTH_lc(pubsub_pipeline_ok));
+  mqtt_publish("status/pipeline_bench", buf);
+  LEAF_LEAVE;
+}
+
+bool AbstractPubsubSimcomLeaf::commandHandler(String type, String name, String topic, String payload)
+{
+  LEAF_HANDLER(L_INFO);
+
+  WHEN("pubsub_pipeline_bench",{
+      int count = payload.toInt();
+      if (count <= 0) count = 20;
+      pipelineBench(count);
+    })
+  else {
+    handled = AbstractPubsubLeaf::commandHandler(type, name, topic, payload);
+  }
+
+  LEAF_HANDLER_END;
+}
+
 void AbstractPubsubSimcomLeaf::_mqtt_subscribe(String topic, int qos,codepoint_t where)
 {
   LEAF_ENTER(L_INFO);
@@ -20,6 +20,7 @@ public:
 
   unsigned long last_sample;
   unsigned long last_report;
+  bool report_deferred = false;
   int sample_interval_ms;
   int report_interval_sec;
   float temperature_change_threshold = 0.5;
@@ -104,6 +105,7 @@ public:
   {
     LEAF_ENTER(L_DEBUG);
 
+    mqtt_publish_begin();
     if (!isnan(temperature)) {
       mqtt_publish("status/temperature", String(temperature,1));
       mqtt_publish("status/temperature/integer", String(temperature,0));
@@ -131,6 +133,7 @@ public:
     if (!isnan(rawEthanol)) {
       mqtt_publish("status/rawEthanol", String(rawEthanol,1));
     }
+    mqtt_publish_commit();
 
     LEAF_LEAVE;
   }
@@ -237,14 +240,23 @@ public:
       LEAF_INFO("Initial environmental report");
       do_report = true;
     }
-    else if ((last_report + report_interval_sec * 1000) <= now) {
+    else if (report_deferred) {
+      do_report = true;
+    }
+    else if ((last_report + reportInterval(report_interval_sec) * 1000) <= now) {
       LEAF_INFO("Periodic environmental report");
       do_report = true;
     }
 
     if (do_report) {
-      status_pub();
-      last_report = now;
+      int policy = reportPolicy(PUBSUB_CLASS_TELEMETRY, report_deferred);
+      report_deferred = (policy == PUBSUB_REPORT_DEFER);
+      if (policy == PUBSUB_REPORT_NOW) {
+	status_pub();
+      }
+      if (!report_deferred) {
+	last_report = now;
+      }
     }
 
     LEAF_LEAVE;
@@ -0,0 +1,4 @@
+#define DEBUG_FILES true
+#define DEBUG_THREAD 1
+#define DEBUG_COLOR true
+#define EARLY_SERIAL 1
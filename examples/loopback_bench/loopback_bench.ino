@@ -0,0 +1,49 @@
+//
+// Load test for pubsub message handling, with no network.
+//
+// The loopback broker checks its own MQTT semantics at startup, then
+// its traffic generator feeds the router.  Change the rate and topic mix
+// from the shell (eg. "set broker_gen_rate 200") and read the results
+// from status/broker_stats, or the "broker_stats" command.
+//
+#include "defaults.h"
+#include "config.h"
+#include "stacx.h"
+
+#include "leaf_shell.h"
+#include "leaf_pubsub_loopback.h"
+#include "abstract_app.h"
+
+PubsubLoopbackLeaf *broker = new PubsubLoopbackLeaf("loopmqtt");
+
+class BenchAppLeaf : public AbstractAppLeaf
+{
+protected:
+  bool started = false;
+
+public:
+  BenchAppLeaf(String name)
+    : AbstractAppLeaf(name)
+    , Debuggable(name)
+  {
+  }
+
+  virtual void loop()
+  {
+    AbstractAppLeaf::loop();
+    if (!started && pubsubLeaf && pubsubLeaf->isConnected()) {
+      started = true;
+      broker->commandHandler("cmd", "app", "broker_selftest", "");
+      broker->commandHandler("cmd", "app", "broker_reset", "");
+      broker->setValue("broker_gen_count", "10000", true, false);
+      broker->setValue("broker_gen_rate", "100", true, false);
+    }
+  }
+};
+
+Leaf *leaves[] = {
+	new ShellLeaf("shell"),
+	broker,
+	new BenchAppLeaf("app"),
+	NULL
+};
@@ -0,0 +1,9 @@
+#define DEBUG_FILES true
+#define DEBUG_THREAD 1
+#define DEBUG_COLOR true
+#define EARLY_SERIAL 1
+
+#define APP_USE_LTE true
+
+// talk to the emulated modem rather than a UART
+#define IP_LTE_EMULATOR 1
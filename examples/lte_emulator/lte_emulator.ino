@@ -0,0 +1,136 @@
+//
+// The LTE modem stack against the emulated SIM7080 modem, with no hardware.
+//
+// Once the modem leaf has attached and the MQTT leaf has connected
+// through the emulator, the app publishes a run of messages and checks
+// that each reached the emulated broker, then reports the timings to
+// status/emulator_script.  Run it again with the "emulator_script"
+// command (payload is the number of messages), or change the emulated
+// modem's latency from the shell first (eg. "set emulator_latency_ms 100").
+//
+// This is an ordinary ESP32 sketch (built with IP_LTE_EMULATOR=1, see
+// defaults.h), it needs a board but no modem.  It does not build for a
+// host.
+//
+#include "defaults.h"
+#include "config.h"
+#include "stacx.h"
+
+#include "leaf_shell.h"
+#include "leaf_ip_simcom_sim7080.h"
+#include "leaf_pubsub_mqtt_simcom_sim7080.h"
+#include "abstract_app.h"
+
+IpSimcomSim7080Leaf *lte = new IpSimcomSim7080Leaf(
+  "lte", NO_TAPS,
+  1, -1, -1, 115200, SERIAL_8N1,
+  MODEM_PWR_PIN_NONE, MODEM_KEY_PIN_NONE, MODEM_SLP_PIN_NONE,
+  LEAF_RUN, true /* autoprobe */);
+
+class EmulatorScriptLeaf : public AbstractAppLeaf
+{
+protected:
+  enum { SCRIPT_WAIT, SCRIPT_PUBLISH, SCRIPT_CHECK, SCRIPT_DONE } state = SCRIPT_WAIT;
+  int script_count = 20;
+  int script_latency = 10;
+  unsigned long script_start = 0;
+  unsigned long connect_ms = 0;
+  unsigned long publish_ms = 0;
+  unsigned long base_publishes = 0;
+
+public:
+  EmulatorScriptLeaf(String name)
+    : AbstractAppLeaf(name)
+    , Debuggable(name)
+  {
+  }
+
+  virtual void setup()
+  {
+    AbstractAppLeaf::setup();
+    registerIntValue("emulator_script_count", &script_count, "Number of messages published by the script");
+    registerIntValue("emulator_latency_ms", &script_latency, "Emulated modem response latency (ms)");
+    registerCommand(HERE, "emulator_script", "Run the connect/publish script again (payload is message count)");
+    script_start = millis();
+  }
+
+  virtual bool valueChangeHandler(String topic, Value *v)
+  {
+    LEAF_HANDLER(L_INFO);
+    WHEN("emulator_latency_ms", {
+	SimcomModemEmulator *emu = lte->ipLteEmulator();
+	if (emu) emu->setLatency(script_latency);
+      })
+    else handled = AbstractAppLeaf::valueChangeHandler(topic, v);
+    LEAF_HANDLER_END;
+  }
+
+  virtual bool commandHandler(String type, String name, String topic, String payload)
+  {
+    LEAF_HANDLER(L_INFO);
+    WHEN("emulator_script", {
+	if (payload.length()) script_count = payload.toInt();
+	state = SCRIPT_PUBLISH;
+      })
+    else handled = AbstractAppLeaf::commandHandler(type, name, topic, payload);
+    LEAF_HANDLER_END;
+  }
+
+  virtual void loop()
+  {
+    AbstractAppLeaf::loop();
+    SimcomModemEmulator *emu = lte->ipLteEmulator();
+    if (!emu) return;
+    unsigned long now = millis();
+
+    switch (state) {
+    case SCRIPT_WAIT:
+      if (lte->isConnected() && pubsubLeaf && pubsubLeaf->isConnected() && emu->brokerIsConnected()) {
+	connect_ms = now - script_start;
+	LEAF_NOTICE("Connected through the emulator after %lums", connect_ms);
+	state = SCRIPT_PUBLISH;
+      }
+      break;
+    case SCRIPT_PUBLISH:
+      base_publishes = emu->stat_publishes;
+      script_start = now;
+      for (int i=0; i<script_count; i++) {
+	mqtt_publish("status/emulator_script/seq", String(i));
+      }
+      state = SCRIPT_CHECK;
+      break;
+    case SCRIPT_CHECK: {
+      // publishes may be queued, so wait for them to reach the broker
+      bool arrived = (emu->stat_publishes - base_publishes) >= (unsigned long)script_count;
+      if (!arrived && ((now - script_start) < 30000)) break;
+      publish_ms = now - script_start;
+      bool last_ok = emu->last_pub_topic.endsWith("emulator_script/seq") &&
+	(emu->last_pub_payload == String(script_count-1));
+      char buf[200];
+      snprintf(buf, sizeof(buf), "{\"result\":\"%s\",\"connect_ms\":%lu,\"count\":%d,\"arrived\":%lu,\"publish_ms\":%lu,\"commands\":%lu,\"errors\":%lu}",
+	       (arrived && last_ok)?"pass":"fail", connect_ms, script_count,
+	       emu->stat_publishes - base_publishes, publish_ms,
+	       emu->stat_commands, emu->stat_errors);
+      if (arrived && last_ok) {
+	LEAF_NOTICE("Emulator script %s", buf);
+      }
+      else {
+	LEAF_ALERT("Emulator script %s", buf);
+      }
+      mqtt_publish("status/emulator_script", buf);
+      state = SCRIPT_DONE;
+    }
+      break;
+    case SCRIPT_DONE:
+      break;
+    }
+  }
+};
+
+Leaf *leaves[] = {
+	new ShellLeaf("shell"),
+	lte,
+	new PubsubMqttSimcomSim7080Leaf("ltemqtt", "lte", PUBSUB_SSL_DISABLE, PUBSUB_DEVICE_TOPIC_DISABLE),
+	new EmulatorScriptLeaf("app"),
+	NULL
+};
@@ -0,0 +1,696 @@
+#ifndef _GNSS_TRACK_H
+#define _GNSS_TRACK_H
+
+#include <FS.h>
+
+//
+// Position fixes in fixed point, a streaming parser for SIMCom
+// +CGNSINF responses and NMEA RMC/GGA sentences, a filter that drops
+// fixes which are inaccurate or say nothing new, and a compact track
+// log of delta-encoded records kept in flash until it can be uploaded.
+//
+// No floating point is used on the parse path, coordinates are held as
+// integer degrees*1e7 (about 1cm of resolution).
+//
+
+#define GNSS_HAVE_TIME   0x01
+#define GNSS_HAVE_POS    0x02
+#define GNSS_HAVE_ALT    0x04
+#define GNSS_HAVE_SPEED  0x08
+#define GNSS_HAVE_COURSE 0x10
+#define GNSS_HAVE_HDOP   0x20
+#define GNSS_HAVE_SATS   0x40
+
+//@******************************** struct GnssFix *******************************
+
+struct GnssFix
+{
+  uint8_t have = 0;     // GNSS_HAVE_* for the fields below that are valid
+  bool run = false;     // receiver is powered
+  bool fix = false;     // receiver has a position solution
+  uint16_t year = 0;    // UTC
+  uint8_t month = 0, day = 0, hour = 0, minute = 0, second = 0;
+  uint16_t msec = 0;
+  int32_t lat = 0;      // degrees * 1e7
+  int32_t lon = 0;      // degrees * 1e7
+  int32_t alt = 0;      // centimetres above mean sea level
+  int32_t speed = 0;    // km/h * 100
+  int32_t course = 0;   // degrees * 100
+  int32_t hdop = 0;     // * 100
+  uint8_t sats_view = 0;
+  uint8_t sats_used = 0;
+
+  bool has(uint8_t what) const { return (have & what) == what; }
+
+  // Seconds since 1970 of the fix time (0 if no time is known)
+  uint32_t epoch() const
+  {
+    if (!has(GNSS_HAVE_TIME) || (year < 1970) || !month || !day) return 0;
+    // days from civil, see http://howardhinnant.github.io/date_algorithms.html
+    int y = year - ((month <= 2)?1:0);
+    int era = y / 400;
+    int yoe = y - era*400;
+    int doy = (153*(month + ((month > 2)?-3:9)) + 2)/5 + day-1;
+    int doe = yoe*365 + yoe/4 - yoe/100 + doy;
+    int32_t days = era*146097 + doe - 719468;
+    return (uint32_t)days*86400 + hour*3600 + minute*60 + second;
+  }
+
+  void setEpoch(uint32_t t)
+  {
+    // civil from days, the inverse of the above
+    int32_t z = t/86400 + 719468;
+    uint32_t secs = t%86400;
+    int era = z / 146097;
+    int doe = z - era*146097;
+    int yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+    int doy = doe - (365*yoe + yoe/4 - yoe/100);
+    int mp = (5*doy + 2)/153;
+    day = doy - (153*mp+2)/5 + 1;
+    month = (mp < 10)?mp+3:mp-9;
+    year = yoe + era*400 + ((month <= 2)?1:0);
+    hour = secs/3600;
+    minute = (secs/60)%60;
+    second = secs%60;
+    msec = 0;
+    have |= GNSS_HAVE_TIME;
+  }
+
+  // Approximate ground distance in metres (equirectangular, which is
+  // plenty for the few hundred metres that the filter cares about)
+  float distanceTo(const GnssFix &other) const
+  {
+    float mean_lat = ((float)lat + (float)other.lat) * (0.5e-7f * (float)M_PI / 180.0f);
+    float dx = (float)(other.lon - lon) * cosf(mean_lat);
+    float dy = (float)(other.lat - lat);
+    return sqrtf(dx*dx + dy*dy) * 0.011131949f; // metres per 1e-7 degree
+  }
+};
+
+//@******************************* class GnssParser *******************************
+//
+// Feed characters one at a time with put(), a complete line (either
+// "1,1,20240131102207.000,-27.565879,..." as returned by AT+CGNSINF, or
+// "$GNRMC,...*hh") is digested when its line terminator arrives, or on
+// an explicit call to end().
+//
+// NMEA sentences each carry part of a solution, so they update the
+// current fix in place, and only once their checksum has been verified.
+// A CGNSINF line replaces the fix entirely.
+//
+class GnssParser
+{
+public:
+  GnssFix fix;
+  unsigned long sentences = 0;
+  unsigned long checksum_errors = 0;
+
+  GnssParser() { reset(); }
+
+  void reset()
+  {
+    kind = KIND_NONE;
+    field = 0;
+    name_len = 0;
+    sum = 0;
+    sum_want = 0;
+    sum_digits = -1;
+    seen = 0;
+    startField();
+  }
+
+  // Returns true when a character completes a line that yielded a fix update
+  bool put(char c)
+  {
+    if ((c == '\r') || (c == '\n')) {
+      return (kind == KIND_NONE)?false:end();
+    }
+    if (kind == KIND_NONE) {
+      if (c == '$') {
+	kind = KIND_NMEA;
+	work = fix;
+	return false;
+      }
+      kind = KIND_CGNSINF;
+      work = GnssFix();
+      field = 1;
+      startField();
+    }
+
+    if (kind != KIND_CGNSINF) {
+      if (sum_digits >= 0) {
+	// checksum trailer
+	int v = hexValue(c);
+	if ((v >= 0) && (sum_digits < 2)) {
+	  sum_want = (sum_want<<4) | v;
+	  ++sum_digits;
+	}
+	return false;
+      }
+      if (c == '*') {
+	finishField();
+	sum_digits = 0;
+	return false;
+      }
+      sum ^= (uint8_t)c;
+    }
+
+    if (c == ',') {
+      finishField();
+      ++field;
+      startField();
+      return false;
+    }
+
+    if ((kind == KIND_NMEA) && (field == 0)) {
+      if (name_len < (int)sizeof(name)-1) name[name_len++] = c;
+      return false;
+    }
+
+    if ((c >= '0') && (c <= '9')) {
+      digits = true;
+      if (!dot) {
+	acc = acc*10 + (c-'0');
+      }
+      else if (frac < scale) {
+	acc = acc*10 + (c-'0');
+	++frac;
+      }
+    }
+    else if (c == '.') {
+      dot = true;
+    }
+    else if ((c == '-') && !digits) {
+      neg = true;
+    }
+    else if (c != ' ') {
+      letter = c;
+    }
+    return false;
+  }
+
+  int put(const char *s, int len)
+  {
+    int updates = 0;
+    for (int i=0; i<len; i++) {
+      if (put(s[i])) ++updates;
+    }
+    return updates;
+  }
+
+  // Conclude the current line; true if it updated the fix
+  bool end()
+  {
+    bool result = false;
+
+    if (kind == KIND_CGNSINF) {
+      finishField();
+      if (!work.fix && (work.lat == 0) && (work.lon == 0)) {
+	// a receiver without a fix reports 0.000000,0.000000
+	work.have &= ~GNSS_HAVE_POS;
+      }
+      fix = work;
+      ++sentences;
+      result = true;
+    }
+    else if ((kind == KIND_RMC) || (kind == KIND_GGA)) {
+      if (sum_digits < 0) finishField();
+      if ((sum_digits == 2) && (sum != sum_want)) {
+	++checksum_errors;
+      }
+      else {
+	fix = work;
+	++sentences;
+	result = true;
+      }
+    }
+    reset();
+    return result;
+  }
+
+protected:
+  enum gnss_kind { KIND_NONE, KIND_CGNSINF, KIND_NMEA, KIND_RMC, KIND_GGA, KIND_OTHER } kind;
+  GnssFix work;
+  int field;
+  char name[8];
+  int name_len;
+  uint8_t sum;
+  uint8_t sum_want;
+  int sum_digits;         // -1 until the '*' is seen
+  uint8_t seen;           // GNSS_HAVE_* set by this sentence
+
+  // the field being accumulated
+  int64_t acc;
+  int scale;              // decimal places kept
+  int frac;               // decimal places seen (up to scale)
+  bool neg;
+  bool dot;
+  bool digits;
+  char letter;
+
+  static int hexValue(char c)
+  {
+    if ((c >= '0') && (c <= '9')) return c-'0';
+    if ((c >= 'A') && (c <= 'F')) return c-'A'+10;
+    if ((c >= 'a') && (c <= 'f')) return c-'a'+10;
+    return -1;
+  }
+
+  // Decimal places wanted from each field of each kind of line
+  int scaleFor(int kind, int field)
+  {
+    switch (kind) {
+    case KIND_CGNSINF:
+      switch (field) {
+      case 3: return 3;               // yyyymmddhhmmss.sss
+      case 4: case 5: return 7;       // degrees
+      case 6: case 7: case 8: case 11: return 2;
+      }
+      break;
+    case KIND_RMC:
+      switch (field) {
+      case 1: return 3;               // hhmmss.sss
+      case 3: case 5: return 6;       // ddmm.mmmm
+      case 7: case 8: return 2;       // knots, degrees
+      }
+      break;
+    case KIND_GGA:
+      switch (field) {
+      case 2: case 4: return 6;
+      case 8: case 9: return 2;       // hdop, metres
+      }
+      break;
+    }
+    return 0;
+  }
+
+  void startField()
+  {
+    acc = 0;
+    frac = 0;
+    neg = dot = digits = false;
+    letter = '\0';
+    scale = scaleFor(kind, field);
+  }
+
+  int64_t value()
+  {
+    int64_t v = acc;
+    for (int i=frac; i<scale; i++) v *= 10;
+    return neg?-v:v;
+  }
+
+  // NMEA (d)ddmm.mmmmmm (scaled 1e6) to degrees*1e7
+  static int32_t fromDegMin(int64_t v)
+  {
+    int32_t deg = v / 100000000;
+    int32_t min_e6 = v % 100000000;
+    return deg*10000000 + min_e6/6;
+  }
+
+  void setTime(int64_t hms_ms)
+  {
+    work.msec = hms_ms%1000;
+    int32_t hms = hms_ms/1000;
+    work.second = hms%100;
+    work.minute = (hms/100)%100;
+    work.hour = (hms/10000)%100;
+  }
+
+  void finishField()
+  {
+    if (kind == KIND_NMEA) {
+      // the sentence name, eg GPRMC or GNGGA, talker is not important
+      name[name_len]='\0';
+      if ((name_len == 5) && (strcmp(name+2, "RMC")==0)) {
+	kind = KIND_RMC;
+      }
+      else if ((name_len == 5) && (strcmp(name+2, "GGA")==0)) {
+	kind = KIND_GGA;
+      }
+      else {
+	kind = KIND_OTHER;
+      }
+      return;
+    }
+    if (!digits && !letter) return;
+
+    int64_t v = value();
+    switch (kind) {
+    case KIND_CGNSINF:
+      switch (field) {
+      case 1:
+	work.run = (v != 0);
+	break;
+      case 2:
+	work.fix = (v != 0);
+	break;
+      case 3:
+	setTime(v%1000000000);
+	v /= 1000000000;      // yyyymmdd
+	work.day = v%100;
+	work.month = (v/100)%100;
+	work.year = v/10000;
+	work.have |= GNSS_HAVE_TIME;
+	break;
+      case 4:
+	work.lat = v;
+	break;
+      case 5:
+	work.lon = v;
+	work.have |= GNSS_HAVE_POS;
+	break;
+      case 6:
+	work.alt = v;
+	work.have |= GNSS_HAVE_ALT;
+	break;
+      case 7:
+	work.speed = v;
+	work.have |= GNSS_HAVE_SPEED;
+	break;
+      case 8:
+	work.course = v;
+	work.have |= GNSS_HAVE_COURSE;
+	break;
+      case 11:
+	work.hdop = v;
+	work.have |= GNSS_HAVE_HDOP;
+	break;
+      case 15:
+	work.sats_view = v;
+	break;
+      case 16:
+	work.sats_used = v;
+	work.have |= GNSS_HAVE_SATS;
+	break;
+      }
+      break;
+
+    case KIND_RMC:
+      // $GNRMC,hhmmss.sss,A,ddmm.mmmm,N,dddmm.mmmm,E,knots,course,ddmmyy,,,A*hh
+      switch (field) {
+      case 1:
+	setTime(v);
+	seen |= GNSS_HAVE_TIME;
+	break;
+      case 2:
+	work.run = true;
+	work.fix = (letter == 'A');
+	break;
+      case 3:
+	work.lat = fromDegMin(v);
+	seen |= GNSS_HAVE_POS;
+	break;
+      case 4:
+	if ((seen & GNSS_HAVE_POS) && (letter == 'S')) work.lat = -work.lat;
+	break;
+      case 5:
+	work.lon = fromDegMin(v);
+	if (seen & GNSS_HAVE_POS) work.have |= GNSS_HAVE_POS;
+	break;
+      case 6:
+	if ((seen & GNSS_HAVE_POS) && (letter == 'W')) work.lon = -work.lon;
+	break;
+      case 7:
+	work.speed = v*1852/1000;
+	work.have |= GNSS_HAVE_SPEED;
+	break;
+      case 8:
+	work.course = v;
+	work.have |= GNSS_HAVE_COURSE;
+	break;
+      case 9:
+	work.day = v/10000;
+	work.month = (v/100)%100;
+	work.year = 2000 + v%100;
+	if (seen & GNSS_HAVE_TIME) work.have |= GNSS_HAVE_TIME;
+	break;
+      }
+      break;
+
+    case KIND_GGA:
+      // $GNGGA,hhmmss.sss,ddmm.mmmm,N,dddmm.mmmm,E,quality,sats,hdop,alt,M,...*hh
+      // (the time is left to RMC, which also carries the date)
+      switch (field) {
+      case 2:
+	work.lat = fromDegMin(v);
+	seen |= GNSS_HAVE_POS;
+	break;
+      case 3:
+	if ((seen & GNSS_HAVE_POS) && (letter == 'S')) work.lat = -work.lat;
+	break;
+      case 4:
+	work.lon = fromDegMin(v);
+	if (seen & GNSS_HAVE_POS) work.have |= GNSS_HAVE_POS;
+	break;
+      case 5:
+	if ((seen & GNSS_HAVE_POS) && (letter == 'W')) work.lon = -work.lon;
+	break;
+      case 6:
+	work.run = true;
+	work.fix = (v != 0);
+	break;
+      case 7:
+	work.sats_used = v;
+	work.have |= GNSS_HAVE_SATS;
+	break;
+      case 8:
+	work.hdop = v;
+	work.have |= GNSS_HAVE_HDOP;
+	break;
+      case 9:
+	work.alt = v;
+	work.have |= GNSS_HAVE_ALT;
+	break;
+      }
+      break;
+
+    default:
+      break;
+    }
+  }
+};
+
+//@***************************** class GnssFixFilter ******************************
+//
+// Decide which fixes are worth keeping.  A fix is dropped if it has
+// no position or its HDOP is poor.  Otherwise it is kept if the
+// heartbeat interval has passed since the last kept fix, or if the
+// receiver has moved at least min_distance metres.  Position wander
+// of a stationary receiver can exceed min_distance, so unless the
+// reported speed is at least min_speed the move must be twice that.
+//
+class GnssFixFilter
+{
+public:
+  int max_hdop = 250;           // * 100, 0 disables the check
+  int min_distance = 25;        // metres
+  int min_speed = 300;          // km/h * 100
+  int heartbeat_sec = 900;
+
+  GnssFix last;
+  bool have_last = false;
+  unsigned long accepted = 0;
+  unsigned long rejected_nofix = 0;
+  unsigned long rejected_hdop = 0;
+  unsigned long rejected_still = 0;
+
+  bool accept(const GnssFix &f)
+  {
+    if (!f.fix || !f.has(GNSS_HAVE_POS)) {
+      ++rejected_nofix;
+      return false;
+    }
+    if (max_hdop && f.has(GNSS_HAVE_HDOP) && (f.hdop > max_hdop)) {
+      ++rejected_hdop;
+      return false;
+    }
+    if (have_last) {
+      uint32_t t = f.epoch();
+      uint32_t last_t = last.epoch();
+      bool due = !t || !last_t || (t < last_t) || (t - last_t >= (uint32_t)heartbeat_sec);
+      float moved = last.distanceTo(f);
+      bool moving = f.has(GNSS_HAVE_SPEED) && (f.speed >= min_speed);
+      if (!due && (moved < (moving?min_distance:2*min_distance))) {
+	++rejected_still;
+	return false;
+      }
+    }
+    last = f;
+    have_last = true;
+    ++accepted;
+    return true;
+  }
+};
+
+//@******************************* class GnssTrackLog ******************************
+//
+// An append-only file of track records.  Each record is a tag byte
+// followed by varints, a keyframe ('K') holds absolute values, a
+// delta ('D') holds the change from the record before it:
+//
+//    K  epoch  zz(lat) zz(lon) zz(alt) speed course hdop sats
+//    D  dt     zz(dlat) zz(dlon) zz(dalt) zz(dspeed) zz(dcourse) zz(dhdop) zz(dsats)
+//
+// (zz being zigzag encoding of signed values, units as in GnssFix).
+// A typical moving record is around a dozen bytes.
+//
+// Every file begins with a keyframe, as does the first record after a
+// restart and every keyframe_interval'th record, so a damaged or
+// truncated file costs only the records back to the last keyframe.
+// When the file reaches max_bytes it is moved aside to <path>.1
+// (replacing any older file of that name) and a new one is begun.
+//
+class GnssTrackLog
+{
+public:
+  fs::FS *fs = NULL;
+  const char *path = "/gps_track.bin";
+  int max_bytes = 4096;
+  int keyframe_interval = 64;
+  unsigned long records = 0;
+  unsigned long rotations = 0;
+
+  static const int RECORD_MAX = 1+9*5;
+
+  void restart() { since_key = -1; }
+
+  String rotatedPath() { return String(path)+".1"; }
+
+  static int putVarint(uint8_t *buf, uint32_t v)
+  {
+    int n = 0;
+    while (v >= 0x80) {
+      buf[n++] = (v & 0x7F) | 0x80;
+      v >>= 7;
+    }
+    buf[n++] = v;
+    return n;
+  }
+  static uint32_t zigzag(int32_t v) { return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31); }
+  static int32_t unzigzag(uint32_t v) { return (int32_t)(v >> 1) ^ -(int32_t)(v & 1); }
+
+  // Encode a record relative to the previous one, returns its length
+  int encode(const GnssFix &f, uint8_t *buf)
+  {
+    int n = 0;
+    if ((since_key < 0) || (since_key >= keyframe_interval)) {
+      buf[n++] = 'K';
+      n += putVarint(buf+n, f.epoch());
+      n += putVarint(buf+n, zigzag(f.lat));
+      n += putVarint(buf+n, zigzag(f.lon));
+      n += putVarint(buf+n, zigzag(f.alt));
+      n += putVarint(buf+n, f.speed);
+      n += putVarint(buf+n, f.course);
+      n += putVarint(buf+n, f.hdop);
+      n += putVarint(buf+n, f.sats_used);
+      since_key = 0;
+    }
+    else {
+      buf[n++] = 'D';
+      n += putVarint(buf+n, f.epoch() - prev.epoch());
+      n += putVarint(buf+n, zigzag(f.lat - prev.lat));
+      n += putVarint(buf+n, zigzag(f.lon - prev.lon));
+      n += putVarint(buf+n, zigzag(f.alt - prev.alt));
+      n += putVarint(buf+n, zigzag(f.speed - prev.speed));
+      n += putVarint(buf+n, zigzag(f.course - prev.course));
+      n += putVarint(buf+n, zigzag(f.hdop - prev.hdop));
+      n += putVarint(buf+n, zigzag((int)f.sats_used - (int)prev.sats_used));
+    }
+    ++since_key;
+    prev = f;
+    return n;
+  }
+
+  bool append(const GnssFix &f)
+  {
+    if (!fs) return false;
+    fs::File probe = fs->open(path, "r");
+    size_t size = probe?probe.size():0;
+    if (probe) probe.close();
+    if (size >= (size_t)max_bytes) {
+      String old = rotatedPath();
+      fs->remove(old);
+      fs->rename(path, old);
+      ++rotations;
+      restart();
+    }
+
+    uint8_t buf[RECORD_MAX];
+    int len = encode(f, buf);
+    fs::File file = fs->open(path, "a");
+    if (!file) {
+      restart();
+      return false;
+    }
+    bool ok = (file.write(buf, len) == (size_t)len);
+    file.close();
+    if (!ok) {
+      restart();
+      return false;
+    }
+    ++records;
+    return true;
+  }
+
+  // Decode the next record from a buffer, with state carried in *fix_r
+  // from one call to the next.  Returns bytes consumed (0 at end or on error).
+  static int decode(const uint8_t *buf, int len, GnssFix *fix_r)
+  {
+    if (len < 1) return 0;
+    uint32_t v[8];
+    int pos = 1;
+    for (int i=0; i<8; i++) {
+      uint32_t x = 0;
+      int shift = 0;
+      while (true) {
+	if ((pos >= len) || (shift > 28)) return 0;
+	uint8_t b = buf[pos++];
+	x |= (uint32_t)(b & 0x7F) << shift;
+	shift += 7;
+	if (!(b & 0x80)) break;
+      }
+      v[i] = x;
+    }
+
+    GnssFix &f = *fix_r;
+    if (buf[0] == 'K') {
+      f = GnssFix();
+      f.setEpoch(v[0]);
+      f.lat = unzigzag(v[1]);
+      f.lon = unzigzag(v[2]);
+      f.alt = unzigzag(v[3]);
+      f.speed = v[4];
+      f.course = v[5];
+      f.hdop = v[6];
+      f.sats_used = v[7];
+    }
+    else if ((buf[0] == 'D') && f.has(GNSS_HAVE_TIME)) {
+      f.setEpoch(f.epoch() + v[0]);
+      f.lat += unzigzag(v[1]);
+      f.lon += unzigzag(v[2]);
+      f.alt += unzigzag(v[3]);
+      f.speed += unzigzag(v[4]);
+      f.course += unzigzag(v[5]);
+      f.hdop += unzigzag(v[6]);
+      f.sats_used += unzigzag(v[7]);
+    }
+    else {
+      return 0;
+    }
+    f.run = f.fix = true;
+    f.have = GNSS_HAVE_TIME|GNSS_HAVE_POS|GNSS_HAVE_ALT|GNSS_HAVE_SPEED|
+      GNSS_HAVE_COURSE|GNSS_HAVE_HDOP|GNSS_HAVE_SATS;
+    return pos;
+  }
+
+protected:
+  GnssFix prev;
+  int since_key = -1;
+};
+
+#endif
+// local Variables:
+// mode: C++
+// c-basic-offset: 2
+// End:
@@ -3,29 +3,51 @@
 #include "Arduino.h"
 #include "Client.h"
 #include <memory>
-#include <cbuf.h>
+#include "ip_rx_arena.h"
+
+// receive buffer for a client that is not given a shared arena
+#ifndef IP_CLIENT_LTE_RX_BUFFER
+#define IP_CLIENT_LTE_RX_BUFFER 1536
+#endif
+
+// shared receive arena size (in IP_RX_ARENA_BLOCK blocks), and the most any one socket may hold
+#ifndef IP_CLIENT_LTE_RX_BLOCKS
+#define IP_CLIENT_LTE_RX_BLOCKS 8
+#endif
+#ifndef IP_CLIENT_LTE_RX_SLOT_BLOCKS
+#define IP_CLIENT_LTE_RX_SLOT_BLOCKS 4
+#endif
 
 class IpClientLTE : public Client, virtual public Debuggable
 {
 protected:
   AbstractIpModemLeaf *modem = NULL;
   bool _connected;
-  cbuf *rx_buffer = NULL;
+  IpRxQueue *rx_buffer = NULL;
+  IpRxArena *own_arena = NULL;
   int connect_timeout_ms = 10000;
   int slot;
   
 public:
-  IpClientLTE(AbstractIpModemLeaf *modem, int slot) 
+  IpClientLTE(AbstractIpModemLeaf *modem, int slot, IpRxArena *arena=NULL)
     : Debuggable(String("tcp_")+slot)
   {
     this->modem = modem;
     this->slot = slot;
     this->_connected = false;
-    this->rx_buffer = new cbuf(512);
+    if (arena) {
+      this->rx_buffer = new IpRxQueue(arena, IP_CLIENT_LTE_RX_SLOT_BLOCKS);
+    }
+    else {
+      int blocks = (IP_CLIENT_LTE_RX_BUFFER + IP_RX_ARENA_BLOCK - 1)/IP_RX_ARENA_BLOCK;
+      own_arena = new IpRxArena(IP_RX_ARENA_BLOCK, blocks);
+      this->rx_buffer = new IpRxQueue(own_arena, blocks);
+    }
   }
   ~IpClientLTE() 
   {
     delete this->rx_buffer;
+    if (own_arena) delete own_arena;
   }
 
   int getSlot() { return slot; }
@@ -36,9 +58,29 @@ public:
 
   virtual void dataIndication(int count=0) {}
 
+  // For modems that hold received data until asked (see AbstractIpLTELeaf::ipClientsReceive)
+  virtual bool receivePending() { return false; }
+  virtual int receiveBlock() { return 0; }
+
+  //
+  // Take size bytes that the modem is pushing at us.  They must all be
+  // read from the port whether or not there is room for them.
+  //
   int readToBuffer(size_t size) 
   {
-    return modem->modemReadToBuffer(rx_buffer, size, HERE);
+    int got = modem->modemReadToBuffer(rx_buffer, size, HERE);
+    size -= got;
+    if (size) {
+      ALERT("RX buffer full, dropping %d bytes", (int)size);
+      uint8_t junk[64];
+      while (size) {
+	int n = (size > sizeof(junk))?sizeof(junk):size;
+	n = modem->modemReadBulk(junk, n, -1, HERE);
+	if (n <= 0) break;
+	size -= n;
+      }
+    }
+    return got;
   }
 
   virtual int connect(IPAddress ip, uint16_t port)
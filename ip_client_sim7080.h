@@ -3,13 +3,17 @@
 #include "Arduino.h"
 #include "Client.h"
 #include <memory>
-#include <cbuf.h>
+
+// the sim7080 chokes on a CASEND or CARECV of more than this
+#ifndef IP_CLIENT_SIM7080_BLOCK_MAX
+#define IP_CLIENT_SIM7080_BLOCK_MAX 1460
+#endif
 
 class IpClientSim7080 : public IpClientLTE, virtual public Debuggable
 {
 public:
-  IpClientSim7080(AbstractIpModemLeaf *modem, int slot)
-    : IpClientLTE(modem, slot)
+  IpClientSim7080(AbstractIpModemLeaf *modem, int slot, IpRxArena *arena=NULL)
+    : IpClientLTE(modem, slot, arena)
     , Debuggable(String("tcp_")+slot)
   {
   }
@@ -73,27 +77,71 @@ public:
   virtual size_t write(const uint8_t *buf, size_t size)
   {
     char cmd[40];
+    size_t sent = 0;
     modem->ipCommsState(TRANSACTION, HERE);
-    snprintf(cmd, sizeof(cmd), "AT+CASEND=%d,%d", slot, size);
-    LEAF_NOTICE("write: %s", cmd);
-    if (!modem->modemSendExpectPrompt(cmd, 2000, HERE)) {
-      LEAF_ALERT("AT+CASEND failed");
-      modem->ipCommsState(REVERT,HERE);
-      disconnectIndication();
-      return 0;
-    }
-    DumpHex(L_NOTICE, "write", buf, size);
-    size_t result = modem->modemSendRaw(buf, size, HERE);
+    while (sent < size) {
+      size_t block = size - sent;
+      if (block > IP_CLIENT_SIM7080_BLOCK_MAX) block = IP_CLIENT_SIM7080_BLOCK_MAX;
+      snprintf(cmd, sizeof(cmd), "AT+CASEND=%d,%d", slot, (int)block);
+      LEAF_NOTICE("write: %s", cmd);
+      if (!modem->modemSendExpectPrompt(cmd, 2000, HERE)) {
+	LEAF_ALERT("AT+CASEND failed");
+	modem->ipCommsState(REVERT,HERE);
+	disconnectIndication();
+	return sent;
+      }
+      DumpHex(L_NOTICE, "write", buf+sent, block);
+      size_t result = modem->modemSendRaw(buf+sent, block, HERE);
 
-    cmd[0]='\0';
-    if (!modem->modemSendExpect("", "OK", cmd, sizeof(cmd), -1, 1, HERE, false)) {
-      LEAF_WARN("Did not get OK after +CASEND (got [%s])", cmd);
+      cmd[0]='\0';
+      if (!modem->modemSendExpect("", "OK", cmd, sizeof(cmd), -1, 1, HERE, false)) {
+	LEAF_WARN("Did not get OK after +CASEND (got [%s])", cmd);
+      }
+      sent += result;
+      if (result < block) break;
     }
     LEAF_NOTICE("write complete");
     modem->ipCommsState(REVERT,HERE);
-    return result;
+    return sent;
   }
-  
+
+  //
+  // Never talks to the modem (nor waits for the port).  Data still held
+  // at the modem counts as one byte, which read() will fetch.
+  //
+  virtual int available()
+  {
+    int n = rx_buffer->available();
+    if ((n == 0) && rx_pending) n = 1;
+    return n;
+  }
+
+  virtual int read()
+  {
+    if (rx_buffer->empty() && rx_pending) fill();
+    return rx_buffer->read();
+  }
+
+  virtual int read(uint8_t *buf, size_t size)
+  {
+    int got = rx_buffer->read((char *)buf, size);
+    if ((got == 0) && size && rx_pending) {
+      // nothing buffered, but the modem has more: take it straight into
+      // the caller's buffer rather than by way of rx_buffer
+      bool release = !modem->modemPortIsMine();
+      if (release && !modem->modemWaitPortMutex(HERE, false, 0, MODEM_PORT_PRIO_DATA)) {
+	return 0;
+      }
+      while (rx_pending && ((size_t)got < size)) {
+	int n = receive(buf+got, size-got);
+	if (n <= 0) break;
+	got += n;
+      }
+      if (release) modem->modemReleasePortMutex(HERE);
+    }
+    return got;
+  }
+
   virtual void stop()
   {
     if (!modem->modemSendCmd(HERE, "AT+CACLOSE=%d", slot)) {
@@ -110,35 +158,82 @@ public:
 
   virtual void dataIndication(int count) 
   {
-    // this is called from URC handler which will be holding the port mutex
-    
+    // The data stays at the modem until fetched by receiveBlock, which
+    // the leaf does for all sockets in turn (see ipClientsReceive)
     LEAF_ENTER_INT(L_NOTICE, count);
-    char cmd[40];
-    int room = rx_buffer->room();
-    if (room == 0) {
-      LEAF_WARN("RX buffer full");
-      LEAF_VOID_RETURN;
+    rx_pending = true;
+    LEAF_VOID_RETURN;
+  }
+
+  virtual bool receivePending()
+  {
+    return rx_pending && (rx_buffer->room() > 0);
+  }
+
+  // Fetch one CARECV's worth into rx_buffer (caller holds the port mutex)
+  virtual int receiveBlock()
+  {
+    uint8_t *p;
+    int n = rx_buffer->reserve(&p);
+    if (n == 0) {
+      LEAF_NOTICE("RX buffer full, remainder left at modem");
+      return 0;
     }
+    int got = receive(p, n);
+    rx_buffer->commit(got);
+    return got;
+  }
 
-    // sim7080 chokes if buffer is over 1460
-    if (room > 1460) room=1460;
+protected:
+  bool rx_pending = false;  // the modem may hold received data that we have not fetched
+
+  //
+  // Fetch up to size bytes of received data from the modem straight into
+  // buf (caller holds the port mutex).
+  // Clears rx_pending once the modem has nothing more.
+  //
+  int receive(uint8_t *buf, size_t size)
+  {
+    char cmd[40];
+    if (size > IP_CLIENT_SIM7080_BLOCK_MAX) size = IP_CLIENT_SIM7080_BLOCK_MAX;
 
     modem->ipCommsState(TRANSACTION, HERE);
-    snprintf(cmd, sizeof(cmd), "AT+CARECV=%d,%d", slot, room);
-    // Response will be +CARECV: <len>,<data>
+    snprintf(cmd, sizeof(cmd), "AT+CARECV=%d,%d", slot, (int)size);
+    // Response will be +CARECV: <len>,<data> (or +CARECV: 0)
     int len = 0;
-    
+    int got = -1;
     if (modem->modemSendExpectInlineInt(cmd, "+CARECV: ", &len, ',', -1, HERE)) {
-      LEAF_NOTICE("length = %d", len);
-      int got = modem->modemReadToBuffer(rx_buffer, len, HERE);
+      LEAF_INFO("length = %d", len);
+      if (len <= 0) {
+	got = 0;
+      }
+      else {
+	got = modem->modemReadBulk(buf, len, -1, HERE);
+      }
       if (got != len) {
 	LEAF_WARN("CARECV short read");
       }
+      // absorb the trailing result code before any further command
+      char ok[16];
+      modem->modemSendExpect(NULL, "OK", ok, sizeof(ok), -1, 1, HERE, false);
+      if (len < (int)size) rx_pending = false;
     }
     else {
       LEAF_WARN("CARECV error");
+      rx_pending = false;
     }
     modem->ipCommsState(REVERT, HERE);
+    return got;
+  }
+
+  void fill()
+  {
+    bool release = !modem->modemPortIsMine();
+    if (release && !modem->modemWaitPortMutex(HERE, false, 0, MODEM_PORT_PRIO_DATA)) {
+      return;
+    }
+    while (receivePending() && (receiveBlock() > 0)) {}
+    if (release) modem->modemReleasePortMutex(HERE);
   }
 
 };
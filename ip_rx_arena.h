@@ -0,0 +1,260 @@
+#pragma once
+
+//
+// Receive buffering for modem sockets, drawn from one pool of fixed size
+// blocks shared by all sockets rather than a worst-case cbuf for each.
+//
+// The modem service task fills a socket's queue and the socket's user
+// drains it, so block chains and the free list are guarded by a
+// spinlock.  The producer reserves space in the tail block, reads from
+// the modem straight into it outside the lock, then commits what it got.
+//
+
+#ifndef IP_RX_ARENA_BLOCK
+#define IP_RX_ARENA_BLOCK 512
+#endif
+
+#ifdef ESP32
+#define IP_RX_LOCK(a) portENTER_CRITICAL(&(a)->lock)
+#define IP_RX_UNLOCK(a) portEXIT_CRITICAL(&(a)->lock)
+#else
+#define IP_RX_LOCK(a)
+#define IP_RX_UNLOCK(a)
+#endif
+
+//@******************************* class IpRxArena ******************************
+
+class IpRxArena
+{
+public:
+  const int block_size;
+  const int block_count;
+#ifdef ESP32
+  portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+#endif
+
+protected:
+  uint8_t *pool;
+  int16_t *link;        // next block in a chain or in the free list (-1=end)
+  int free_head = 0;
+  int free_count;
+  int low_water;
+  unsigned long exhausted_count = 0;
+
+public:
+  IpRxArena(int block_size, int block_count)
+    : block_size(block_size)
+    , block_count(block_count)
+  {
+    pool = new uint8_t[block_size*block_count];
+    link = new int16_t[block_count];
+    for (int i=0; i<block_count; i++) {
+      link[i] = (i+1 < block_count)?(i+1):-1;
+    }
+    free_count = low_water = block_count;
+  }
+  ~IpRxArena()
+  {
+    delete[] pool;
+    delete[] link;
+  }
+
+  int blocksFree() { return free_count; }
+  int lowWater() { return low_water; }
+  unsigned long exhaustedCount() { return exhausted_count; }
+
+  // The methods below are for IpRxQueue, which holds the lock
+
+  uint8_t *data(int b) { return pool + b*block_size; }
+  int next(int b) { return link[b]; }
+  void setNext(int b, int n) { link[b] = n; }
+
+  int alloc()
+  {
+    if (free_head < 0) {
+      ++exhausted_count;
+      return -1;
+    }
+    int b = free_head;
+    free_head = link[b];
+    link[b] = -1;
+    if (--free_count < low_water) low_water = free_count;
+    return b;
+  }
+
+  void release(int b)
+  {
+    link[b] = free_head;
+    free_head = b;
+    ++free_count;
+  }
+};
+
+//@******************************* class IpRxQueue ******************************
+//
+// One socket's received data, as a chain of arena blocks.  Offers the
+// parts of the cbuf interface that the socket clients use.
+//
+// A socket may hold at most max_blocks, so that one busy connection
+// cannot take the whole arena from the others.
+//
+class IpRxQueue
+{
+protected:
+  IpRxArena *arena;
+  int max_blocks;
+  int head = -1;        // block being read
+  int tail = -1;        // block being written
+  int head_pos = 0;
+  int tail_pos = 0;
+  int blocks = 0;
+  volatile int count = 0;
+  bool reserved = false;
+
+  // Give back the head block once read out (lock held)
+  void retire()
+  {
+    if (head < 0) return;
+    if (head_pos >= arena->block_size) {
+      int nb = (head == tail)?-1:arena->next(head);
+      arena->release(head);
+      --blocks;
+      if (nb < 0) {
+	head = tail = -1;
+	head_pos = tail_pos = 0;
+      }
+      else {
+	head = nb;
+	head_pos = 0;
+      }
+    }
+    else if ((count == 0) && !reserved) {
+      // drained, don't sit on a partly used block
+      arena->release(head);
+      head = tail = -1;
+      head_pos = tail_pos = 0;
+      blocks = 0;
+    }
+  }
+
+public:
+  IpRxQueue(IpRxArena *arena, int max_blocks)
+  {
+    this->arena = arena;
+    this->max_blocks = max_blocks;
+  }
+  ~IpRxQueue() { flush(); }
+
+  int available() { return count; }
+  bool empty() { return count == 0; }
+
+  // Bytes that could be taken in now
+  int room()
+  {
+    IP_RX_LOCK(arena);
+    int r = (tail >= 0)?(arena->block_size - tail_pos):0;
+    int more = max_blocks - blocks;
+    if (more > arena->blocksFree()) more = arena->blocksFree();
+    if (more > 0) r += more * arena->block_size;
+    IP_RX_UNLOCK(arena);
+    return r;
+  }
+
+  //
+  // Find contiguous space to write into, taking a fresh block if the
+  // tail is full.  Returns the size of the space (0 if none), which
+  // must be followed by commit().
+  //
+  int reserve(uint8_t **ptr_r)
+  {
+    IP_RX_LOCK(arena);
+    if ((tail < 0) || (tail_pos >= arena->block_size)) {
+      int b = (blocks < max_blocks)?arena->alloc():-1;
+      if (b < 0) {
+	IP_RX_UNLOCK(arena);
+	return 0;
+      }
+      if (tail >= 0) {
+	arena->setNext(tail, b);
+      }
+      else {
+	head = b;
+	head_pos = 0;
+      }
+      tail = b;
+      tail_pos = 0;
+      ++blocks;
+    }
+    reserved = true;
+    *ptr_r = arena->data(tail) + tail_pos;
+    int n = arena->block_size - tail_pos;
+    IP_RX_UNLOCK(arena);
+    return n;
+  }
+
+  void commit(int n)
+  {
+    IP_RX_LOCK(arena);
+    if (n > 0) {
+      tail_pos += n;
+      count += n;
+    }
+    reserved = false;
+    retire();
+    IP_RX_UNLOCK(arena);
+  }
+
+  int read(char *dst, int size)
+  {
+    int got = 0;
+    IP_RX_LOCK(arena);
+    while ((got < size) && (count > 0)) {
+      int limit = (head == tail)?tail_pos:arena->block_size;
+      int n = limit - head_pos;
+      if (n > size-got) n = size-got;
+      memcpy(dst+got, arena->data(head)+head_pos, n);
+      head_pos += n;
+      got += n;
+      count -= n;
+      retire();
+    }
+    IP_RX_UNLOCK(arena);
+    return got;
+  }
+
+  int read()
+  {
+    char c;
+    return (read(&c, 1) == 1)?(uint8_t)c:-1;
+  }
+
+  int peek()
+  {
+    int c = -1;
+    IP_RX_LOCK(arena);
+    if (count > 0) c = arena->data(head)[head_pos];
+    IP_RX_UNLOCK(arena);
+    return c;
+  }
+
+  void flush()
+  {
+    IP_RX_LOCK(arena);
+    while (head >= 0) {
+      int nb = (head == tail)?-1:arena->next(head);
+      arena->release(head);
+      head = nb;
+    }
+    tail = -1;
+    head_pos = tail_pos = 0;
+    blocks = 0;
+    count = 0;
+    reserved = false;
+    IP_RX_UNLOCK(arena);
+  }
+};
+
+// Local Variables:
+// mode: C++
+// c-basic-offset: 2
+// End:
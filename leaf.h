@@ -1,5 +1,7 @@
 #pragma once
 
+#include <atomic>
+
 #ifdef ESP32
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
@@ -315,6 +317,143 @@ struct LeafQueueMessage
 };
 #endif
 
+//
+//@***************************** Publish rate limits **************************
+//
+// Publishes are classified by urgency so that a flood of readings cannot
+// crowd out alarms or command responses.
+//
+enum pubsub_topic_class {
+  PUBSUB_CLASS_ALERT,     // alert/ and change/ topics, and replies to commands
+  PUBSUB_CLASS_EVENT,     // event/ topics
+  PUBSUB_CLASS_STATUS,    // status of the comms and storage layers
+  PUBSUB_CLASS_TELEMETRY, // everything else, mostly sensor readings
+  PUBSUB_CLASS_MAX
+};
+
+const char *pubsub_topic_class_names[] = {
+  "alert",
+  "event",
+  "status",
+  "telemetry"
+};
+
+#ifndef LEAF_PUBLISH_RATE
+#define LEAF_PUBLISH_RATE 0
+#endif
+#ifndef LEAF_PUBLISH_BURST
+#define LEAF_PUBLISH_BURST 10
+#endif
+
+//
+// A token bucket holding up to burst tokens, refilled at rate tokens per
+// minute (a rate of zero means unlimited).  Each message takes one token.
+//
+struct LeafTokenBucket
+{
+  int rate;
+  int burst;
+  float tokens;
+  unsigned long last_ms;
+  unsigned long drop_count;
+};
+
+bool leafTokenTake(struct LeafTokenBucket *b)
+{
+  if (b->rate <= 0) return true;
+
+  unsigned long now = millis();
+  float burst = (b->burst > 0)?b->burst:1;
+  if (b->last_ms == 0) {
+    b->tokens = burst;
+  }
+  else {
+    b->tokens += (now - b->last_ms) * b->rate / 60000.0;
+    if (b->tokens > burst) b->tokens = burst;
+  }
+  b->last_ms = now;
+
+  if (b->tokens >= 1) {
+    b->tokens -= 1;
+    return true;
+  }
+  ++b->drop_count;
+  return false;
+}
+
+//
+// A batch of publishes collected between mqtt_publish_begin() and
+// mqtt_publish_commit(), so that the transport can send them in one
+// locked operation (or as one JSON document).
+//
+// Records are held in one buffer, each as a header of QoS and retain
+// digits followed by the topic and payload lengths in decimal, then the
+// topic and payload themselves:
+//
+//     <qos><retain><topic-len>:<payload-len>:<topic><payload>
+//
+// Being length-prefixed, a payload may contain any character.  Topics
+// are complete.
+//
+#ifndef LEAF_TOPIC_BUF_SIZE
+#define LEAF_TOPIC_BUF_SIZE 128
+#endif
+
+struct PubsubBatch
+{
+  int depth;   // nested begin calls
+  int count;
+  int qos;     // defaults for mqtt_publish_add
+  bool retain;
+  int qos_max; // highest QoS of any member
+  bool retain_all; // every member is retained
+  int topic_class;
+  String prefix; // base topic of the publishing leaf
+  String buf;
+};
+
+void pubsubBatchAdd(struct PubsubBatch *batch, const char *topic, String &payload, int topic_class, int qos=0, bool retain=false)
+{
+  char hdr[24];
+  int topic_len = strlen(topic);
+  snprintf(hdr, sizeof(hdr), "%d%d%d:%d:", qos, retain?1:0, topic_len, (int)payload.length());
+  batch->buf += hdr;
+  batch->buf += topic;
+  batch->buf += payload;
+  // the batch as a whole travels at the most urgent class of its members
+  if (topic_class < batch->topic_class) batch->topic_class = topic_class;
+  if (batch->count == 0) {
+    batch->qos_max = qos;
+    batch->retain_all = retain;
+  }
+  else {
+    if (qos > batch->qos_max) batch->qos_max = qos;
+    if (!retain) batch->retain_all = false;
+  }
+  ++batch->count;
+}
+
+// Iterate over the records in a batch, starting with *pos = 0
+bool pubsubBatchNext(struct PubsubBatch *batch, int *pos, String &topic, String &payload, int *qos_r=NULL, bool *retain_r=NULL)
+{
+  int len = batch->buf.length();
+  if (*pos + 6 > len) return false;
+  const char *rec = batch->buf.c_str() + *pos;
+  char *end;
+  int topic_len = strtol(rec+2, &end, 10);
+  if (*end != ':') return false;
+  int payload_len = strtol(end+1, &end, 10);
+  if (*end != ':') return false;
+  int start = (end+1) - batch->buf.c_str();
+  if (start + topic_len + payload_len > len) return false;
+  if (qos_r) *qos_r = rec[0]-'0';
+  if (retain_r) *retain_r = (rec[1]=='1');
+  topic = batch->buf.substring(start, start+topic_len);
+  payload = batch->buf.substring(start+topic_len, start+topic_len+payload_len);
+  *pos = start+topic_len+payload_len;
+  return true;
+}
+
 //
 //@******************************* class Leaf *********************************
 //
@@ -337,6 +476,7 @@ protected:
   AbstractIpLeaf *ipServiceLeaf = NULL;
   AbstractPubsubLeaf *pubsubServiceLeaf = NULL;
   unsigned long last_heartbeat= 0;
+  unsigned long report_window_start = 0; // held-back status reports go in the window after our heartbeat
   String tap_targets;
 #if USE_PREFS
   StorageLeaf *prefsLeaf = NULL;
@@ -364,6 +504,13 @@ public:
   virtual void setup();
   virtual void loop();
   virtual void heartbeat(unsigned long uptime);
+  // Beat now and restart the interval from here (eg. to line up with a radio upload window)
+  void heartbeatSync(unsigned long now) {
+    if (!do_heartbeat) return;
+    last_heartbeat = now;
+    heartbeat(now/1000);
+    report_window_start = now;
+  }
   virtual void mqtt_connect();
   virtual void mqtt_do_subscribe(){};
   virtual void start();
@@ -372,6 +519,8 @@ public:
   virtual void post_sleep() {};
   virtual void pre_reboot(String reason="") {};
   virtual String makeBaseTopic();
+  bool topicBufPrepare();
+  size_t buildTopic(char *buf, size_t size, const String &topic);
 
   virtual void mqtt_disconnect() {};
   virtual bool hasHelp()
@@ -386,7 +535,17 @@ public:
   virtual bool wants_topic(String type, String name, String topic);
   virtual bool wants_raw_topic(String topic) { return false ; }
   virtual bool mqtt_receive(String type, String name, String topic, String payload, bool direct=false);
+  // As mqtt_receive, with the payload as a view of the received message
+  // (valid for the duration of the call).  Leaves that can work from the
+  // view override this to save copying the payload.
+  virtual bool mqtt_receive_view(String type, String name, String topic, const char *payload, size_t payload_len, bool direct=false) {
+    return mqtt_receive(type, name, topic, String(payload, payload_len), direct);
+  }
   virtual bool mqtt_receive_raw(String topic, String payload) {return false;};
+  virtual bool wants_topic_chunks(String topic) { return false; }
+  virtual bool mqtt_receive_chunk(String topic, const char *chunk, size_t len, size_t index, size_t total) {return false;};
+  // A streamed message was cut short after received bytes (fragments were lost), discard it
+  virtual void mqtt_receive_chunk_abort(String topic, size_t received, size_t total) {};
   virtual void status_pub() {};
   virtual void config_pub() {};
   virtual void stats_pub() {};
@@ -400,6 +559,12 @@ public:
   void publish(String topic, float payload, int decimals=1, int level=L_DEBUG, codepoint_t where=undisclosed_location);
   void publish(String topic, bool flag, int level=L_DEBUG, codepoint_t where=undisclosed_location);
   void mqtt_publish(String topic, String payload, int qos = 0, bool retain = false, int level=L_DEBUG, codepoint_t where=undisclosed_location);
+  void mqtt_publish_begin(int qos = 0, bool retain = false);
+  void mqtt_publish_add(String topic, String payload) { mqtt_publish(topic, payload, publish_batch?publish_batch->qos:0, publish_batch?publish_batch->retain:false); }
+  int mqtt_publish_commit();
+  int reportPolicy(int topic_class=PUBSUB_CLASS_TELEMETRY, bool retry=false);
+  unsigned long *reportWindow() { return &report_window_start; }
+  unsigned long reportInterval(unsigned long interval);
   void fslog(codepoint_t where, const char *filename, const char *fmt, ...);
 
   void registerCommand(codepoint_t where, String cmd, String description="");
@@ -627,6 +792,12 @@ protected:
   unsigned long heartbeat_interval_seconds = ::heartbeat_interval_seconds;
   bool do_presence = false;
   bool do_status = true;
+  struct PubsubBatch *publish_batch = NULL;
+  char *topic_buf = NULL;  // base_topic followed by space for the per-publish suffix
+  int topic_buf_size = LEAF_TOPIC_BUF_SIZE;
+  int topic_prefix_len = -1;
+  std::atomic<bool> topic_buf_busy{false}; // claimed by one publish at a time (any task)
+  struct LeafTokenBucket leaf_publish_limit = {LEAF_PUBLISH_RATE, LEAF_PUBLISH_BURST, 0, 0, 0};
 
 private:
   SimpleMap<String,Tap*> *taps = NULL;
@@ -846,11 +1017,93 @@ String Leaf::makeBaseTopic()
       //LEAF_INFO("Change of base_topic for %s: [%s] => [%s]", getNameStr(), base_topic.c_str(), new_base_topic.c_str());
     }
     base_topic = new_base_topic;
+    topic_prefix_len = -1;
   }
 
   LEAF_STR_RETURN(base_topic);
 }
 
+// Make sure the topic buffer holds the current base topic
+bool Leaf::topicBufPrepare()
+{
+  if (topic_prefix_len == (int)base_topic.length()) return true;
+  if ((int)base_topic.length() >= topic_buf_size) {
+    return false;
+  }
+  if (!topic_buf) {
+    topic_buf = (char *)malloc(topic_buf_size);
+    if (!topic_buf) return false;
+  }
+  memcpy(topic_buf, base_topic.c_str(), base_topic.length()+1);
+  topic_prefix_len = base_topic.length();
+  return true;
+}
+
+//
+// Write the full topic for a leaf-relative topic into buf, and return
+// its length (if that is not less than size, nothing was written, as
+// with snprintf).  When buf is the leaf topic buffer the base topic is
+// already in place and only the suffix is written.
+//
+// Flat-topic mode turns status/foo into status-foo; priority mode adds a
+// leading priority (or admin/ or alert/) level.
+//
+size_t Leaf::buildTopic(char *buf, size_t size, const String &topic)
+{
+  size_t prefix_len = base_topic.length();
+  size_t suffix_len = topic.length();
+
+  if ((suffix_len == 0) && !use_flat_topic) {
+    // the base topic itself, without its trailing slash
+    size_t len = prefix_len?prefix_len-1:0;
+    if (len < size) {
+      memcpy(buf, base_topic.c_str(), len);
+      buf[len] = '\0';
+    }
+    return len;
+  }
+
+  const char *lead = NULL;
+  if (hasPriority() && suffix_len && !use_flat_topic) {
+    if (topic.startsWith("status/")) {
+      lead = (leaf_priority=="normal")?"admin":leaf_priority.c_str();
+    }
+    else if (topic.startsWith("change/")) {
+      lead = "alert";
+    }
+    else {
+      lead = leaf_priority.c_str();
+    }
+  }
+  size_t lead_len = lead?strlen(lead)+1:0;
+  size_t len = prefix_len + lead_len + suffix_len;
+  if (len >= size) return len;
+
+  if (buf != topic_buf) {
+    memcpy(buf, base_topic.c_str(), prefix_len);
+  }
+  char *p = buf + prefix_len;
+  if (lead) {
+    memcpy(p, lead, lead_len-1);
+    p += lead_len-1;
+    *p++ = '/';
+  }
+  const char *s = topic.c_str();
+  if (use_flat_topic) {
+    // for servers like sensabhub, change topic from status/foo to
+    // status-foo
+    for (size_t i=0; i<suffix_len; i++) {
+      *p++ = (s[i]=='/')?'-':s[i];
+    }
+  }
+  else {
+    memcpy(p, s, suffix_len);
+    p += suffix_len;
+  }
+  *p = '\0';
+  return len;
+}
+
 void Leaf::setup(void)
 {
   ACTION("SETUP %s", leaf_name.c_str());
@@ -924,6 +1177,8 @@ void Leaf::setup(void)
   registerLeafValue(HERE, "do_status", VALUE_KIND_BOOL, &do_status);
   registerLeafValue(HERE, "mute", VALUE_KIND_BOOL, &leaf_mute);
   registerLeafValue(HERE, "debug_level", VALUE_KIND_INT, &class_debug_level);
+  registerLeafValue(HERE, "publish_rate", VALUE_KIND_INT, &leaf_publish_limit.rate, "Maximum publishes per minute from this leaf, excluding alerts (0=unlimited)");
+  registerLeafValue(HERE, "publish_burst", VALUE_KIND_INT, &leaf_publish_limit.burst, "Number of publishes permitted in a burst above publish_rate");
   registerCommand(HERE, "status");
 
   setup_done = true;
@@ -1307,10 +1562,12 @@ void Leaf::loop()
     Leaf::wdtReset(HERE);
   }
 
-  if (do_heartbeat && (now > (last_heartbeat + heartbeat_interval_seconds*1000))) {
+  if (do_heartbeat && (now > (last_heartbeat + reportInterval(heartbeat_interval_seconds)*1000))) {
     last_heartbeat = now;
     //LEAF_DEBUG("time to publish heartbeat");
     this->heartbeat(now/1000);
+    // held-back status reports follow the heartbeat
+    report_window_start = now;
   }
   LEAF_LEAVE;
 }
@@ -1846,10 +2103,10 @@ void Leaf::mqtt_subscribe(String topic, int qos, int level, codepoint_t where)
       // status-foo
       String flat_topic = topic;
       flat_topic.replace("/","-");
-      pubsubLeaf->_mqtt_subscribe(base_topic + flat_topic, qos, CODEPOINT(where));
+      pubsubLeaf->pubsubSubscribe(base_topic + flat_topic, qos, CODEPOINT(where));
   }
   else {
-    pubsubLeaf->_mqtt_subscribe(base_topic + topic, qos, CODEPOINT(where));
+    pubsubLeaf->pubsubSubscribe(base_topic + topic, qos, CODEPOINT(where));
   }
 }
 
@@ -1873,6 +2130,8 @@ void Leaf::mqtt_publish(String topic, String payload, int qos, bool retain, int
 
   // Publish to the MQTT server (unless this leaf is "muted", i.e. performs local publish only)
   if (pubsubLeaf) {
+    int topic_class = pubsubLeaf->pubsubTopicClass(this, topic);
+
     if (::pubsub_loopback) {
       // don't actually publish, capture output in a buffer
       pubsubLeaf->sendLoopback(topic, payload);
@@ -1886,46 +2145,65 @@ void Leaf::mqtt_publish(String topic, String payload, int qos, bool retain, int
     else if (topic.startsWith("event/") && !use_event) {
       LEAF_NOTICE("Event publish disabled for %s", topic.c_str());
     }
+    else if (!pubsubLeaf->pubsubRateCheck(&leaf_publish_limit, topic_class)) {
+      LEAF_INFO("Rate limit (%s), drop publish %s", pubsub_topic_class_names[topic_class], topic.c_str());
+    }
     else {
-      if (use_flat_topic) {
-	// for servers like sensabhub, change topic from status/foo to
-	// status-foo
-	String flat_topic = topic;
-	flat_topic.replace("/","-");
-	__LEAF_DEBUG_AT__((where.file?where:HERE), level, "PUB [%s] <= [%s]", topic.c_str(), payload.c_str());
-	pubsubLeaf->_mqtt_publish(base_topic + flat_topic, payload, qos, retain);
-      }
-      else {
-	if (hasPriority() && topic.length()) {
-	  if (topic.startsWith("status/")) {
-	    if (getPriority()=="normal") {
-	      topic = "admin/" + topic;
-	    }
-	    else {
-	      topic = getPriority() + "/" + topic;
-	    }
-	  }
-	  else if (topic.startsWith("change/")) {
-	    topic = "alert/" + topic;
-	    LEAF_WARN("ALERT PUB [%s] <= [%s]", topic.c_str(), payload.c_str());
-	  }
-	  else {
-	    topic = leaf_priority + "/" + topic;
-	  }
+      // Assemble the full topic in the preallocated per-leaf buffer, which
+      // already holds the base topic.  A heap buffer is used only if the
+      // topic does not fit, or the leaf buffer is in use by a nested
+      // publish.
+      size_t full_len = 0;
+      char *full_topic = NULL;
+      char *heap_topic = NULL;
+      bool buf_claimed = false;
+      if (topic.length() && !topic_buf_busy.exchange(true)) {
+	buf_claimed = true;
+	if (topicBufPrepare()) {
+	  full_len = buildTopic(topic_buf, topic_buf_size, topic);
+	  if (full_len < (size_t)topic_buf_size) full_topic = topic_buf;
 	}
-	String full_topic;
-	if (topic.length()) {
-	  full_topic = base_topic + topic;
+	if (!full_topic) {
+	  topic_buf_busy = false;
+	  buf_claimed = false;
 	}
-	else {
-	  full_topic = base_topic.substring(0,base_topic.length()-1);
+      }
+      if (!full_topic) {
+	full_len = buildTopic(NULL, 0, topic);
+	full_topic = heap_topic = (char *)malloc(full_len+1);
+	if (!heap_topic) {
+	  LEAF_ALERT("Topic allocation failed");
+	  LEAF_VOID_RETURN;
+	}
+	buildTopic(heap_topic, full_len+1, topic);
+      }
+
+      if (hasPriority() && !use_flat_topic && topic.startsWith("change/")) {
+	LEAF_WARN("ALERT PUB [%s] <= [%s]", full_topic, payload.c_str());
+      }
+      __LEAF_DEBUG_AT__((where.file?where:HERE), level, "PUB [%s] <= [%s]", full_topic, payload.c_str());
+      if (publish_batch) {
+	pubsubBatchAdd(publish_batch, full_topic, payload, topic_class, qos, retain);
+      }
+      else {
+	pubsubLeaf->pubsubPublish(full_topic, full_len, payload, qos, retain, topic_class);
+      }
+      if ((::pubsub_service && pubsubServiceLeaf && !use_flat_topic) || pubsub_fanout_count) {
+	String full_topic_str(full_topic);
+	if (::pubsub_service && pubsubServiceLeaf && !use_flat_topic) {
+	  pubsubServiceLeaf->pubsubPublish(full_topic_str, payload, qos, retain, topic_class);
 	}
-	__LEAF_DEBUG_AT__((where.file?where:HERE), level, "PUB [%s] <= [%s]", full_topic.c_str(), payload.c_str());
-	pubsubLeaf->_mqtt_publish(full_topic, payload, qos, retain);
-	if (::pubsub_service && pubsubServiceLeaf) {
-	  pubsubServiceLeaf->_mqtt_publish(full_topic, payload, qos, retain);
+	if (pubsub_fanout_count) {
+	  AbstractPubsubLeaf::pubsubFanout(pubsubLeaf, full_topic_str, payload, qos, retain, topic_class);
 	}
       }
+
+      if (hasPriority() && !use_flat_topic && topic.length()) {
+	// taps see the topic with its priority prefix
+	topic = String(full_topic + base_topic.length());
+      }
+      if (buf_claimed) topic_buf_busy = false;
+      if (heap_topic) free(heap_topic);
     }
   }
   else {
@@ -1948,6 +2226,67 @@ void Leaf::mqtt_publish(String topic, String payload, int qos, bool retain, int
   LEAF_LEAVE;
 }
 
+//
+// Begin collecting publishes into a batch.  Until the matching
+// mqtt_publish_commit(), calls to mqtt_publish (or mqtt_publish_add) are
+// checked and given their full topic as usual, but are held back to be
+// handed to the pubsub leaf all at once.  Batches may nest, only the
+// outermost commit sends.
+//
+void Leaf::mqtt_publish_begin(int qos, bool retain)
+{
+  if (publish_batch) {
+    ++publish_batch->depth;
+    return;
+  }
+  if (!pubsubLeaf || ::pubsub_loopback) {
+    // nothing to be gained, publish as normal
+    return;
+  }
+  publish_batch = new PubsubBatch();
+  publish_batch->depth = 1;
+  publish_batch->count = 0;
+  publish_batch->qos = qos;
+  publish_batch->retain = retain;
+  publish_batch->qos_max = qos;
+  publish_batch->retain_all = retain;
+  publish_batch->topic_class = PUBSUB_CLASS_TELEMETRY;
+  publish_batch->prefix = base_topic;
+  publish_batch->buf.reserve(512);
+}
+
+//
+// Ask the pubsub leaf whether a periodic or on-change report should go now
+// (see AbstractPubsubLeaf::pubsubReportPolicy).
+//
+int Leaf::reportPolicy(int topic_class, bool retry)
+{
+  if (!pubsubLeaf) return PUBSUB_REPORT_NOW;
+  return pubsubLeaf->pubsubReportPolicy(this, topic_class, retry);
+}
+
+unsigned long Leaf::reportInterval(unsigned long interval)
+{
+  if (!pubsubLeaf) return interval;
+  return pubsubLeaf->pubsubReportInterval(interval);
+}
+
+int Leaf::mqtt_publish_commit()
+{
+  if (!publish_batch) return 0;
+  if (--publish_batch->depth > 0) return 0;
+
+  struct PubsubBatch *batch = publish_batch;
+  publish_batch = NULL;
+  int count = batch->count;
+  if (count && pubsubLeaf) {
+    LEAF_INFO("Commit batch of %d publishes (%d bytes)", count, (int)batch->buf.length());
+    pubsubLeaf->pubsubPublishBatch(batch);
+  }
+  delete batch;
+  return count;
+}
+
 Leaf *Leaf::find(String find_name, String find_type)
 {
   Leaf *result = NULL;
@@ -46,6 +46,11 @@ public:
     return mounted;
   }
 
+  fs::FS *getFS()
+  {
+    return mounted?fs:NULL;
+  }
+
   virtual bool mount()
   {
 #ifdef ESP8266
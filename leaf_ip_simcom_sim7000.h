@@ -247,9 +247,18 @@ public:
 
 
   virtual bool ipGetAddress(bool link_test=true) {
-    String response = modemQuery("AT+CNACT?","+CNACT: ", 10*modem_timeout_default,HERE);
-    if (response && response.startsWith("1,")) {
-      ip_addr_str = response.substring(3,response.length()-1);
+    // response is <status>,<address>
+    ModemFieldTokenizer fields(modem_response_buf, 0);
+    ModemToken addr;
+    bool found = false;
+    modemWaitBufferMutex(HERE);
+    if (modemQueryFields("AT+CNACT?","+CNACT: ", &fields, 10*modem_timeout_default,HERE) &&
+	(fields.nextInt()==1) && fields.next(&addr)) {
+      ip_addr_str = addr.toString();
+      found = true;
+    }
+    modemReleaseBufferMutex(HERE);
+    if (found) {
 
       //response = modemQuery("AT+CIFSR", "+CIFSR: ", -1, HERE);
 
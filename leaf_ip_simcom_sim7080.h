@@ -67,9 +67,18 @@ public:
 
 
   virtual bool ipGetAddress(bool link_test=true) {
-    String response = modemQuery("AT+CNACT?","+CNACT: ", 10*modem_timeout_default,HERE);
-    if (response && response.startsWith("0,1,")) {
-      ip_addr_str = response.substring(5,response.length()-1);
+    // response is <pdpidx>,<statusx>,<addressx>
+    ModemFieldTokenizer fields(modem_response_buf, 0);
+    ModemToken addr;
+    bool found = false;
+    modemWaitBufferMutex(HERE);
+    if (modemQueryFields("AT+CNACT?","+CNACT: ", &fields, 10*modem_timeout_default,HERE) &&
+	(fields.nextInt(-1)==0) && (fields.nextInt()==1) && fields.next(&addr)) {
+      ip_addr_str = addr.toString();
+      found = true;
+    }
+    modemReleaseBufferMutex(HERE);
+    if (found) {
       if (ip_modem_test_after_connect && link_test && !ipTestLink()) {
 	return false;
       }
@@ -110,16 +119,16 @@ public:
 
     // don't call the superclass because in this instance it is wrong
 
-    String status_str = modemQuery("AT+CNACT?", "+CNACT: ",10*modem_timeout_default, HERE);
-
-    LEAF_NOTICE("Connection status %s", status_str.c_str());
-
     // response is <pdpidx>,<statusx>,<addressx>, and we want <statusx>
-    int comma = status_str.indexOf(',');
-    if (comma >= 0) {
-      status_str.remove(0, comma+1);
-    }
-    int statusx = status_str.toInt();
+    ModemFieldTokenizer fields(modem_response_buf, 0);
+    int statusx = 0;
+    modemWaitBufferMutex(HERE);
+    if (modemQueryFields("AT+CNACT?", "+CNACT: ", &fields, 10*modem_timeout_default, HERE)) {
+      LEAF_NOTICE("Connection status %s", modem_response_buf);
+      fields.next();
+      statusx = fields.nextInt();
+    }
+    modemReleaseBufferMutex(HERE);
     bool status = statusx;
 
     if (force_correction) {
@@ -231,10 +240,14 @@ for SMS-DELIVER:
     */
 
     modemFlushInput();
-    if (!modemSendExpectIntField(modem_command_buf, "+CMGR: ", 12, &sms_len, ',', -1, HERE,false)) {
+    modemWaitBufferMutex(HERE);
+    if (!modemSendExpect(modem_command_buf, "+CMGR: ", modem_response_buf, modem_response_max, -1, 1, HERE, MODEM_REPLY_NO_FLUSH) ||
+	!parseSMSHeader(ModemToken(modem_response_buf), NULL, &sms_len)) {
+      modemReleaseBufferMutex(HERE);
       LEAF_ALERT("Error requesting message %d", msg_index);
       LEAF_STR_RETURN(result);
     }
+    modemReleaseBufferMutex(HERE);
     LEAF_NOTICE("SMS message %d length is %d", msg_index, sms_len);
     //LEAF_DEBUG("Remainder of modem_response_buf is [%s]", modem_response_buf);
     if (sms_len >= modem_response_max) {
@@ -281,7 +294,11 @@ for SMS-DELIVER:
     */
 
     modemFlushInput();
-    result = modemSendExpectQuotedField(modem_command_buf, "+CMGR: ", 2, ',', -1, HERE);
+    modemWaitBufferMutex(HERE);
+    if (modemSendExpect(modem_command_buf, "+CMGR: ", modem_response_buf, modem_response_max, -1, 1, HERE)) {
+      parseSMSHeader(ModemToken(modem_response_buf), &result, NULL);
+    }
+    modemReleaseBufferMutex(HERE);
     if (result == "") {
       LEAF_ALERT("Error inspecting message %d", msg_index);
       LEAF_STR_RETURN(result);
@@ -294,7 +311,7 @@ for SMS-DELIVER:
 
   virtual IpClientSim7080 *newClient(int port)
   {
-    return new IpClientSim7080(this, port);
+    return new IpClientSim7080(this, port, ipRxArena());
   }
 
 
@@ -337,11 +354,13 @@ for SMS-DELIVER:
       else {
 	LEAF_NOTICE("Data received connection slot %d", slot);
 	// tell the socket it has data (we don't know how much)
-	if (!modemWaitPortMutex(HERE)) {
+	if (!modemWaitPortMutex(HERE, false, 0, MODEM_PORT_PRIO_DATA)) {
 	  LEAF_ALERT("Cannot obtain modem port mutex to process [%s]", Message.c_str());
 	}
 	else {
 	  ((IpClientSim7080 *)ip_clients[slot])->dataIndication(0);
+	  // share the reads out among every socket that has data waiting
+	  ipClientsReceive();
 	  modemReleasePortMutex(HERE);
 	}
       }
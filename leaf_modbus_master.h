@@ -387,7 +387,8 @@ public:
   virtual void range_pub(String filter="") 
   {
     if (filter=="1") filter = "";
-    
+
+    mqtt_publish_begin();
     for (int range_idx = 0; range_idx < readRanges->size(); range_idx++) {
       ModbusReadRange *range = this->readRanges->getData(range_idx);
       LEAF_NOTICE("Consider range %s", range->name.c_str());
@@ -399,6 +400,7 @@ public:
       DumpHex(L_NOTICE, "  range values", range->values, range->quantity*sizeof(uint16_t));
       publishRange(range, true);
     }
+    mqtt_publish_commit();
   }
 
   virtual bool commandHandler(String type, String name, String topic, String payload) {
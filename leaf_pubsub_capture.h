@@ -0,0 +1,463 @@
+#pragma once
+#include "abstract_pubsub.h"
+#include "leaf_fs.h"
+//
+//@********************** class PubsubCaptureLeaf ***********************
+//
+// Record pubsub traffic to a file, and play it back.
+//
+// While capturing, every message received or published by the pubsub
+// leaf is appended to capture_file along with its time and direction.
+// Records are collected in RAM by whichever task is publishing, and
+// written out from this leaf's loop, so that capture adds no flash I/O to
+// the publish path.  If the buffer fills between writes, records are
+// dropped (and counted).
+//
+// A capture may be replayed on a bench unit: received messages are fed to
+// the pubsub leaf's _mqtt_route at their original spacing, scaled by
+// capture_replay_speed (percent, 0 means as fast as possible).  The device
+// id of the capturing unit is rewritten to ours.  Recorded publishes are
+// not replayed, they are what the stack is expected to do in response
+// (capture while replaying to record what it actually did).
+//
+// The file system is that of the FS leaf named in the constructor, so
+// captures may go to LittleFS or to SD.
+//
+// File format (all integers little-endian):
+//   header: "SXCP", uint16 version, uint16 device_id_len, device_id
+//   record: uint32 ms, uint8 direction ('<' received, '>' published),
+//           uint8 flags (qos | retain<<2), uint16 topic_len,
+//           uint32 payload_len, topic, payload
+//
+
+#ifndef PUBSUB_CAPTURE_FILE
+#define PUBSUB_CAPTURE_FILE "/pubsub.cap"
+#endif
+
+#ifndef PUBSUB_CAPTURE_BUFFER_SIZE
+#define PUBSUB_CAPTURE_BUFFER_SIZE 4096
+#endif
+
+#ifndef PUBSUB_CAPTURE_MAX_BYTES
+#define PUBSUB_CAPTURE_MAX_BYTES (256*1024)
+#endif
+
+#ifndef PUBSUB_CAPTURE_FLUSH_MS
+#define PUBSUB_CAPTURE_FLUSH_MS 1000
+#endif
+
+#ifndef PUBSUB_REPLAY_BUDGET
+#define PUBSUB_REPLAY_BUDGET 8
+#endif
+
+#define PUBSUB_CAPTURE_MAGIC "SXCP"
+#define PUBSUB_CAPTURE_VERSION 1
+#define PUBSUB_CAPTURE_RECEIVED '<'
+#define PUBSUB_CAPTURE_PUBLISHED '>'
+
+struct __attribute__((packed)) PubsubCaptureRecord
+{
+  uint32_t ms;
+  uint8_t direction;
+  uint8_t flags;
+  uint16_t topic_len;
+  uint32_t payload_len;
+};
+
+class PubsubCaptureLeaf : public Leaf, public PubsubCaptureSink
+{
+public:
+  PubsubCaptureLeaf(String name="capture", String fs_name="fs")
+    : Leaf("capture", name, (pinmask_t)0)
+    , Debuggable(name)
+    , fs_name(fs_name)
+  {
+  }
+
+  virtual void setup();
+  virtual void loop();
+  virtual void status_pub();
+  virtual bool commandHandler(String type, String name, String topic, String payload);
+  virtual void pubsubCapture(bool outbound, const char *topic, size_t topic_len,
+			     const char *payload, size_t payload_len, int qos, bool retain);
+
+protected:
+  fs::FS *captureFS();
+  bool captureStart(String path);
+  void captureStop();
+  void captureFlush();
+  bool replayStart(String path);
+  void replayStop();
+  void replayLoop();
+
+  String fs_name;
+  FSLeaf *fs_leaf = NULL;
+
+  String capture_file = PUBSUB_CAPTURE_FILE;
+  int capture_buffer_size = PUBSUB_CAPTURE_BUFFER_SIZE;
+  int capture_max_bytes = PUBSUB_CAPTURE_MAX_BYTES;
+  int capture_flush_ms = PUBSUB_CAPTURE_FLUSH_MS;
+  int capture_replay_speed = 100;
+  int capture_replay_budget = PUBSUB_REPLAY_BUDGET;
+
+  // capture state, the fill buffer is shared with publishing tasks
+  File capture_fp;
+  volatile bool capturing = false;
+  SemaphoreHandle_t capture_mutex = NULL;
+  uint8_t *capture_buf[2] = {NULL, NULL};
+  int capture_fill = 0;
+  size_t capture_len = 0;
+  unsigned long capture_start_ms = 0;
+  unsigned long capture_flush_last = 0;
+  size_t capture_bytes = 0;
+  unsigned long capture_count = 0;
+  unsigned long capture_drop_count = 0;
+
+  // replay state
+  File replay_fp;
+  bool replaying = false;
+  String replay_device_id;
+  struct PubsubCaptureRecord replay_rec;
+  bool replay_rec_valid = false;
+  uint32_t replay_first_ms = 0;
+  unsigned long replay_start_ms = 0;
+  unsigned long replay_count = 0;
+  unsigned long replay_skip_count = 0;
+  unsigned long replay_late_max_ms = 0;
+};
+
+void PubsubCaptureLeaf::setup()
+{
+  Leaf::setup();
+  LEAF_ENTER(L_INFO);
+
+  registerLeafStrValue("file", &capture_file, "File to capture pubsub traffic to (and replay from)");
+  registerLeafIntValue("buffer_size", &capture_buffer_size, "Size of capture RAM buffers (takes effect at next capture)");
+  registerLeafIntValue("max_bytes", &capture_max_bytes, "Stop capturing when the capture file reaches this size");
+  registerLeafIntValue("flush_ms", &capture_flush_ms, "Interval at which captured records are written to file");
+  registerLeafIntValue("replay_speed", &capture_replay_speed, "Replay speed in percent of original (0=as fast as possible)");
+  registerLeafIntValue("replay_budget", &capture_replay_budget, "Maximum messages replayed per loop");
+
+  registerLeafCommand(HERE,"start", "Begin capturing pubsub traffic (payload is optional file name)");
+  registerLeafCommand(HERE,"stop", "Stop capturing pubsub traffic");
+  registerLeafCommand(HERE,"replay", "Replay received messages from a capture (payload is optional file name)");
+  registerLeafCommand(HERE,"replay_stop", "Stop a replay in progress");
+  registerLeafCommand(HERE,"stats", "Publish capture and replay statistics");
+
+  capture_mutex = xSemaphoreCreateMutex();
+  fs_leaf = (FSLeaf *)find(fs_name, "fs");
+  if (!fs_leaf) {
+    LEAF_WARN("Filesystem leaf %s not found, capture is unavailable", fs_name.c_str());
+  }
+
+  LEAF_LEAVE;
+}
+
+fs::FS *PubsubCaptureLeaf::captureFS()
+{
+  fs::FS *fs = fs_leaf?fs_leaf->getFS():NULL;
+  if (!fs) {
+    LEAF_ALERT("Filesystem %s is not available", fs_name.c_str());
+  }
+  return fs;
+}
+
+void PubsubCaptureLeaf::loop()
+{
+  Leaf::loop();
+  unsigned long now = millis();
+
+  if (capturing &&
+      ((capture_len >= (size_t)capture_buffer_size/2) ||
+       ((now - capture_flush_last) >= (unsigned long)capture_flush_ms))) {
+    captureFlush();
+  }
+
+  if (replaying) {
+    replayLoop();
+  }
+}
+
+bool PubsubCaptureLeaf::captureStart(String path)
+{
+  LEAF_ENTER_STR(L_NOTICE, path);
+  if (capturing) captureStop();
+  if (!pubsubLeaf) {
+    LEAF_ALERT("No pubsub leaf to capture from");
+    LEAF_BOOL_RETURN(false);
+  }
+  if (replaying && (path == capture_file)) {
+    LEAF_ALERT("Cannot capture to the file being replayed");
+    LEAF_BOOL_RETURN(false);
+  }
+  fs::FS *fs = captureFS();
+  if (!fs) LEAF_BOOL_RETURN(false);
+
+  capture_fp = fs->open(path, "w");
+  if (!capture_fp) {
+    LEAF_ALERT("Could not create capture file %s", path.c_str());
+    LEAF_BOOL_RETURN(false);
+  }
+  for (int i=0; i<2; i++) {
+    if (capture_buf[i]) free(capture_buf[i]);
+    capture_buf[i] = (uint8_t *)malloc(capture_buffer_size);
+  }
+  if (!capture_buf[0] || !capture_buf[1]) {
+    LEAF_ALERT("Capture buffer allocation failed");
+    capture_fp.close();
+    LEAF_BOOL_RETURN(false);
+  }
+
+  uint16_t version = PUBSUB_CAPTURE_VERSION;
+  uint16_t id_len = strlen(device_id);
+  capture_fp.write((const uint8_t *)PUBSUB_CAPTURE_MAGIC, 4);
+  capture_fp.write((const uint8_t *)&version, sizeof(version));
+  capture_fp.write((const uint8_t *)&id_len, sizeof(id_len));
+  capture_fp.write((const uint8_t *)device_id, id_len);
+
+  capture_file = path;
+  capture_fill = 0;
+  capture_len = 0;
+  capture_bytes = capture_fp.size();
+  capture_count = capture_drop_count = 0;
+  capture_start_ms = capture_flush_last = millis();
+  capturing = true;
+  pubsubLeaf->pubsubSetCapture(this);
+  LEAF_NOTICE("Capturing pubsub traffic to %s", path.c_str());
+  LEAF_BOOL_RETURN(true);
+}
+
+void PubsubCaptureLeaf::captureStop()
+{
+  LEAF_ENTER(L_NOTICE);
+  if (!capturing) LEAF_VOID_RETURN;
+  if (pubsubLeaf) pubsubLeaf->pubsubSetCapture(NULL);
+  capturing = false;
+  captureFlush();
+  capture_fp.close();
+  LEAF_NOTICE("Captured %lu messages (%lu dropped, %lu bytes) to %s",
+	      capture_count, capture_drop_count, (unsigned long)capture_bytes, capture_file.c_str());
+  LEAF_LEAVE;
+}
+
+//
+// Called by the pubsub leaf from whichever task sends or routes a message.
+// Only copies into the fill buffer, never touches the file.
+//
+void PubsubCaptureLeaf::pubsubCapture(bool outbound, const char *topic, size_t topic_len,
+				      const char *payload, size_t payload_len, int qos, bool retain)
+{
+  if (!capturing) return;
+
+  struct PubsubCaptureRecord rec;
+  rec.ms = millis() - capture_start_ms;
+  rec.direction = outbound?PUBSUB_CAPTURE_PUBLISHED:PUBSUB_CAPTURE_RECEIVED;
+  rec.flags = (qos & 0x03) | (retain?0x04:0);
+  rec.topic_len = topic_len;
+  rec.payload_len = payload_len;
+  size_t need = sizeof(rec) + topic_len + payload_len;
+
+  if (xSemaphoreTake(capture_mutex, pdMS_TO_TICKS(5)) != pdTRUE) {
+    ++capture_drop_count;
+    return;
+  }
+  if (!capturing || (capture_len + need > (size_t)capture_buffer_size)) {
+    ++capture_drop_count;
+    xSemaphoreGive(capture_mutex);
+    return;
+  }
+  uint8_t *p = capture_buf[capture_fill] + capture_len;
+  memcpy(p, &rec, sizeof(rec));
+  memcpy(p+sizeof(rec), topic, topic_len);
+  memcpy(p+sizeof(rec)+topic_len, payload, payload_len);
+  capture_len += need;
+  ++capture_count;
+  xSemaphoreGive(capture_mutex);
+}
+
+//
+// Swap buffers so that publishers may carry on, then write out the full one
+//
+void PubsubCaptureLeaf::captureFlush()
+{
+  if (!capture_buf[0]) return;
+  xSemaphoreTake(capture_mutex, portMAX_DELAY);
+  uint8_t *buf = capture_buf[capture_fill];
+  size_t len = capture_len;
+  capture_fill ^= 1;
+  capture_len = 0;
+  xSemaphoreGive(capture_mutex);
+
+  capture_flush_last = millis();
+  if (!len) return;
+  if (capture_fp.write(buf, len) != len) {
+    LEAF_ALERT("Capture file write failed, stopping capture");
+    captureStop();
+    return;
+  }
+  capture_bytes += len;
+  if (capturing && (capture_bytes >= (size_t)capture_max_bytes)) {
+    LEAF_WARN("Capture file reached %lu bytes, stopping capture", (unsigned long)capture_bytes);
+    captureStop();
+  }
+}
+
+bool PubsubCaptureLeaf::replayStart(String path)
+{
+  LEAF_ENTER_STR(L_NOTICE, path);
+  if (replaying) replayStop();
+  if (!pubsubLeaf) {
+    LEAF_ALERT("No pubsub leaf to replay to");
+    LEAF_BOOL_RETURN(false);
+  }
+  if (capturing && (path == capture_file)) {
+    LEAF_ALERT("Cannot replay the file being captured");
+    LEAF_BOOL_RETURN(false);
+  }
+  fs::FS *fs = captureFS();
+  if (!fs) LEAF_BOOL_RETURN(false);
+
+  replay_fp = fs->open(path, "r");
+  if (!replay_fp) {
+    LEAF_ALERT("Could not open capture file %s", path.c_str());
+    LEAF_BOOL_RETURN(false);
+  }
+
+  char magic[4];
+  uint16_t version = 0;
+  uint16_t id_len = 0;
+  if ((replay_fp.read((uint8_t *)magic, 4) != 4) ||
+      (memcmp(magic, PUBSUB_CAPTURE_MAGIC, 4) != 0) ||
+      (replay_fp.read((uint8_t *)&version, sizeof(version)) != sizeof(version)) ||
+      (version != PUBSUB_CAPTURE_VERSION) ||
+      (replay_fp.read((uint8_t *)&id_len, sizeof(id_len)) != sizeof(id_len)) ||
+      (id_len >= DEVICE_ID_MAX)) {
+    LEAF_ALERT("%s is not a capture file", path.c_str());
+    replay_fp.close();
+    LEAF_BOOL_RETURN(false);
+  }
+  char id[DEVICE_ID_MAX];
+  replay_fp.read((uint8_t *)id, id_len);
+  id[id_len] = '\0';
+  replay_device_id = id;
+
+  replay_rec_valid = false;
+  replay_first_ms = 0;
+  replay_count = replay_skip_count = replay_late_max_ms = 0;
+  replay_start_ms = millis();
+  replaying = true;
+  LEAF_NOTICE("Replaying %s (captured by %s) at %d%% speed", path.c_str(), id, capture_replay_speed);
+  LEAF_BOOL_RETURN(true);
+}
+
+void PubsubCaptureLeaf::replayStop()
+{
+  LEAF_ENTER(L_NOTICE);
+  if (!replaying) LEAF_VOID_RETURN;
+  replaying = false;
+  replay_fp.close();
+  LEAF_NOTICE("Replayed %lu messages (%lu publishes skipped), worst lateness %lums",
+	      replay_count, replay_skip_count, replay_late_max_ms);
+  status_pub();
+  LEAF_LEAVE;
+}
+
+//
+// Route those messages that have come due, up to a limit per loop so that
+// a burst in the capture does not starve the rest of the stack
+//
+void PubsubCaptureLeaf::replayLoop()
+{
+  unsigned long elapsed = millis() - replay_start_ms;
+
+  for (int n=0; n<capture_replay_budget; n++) {
+    if (!replay_rec_valid) {
+      if (replay_fp.read((uint8_t *)&replay_rec, sizeof(replay_rec)) != sizeof(replay_rec)) {
+	replayStop();
+	return;
+      }
+      if (!replay_count && !replay_skip_count) replay_first_ms = replay_rec.ms;
+      replay_rec_valid = true;
+    }
+
+    if (replay_rec.direction != PUBSUB_CAPTURE_RECEIVED) {
+      replay_fp.seek(replay_rec.topic_len + replay_rec.payload_len, SeekCur);
+      replay_rec_valid = false;
+      ++replay_skip_count;
+      continue;
+    }
+
+    unsigned long due = 0;
+    if (capture_replay_speed > 0) {
+      due = (unsigned long)((uint64_t)(replay_rec.ms - replay_first_ms) * 100 / capture_replay_speed);
+      if (due > elapsed) return;
+      if (elapsed - due > replay_late_max_ms) replay_late_max_ms = elapsed - due;
+    }
+
+    char *buf = (char *)malloc(replay_rec.topic_len + replay_rec.payload_len + 2);
+    if (!buf) {
+      LEAF_ALERT("Replay buffer allocation failed");
+      replayStop();
+      return;
+    }
+    char *topic = buf;
+    char *payload = buf + replay_rec.topic_len + 1;
+    replay_fp.read((uint8_t *)topic, replay_rec.topic_len);
+    topic[replay_rec.topic_len] = '\0';
+    replay_fp.read((uint8_t *)payload, replay_rec.payload_len);
+    payload[replay_rec.payload_len] = '\0';
+    replay_rec_valid = false;
+
+    String Topic(topic);
+    String Payload(payload);
+    free(buf);
+    if (replay_device_id.length() && (replay_device_id != device_id)) {
+      Topic.replace(replay_device_id, device_id);
+    }
+    LEAF_INFO("REPLAY +%lums %s <= %s", due, Topic.c_str(), Payload.c_str());
+    pubsubLeaf->_mqtt_route(Topic, Payload, PUBSUB_REPLAY);
+    ++replay_count;
+  }
+}
+
+void PubsubCaptureLeaf::status_pub()
+{
+  char buf[200];
+  snprintf(buf, sizeof(buf),
+	   "{\"capturing\":%s,\"captured\":%lu,\"dropped\":%lu,\"bytes\":%lu,"
+	   "\"replaying\":%s,\"replayed\":%lu,\"skipped\":%lu,\"late_max_ms\":%lu}",
+	   TRUTH_lc(capturing), capture_count, capture_drop_count, (unsigned long)capture_bytes,
+	   TRUTH_lc(replaying), replay_count, replay_skip_count, replay_late_max_ms);
+  mqtt_publish("status/capture", buf);
+}
+
+bool PubsubCaptureLeaf::commandHandler(String type, String name, String topic, String payload)
+{
+  LEAF_HANDLER(L_INFO);
+
+  WHEN("start",{
+      captureStart(payload.length()?payload:capture_file);
+    })
+  ELSEWHEN("stop",{
+      captureStop();
+    })
+  ELSEWHEN("replay",{
+      replayStart(payload.length()?payload:capture_file);
+    })
+  ELSEWHEN("replay_stop",{
+      replayStop();
+    })
+  ELSEWHEN("stats",{
+      status_pub();
+    })
+  else {
+    handled = Leaf::commandHandler(type, name, topic, payload);
+  }
+
+  LEAF_HANDLER_END;
+}
+
+// Local Variables:
+// mode: C++
+// c-basic-offset: 2
+// End:
@@ -9,8 +9,7 @@
 
 struct PubsubIdfReceiveMessage
 {
-  String *topic;
-  String *payload;
+  PubsubMessageBuffer *buffer;
 };
 
 struct PubsubIdfEventMessage
@@ -45,6 +44,11 @@ protected:
   Ticker mqttReconnectTimer;
   QueueHandle_t receive_queue;
   QueueHandle_t event_queue;
+  PubsubMessageBuffer *pubsub_receive_frag = NULL;
+  bool pubsub_receive_streaming = false;
+  bool pubsub_receive_stream_lost = false;   // a fragment was dropped, skip the rest
+  uint8_t pubsub_receive_stream_qos = 0;
+  bool pubsub_receive_stream_retain = false;
 
 public:
   PubsubMQTTEspIdfLeaf(String name, String target, bool use_ssl=true, bool use_device_topic=true, bool run = true)
@@ -56,6 +60,8 @@ public:
     this->run = run;
     this->impersonate_backplane = true;
     this->pubsub_keepalive_sec = 60;
+    // the esp-mqtt client retransmits unacknowledged messages itself
+    this->pubsub_inflight_retry_max = 0;
     // further the setup happens in the superclass
 
 #ifdef PUBSUB_WIFI_AUTOCONNECT
@@ -69,6 +75,7 @@ public:
   virtual void loop(void);
   virtual void status_pub();
   virtual uint16_t _mqtt_publish(String topic, String payload, int qos=0, bool retain=false);
+  virtual bool _mqtt_publish_raw(const char *topic, size_t topic_len, const char *payload, size_t payload_len, int qos, bool retain, uint16_t *msg_id_r=NULL);
   virtual void _mqtt_subscribe(String topic, int qos=0, codepoint_t where=undisclosed_location);
   virtual void _mqtt_unsubscribe(String topic, int level=L_NOTICE);
   virtual bool mqtt_receive(String type, String name, String topic, String payload, bool direct=false);
@@ -77,9 +84,10 @@ public:
   virtual bool pubsubConnect(void);
   virtual void pubsubDisconnect(bool deliberate=true);
   virtual void pre_sleep(int duration=0);
+  virtual bool pubsubHasAsyncAck() { return true; }
 
   void eventQueueSend(struct PubsubIdfEventMessage *msg);
-  void receiveQueueSend(struct PubsubIdfReceiveMessage *msg);
+  bool receiveQueueSend(struct PubsubIdfReceiveMessage *msg);
   void processEvent(struct PubsubIdfEventMessage *msg);
   void processReceive(struct PubsubIdfReceiveMessage *msg);
 
@@ -172,7 +180,6 @@ esp_err_t PubsubMQTTEspIdfLeaf::_mqttEvent(esp_mqtt_event_t *event)
   struct PubsubIdfEventMessage msg;
   struct PubsubIdfReceiveMessage rmsg;
   static char topic_buf[1025];
-  static char payload_buf[1025];
 #if ESP_ARDUINO_VERSION_MAJOR < 3
   int32_t event_id = ((int)event->event_id);
 #endif
@@ -182,6 +189,7 @@ esp_err_t PubsubMQTTEspIdfLeaf::_mqttEvent(esp_mqtt_event_t *event)
   case MQTT_EVENT_CONNECTED:
     LEAF_NOTICE("MQTT_EVENT_CONNECTED");
     msg.code = PUBSUB_EVENT_CONNECT;
+    msg.context = event->session_present;
     eventQueueSend(&msg);
     break;
   case MQTT_EVENT_DISCONNECTED:
@@ -209,19 +217,95 @@ esp_err_t PubsubMQTTEspIdfLeaf::_mqttEvent(esp_mqtt_event_t *event)
     memcpy(topic_buf, event->topic, event->topic_len);
     topic_buf[event->topic_len]='\0';
     LEAF_INFO("MQTT_EVENT_PUBLISHED [%s]", topic_buf);
-    //msg.code = PUBSUB_EVENT_PUBLISH_DONE;
-    //msg.context = event->msg_id;
-    //eventQueueSend(&msg);
+    msg.code = PUBSUB_EVENT_PUBLISH_DONE;
+    msg.context = event->msg_id;
+    eventQueueSend(&msg);
     break;
   case MQTT_EVENT_DATA:
-    memcpy(topic_buf, event->topic, event->topic_len);
-    topic_buf[event->topic_len]='\0';
-    memcpy(payload_buf, event->data, event->data_len);
-    payload_buf[event->data_len]='\0';
-    LEAF_INFO("MQTT_EVENT_DATA [%s] <= [%s]\n", topic_buf, payload_buf);
-    rmsg.topic = new String(topic_buf);
-    rmsg.payload = new String(payload_buf);
-    receiveQueueSend(&rmsg);
+    // The client delivers oversize messages as a series of events, only
+    // the first of which carries the topic
+    if (event->current_data_offset == 0) {
+      if (pubsub_receive_frag) {
+	// a previous message was never completed
+	++pubsub_receive_drop_count;
+	pubsubMessageRelease(pubsub_receive_frag);
+	pubsub_receive_frag = NULL;
+      }
+      pubsub_receive_streaming = false;
+      pubsub_receive_stream_lost = false;
+      if (event->data_len >= event->total_data_len) {
+	rmsg.buffer = pubsubMessageAlloc(event->topic, event->topic_len, event->data_len);
+	if (!rmsg.buffer) {
+	  ++pubsub_receive_drop_count;
+	  break;
+	}
+	pubsubMessageFill(rmsg.buffer, 0, event->data, event->data_len);
+	rmsg.buffer->qos = event->qos;
+	rmsg.buffer->retain = event->retain;
+	LEAF_INFO("MQTT_EVENT_DATA [%s] <= [%s]", rmsg.buffer->topic(), rmsg.buffer->payload());
+	receiveQueueSend(&rmsg);
+	break;
+      }
+      pubsub_receive_streaming = (event->total_data_len > pubsub_receive_max);
+      if (pubsub_receive_streaming) {
+	// Too large to hold whole, remember the topic and pass the
+	// fragments on individually to any stream handlers
+	int topic_len = (event->topic_len < (int)sizeof(topic_buf)-1)?event->topic_len:(int)sizeof(topic_buf)-1;
+	memcpy(topic_buf, event->topic, topic_len);
+	topic_buf[topic_len]='\0';
+	pubsub_receive_stream_qos = event->qos;
+	pubsub_receive_stream_retain = event->retain;
+      }
+      else {
+	pubsub_receive_frag = pubsubMessageAlloc(event->topic, event->topic_len, event->total_data_len);
+	if (!pubsub_receive_frag) {
+	  ++pubsub_receive_drop_count;
+	  break;
+	}
+	pubsub_receive_frag->qos = event->qos;
+	pubsub_receive_frag->retain = event->retain;
+      }
+    }
+    if (pubsub_receive_streaming) {
+      if (pubsub_receive_stream_lost) {
+	// the stream handler is told of the gap when it is routed (see
+	// _mqtt_route_message), the rest of the message is of no use
+	break;
+      }
+      rmsg.buffer = pubsubMessageAlloc(topic_buf, strlen(topic_buf), event->data_len);
+      if (!rmsg.buffer) {
+	++pubsub_receive_drop_count;
+	pubsub_receive_stream_lost = true;
+	break;
+      }
+      pubsubMessageFill(rmsg.buffer, 0, event->data, event->data_len);
+      rmsg.buffer->index = event->current_data_offset;
+      rmsg.buffer->total = event->total_data_len;
+      // only the first fragment's event carries these
+      rmsg.buffer->qos = pubsub_receive_stream_qos;
+      rmsg.buffer->retain = pubsub_receive_stream_retain;
+      if (!receiveQueueSend(&rmsg)) pubsub_receive_stream_lost = true;
+      break;
+    }
+    if (!pubsub_receive_frag) {
+      // the start of this message was already dropped
+      break;
+    }
+    if ((event->current_data_offset != (int)pubsub_receive_frag->payload_len) ||
+	(event->current_data_offset + event->data_len > (int)pubsub_receive_frag->total)) {
+      LEAF_WARN("MQTT_EVENT_DATA fragment out of sequence for [%s], message dropped", pubsub_receive_frag->topic());
+      ++pubsub_receive_drop_count;
+      pubsubMessageRelease(pubsub_receive_frag);
+      pubsub_receive_frag = NULL;
+      break;
+    }
+    pubsubMessageFill(pubsub_receive_frag, event->current_data_offset, event->data, event->data_len);
+    if (pubsub_receive_frag->payload_len == pubsub_receive_frag->total) {
+      LEAF_INFO("MQTT_EVENT_DATA [%s] reassembled %d bytes", pubsub_receive_frag->topic(), (int)pubsub_receive_frag->total);
+      rmsg.buffer = pubsub_receive_frag;
+      pubsub_receive_frag = NULL;
+      receiveQueueSend(&rmsg);
+    }
     break;
   case MQTT_EVENT_ERROR:
     LEAF_NOTICE("MQTT_EVENT_ERROR");
@@ -245,9 +329,15 @@ void PubsubMQTTEspIdfLeaf::eventQueueSend(struct PubsubIdfEventMessage *msg)
   xQueueGenericSend(event_queue, (void *)msg, (TickType_t)0, queueSEND_TO_BACK);
 }
 
-void PubsubMQTTEspIdfLeaf::receiveQueueSend(struct PubsubIdfReceiveMessage *msg)
+bool PubsubMQTTEspIdfLeaf::receiveQueueSend(struct PubsubIdfReceiveMessage *msg)
 {
-  xQueueGenericSend(receive_queue, (void *)msg, (TickType_t)0, queueSEND_TO_BACK);
+  if (xQueueGenericSend(receive_queue, (void *)msg, (TickType_t)0, queueSEND_TO_BACK) != pdTRUE) {
+    // queue full, the message is lost
+    ++pubsub_receive_drop_count;
+    pubsubMessageRelease(msg->buffer);
+    return false;
+  }
+  return true;
 }
 
 
@@ -309,6 +399,7 @@ void PubsubMQTTEspIdfLeaf::processEvent(struct PubsubIdfEventMessage *event)
   LEAF_ENTER_CSTR(L_NOTICE, pubsub_event_names[event->code]);
   switch (event->code) {
   case PUBSUB_EVENT_CONNECT:
+    pubsubSetSessionPresent(event->context);
     pubsubSetConnected();        
     pubsubOnConnect(true);
     break;
@@ -316,6 +407,9 @@ void PubsubMQTTEspIdfLeaf::processEvent(struct PubsubIdfEventMessage *event)
     pubsubSetConnected(false);        
     pubsubOnDisconnect();
     break;
+  case PUBSUB_EVENT_PUBLISH_DONE:
+    pubsubInflightAck(event->context & 0xFFFF);
+    break;
   default:
     LEAF_ALERT("Event code %s unhandled", pubsub_event_names[event->code]);
   }
@@ -326,10 +420,9 @@ void PubsubMQTTEspIdfLeaf::processEvent(struct PubsubIdfEventMessage *event)
 void PubsubMQTTEspIdfLeaf::processReceive(struct PubsubIdfReceiveMessage *msg)
 {
   LEAF_NOTICE("MQTT message from server %s <= [%s]",
-	      msg->topic->c_str(), msg->payload->c_str());
-  this->_mqtt_route(*msg->topic, *msg->payload);
-  delete msg->topic;
-  delete msg->payload;
+	      msg->buffer->topic(), msg->buffer->payload());
+  this->_mqtt_route_message(msg->buffer);
+  pubsubMessageRelease(msg->buffer);
 }
 
 void PubsubMQTTEspIdfLeaf::loop()
@@ -374,6 +467,7 @@ void PubsubMQTTEspIdfLeaf::loop()
 
 void PubsubMQTTEspIdfLeaf::pre_sleep(int duration)
 {
+  AbstractPubsubLeaf::pre_sleep(duration);
   pubsubDisconnect(true);
 }
 
@@ -441,15 +535,34 @@ void PubsubMQTTEspIdfLeaf::pubsubDisconnect(bool deliberate) {
 }
  
 uint16_t PubsubMQTTEspIdfLeaf::_mqtt_publish(String topic, String payload, int qos, bool retain)
+{
+  uint16_t msg_id = 0;
+  _mqtt_publish_raw(topic.c_str(), topic.length(), payload.c_str(), payload.length(), qos, retain, &msg_id);
+  return msg_id;
+}
+
+//
+// All publishes come here.  The client library takes a char pointer and
+// length, so Strings are made only if the message is looped back or
+// queued.
+//
+// The client gives message id 0 for a QoS0 publish, so success is
+// reported apart from the id.
+//
+bool PubsubMQTTEspIdfLeaf::_mqtt_publish_raw(const char *topic, size_t topic_len, const char *payload, size_t payload_len, int qos, bool retain, uint16_t *msg_id_r)
 {
   LEAF_ENTER(L_DEBUG);
-  LEAF_INFO("PUB %s => [%s]", topic.c_str(), payload.c_str());
-  int i;
+  LEAF_INFO("PUB %s => [%.*s]", topic, (int)payload_len, payload);
   bool published = false;
+  bool ok = false;
+  uint16_t msg_id = 0;
+  if (msg_id_r) *msg_id_r = 0;
 
   if (pubsub_loopback) {
-    sendLoopback(topic, payload);
-    return 0;
+    String topic_str(topic, topic_len);
+    String payload_str(payload, payload_len);
+    sendLoopback(topic_str, payload_str);
+    LEAF_BOOL_RETURN(true);
   }
 
   if (pubsub_connected
@@ -463,11 +576,15 @@ uint16_t PubsubMQTTEspIdfLeaf::_mqtt_publish(String topic, String payload, int q
     else {
       LEAF_ALERT("WTF ipLeaf is null");
     }
-    LEAF_DEBUG("Initiate publish %s", topic.c_str());
-    int pub_result = esp_mqtt_client_publish(mqtt_handle, topic.c_str(), payload.c_str(), payload.length(), qos, retain);
+    LEAF_DEBUG("Initiate publish %s", topic);
+    int pub_result = esp_mqtt_client_publish(mqtt_handle, topic, payload, payload_len, qos, retain);
     if (pub_result < 0) {
       LEAF_ALERT("Publish failed");
     }
+    else {
+      msg_id = pub_result;
+      ok = true;
+    }
     if (ipLeaf) {
       ipLeaf->ipCommsState(REVERT, HERE);
       published = true;
@@ -476,18 +593,18 @@ uint16_t PubsubMQTTEspIdfLeaf::_mqtt_publish(String topic, String payload, int q
 #ifdef ESP32
   if (!published && send_queue) {
     LEAF_DEBUG("Queueing publish");
-    _mqtt_queue_publish(topic, payload, qos, retain);
+    ok = _mqtt_queue_publish(String(topic, topic_len), String(payload, payload_len), qos, retain);
   }
 #endif
   else if (pubsub_warn_noconn) {
-    LEAF_WARN("Publish skipped while MQTT connection is down: %s=>%s", topic.c_str(), payload.c_str());
+    LEAF_WARN("Publish skipped while MQTT connection is down: %s=>%.*s", topic, (int)payload_len, payload);
   }
 
 #ifndef ESP8266
   yield();
 #endif
-  //LEAVE;
-  LEAF_RETURN(1);
+  if (msg_id_r) *msg_id_r = msg_id;
+  LEAF_BOOL_RETURN(ok);
 }
 
 
@@ -0,0 +1,483 @@
+#pragma once
+#include "abstract_pubsub.h"
+//
+//@******************** class PubsubLoopbackLeaf *********************
+//
+// This class is an in-process stand-in for an MQTT broker, used to
+// load-test a stack's message handling without a network.
+//
+// Publishes are matched against our own subscriptions (including + and #
+// wildcards) and delivered back through a receive queue, exactly as a
+// real transport would.  Retained messages are stored and replayed on
+// subscribe, and QoS1 publishes are acknowledged after a configurable
+// delay (or not at all, with a configurable loss rate) so that in-flight
+// tracking and retransmission can be exercised.
+//
+// A traffic generator injects messages at broker_gen_rate per second,
+// drawn from a weighted topic mix such as "cmd/ping:5,set/foo:1" (topics
+// are relative to our base topic).  The broker_stats command reports
+// throughput and queue behaviour.
+//
+
+#ifndef PUBSUB_BROKER_QUEUE_SIZE
+#define PUBSUB_BROKER_QUEUE_SIZE 20
+#endif
+
+#ifndef PUBSUB_BROKER_DELIVER_BUDGET
+#define PUBSUB_BROKER_DELIVER_BUDGET 4
+#endif
+
+#ifndef PUBSUB_BROKER_GEN_TOPICS
+#define PUBSUB_BROKER_GEN_TOPICS "cmd/ping:1"
+#endif
+
+struct PubsubBrokerMessage
+{
+  PubsubMessageBuffer *buffer;
+};
+
+struct PubsubBrokerAck
+{
+  uint16_t msg_id;
+  unsigned long due_ms;
+};
+
+class PubsubLoopbackLeaf : public AbstractPubsubLeaf
+{
+public:
+  PubsubLoopbackLeaf(String name="loopmqtt", String target="")
+    : AbstractPubsubLeaf(name, target)
+    , Debuggable(name)
+  {
+    pubsub_use_device_topic = false;
+  }
+
+  virtual void setup();
+  virtual void loop();
+  virtual bool pubsubConnect() {
+    AbstractPubsubLeaf::pubsubConnect();
+    pubsubOnConnect();
+    return true;
+  }
+  virtual void pubsubDisconnect(bool deliberate=true) {
+    AbstractPubsubLeaf::pubsubDisconnect(deliberate);
+    // acknowledgements die with the session
+    memset(broker_ack, 0, sizeof(broker_ack));
+    pubsubOnDisconnect();
+  }
+
+  virtual void _mqtt_subscribe(String topic, int qos=0, codepoint_t where=undisclosed_location);
+  virtual void _mqtt_unsubscribe(String topic, int level=L_NOTICE);
+  virtual uint16_t _mqtt_publish(String topic, String payload, int qos=0, bool retain=false);
+  virtual void status_pub();
+  virtual bool commandHandler(String type, String name, String topic, String payload);
+
+protected:
+  virtual bool pubsubHasAsyncAck() { return true; }
+
+  bool brokerDeliver(const String &topic, const String &payload, int qos, bool retain);
+  void brokerGenerate(unsigned long now);
+  void brokerStats();
+  bool brokerSelfTest();
+
+  QueueHandle_t broker_queue = NULL;
+  int broker_queue_size = PUBSUB_BROKER_QUEUE_SIZE;
+  int broker_deliver_budget = PUBSUB_BROKER_DELIVER_BUDGET;
+  SimpleMap<String,String> *broker_retained = NULL;
+
+  uint16_t broker_msg_id = 0;
+  int broker_ack_delay_ms = 0;
+  int broker_ack_loss_percent = 0;
+  struct PubsubBrokerAck broker_ack[PUBSUB_INFLIGHT_MAX];
+
+  int broker_gen_rate = 0;
+  int broker_gen_count = 0;
+  int broker_gen_payload_size = 16;
+  String broker_gen_topics = PUBSUB_BROKER_GEN_TOPICS;
+  unsigned long broker_gen_last_ms = 0;
+  float broker_gen_credit = 0;
+
+  unsigned long broker_publish_count = 0;
+  unsigned long broker_deliver_count = 0;
+  unsigned long broker_unmatched_count = 0;
+  unsigned long broker_drop_count = 0;
+  unsigned long broker_ack_lost_count = 0;
+  unsigned long broker_generated_count = 0;
+  unsigned long broker_route_us = 0;
+  int broker_queue_high = 0;
+  unsigned long broker_stats_start_ms = 0;
+};
+
+void PubsubLoopbackLeaf::setup()
+{
+  AbstractPubsubLeaf::setup();
+  LEAF_ENTER(L_INFO);
+
+  registerIntValue("broker_queue_size", &broker_queue_size, "Loopback broker delivery queue size (takes effect at restart)");
+  registerIntValue("broker_deliver_budget", &broker_deliver_budget, "Loopback broker deliveries routed per loop");
+  registerIntValue("broker_ack_delay_ms", &broker_ack_delay_ms, "Loopback broker delay before acknowledging QoS1 publishes");
+  registerIntValue("broker_ack_loss_percent", &broker_ack_loss_percent, "Loopback broker percentage of QoS1 acknowledgements to lose");
+  registerIntValue("broker_gen_rate", &broker_gen_rate, "Loopback traffic generator rate (messages per second, 0=off)");
+  registerIntValue("broker_gen_count", &broker_gen_count, "Loopback traffic generator message limit (0=unlimited)");
+  registerIntValue("broker_gen_payload_size", &broker_gen_payload_size, "Loopback traffic generator payload size");
+  registerStrValue("broker_gen_topics", &broker_gen_topics, "Loopback traffic generator topic mix (topic:weight,...)");
+
+  registerCommand(HERE,"broker_stats", "Publish loopback broker statistics");
+  registerCommand(HERE,"broker_reset", "Reset loopback broker statistics");
+  registerCommand(HERE,"broker_selftest", "Check the loopback broker's topic matching, retention and acknowledgement");
+
+  broker_retained = new SimpleMap<String,String>(_compareStringKeys);
+  broker_queue = xQueueCreate(broker_queue_size, sizeof(struct PubsubBrokerMessage));
+  memset(broker_ack, 0, sizeof(broker_ack));
+  broker_stats_start_ms = millis();
+
+  LEAF_NOTICE("LOOPBACK PUBSUB - in-process broker, queue size %d", broker_queue_size);
+  LEAF_LEAVE;
+}
+
+void PubsubLoopbackLeaf::loop()
+{
+  last_broker_heartbeat = millis();
+  AbstractPubsubLeaf::loop();
+
+  unsigned long now = millis();
+
+  // Deliver acknowledgements that have come due
+  for (int i=0; i<PUBSUB_INFLIGHT_MAX; i++) {
+    if (broker_ack[i].msg_id && ((long)(now - broker_ack[i].due_ms) >= 0)) {
+      uint16_t msg_id = broker_ack[i].msg_id;
+      broker_ack[i].msg_id = 0;
+      pubsubInflightAck(msg_id);
+    }
+  }
+
+  if (broker_gen_rate && pubsub_connected) {
+    brokerGenerate(now);
+  }
+
+  // Route a limited number of deliveries per loop, as a real transport would
+  struct PubsubBrokerMessage msg;
+  for (int n=0; (n<broker_deliver_budget) && xQueueReceive(broker_queue, &msg, 0); n++) {
+    unsigned long start = micros();
+    _mqtt_route_message(msg.buffer);
+    broker_route_us += micros() - start;
+    pubsubMessageRelease(msg.buffer);
+  }
+}
+
+//
+// Queue a message for delivery if it matches any of our subscriptions.
+// Like a broker, we deliver at most one copy per client however many
+// of its subscriptions overlap.
+//
+bool PubsubLoopbackLeaf::brokerDeliver(const String &topic, const String &payload, int qos, bool retain)
+{
+  int i;
+  for (i=0; i<pubsub_subscriptions->size(); i++) {
+    if (pubsubTopicMatch(pubsub_subscriptions->getKey(i).c_str(), topic.c_str())) break;
+  }
+  if (i >= pubsub_subscriptions->size()) {
+    ++broker_unmatched_count;
+    return false;
+  }
+
+  PubsubMessageBuffer *buffer = pubsubMessageAlloc(topic.c_str(), topic.length(), payload.length());
+  if (!buffer) {
+    ++broker_drop_count;
+    return false;
+  }
+  pubsubMessageFill(buffer, 0, payload.c_str(), payload.length());
+  buffer->qos = qos;
+  buffer->retain = retain;
+
+  struct PubsubBrokerMessage msg = {buffer};
+  if (xQueueGenericSend(broker_queue, (void *)&msg, (TickType_t)0, queueSEND_TO_BACK) != pdTRUE) {
+    LEAF_DEBUG("Loopback broker queue full, dropping %s", topic.c_str());
+    pubsubMessageRelease(buffer);
+    ++broker_drop_count;
+    return false;
+  }
+  int depth = (int)uxQueueMessagesWaiting(broker_queue);
+  if (depth > broker_queue_high) broker_queue_high = depth;
+  ++broker_deliver_count;
+  return true;
+}
+
+void PubsubLoopbackLeaf::_mqtt_subscribe(String topic, int qos, codepoint_t where)
+{
+  LEAF_NOTICE_AT(CODEPOINT(where), "LOOPBACK SUB %s", topic.c_str());
+  if (pubsub_subscriptions) {
+    pubsub_subscriptions->put(topic, qos);
+  }
+
+  // Replay retained messages that match the new subscription
+  for (int i=0; i<broker_retained->size(); i++) {
+    String t = broker_retained->getKey(i);
+    if (pubsubTopicMatch(topic.c_str(), t.c_str())) {
+      brokerDeliver(t, broker_retained->getData(i), qos, true);
+    }
+  }
+}
+
+void PubsubLoopbackLeaf::_mqtt_unsubscribe(String topic, int level)
+{
+  __LEAF_DEBUG__(level, "LOOPBACK UNSUB %s", topic.c_str());
+  if (topic == "ALL") {
+    while (pubsub_subscriptions->size()) {
+      pubsub_subscriptions->remove(pubsub_subscriptions->getKey(0));
+    }
+    return;
+  }
+  pubsub_subscriptions->remove(topic);
+}
+
+uint16_t PubsubLoopbackLeaf::_mqtt_publish(String topic, String payload, int qos, bool retain)
+{
+  LEAF_INFO("(LOOPBACK) PUB %s => [%s]", topic.c_str(), payload.c_str());
+
+  if (pubsub_loopback) {
+    sendLoopback(topic, payload);
+    return 0;
+  }
+  if (!pubsub_connected) {
+    return 0;
+  }
+  ++broker_publish_count;
+
+  if (retain) {
+    // as per MQTT, an empty retained payload clears the retained message
+    if (payload.length()) {
+      broker_retained->put(topic, payload);
+    }
+    else {
+      broker_retained->remove(topic);
+    }
+  }
+
+  brokerDeliver(topic, payload, qos, false);
+
+  if (qos == 0) {
+    return 0;
+  }
+
+  if (++broker_msg_id == 0) ++broker_msg_id;
+  if ((broker_ack_loss_percent > 0) && ((int)random(100) < broker_ack_loss_percent)) {
+    LEAF_DEBUG("Loopback broker losing acknowledgement for id=%d", (int)broker_msg_id);
+    ++broker_ack_lost_count;
+    return broker_msg_id;
+  }
+  int slot = -1;
+  for (int i=0; i<PUBSUB_INFLIGHT_MAX; i++) {
+    if (broker_ack[i].msg_id == 0) {
+      slot = i;
+      break;
+    }
+    if ((slot < 0) || ((long)(broker_ack[i].due_ms - broker_ack[slot].due_ms) < 0)) {
+      slot = i;
+    }
+  }
+  if (broker_ack[slot].msg_id) {
+    // no room (eg. retransmissions while acks are delayed), so make room
+    // by acknowledging the earliest one now rather than never
+    uint16_t early = broker_ack[slot].msg_id;
+    broker_ack[slot].msg_id = 0;
+    pubsubInflightAck(early);
+  }
+  broker_ack[slot].msg_id = broker_msg_id;
+  broker_ack[slot].due_ms = millis() + broker_ack_delay_ms;
+  return broker_msg_id;
+}
+
+//
+// Inject messages "from the network" at the configured rate, choosing a
+// topic from the weighted mix for each one.
+//
+void PubsubLoopbackLeaf::brokerGenerate(unsigned long now)
+{
+  if (broker_gen_count && (broker_generated_count >= (unsigned long)broker_gen_count)) {
+    return;
+  }
+  if (broker_gen_last_ms == 0) {
+    broker_gen_last_ms = now;
+    return;
+  }
+  broker_gen_credit += (now - broker_gen_last_ms) * broker_gen_rate / 1000.0;
+  broker_gen_last_ms = now;
+  if (broker_gen_credit > broker_gen_rate) {
+    // don't build up an unbounded backlog if we were stalled
+    broker_gen_credit = broker_gen_rate;
+  }
+
+  int total_weight = 0;
+  int pos = 0;
+  while (pos < (int)broker_gen_topics.length()) {
+    int end = broker_gen_topics.indexOf(',', pos);
+    if (end < 0) end = broker_gen_topics.length();
+    int colon = broker_gen_topics.indexOf(':', pos);
+    total_weight += ((colon > 0) && (colon < end)) ? broker_gen_topics.substring(colon+1, end).toInt() : 1;
+    pos = end+1;
+  }
+  if (total_weight <= 0) return;
+
+  String payload;
+  payload.reserve(broker_gen_payload_size);
+  while (payload.length() < (unsigned int)broker_gen_payload_size) {
+    payload += (char)('a' + (payload.length()%26));
+  }
+
+  while (broker_gen_credit >= 1.0) {
+    broker_gen_credit -= 1.0;
+    if (broker_gen_count && (broker_generated_count >= (unsigned long)broker_gen_count)) {
+      LEAF_NOTICE("Loopback traffic generator finished after %lu messages", broker_generated_count);
+      brokerStats();
+      return;
+    }
+
+    int pick = random(total_weight);
+    pos = 0;
+    String topic;
+    while (pos < (int)broker_gen_topics.length()) {
+      int end = broker_gen_topics.indexOf(',', pos);
+      if (end < 0) end = broker_gen_topics.length();
+      int colon = broker_gen_topics.indexOf(':', pos);
+      int weight = 1;
+      if ((colon > 0) && (colon < end)) {
+	weight = broker_gen_topics.substring(colon+1, end).toInt();
+      }
+      else {
+	colon = end;
+      }
+      if (pick < weight) {
+	topic = base_topic + broker_gen_topics.substring(pos, colon);
+	break;
+      }
+      pick -= weight;
+      pos = end+1;
+    }
+    ++broker_generated_count;
+    brokerDeliver(topic, payload, 0, false);
+  }
+}
+
+void PubsubLoopbackLeaf::brokerStats()
+{
+  unsigned long elapsed = millis() - broker_stats_start_ms;
+  if (elapsed == 0) elapsed = 1;
+  char buf[160];
+  snprintf(buf, sizeof(buf),
+	   "{\"publish\":%lu,\"deliver\":%lu,\"unmatched\":%lu,\"drop\":%lu,\"ack_lost\":%lu,"
+	   "\"generated\":%lu,\"queue_high\":%d,\"rate\":%lu,\"route_us\":%lu}",
+	   broker_publish_count, broker_deliver_count, broker_unmatched_count, broker_drop_count,
+	   broker_ack_lost_count, broker_generated_count, broker_queue_high,
+	   broker_deliver_count * 1000 / elapsed,
+	   broker_deliver_count ? (broker_route_us / broker_deliver_count) : 0);
+  mqtt_publish("status/broker_stats", buf);
+}
+
+//
+// Exercise the broker semantics that the load tests depend on, and
+// publish the outcome to status/broker_selftest.  Leaves the broker as
+// it was found (apart from statistics).
+//
+bool PubsubLoopbackLeaf::brokerSelfTest()
+{
+  LEAF_ENTER(L_NOTICE);
+  int failed = 0;
+  int checks = 0;
+#define BROKER_CHECK(cond, what) do { ++checks; if (!(cond)) { ++failed; LEAF_ALERT("broker_selftest FAIL: %s", what); } } while (0)
+
+  static const struct { const char *filter; const char *topic; bool match; } cases[] = {
+    {"a/b/c", "a/b/c", true},
+    {"a/b/c", "a/b/d", false},
+    {"a/+/c", "a/b/c", true},
+    {"a/+/c", "a/b/x/c", false},
+    {"a/+", "a/", true},
+    {"a/#", "a/b/c", true},
+    {"a/#", "a", true},
+    {"#", "a/b", true},
+    {"a/b", "a/b/c", false},
+    {"+/+", "a/b", true},
+    {NULL, NULL, false}
+  };
+  for (int i=0; cases[i].filter; i++) {
+    BROKER_CHECK(pubsubTopicMatch(cases[i].filter, cases[i].topic) == cases[i].match, cases[i].filter);
+  }
+
+  String prefix = base_topic + "selftest/";
+  int depth = (int)uxQueueMessagesWaiting(broker_queue);
+  bool was_connected = pubsub_connected;
+  pubsub_connected = true;
+
+  // a retained message is stored, and replayed to a later subscriber
+  _mqtt_publish(prefix+"retained", "r", 0, true);
+  BROKER_CHECK(broker_retained->has(prefix+"retained"), "retain stored");
+  _mqtt_subscribe(prefix+"+", 0, HERE);
+  BROKER_CHECK((int)uxQueueMessagesWaiting(broker_queue) == depth+1, "retained replay on subscribe");
+
+  // a wildcard subscription gets one copy of a matching publish
+  _mqtt_subscribe(prefix+"#", 0, HERE);
+  _mqtt_publish(prefix+"x", "x", 0, false);
+  BROKER_CHECK((int)uxQueueMessagesWaiting(broker_queue) == depth+3, "one delivery for overlapping subscriptions");
+
+  // an empty retained payload clears the retained message
+  _mqtt_publish(prefix+"retained", "", 0, true);
+  BROKER_CHECK(!broker_retained->has(prefix+"retained"), "retain cleared");
+
+  // a QoS1 publish is given an id and an acknowledgement is scheduled
+  int loss_was = broker_ack_loss_percent;
+  broker_ack_loss_percent = 0;
+  uint16_t id = _mqtt_publish(prefix+"q", "q", 1, false);
+  bool scheduled = false;
+  for (int i=0; i<PUBSUB_INFLIGHT_MAX; i++) {
+    if (id && (broker_ack[i].msg_id == id)) scheduled = true;
+  }
+  BROKER_CHECK(scheduled, "qos1 acknowledgement scheduled");
+  broker_ack_loss_percent = loss_was;
+
+  _mqtt_unsubscribe(prefix+"+");
+  _mqtt_unsubscribe(prefix+"#");
+  pubsub_connected = was_connected;
+#undef BROKER_CHECK
+
+  char buf[64];
+  snprintf(buf, sizeof(buf), "{\"checks\":%d,\"failed\":%d}", checks, failed);
+  mqtt_publish("status/broker_selftest", buf);
+  LEAF_BOOL_RETURN(failed == 0);
+}
+
+void PubsubLoopbackLeaf::status_pub()
+{
+  AbstractPubsubLeaf::status_pub();
+  brokerStats();
+}
+
+bool PubsubLoopbackLeaf::commandHandler(String type, String name, String topic, String payload)
+{
+  LEAF_HANDLER(L_INFO);
+
+  WHEN("broker_stats",{
+      brokerStats();
+    })
+  ELSEWHEN("broker_selftest",{
+      brokerSelfTest();
+    })
+  ELSEWHEN("broker_reset",{
+      broker_publish_count = broker_deliver_count = broker_unmatched_count = 0;
+      broker_drop_count = broker_ack_lost_count = broker_generated_count = 0;
+      broker_route_us = 0;
+      broker_queue_high = 0;
+      broker_gen_last_ms = 0;
+      broker_gen_credit = 0;
+      broker_stats_start_ms = millis();
+    })
+  else {
+    handled = AbstractPubsubLeaf::commandHandler(type, name, topic, payload);
+  }
+
+  LEAF_HANDLER_END;
+}
+
+// Local Variables:
+// mode: C++
+// c-basic-offset: 2
+// End:
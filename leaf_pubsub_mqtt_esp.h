@@ -7,11 +7,14 @@
 // This class encapsulates an Mqtt connection using esp32 wifi
 //
 
+//
+// A received message (or, for messages larger than pubsub_receive_max, one
+// fragment of a message).  The queue entry carries the reference created
+// by the network callback.
+//
 struct PubsubReceiveMessage
 {
-  String *topic;
-  String *payload;
-  AsyncMqttClientMessageProperties properties;
+  PubsubMessageBuffer *buffer;
 };
 
 
@@ -68,6 +71,7 @@ public:
   virtual void loop(void);
   virtual void status_pub();
   virtual uint16_t _mqtt_publish(String topic, String payload, int qos=0, bool retain=false);
+  virtual bool _mqtt_publish_raw(const char *topic, size_t topic_len, const char *payload, size_t payload_len, int qos, bool retain, uint16_t *msg_id_r=NULL);
   virtual void _mqtt_subscribe(String topic, int qos=0,codepoint_t where=undisclosed_location);
   virtual void _mqtt_unsubscribe(String topic, int level = L_NOTICE);
   virtual bool mqtt_receive(String type, String name, String topic, String payload, bool direct=false);
@@ -78,6 +82,7 @@ public:
   virtual void pubsubDisconnect(bool deliberate=true) ;
   virtual void processEvent(struct PubsubEventMessage *msg);
   virtual void processReceive(struct PubsubReceiveMessage *msg);
+  virtual bool pubsubHasAsyncAck() { return true; }
 
   void eventQueueSend(struct PubsubEventMessage *msg)
   {
@@ -89,13 +94,19 @@ public:
 #endif
   }
 
-  void receiveQueueSend(struct PubsubReceiveMessage *msg)
+  bool receiveQueueSend(struct PubsubReceiveMessage *msg)
   {
 #ifdef ESP32
-    xQueueGenericSend(receive_queue, (void *)msg, (TickType_t)0, queueSEND_TO_BACK);
+    if (xQueueGenericSend(receive_queue, (void *)msg, (TickType_t)0, queueSEND_TO_BACK) != pdTRUE) {
+      // queue full, the message is lost
+      ++pubsub_receive_drop_count;
+      pubsubMessageRelease(msg->buffer);
+      return false;
+    }
 #else
     processReceive(msg);
 #endif
+    return true;
   }
 
 
@@ -113,6 +124,10 @@ private:
   QueueHandle_t event_queue;
 #endif
 
+  // reassembly state for a message that spans several TCP segments
+  PubsubMessageBuffer *receive_frag_buf = NULL;
+  bool receive_stream_lost = false;   // a streamed fragment was dropped, skip the rest
+
   void _mqtt_receive_callback(char* topic,
 			      char* payload,
 			      AsyncMqttClientMessageProperties properties,
@@ -399,8 +414,7 @@ void PubsubEspAsyncMQTTLeaf::processEvent(struct PubsubEventMessage *event)
   case PUBSUB_EVENT_PUBLISH_DONE: {
     int packetId = event->context & 0xFFFF;
     LEAF_INFO("Publish acknowledged %d", (int)packetId);
-    // this appears to never get called
-    //ipLeaf->ipCommsState(REVERT, HERE);
+    pubsubInflightAck(packetId);
     if (event->context == sleep_pub_id) {
       LEAF_NOTICE("Going to sleep for %d ms", sleep_duration_ms);
 #ifdef ESP8266
@@ -412,6 +426,7 @@ void PubsubEspAsyncMQTTLeaf::processEvent(struct PubsubEventMessage *event)
 #endif
     }
   }
+    break;
   default:
     LEAF_WARN("Unhandled pubsub event %d", (int)event->code)
     break;
@@ -421,18 +436,18 @@ void PubsubEspAsyncMQTTLeaf::processEvent(struct PubsubEventMessage *event)
 
 void PubsubEspAsyncMQTTLeaf::processReceive(struct PubsubReceiveMessage *msg)
 {
-  LEAF_NOTICE("MQTT message from server %s <= [%s] (q%d%s)",
-	      msg->topic->c_str(), msg->payload->c_str(), (int)msg->properties.qos, msg->properties.retain?" retain":"");
+  PubsubMessageBuffer *buffer = msg->buffer;
 
-  if (pubsub_ignore_retain && msg->properties.retain) {
-    LEAF_NOTICE("(ignore retained)");
+  if (pubsub_ignore_retain && buffer->retain) {
+    LEAF_NOTICE("MQTT message from server %s (ignore retained)", buffer->topic());
   }
   else {
-    this->_mqtt_route(*msg->topic, *msg->payload);
+    LEAF_NOTICE("MQTT message from server %s <= [%s] (q%d%s)",
+		buffer->topic(), buffer->payload(), (int)buffer->qos, buffer->retain?" retain":"");
+    this->_mqtt_route_message(buffer);
   }
-  
-  delete msg->topic;
-  delete msg->payload;
+
+  pubsubMessageRelease(buffer);
 }
 
 void PubsubEspAsyncMQTTLeaf::loop()
@@ -554,18 +569,35 @@ void PubsubEspAsyncMQTTLeaf::pubsubDisconnect(bool deliberate)
 
 uint16_t PubsubEspAsyncMQTTLeaf::_mqtt_publish(String topic, String payload, int qos, bool retain)
 {
-  LEAF_ENTER_STR(L_DEBUG, topic);
+  uint16_t msg_id = 0;
+  _mqtt_publish_raw(topic.c_str(), topic.length(), payload.c_str(), payload.length(), qos, retain, &msg_id);
+  return msg_id;
+}
+
+//
+// All publishes come here.  The client library takes a char pointer and
+// length, so Strings are made only if the message is looped back or
+// queued.
+//
+// The client returns a nonzero packet id for any accepted publish (a
+// dummy one for QoS0), only a QoS1 id is passed back.
+//
+bool PubsubEspAsyncMQTTLeaf::_mqtt_publish_raw(const char *topic, size_t topic_len, const char *payload, size_t payload_len, int qos, bool retain, uint16_t *msg_id_r)
+{
+  LEAF_ENTER_CSTR(L_DEBUG, topic);
+  if (msg_id_r) *msg_id_r = 0;
 
   if (pubsub_loopback) {
-    sendLoopback(topic, payload);
-    return 0;
+    String topic_str(topic, topic_len);
+    String payload_str(payload, payload_len);
+    sendLoopback(topic_str, payload_str);
+    LEAF_BOOL_RETURN(true);
   }
 
   uint16_t packetId = 0;
+  bool ok = false;
   //ENTER(L_DEBUG);
-  const char *topic_c_str = topic.c_str();
-  const char *payload_c_str = payload.c_str();
-  LEAF_NOTICE("PUB %s => [%s] qos=%d retain=%s", topic_c_str, payload_c_str, qos, TRUTH_lc(retain));
+  LEAF_NOTICE("PUB %s => [%.*s] qos=%d retain=%s", topic, (int)payload_len, payload, qos, TRUTH_lc(retain));
   //DEBUG_AUGMENT(level, 4);
   //DEBUG_AUGMENT(flush, 1);
   //DEBUG_AUGMENT(wait, 50);
@@ -581,9 +613,10 @@ uint16_t PubsubEspAsyncMQTTLeaf::_mqtt_publish(String topic, String payload, int
     else {
       LEAF_ALERT("WTF ipLeaf is null");
     }
-    LEAF_DEBUG("Initiate publish %s", topic.c_str());
-    packetId = mqttClient.publish(topic.c_str(), qos, retain, payload_c_str);
+    LEAF_DEBUG("Initiate publish %s", topic);
+    packetId = mqttClient.publish(topic, qos, retain, payload, payload_len);
     LEAF_DEBUG("Publish initiated, ID=%d", packetId);
+    ok = (packetId != 0);
     if (ipLeaf) {
       ipLeaf->ipCommsState(REVERT, HERE);
     }
@@ -591,11 +624,11 @@ uint16_t PubsubEspAsyncMQTTLeaf::_mqtt_publish(String topic, String payload, int
 #ifdef ESP32
   else if (send_queue) {
     LEAF_DEBUG("Queueing publish");
-    _mqtt_queue_publish(topic, payload, qos, retain);
+    ok = _mqtt_queue_publish(String(topic, topic_len), String(payload, payload_len), qos, retain);
   }
 #endif
   else if (pubsub_warn_noconn) {
-    LEAF_WARN("Publish skipped while MQTT connection is down: %s=>%s", topic_c_str, payload_c_str);
+    LEAF_WARN("Publish skipped while MQTT connection is down: %s=>%.*s", topic, (int)payload_len, payload);
   }
 
   //DEBUG_RESTORE(level);
@@ -606,8 +639,8 @@ uint16_t PubsubEspAsyncMQTTLeaf::_mqtt_publish(String topic, String payload, int
 #ifndef ESP8266
   yield();
 #endif
-  //LEAVE;
-  LEAF_RETURN(packetId);
+  if (msg_id_r && (qos > 0)) *msg_id_r = packetId;
+  LEAF_BOOL_RETURN(ok);
 }
 
 
@@ -667,22 +700,72 @@ void PubsubEspAsyncMQTTLeaf::_mqtt_receive_callback(char* topic,
 			    size_t len,
 			    size_t index,
 			    size_t total) {
-  LEAF_ENTER(L_DEBUG);
+  // dont log in interrupt context
+  size_t topic_len = strlen(topic);
+
+  if (((index == 0) && (len >= total)) || (total > (size_t)pubsub_receive_max)) {
+    // Either the whole message arrived in one segment (the usual case),
+    // or the message is too large to hold whole, in which case the
+    // fragments are passed on individually to any stream handlers
+    if (index == 0) {
+      receive_stream_lost = false;
+    }
+    else if (receive_stream_lost) {
+      // the stream handler is told of the gap when it is routed (see
+      // _mqtt_route_message), the rest of the message is of no use
+      return;
+    }
+    PubsubMessageBuffer *buffer = pubsubMessageAlloc(topic, topic_len, len);
+    if (!buffer) {
+      ++pubsub_receive_drop_count;
+      receive_stream_lost = true;
+      return;
+    }
+    pubsubMessageFill(buffer, 0, payload, len);
+    buffer->index = index;
+    buffer->total = total;
+    buffer->qos = properties.qos;
+    buffer->retain = properties.retain;
+    struct PubsubReceiveMessage msg={.buffer=buffer};
+    if (!receiveQueueSend(&msg)) receive_stream_lost = true;
+    return;
+  }
 
-  // handle message arrived
-  char payload_buf[512];
-  if (len > sizeof(payload_buf)-1) len=sizeof(payload_buf)-1;
-  memcpy(payload_buf, payload, len);
-  payload_buf[len]='\0';
-  (void)index;
-  (void)total;
+  //
+  // Reassemble a multi-segment message, dispatching it once complete
+  //
+  if (index == 0) {
+    if (receive_frag_buf) {
+      // a previous message was never completed
+      ++pubsub_receive_drop_count;
+      pubsubMessageRelease(receive_frag_buf);
+    }
+    receive_frag_buf = pubsubMessageAlloc(topic, topic_len, total);
+    if (!receive_frag_buf) {
+      ++pubsub_receive_drop_count;
+      return;
+    }
+    receive_frag_buf->qos = properties.qos;
+    receive_frag_buf->retain = properties.retain;
+  }
+  if (!receive_frag_buf) {
+    // we are not holding the start of this message
+    return;
+  }
+  if ((index != receive_frag_buf->payload_len) || (total != receive_frag_buf->total) || (index+len > total)) {
+    // fragment out of sequence, abandon the message
+    ++pubsub_receive_drop_count;
+    pubsubMessageRelease(receive_frag_buf);
+    receive_frag_buf = NULL;
+    return;
+  }
 
-  // dont log in interrupt context
-  //LEAF_NOTICE("MQTT message from server %s <= [%s] (q%d%s)",
-  //topic, payload_buf, (int)properties.qos, properties.retain?" retain":"");
-  struct PubsubReceiveMessage msg={.topic=new String(topic), .payload=new String(payload_buf), .properties=properties};
-  receiveQueueSend(&msg);
-  LEAF_LEAVE;
+  pubsubMessageFill(receive_frag_buf, index, payload, len);
+  if (receive_frag_buf->payload_len == receive_frag_buf->total) {
+    struct PubsubReceiveMessage msg={.buffer=receive_frag_buf};
+    receive_frag_buf = NULL;
+    receiveQueueSend(&msg);
+  }
 }
 
 void PubsubEspAsyncMQTTLeaf::initiate_sleep_ms(int ms)
@@ -136,7 +136,7 @@ int shell_msg(int argc, char** argv)
   }
 
 
-  if ((argc < 2) && (strcmp(args[0],"tsk")!=0)) {
+  if ((argc < 2) && (strcmp(args[0],"tsk")!=0) && (strcmp(args[0],"lat")!=0)) {
     ALERT("Invalid command '%s'", (argc>=1)?args[0]:"(none)");
     goto _done;
   }
@@ -228,6 +228,13 @@ int shell_msg(int argc, char** argv)
     flags &= ~PUBSUB_LOOPBACK;
     INFO("Routing do command %s", Topic.c_str());
   }
+  else if (strcasecmp(args[0],"lat")==0) {
+    // latency burst test, probes must really go to the broker so no loopback
+    Payload = Topic;
+    Topic = "cmd/pubsub_probe_burst";
+    flags &= ~PUBSUB_LOOPBACK;
+    INFO("Latency probe burst of %s", Payload.c_str());
+  }
 #if USE_PREFS
   else if (strcasecmp(args[0],"ena")==0) {
     INFO("Enabling preference %s", Topic.c_str());
@@ -404,6 +411,7 @@ int shell_help(int argc, char** argv)
   shell_println("         dbg: set debug to <arg1> (0=alert 1=notice 2=info 3=debug)");
   shell_println("          do: as if published to <arg1> <arg2>, with mqtt enabled");
   shell_println("         get: as if published to get/<arg1> <arg2>");
+  shell_println("         lat: round-trip latency test, <arg1> probes (default 10)");
   shell_println("         msg: send to leaf <arg1> topic=<arg2> payload=<arg3>");
   shell_println("         pin: do GPIO. 'pin NUM {mode|write|read}' (mode=out/in)");
   shell_println("         set: as if published to set/<arg1> <arg2>");
@@ -672,6 +680,7 @@ public:
     shell_register(shell_msg, PSTR("at"));
     shell_register(shell_msg, PSTR("msg"));
     shell_register(shell_msg, PSTR("tsk"));
+    shell_register(shell_msg, PSTR("lat"));
     shell_register(shell_msg, PSTR("mem"));
     shell_register(shell_msg, PSTR("exit"));
     shell_register(shell_msg, PSTR("leaf"));
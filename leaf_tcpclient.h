@@ -26,6 +26,7 @@ public:
   char *rx_buf=NULL;
   char *tx_buf=NULL;
   bool connected = false;
+  bool pool_keep = false;
   int reconnect_sec = 30;
   unsigned long connected_at =0;
   unsigned long disconnected_at =0;
@@ -68,6 +69,7 @@ public:
     registerValue(HERE, "tcp_port", VALUE_KIND_INT, &port, "Port number to which TCP client connects");
     registerValue(HERE, "tcp_reconnect_sec", VALUE_KIND_INT, &reconnect_sec, "Seconds after which to retry TCP connection (0=off)", ACL_GET_SET);
     registerValue(HERE, "tcp_status_sec", VALUE_KIND_INT, &status_sec, "Seconds after which to publish stats", ACL_GET_SET);
+    registerValue(HERE, "tcp_pool_keep", VALUE_KIND_BOOL, &pool_keep, "On disconnect leave the connection open in the IP leaf's pool, for the next connect to reuse", ACL_GET_SET);
 
     registerCommand(HERE, "connect", "Initiate TCP connection");
     registerCommand(HERE, "disconnect", "Terminate TCP connection");
@@ -178,7 +180,7 @@ public:
     rcvd_count = 0;
 
     fslog(HERE, TCP_LOG_FILE, "TCP disconnect #%d slot %d %s:%d", conn_count, client_slot, host.c_str(), port);
-    ipLeaf->tcpRelease(client);
+    ipLeaf->tcpRelease(client, pool_keep);
     client = NULL;
     client_slot = -1;
 
@@ -247,6 +249,11 @@ public:
   bool disconnect()
   {
     LEAF_ENTER(L_NOTICE);
+    if (pool_keep && client && client->connected()) {
+      // hand the open connection back to the pool instead of closing it
+      onTcpDisconnect();
+      LEAF_RETURN(true);
+    }
     client->stop();
     // loop will pick up the change of state and invoke onTcpDisconnect()
     LEAF_RETURN(true);
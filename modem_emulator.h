@@ -0,0 +1,674 @@
+#ifndef _MODEM_EMULATOR_H
+#define _MODEM_EMULATOR_H
+
+#include <StreamString.h>
+#include "modem_tokenizer.h"
+
+//
+// A scriptable stand-in for a SIMCom SIM7000/SIM7080 modem.
+//
+// It looks like a Stream to the modem driver, just as PseudoStream
+// does, so a modem leaf can be pointed at it with modemSetStream()
+// before setup, eg
+//
+//    SimcomModemEmulator *emu = new SimcomModemEmulator();
+//    emu->setLatency(50, 20);
+//    emu->setThroughput(11520);
+//    lte->modemSetStream(emu);
+//
+// It answers the AT commands that stacx uses (network attach, MQTT,
+// TCP sockets, GNSS, SMS and FTP) and can be told to add latency, fail
+// commands, throttle its output or inject unsolicited result codes.
+// It needs nothing beyond the Arduino core (Stream, String, millis,
+// random) and runs on the target itself, standing in for the modem so
+// that the modem stack can be exercised and benchmarked without one
+// (see examples/lte_emulator).  There is no host build.
+//
+
+#ifndef MODEM_EMULATOR_PENDING
+#define MODEM_EMULATOR_PENDING 32
+#endif
+
+#ifndef MODEM_EMULATOR_SOCKETS
+#define MODEM_EMULATOR_SOCKETS 4
+#endif
+
+#ifndef MODEM_EMULATOR_SMS
+#define MODEM_EMULATOR_SMS 40
+#endif
+
+#ifndef MODEM_EMULATOR_SUBS
+#define MODEM_EMULATOR_SUBS 16
+#endif
+
+#ifndef MODEM_EMULATOR_SCRIPTS
+#define MODEM_EMULATOR_SCRIPTS 8
+#endif
+
+//@************************** class SimcomModemEmulator ***************************
+
+class SimcomModemEmulator: public Stream
+{
+public:
+  SimcomModemEmulator(bool sim7080=true)
+  {
+    this->sim7080 = sim7080;
+    model = sim7080?"SIM7080":"SIM7000G";
+  }
+
+  //
+  // Stream interface, as seen by the modem driver
+  //
+  int available() {
+    pump();
+    int n = tx.length();
+    if (throughput && (n > (int)tx_credit)) n = (int)tx_credit;
+    return n;
+  }
+
+  int read() {
+    if (available() <= 0) return -1;
+    if (throughput) tx_credit -= 1;
+    ++stat_bytes_out;
+    return tx.read();
+  }
+
+  int peek() {
+    if (available() <= 0) return -1;
+    return tx.peek();
+  }
+
+  void flush() {}
+
+  size_t write(const uint8_t *buffer, size_t size) {
+    for (size_t i=0; i<size; i++) write(buffer[i]);
+    return size;
+  }
+
+  size_t write(uint8_t c) {
+    ++stat_bytes_in;
+    if (skip_lf) {
+      // the LF of a CRLF command terminator is not part of any data that follows
+      skip_lf = false;
+      if (c == '\n') return 1;
+    }
+    if (data_want) {
+      dataByte(c);
+      return 1;
+    }
+    if (echo) emit(String((char)c), 0);
+    if ((c == '\r') || (c == '\n')) {
+      skip_lf = (c == '\r');
+      if (line.length()) {
+	String cmd = line;
+	line = "";
+	command(cmd);
+      }
+    }
+    else {
+      line += (char)c;
+    }
+    return 1;
+  }
+
+  //
+  // Scripting interface
+  //
+
+  // Delay before each response, plus up to jitter_ms of random extra
+  void setLatency(int ms, int jitter_ms=0) { latency = ms; jitter = jitter_ms; }
+
+  // Limit the rate at which the modem sends to us (0 is unlimited)
+  void setThroughput(int bytes_per_sec) {
+    throughput = bytes_per_sec;
+    tx_credit = 0;
+    tx_credit_at = millis();
+  }
+
+  // Fail this percentage of commands at random with ERROR
+  void setErrorRate(int percent) { error_rate = percent; }
+
+  // Answer commands beginning with prefix with the given lines (separated
+  // by \n, final result code included) instead of the built in behaviour.
+  // A count limits the number of times the script applies (-1 forever).
+  bool script(const char *prefix, const char *response, int count=-1) {
+    for (int i=0; i<MODEM_EMULATOR_SCRIPTS; i++) {
+      if (script_count[i] == 0) {
+	script_prefix[i] = prefix;
+	script_response[i] = response;
+	script_count[i] = count;
+	return true;
+      }
+    }
+    return false;
+  }
+  void clearScripts() {
+    for (int i=0; i<MODEM_EMULATOR_SCRIPTS; i++) script_count[i] = 0;
+  }
+
+  // Deliver an unsolicited line after delay_ms
+  void injectURC(const String &urc, int delay_ms=0) { emit("\r\n"+urc+"\r\n", delay_ms); }
+
+  void setSignal(int csq) { rssi = csq; }
+  void setGnssInfo(const char *info) { gnss_info = info; }
+  void setClock(const char *cclk) { clock = cclk; }
+  void setLinkUp(bool up, int delay_ms=0) {
+    if (up == link_up) return;
+    link_up = up;
+    injectURC(sim7080?(up?"+APP PDP: 0,ACTIVE":"+APP PDP: 0,DEACTIVE"):(up?"+APP PDP: ACTIVE":"+APP PDP: DEACTIVE"), delay_ms);
+    if (!up && mqtt_connected) dropBroker();
+  }
+  void dropBroker() {
+    mqtt_connected = false;
+    injectURC("+SMSTATE: 0");
+  }
+
+  // Deliver an MQTT message as if the broker had sent it
+  void brokerPublish(const String &topic, const String &payload, int delay_ms=0) {
+    injectURC("+SMSUB: \""+topic+"\",\""+payload+"\"", delay_ms);
+  }
+
+  // Queue data as if it had arrived from the far end of a socket
+  void socketInject(int cid, const String &data) {
+    if ((cid < 0) || (cid >= MODEM_EMULATOR_SOCKETS)) return;
+    sock_rx[cid] += data;
+    injectURC("+CADATAIND: "+String(cid));
+  }
+  // Echo socket writes back as received data
+  void setSocketEcho(bool e) { sock_echo = e; }
+
+  bool addSMS(const String &sender, const String &text, bool notify=true) {
+    for (int i=0; i<MODEM_EMULATOR_SMS; i++) {
+      if (sms_sender[i].length()==0) {
+	sms_sender[i] = sender;
+	sms_text[i] = text;
+	sms_read[i] = false;
+	if (notify) injectURC("+CMTI: \"SM\","+String(i));
+	return true;
+      }
+    }
+    return false;
+  }
+
+  void setFtpDownload(const String &data) { ftp_download = data; }
+  const String &ftpUploaded() { return ftp_upload; }
+
+  bool linkIsUp() { return link_up; }
+  bool brokerIsConnected() { return mqtt_connected; }
+
+  // The most recent MQTT publish seen
+  String last_pub_topic;
+  String last_pub_payload;
+
+  unsigned long stat_commands = 0;
+  unsigned long stat_errors = 0;
+  unsigned long stat_bytes_in = 0;
+  unsigned long stat_bytes_out = 0;
+  unsigned long stat_publishes = 0;
+
+protected:
+  bool sim7080;
+  String model;
+  bool echo = false;
+  bool skip_lf = false;
+  String line;
+  StreamString tx;
+
+  int latency = 10;
+  int jitter = 0;
+  int error_rate = 0;
+  int throughput = 0;
+  float tx_credit = 0;
+  unsigned long tx_credit_at = 0;
+
+  unsigned long pend_due[MODEM_EMULATOR_PENDING];
+  String pend_text[MODEM_EMULATOR_PENDING];
+  int pend_count = 0;
+
+  String script_prefix[MODEM_EMULATOR_SCRIPTS];
+  String script_response[MODEM_EMULATOR_SCRIPTS];
+  int script_count[MODEM_EMULATOR_SCRIPTS] = {0};
+
+  // data mode (after a '>' prompt)
+  enum { DATA_SMPUB, DATA_CASEND, DATA_CMGS, DATA_FTPPUT } data_kind;
+  int data_want = 0;
+  int data_cid = 0;
+  String data_buf;
+  String data_topic;
+
+  int rssi = 21;
+  bool link_up = false;
+  bool mqtt_connected = false;
+  String subs[MODEM_EMULATOR_SUBS];
+  bool gnss_power = false;
+  String gnss_info = "1,1,20240131102207.000,-27.565879,152.936990,16.700,0.00,103.8,1,,0.6,0.9,0.7,,25,9,3,,,34,,";
+  String clock = "24/01/31,10:22:07+40";
+
+  bool sock_open[MODEM_EMULATOR_SOCKETS] = {false};
+  String sock_rx[MODEM_EMULATOR_SOCKETS];
+  bool sock_echo = true;
+
+  String sms_sender[MODEM_EMULATOR_SMS];
+  String sms_text[MODEM_EMULATOR_SMS];
+  bool sms_read[MODEM_EMULATOR_SMS] = {false};
+  int sms_sent = 0;
+
+  String ftp_download;
+  int ftp_download_pos = 0;
+  String ftp_upload;
+
+  int delayFor() { return latency + (jitter?random(jitter):0); }
+
+  // Queue output to appear after delay_ms (order is preserved among
+  // items that fall due together)
+  void emit(const String &text, int delay_ms) {
+    if (pend_count >= MODEM_EMULATOR_PENDING) {
+      pump(true);
+    }
+    pend_due[pend_count] = millis() + delay_ms;
+    pend_text[pend_count] = text;
+    ++pend_count;
+  }
+
+  void respond(const String &text) { emit("\r\n"+text+"\r\n", delayFor()); }
+  void ok() { respond("OK"); }
+  void error() { ++stat_errors; respond("ERROR"); }
+  void prompt() { emit("\r\n> ", delayFor()); }
+
+  void pump(bool force=false) {
+    unsigned long now = millis();
+    int keep = 0;
+    for (int i=0; i<pend_count; i++) {
+      if (force || ((long)(now - pend_due[i]) >= 0)) {
+	tx.print(pend_text[i]);
+	force = false;
+      }
+      else {
+	if (keep != i) {
+	  pend_due[keep] = pend_due[i];
+	  pend_text[keep] = pend_text[i];
+	}
+	++keep;
+      }
+    }
+    for (int i=keep; i<pend_count; i++) pend_text[i] = "";
+    pend_count = keep;
+
+    if (throughput) {
+      tx_credit += (now - tx_credit_at) * (float)throughput / 1000;
+      tx_credit_at = now;
+      // allow at most a quarter second of burst
+      if (tx_credit > (throughput/4 + 1)) tx_credit = throughput/4 + 1;
+    }
+  }
+
+  static bool topicMatch(const String &filter, const String &topic) {
+    int f=0, t=0;
+    while ((f < (int)filter.length()) && (t < (int)topic.length())) {
+      if (filter[f] == '#') return true;
+      if (filter[f] == '+') {
+	while ((t < (int)topic.length()) && (topic[t] != '/')) ++t;
+	++f;
+	continue;
+      }
+      if (filter[f] != topic[t]) return false;
+      ++f; ++t;
+    }
+    if ((f < (int)filter.length()) && (filter.substring(f) == "/#")) return true;
+    return (f == (int)filter.length()) && (t == (int)topic.length());
+  }
+
+  void dataByte(uint8_t c) {
+    if (data_kind == DATA_CMGS) {
+      if (c == 0x1A) {
+	data_want = 0;
+	respond("+CMGS: "+String(++sms_sent)+"\r\n\r\nOK");
+      }
+      else {
+	data_buf += (char)c;
+      }
+      return;
+    }
+
+    data_buf += (char)c;
+    if (--data_want > 0) return;
+
+    switch (data_kind) {
+    case DATA_SMPUB:
+      ++stat_publishes;
+      last_pub_topic = data_topic;
+      last_pub_payload = data_buf;
+      ok();
+      for (int i=0; i<MODEM_EMULATOR_SUBS; i++) {
+	if (subs[i].length() && topicMatch(subs[i], data_topic)) {
+	  brokerPublish(data_topic, data_buf, delayFor());
+	  break;
+	}
+      }
+      break;
+    case DATA_CASEND:
+      ok();
+      if (sock_echo) {
+	sock_rx[data_cid] += data_buf;
+	injectURC("+CADATAIND: "+String(data_cid), delayFor());
+      }
+      break;
+    case DATA_FTPPUT:
+      ftp_upload += data_buf;
+      ok();
+      injectURC("+FTPPUT: 1,1,1360", delayFor());
+      break;
+    default:
+      break;
+    }
+    data_buf = "";
+  }
+
+  bool scripted(const String &cmd) {
+    for (int i=0; i<MODEM_EMULATOR_SCRIPTS; i++) {
+      if (script_count[i] && cmd.startsWith(script_prefix[i])) {
+	if (script_count[i] > 0) --script_count[i];
+	String r = script_response[i];
+	r.replace("\n", "\r\n");
+	respond(r);
+	return true;
+      }
+    }
+    return false;
+  }
+
+  void command(String cmd) {
+    ++stat_commands;
+    cmd.trim();
+    if (scripted(cmd)) return;
+    if (!cmd.startsWith("AT") && !cmd.startsWith("at")) return;
+    if (error_rate && (random(100) < error_rate) && (cmd != "AT")) {
+      error();
+      return;
+    }
+
+    // split AT+VERB=args
+    String args;
+    int eq = cmd.indexOf('=');
+    if (eq > 0) {
+      args = cmd.substring(eq+1);
+    }
+    ModemFieldTokenizer fields(args.c_str(), args.length());
+
+    if ((cmd == "AT") || cmd.startsWith("AT&") || (cmd == "ATZ")) ok();
+    else if (cmd == "ATE0") { echo = false; ok(); }
+    else if (cmd == "ATE1") { echo = true; ok(); }
+    else if ((cmd == "ATI") || (cmd == "AT+CGMM")) respond(model+"\r\n\r\nOK");
+    else if (cmd == "AT+CGMR") respond("Revision:"+model+"R01\r\n\r\nOK");
+    else if (cmd == "AT+CGSN") respond("869951030000001\r\n\r\nOK");
+    else if (cmd == "AT+CIMI") respond("505010000000001\r\n\r\nOK");
+    else if ((cmd == "AT+CCID") || (cmd == "AT+CICCID")) respond("8961010000000000001\r\n\r\nOK");
+    else if (cmd == "AT+CPIN?") respond("+CPIN: READY\r\n\r\nOK");
+    else if (cmd == "AT+CSQ") respond("+CSQ: "+String(rssi)+",99\r\n\r\nOK");
+    else if (cmd == "AT+CFUN?") respond("+CFUN: 1\r\n\r\nOK");
+    else if (cmd == "AT+CBC") respond("+CBC: 0,85,3900\r\n\r\nOK");
+    else if ((cmd == "AT+CREG?") || (cmd == "AT+CGREG?") || (cmd == "AT+CEREG?")) {
+      respond(cmd.substring(2, cmd.length()-1)+": 0,"+String(link_up?1:2)+"\r\n\r\nOK");
+    }
+    else if (cmd == "AT+CPSI?") {
+      respond(String("+CPSI: ")+(link_up?"LTE CAT-M1,Online,505-01,0x3072,135209991,318,EUTRAN-BAND28,9410,5,5,-12,-96,-66,13":"NO SERVICE,Online")+"\r\n\r\nOK");
+    }
+    else if (cmd == "AT+CCLK?") respond("+CCLK: \""+clock+"\"\r\n\r\nOK");
+    else if (cmd.startsWith("AT+CNACT")) cmdCnact(cmd, fields);
+    else if (cmd.startsWith("AT+SM")) cmdMqtt(cmd, fields);
+    else if (cmd.startsWith("AT+CA")) cmdSocket(cmd, fields);
+    else if (cmd.startsWith("AT+CGNS")) cmdGnss(cmd, fields);
+    else if (cmd.startsWith("AT+CM") || cmd.startsWith("AT+CPMS") || cmd.startsWith("AT+CSDH")) cmdSms(cmd, fields);
+    else if (cmd.startsWith("AT+FTP")) cmdFtp(cmd, fields);
+    else {
+      // settings the emulator has no opinion about
+      ok();
+    }
+  }
+
+  void cmdCnact(const String &cmd, ModemFieldTokenizer &fields) {
+    if (cmd == "AT+CNACT?") {
+      if (sim7080) {
+	respond(String("+CNACT: 0,")+(link_up?"1,\"10.64.1.2\"":"0,\"0.0.0.0\"")+"\r\n+CNACT: 1,0,\"0.0.0.0\"\r\n\r\nOK");
+      }
+      else {
+	respond(String("+CNACT: ")+(link_up?"1,\"10.64.1.2\"":"0,\"0.0.0.0\"")+"\r\n\r\nOK");
+      }
+      return;
+    }
+    if (sim7080) fields.next(); // pdpidx
+    bool up = fields.nextInt()!=0;
+    // the command is acknowledged before the PDP context changes state
+    int delay_ms = delayFor();
+    emit("\r\nOK\r\n", delay_ms);
+    link_up = !up; // setLinkUp only reports changes
+    setLinkUp(up, delay_ms + delayFor());
+  }
+
+  void cmdMqtt(const String &cmd, ModemFieldTokenizer &fields) {
+    ModemToken topic;
+    if (cmd.startsWith("AT+SMCONF")) ok();
+    else if (cmd == "AT+SMCONN") {
+      if (!link_up) {
+	error();
+	return;
+      }
+      mqtt_connected = true;
+      emit("\r\nOK\r\n", delayFor()*5);
+    }
+    else if (cmd == "AT+SMDISC") {
+      mqtt_connected = false;
+      ok();
+    }
+    else if (cmd == "AT+SMSTATE?") respond("+SMSTATE: "+String(mqtt_connected?1:0)+"\r\n\r\nOK");
+    else if (cmd.startsWith("AT+SMSUB=") && fields.next(&topic)) {
+      if (!mqtt_connected) {
+	error();
+	return;
+      }
+      for (int i=0; i<MODEM_EMULATOR_SUBS; i++) {
+	if (subs[i].length()==0) {
+	  subs[i] = topic.toString();
+	  break;
+	}
+      }
+      ok();
+    }
+    else if (cmd.startsWith("AT+SMUNSUB=") && fields.next(&topic)) {
+      for (int i=0; i<MODEM_EMULATOR_SUBS; i++) {
+	if (topic.equals(subs[i].c_str())) subs[i] = "";
+      }
+      ok();
+    }
+    else if (cmd.startsWith("AT+SMPUB=") && fields.next(&topic)) {
+      int len = fields.nextInt(-1);
+      if (!mqtt_connected || (len <= 0)) {
+	error();
+	return;
+      }
+      data_kind = DATA_SMPUB;
+      data_topic = topic.toString();
+      data_buf = "";
+      data_want = len;
+      prompt();
+    }
+    else error();
+  }
+
+  void cmdSocket(const String &cmd, ModemFieldTokenizer &fields) {
+    if (cmd.startsWith("AT+CACFG=")) {
+      // "KEEPALIVE", "TIMEOUT" and the like, keyed by a quoted name
+      ModemToken name;
+      if (!fields.next(&name) || name.isEmpty()) {
+	error();
+	return;
+      }
+      ok();
+      return;
+    }
+    if (cmd == "AT+CASTATE?") {
+      String r;
+      for (int i=0; i<MODEM_EMULATOR_SOCKETS; i++) {
+	if (sock_open[i]) r += "+CASTATE: "+String(i)+",1\r\n";
+      }
+      respond(r+"\r\nOK");
+      return;
+    }
+    int cid = fields.nextInt(-1);
+    if ((cid < 0) || (cid >= MODEM_EMULATOR_SOCKETS)) {
+      error();
+      return;
+    }
+    if (cmd.startsWith("AT+CAOPEN=")) {
+      if (!link_up) {
+	error();
+	return;
+      }
+      sock_open[cid] = true;
+      sock_rx[cid] = "";
+      respond("+CAOPEN: "+String(cid)+",0\r\n\r\nOK");
+    }
+    else if (cmd.startsWith("AT+CACLOSE=")) {
+      sock_open[cid] = false;
+      ok();
+    }
+    else if (cmd.startsWith("AT+CASEND=")) {
+      int len = fields.nextInt(-1);
+      if (!sock_open[cid] || (len <= 0)) {
+	error();
+	return;
+      }
+      data_kind = DATA_CASEND;
+      data_cid = cid;
+      data_buf = "";
+      data_want = len;
+      prompt();
+    }
+    else if (cmd.startsWith("AT+CARECV=")) {
+      int want = fields.nextInt(0);
+      int n = sock_rx[cid].length();
+      if (n > want) n = want;
+      if (n == 0) {
+	respond("+CARECV: 0\r\n\r\nOK");
+	return;
+      }
+      respond("+CARECV: "+String(n)+","+sock_rx[cid].substring(0, n)+"\r\n\r\nOK");
+      sock_rx[cid].remove(0, n);
+    }
+    else error();
+  }
+
+  void cmdGnss(const String &cmd, ModemFieldTokenizer &fields) {
+    if (cmd == "AT+CGNSPWR?") respond("+CGNSPWR: "+String(gnss_power?1:0)+"\r\n\r\nOK");
+    else if (cmd.startsWith("AT+CGNSPWR=")) {
+      gnss_power = fields.nextInt()!=0;
+      ok();
+    }
+    else if (cmd == "AT+CGNSINF") {
+      respond("+CGNSINF: "+(gnss_power?gnss_info:String("0,,,,,,,,,,,,,,,,,,,,"))+"\r\n\r\nOK");
+    }
+    else ok();
+  }
+
+  String smsHeader(int i, bool detailed) {
+    String h = String(sms_read[i]?"\"REC READ\",\"":"\"REC UNREAD\",\"")+sms_sender[i]+"\",\"\",\""+clock+"\"";
+    if (detailed) h += ",145,4,0,0,\"+61418706700\",145,"+String(sms_text[i].length());
+    return h;
+  }
+
+  void cmdSms(const String &cmd, ModemFieldTokenizer &fields) {
+    if (cmd == "AT+CPMS?") {
+      int n = 0;
+      for (int i=0; i<MODEM_EMULATOR_SMS; i++) if (sms_sender[i].length()) ++n;
+      String u = "\"SM\","+String(n)+","+String(MODEM_EMULATOR_SMS);
+      respond("+CPMS: "+u+","+u+","+u+"\r\n\r\nOK");
+    }
+    else if (cmd.startsWith("AT+CMGL")) {
+      String r;
+      for (int i=0; i<MODEM_EMULATOR_SMS; i++) {
+	if (sms_sender[i].length()==0) continue;
+	r += "+CMGL: "+String(i)+","+smsHeader(i,false)+",145,"+String(sms_text[i].length())+"\r\n"+sms_text[i]+"\r\n";
+	sms_read[i] = true;
+      }
+      respond(r+"\r\nOK");
+    }
+    else if (cmd.startsWith("AT+CMGR=")) {
+      int i = fields.nextInt(-1);
+      if ((i < 0) || (i >= MODEM_EMULATOR_SMS) || (sms_sender[i].length()==0)) {
+	++stat_errors;
+	respond("+CMS ERROR: 321");
+	return;
+      }
+      respond("+CMGR: "+smsHeader(i,true)+"\r\n"+sms_text[i]+"\r\n\r\nOK");
+      sms_read[i] = true;
+    }
+    else if (cmd.startsWith("AT+CMGD=")) {
+      int i = fields.nextInt(-1);
+      int flag = fields.nextInt(0);
+      for (int j=0; j<MODEM_EMULATOR_SMS; j++) {
+	// with a flag the index is ignored
+	if ((flag == 0)?(j == i):((flag == 4) || sms_read[j])) {
+	  sms_sender[j] = sms_text[j] = "";
+	}
+      }
+      ok();
+    }
+    else if (cmd.startsWith("AT+CMGS=")) {
+      data_kind = DATA_CMGS;
+      data_buf = "";
+      data_want = 1; // until ctrl-Z
+      prompt();
+    }
+    else ok();
+  }
+
+  void cmdFtp(const String &cmd, ModemFieldTokenizer &fields) {
+    if (cmd == "AT+FTPGET=1") {
+      ftp_download_pos = 0;
+      ok();
+      injectURC("+FTPGET: 1,1", delayFor()*2);
+    }
+    else if (cmd.startsWith("AT+FTPGET=2,")) {
+      fields.next();
+      int want = fields.nextInt(0);
+      int n = ftp_download.length() - ftp_download_pos;
+      if (n > want) n = want;
+      respond("+FTPGET: 2,"+String(n)+"\r\n"+ftp_download.substring(ftp_download_pos, ftp_download_pos+n)+"\r\nOK");
+      ftp_download_pos += n;
+      if (ftp_download_pos >= (int)ftp_download.length()) {
+	injectURC("+FTPGET: 1,0", delayFor());
+      }
+      else {
+	injectURC("+FTPGET: 1,1", delayFor());
+      }
+    }
+    else if (cmd == "AT+FTPPUT=1") {
+      ftp_upload = "";
+      ok();
+      injectURC("+FTPPUT: 1,1,1360", delayFor()*2);
+    }
+    else if (cmd.startsWith("AT+FTPPUT=2,")) {
+      fields.next();
+      int len = fields.nextInt(0);
+      if (len == 0) {
+	ok();
+	injectURC("+FTPPUT: 1,0", delayFor());
+	return;
+      }
+      data_kind = DATA_FTPPUT;
+      data_buf = "";
+      data_want = len;
+      respond("+FTPPUT: 2,"+String(len));
+    }
+    else {
+      // FTPCID, FTPSERV, FTPUN, FTPPW, FTPGETNAME, FTPPUTPATH etc
+      ok();
+    }
+  }
+};
+
+#endif
+// local Variables:
+// mode: C++
+// c-basic-offset: 2
+// End:
@@ -0,0 +1,298 @@
+#ifndef _MODEM_TOKENIZER_H
+#define _MODEM_TOKENIZER_H
+
+#include <algorithm>
+
+//
+// Zero-copy helpers for picking apart modem responses.
+//
+// A ModemToken is a (pointer, length) view into some buffer owned by
+// somebody else (usually the modem response buffer or a ModemLineRing).
+// It is only valid for as long as that buffer is left alone.
+//
+
+//@******************************* struct ModemToken *****************************
+
+struct ModemToken
+{
+  const char *ptr;
+  int len;
+
+  ModemToken() : ptr(NULL), len(0) {}
+  ModemToken(const char *p, int l=-1) : ptr(p), len((l<0)?(p?strlen(p):0):l) {}
+
+  bool isEmpty() { return len==0; }
+  bool equals(const char *s) {
+    int l = strlen(s);
+    return (l==len) && (strncmp(ptr, s, l)==0);
+  }
+  bool startsWith(const char *s) {
+    int l = strlen(s);
+    return (l<=len) && (strncmp(ptr, s, l)==0);
+  }
+
+  // The remainder of the view after a leading prefix (empty if absent)
+  ModemToken after(const char *prefix) {
+    int l = strlen(prefix);
+    if (!startsWith(prefix)) return ModemToken(ptr+len, 0);
+    return ModemToken(ptr+l, len-l);
+  }
+
+  ModemToken sub(int start, int count=-1) {
+    if (start > len) start = len;
+    if ((count < 0) || (start+count > len)) count = len-start;
+    return ModemToken(ptr+start, count);
+  }
+
+  long toInt(long dflt=0) {
+    int i = 0;
+    bool neg = false;
+    long v = 0;
+    if ((i<len) && ((ptr[i]=='-') || (ptr[i]=='+'))) neg = (ptr[i++]=='-');
+    if ((i>=len) || !isdigit(ptr[i])) return dflt;
+    while ((i<len) && isdigit(ptr[i])) {
+      v = v*10 + (ptr[i++]-'0');
+    }
+    return neg?-v:v;
+  }
+
+  double toDouble(double dflt=NAN) {
+    // strtod wants a terminated string, numbers are short so use the stack
+    char tmp[32];
+    if ((len == 0) || (len >= (int)sizeof(tmp))) return dflt;
+    memcpy(tmp, ptr, len);
+    tmp[len]='\0';
+    char *end;
+    double v = strtod(tmp, &end);
+    return (end==tmp)?dflt:v;
+  }
+
+  int copyTo(char *buf, int buf_max) {
+    int n = (len < buf_max)?len:(buf_max-1);
+    if (n<0) return 0;
+    memcpy(buf, ptr, n);
+    buf[n]='\0';
+    return n;
+  }
+
+  String toString() {
+    String s;
+    s.reserve(len);
+    for (int i=0; i<len; i++) s += ptr[i];
+    return s;
+  }
+};
+
+//@************************** class ModemFieldTokenizer **************************
+//
+// Walk the separated fields of a response line such as
+//
+//    "REC READ","+61412345678","","24/01/31,10:22:07+40",145,4,0,0,"+61418706700",145,5
+//
+// Separators inside double quotes do not split fields, and the quotes
+// themselves are not part of the field returned.
+//
+class ModemFieldTokenizer
+{
+protected:
+  const char *pos;
+  const char *end;
+  char separator;
+  bool exhausted = false;
+
+public:
+  ModemFieldTokenizer(const char *p, int len=-1, char separator=',')
+  {
+    if (len < 0) len = p?strlen(p):0;
+    this->pos = p;
+    this->end = p+len;
+    this->separator = separator;
+  }
+  ModemFieldTokenizer(ModemToken t, char separator=',')
+    : ModemFieldTokenizer(t.ptr, t.len, separator)
+  {}
+
+  bool atEnd() { return exhausted; }
+
+  bool next(ModemToken *field_r=NULL)
+  {
+    if (exhausted) return false;
+    while ((pos < end) && (*pos == ' ')) ++pos;
+
+    const char *start = pos;
+    const char *stop;
+    if ((pos < end) && (*pos == '"')) {
+      start = ++pos;
+      while ((pos < end) && (*pos != '"')) ++pos;
+      stop = pos;
+      // skip to the separator (there should be nothing between)
+      while ((pos < end) && (*pos != separator)) ++pos;
+    }
+    else {
+      while ((pos < end) && (*pos != separator)) ++pos;
+      stop = pos;
+      while ((stop > start) && (stop[-1] == ' ')) --stop;
+    }
+
+    if (pos < end) {
+      ++pos; // consume the separator
+    }
+    else {
+      exhausted = true;
+    }
+    if (field_r) *field_r = ModemToken(start, stop-start);
+    return true;
+  }
+
+  // Advance to the n'th field from here (1 is the next field)
+  bool field(int n, ModemToken *field_r=NULL)
+  {
+    while (n > 1) {
+      if (!next()) return false;
+      --n;
+    }
+    return next(field_r);
+  }
+
+  bool last(ModemToken *field_r=NULL)
+  {
+    ModemToken f;
+    bool found = false;
+    while (next(&f)) found = true;
+    if (found && field_r) *field_r = f;
+    return found;
+  }
+
+  long nextInt(long dflt=0)
+  {
+    ModemToken f;
+    return next(&f)?f.toInt(dflt):dflt;
+  }
+};
+
+//@***************************** class ModemLineRing ******************************
+//
+// A byte ring from which whole lines are taken as views, without
+// copying.  The line terminator is overwritten with a NUL so views may
+// also be handed to C string functions.  A line that would wrap the end
+// of the ring is rotated into place first, which is rare as the ring is
+// normally emptied line by line.
+//
+// A view is valid until the next put or fill.
+//
+class ModemLineRing
+{
+protected:
+  char *buf;
+  int size;
+  int head = 0;   // oldest unconsumed byte
+  int count = 0;
+  int scan = 0;   // bytes already known to hold no newline
+  int overflow = 0;
+
+public:
+  ModemLineRing(int size)
+  {
+    this->size = size;
+    buf = new char[size];
+  }
+  ~ModemLineRing() { delete[] buf; }
+
+  int length() { return count; }
+  int room() { return size-count; }
+  int overflowCount() { return overflow; }
+  void clear() { head = count = scan = 0; }
+
+  bool put(char c)
+  {
+    if (count >= size) {
+      ++overflow;
+      return false;
+    }
+    buf[(head+count)%size] = c;
+    ++count;
+    return true;
+  }
+
+  int put(const char *data, int len)
+  {
+    int n;
+    for (n=0; (n<len) && put(data[n]); n++) {}
+    return n;
+  }
+
+  char at(int i) { return (i < count)?buf[(head+i)%size]:'\0'; }
+
+  // Take bytes from the front of the ring (for readers that do not work
+  // line by line), returns the number taken.
+  int get(char *out, int max)
+  {
+    int n = (max < count)?max:count;
+    for (int i=0; i<n; i++) {
+      out[i] = buf[(head+i)%size];
+    }
+    head = (head+n)%size;
+    count -= n;
+    scan = (scan > n)?(scan-n):0;
+    return n;
+  }
+
+  //
+  // Take in what the stream has, up to max bytes.  With to_newline the
+  // fill stops once a line is complete, so that anything after it (such
+  // as a binary payload announced by that line) is left in the stream.
+  //
+  int fill(Stream *s, int max=-1, bool to_newline=false)
+  {
+    int got = 0;
+    while ((count < size) && ((max < 0) || (got < max)) && s->available()) {
+      int c = s->read();
+      if (c < 0) break;
+      buf[(head+count)%size] = (char)c;
+      ++count;
+      ++got;
+      if (to_newline && (c == '\n')) break;
+    }
+    return got;
+  }
+
+  bool getLine(ModemToken *line_r)
+  {
+    int nl = -1;
+    for (int i=scan; i<count; i++) {
+      if (buf[(head+i)%size] == '\n') {
+	nl = i;
+	break;
+      }
+    }
+    if (nl < 0) {
+      scan = count;
+      if (count < size) return false;
+      // ring is full without a newline, give up the overlong line
+      nl = count-1;
+      ++overflow;
+    }
+
+    if (head+nl >= size) {
+      std::rotate(buf, buf+head, buf+size);
+      head = 0;
+    }
+    int len = nl;
+    buf[head+nl] = '\0';
+    if ((len > 0) && (buf[head+len-1] == '\r')) {
+      buf[head+--len] = '\0';
+    }
+    if (line_r) *line_r = ModemToken(buf+head, len);
+
+    head = (head+nl+1)%size;
+    count -= nl+1;
+    scan = 0;
+    return true;
+  }
+};
+
+#endif
+// local Variables:
+// mode: C++
+// c-basic-offset: 2
+// End:
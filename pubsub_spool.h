@@ -0,0 +1,158 @@
+#ifndef _PUBSUB_SPOOL_H
+#define _PUBSUB_SPOOL_H
+
+#include <FS.h>
+
+//@******************************* class PubsubSpool *******************************
+//
+// Overflow for a pubsub send queue, kept in a flash file so that a burst
+// (or a long hold between radio upload windows) does not cost messages.
+//
+// The file is a sequence of records, read from the front and appended to
+// at the back:
+//
+//    flags class topic_len(2) payload_len(2) topic payload
+//
+// (flags being qos | retain<<2, lengths little-endian).  When the reader
+// catches up with the writer the file is removed, until then it may not
+// grow beyond max_bytes.  A spool found at startup is delivered again
+// from the beginning, so after a reset some messages may be sent twice
+// rather than not at all.
+//
+// Not thread safe, the owner holds a lock around each call.
+//
+class PubsubSpool
+{
+public:
+  fs::FS *fs = NULL;
+  const char *path = "/pubsub_spool.bin";
+  int max_bytes = 32768;
+  unsigned long spooled = 0;
+  unsigned long unspooled = 0;
+  unsigned long refused = 0;
+
+  static const int HEADER = 6;
+
+  bool ready() { return fs != NULL; }
+  int pending() { return records; }
+  size_t size() { return write_pos - read_pos; }
+
+  // Take up an existing spool (left by a reset)
+  void begin(fs::FS *fs)
+  {
+    this->fs = fs;
+    read_pos = write_pos = 0;
+    records = 0;
+    sealed = false;
+    fs::File file = fs->open(path, "r");
+    if (!file) return;
+    size_t file_size = file.size();
+    uint8_t hdr[HEADER];
+    while (file.read(hdr, HEADER) == HEADER) {
+      size_t body = (hdr[2] | (hdr[3]<<8)) + (hdr[4] | (hdr[5]<<8));
+      // (a truncated last record is ignored)
+      if ((write_pos + HEADER + body > file_size) || !file.seek(write_pos + HEADER + body)) break;
+      write_pos += HEADER + body;
+      ++records;
+    }
+    file.close();
+    if (!records) {
+      clear();
+    }
+    else if (write_pos != file_size) {
+      // appending after a torn record would misalign the rest, so
+      // deliver what there is and start afresh after that
+      sealed = true;
+    }
+  }
+
+  bool append(const char *topic, size_t topic_len, const char *payload, size_t payload_len, int qos, bool retain, int topic_class)
+  {
+    size_t need = HEADER + topic_len + payload_len;
+    if (!fs || sealed || (topic_len > 0xFFFF) || (payload_len > 0xFFFF) ||
+	(write_pos + need > (size_t)max_bytes)) {
+      ++refused;
+      return false;
+    }
+    fs::File file = fs->open(path, "a");
+    if (!file) {
+      ++refused;
+      return false;
+    }
+    uint8_t hdr[HEADER] = {
+      (uint8_t)((qos & 3) | (retain?4:0)),
+      (uint8_t)topic_class,
+      (uint8_t)(topic_len & 0xFF), (uint8_t)(topic_len >> 8),
+      (uint8_t)(payload_len & 0xFF), (uint8_t)(payload_len >> 8)
+    };
+    bool ok = (file.write(hdr, HEADER) == HEADER) &&
+      (file.write((const uint8_t *)topic, topic_len) == topic_len) &&
+      (file.write((const uint8_t *)payload, payload_len) == payload_len);
+    file.close();
+    if (!ok) {
+      // a partial record would misalign everything after it
+      clear();
+      ++refused;
+      return false;
+    }
+    write_pos += need;
+    ++records;
+    ++spooled;
+    return true;
+  }
+
+  bool next(String &topic, String &payload, int *qos_r, bool *retain_r, int *class_r)
+  {
+    if (!fs || !records) return false;
+    fs::File file = fs->open(path, "r");
+    if (!file || !file.seek(read_pos)) {
+      clear();
+      return false;
+    }
+    uint8_t hdr[HEADER];
+    bool ok = (file.read(hdr, HEADER) == HEADER);
+    size_t topic_len = hdr[2] | (hdr[3]<<8);
+    size_t payload_len = hdr[4] | (hdr[5]<<8);
+    char *buf = ok?(char *)malloc(topic_len + payload_len + 1):NULL;
+    ok = buf && (file.read((uint8_t *)buf, topic_len + payload_len) == topic_len + payload_len);
+    file.close();
+    if (!ok) {
+      if (buf) free(buf);
+      clear();
+      return false;
+    }
+    topic = String(buf, topic_len);
+    payload = String(buf + topic_len, payload_len);
+    free(buf);
+    *qos_r = hdr[0] & 3;
+    *retain_r = (hdr[0] & 4) != 0;
+    *class_r = hdr[1];
+
+    read_pos += HEADER + topic_len + payload_len;
+    --records;
+    ++unspooled;
+    if (!records || (read_pos >= write_pos)) clear();
+    return true;
+  }
+
+  void clear()
+  {
+    if (fs) fs->remove(path);
+    read_pos = write_pos = 0;
+    records = 0;
+    sealed = false;
+  }
+
+protected:
+  size_t read_pos = 0;
+  size_t write_pos = 0;
+  int records = 0;
+  bool sealed = false;
+};
+
+#endif
+
+// Local Variables:
+// mode: C++
+// c-basic-offset: 2
+// End:
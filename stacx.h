@@ -1083,6 +1083,9 @@ void stacxSetComms(AbstractIpLeaf *ip, AbstractPubsubLeaf *pubsub)
   for (int i=0; leaves[i]; i++) {
     leaves[i]->setComms(ip, pubsub);
   }
+  if (pubsub) {
+    pubsub_policy_leaf = pubsub;
+  }
 
   if (ip) {
     if (!ip->canRun()) {
@@ -1100,6 +1103,45 @@ void stacxSetComms(AbstractIpLeaf *ip, AbstractPubsubLeaf *pubsub)
   }
 }
 
+//
+// Add an additional active pubsub leaf (eg. a cloud broker alongside a
+// local one).  Publishes of the topic classes in class_mask (bits
+// 1<<PUBSUB_CLASS_x) are copied to it via its own send queue.  The leaf
+// keeps its own connection and reconnect schedule.
+//
+// The additional leaf is publish-only for other leaves: it subscribes to
+// its own cmd/get/set topics, but leaf subscriptions stay with the primary.
+//
+void stacxAddComms(AbstractIpLeaf *ip, AbstractPubsubLeaf *pubsub, int class_mask=(1<<PUBSUB_CLASS_MAX)-1)
+{
+  if (!pubsub) return;
+  for (int i=0; i<pubsub_fanout_count; i++) {
+    if (pubsub_fanout[i] == pubsub) {
+      pubsub->pubsubSetFanoutClasses(class_mask);
+      return;
+    }
+  }
+  if (pubsub_fanout_count >= PUBSUB_FANOUT_MAX) {
+    ALERT("Too many additional pubsub leaves, cannot add %s", pubsub->getNameStr());
+    return;
+  }
+
+  if (ip && !ip->canRun()) {
+    ip->permitRun();
+    ip->setup();
+    stacx_heap_check(HERE);
+  }
+  pubsub->setComms(ip, pubsub);
+  pubsub->pubsubFanoutPrepare(class_mask);
+  if (!pubsub->canRun()) {
+    WARN("Enabling %s as additional pubsub (class mask 0x%x)", pubsub->getNameStr(), class_mask);
+    pubsub->permitRun();
+    pubsub->setup();
+    stacx_heap_check(HERE);
+  }
+  pubsub_fanout[pubsub_fanout_count++] = pubsub;
+}
+
 void stacxSetServiceComms(AbstractIpLeaf *ip, AbstractPubsubLeaf *pubsub)
 {
   stacx_heap_check(HERE);
@@ -3,6 +3,8 @@
 
 #include <HardwareSerial.h>
 #include "freertos/semphr.h"
+#include "modem_tokenizer.h"
+#include "ip_rx_arena.h"
 
 #ifndef IP_MODEM_CHAT_TRACE_LEVEL
 #define IP_MODEM_CHAT_TRACE_LEVEL L_INFO
@@ -21,6 +23,113 @@
 
 #define MODEM_REPLY_NO_FLUSH false
 
+#ifndef MODEM_MUTEX_STATS_MAX
+#define MODEM_MUTEX_STATS_MAX 16
+#endif
+#define MODEM_MUTEX_HIST_BUCKETS 8
+
+//
+// Requests for the modem port are arbitrated by priority: a request
+// stands aside while one of higher priority is waiting, so that
+// publishes and socket data are not stuck behind periodic polls.
+//
+enum modem_port_priority {
+  MODEM_PORT_PRIO_POLL=0,    // housekeeping (GPS, signal strength), may be deferred
+  MODEM_PORT_PRIO_NORMAL,
+  MODEM_PORT_PRIO_DATA,      // publishes and socket traffic
+  MODEM_PORT_PRIO_COUNT
+};
+
+//
+// Port mutex contention seen at one codepoint.  Histogram buckets are
+// <1ms, <4ms, <16ms ... <4096ms and longer.
+//
+struct ModemMutexStats
+{
+  const char *file;
+  const char *func;
+  int line;
+  unsigned long acquires;
+  unsigned long busy;        // gave up (timed out, or found the port taken)
+  unsigned long deferred;    // stood aside for a higher priority request
+  volatile int waiting;
+  unsigned long wait_hist[MODEM_MUTEX_HIST_BUCKETS];
+  unsigned long hold_hist[MODEM_MUTEX_HIST_BUCKETS];
+  unsigned long wait_max_us;
+  unsigned long hold_max_us;
+  unsigned long hold_total_ms;
+};
+
+#ifndef MODEM_COMMAND_QUEUE_SIZE
+#define MODEM_COMMAND_QUEUE_SIZE 8
+#endif
+
+#ifndef MODEM_URC_BACKLOG
+#define MODEM_URC_BACKLOG 8
+#endif
+
+#ifndef MODEM_RX_LINE_MAX
+#define MODEM_RX_LINE_MAX 1024
+#endif
+
+#ifndef MODEM_SERVICE_TASK
+#define MODEM_SERVICE_TASK 0
+#endif
+
+#ifndef MODEM_SERVICE_STACK_SIZE
+#define MODEM_SERVICE_STACK_SIZE 8192
+#endif
+
+#ifndef MODEM_SERVICE_IDLE_MSEC
+#define MODEM_SERVICE_IDLE_MSEC 1000
+#endif
+
+enum modem_command_state {
+  MODEM_CMD_IDLE=0,
+  MODEM_CMD_QUEUED,
+  MODEM_CMD_ACTIVE,
+  MODEM_CMD_OK,
+  MODEM_CMD_ERROR,
+  MODEM_CMD_TIMEOUT
+};
+
+//
+// One AT command in flight through the modem engine.
+//
+// Commands are either run synchronously (modemCommandRun, which is what
+// all the modemSendExpect family use underneath) or submitted to a queue
+// (modemCommandSubmit) and advanced by modemPoll() from the leaf loop, in
+// which case the callback is invoked on completion.  Callbacks run in the
+// polling task and must not block on the modem.
+//
+struct ModemCommand;
+typedef void (*modem_command_cb_t)(struct ModemCommand *cmd, void *ctx);
+
+struct ModemCommand
+{
+  String cmd;
+  String prefix;                 // response lines begin thus (default derived from cmd)
+  const uint8_t *data = NULL;    // payload to send when the modem prompts with '>'
+  size_t data_len = 0;
+  int timeout = -1;
+  int max_lines = 0;             // complete after this many lines, 0=wait for final result
+  modem_command_cb_t cb = NULL;
+  void *cb_ctx = NULL;
+  bool dispose = false;          // engine deletes the command after the callback
+  bool async = false;
+  volatile int state = MODEM_CMD_IDLE;
+  unsigned long start = 0;
+  unsigned long deadline = 0;
+  int lines = 0;
+  bool ok_deferred = false;      // an early OK was taken as a line, awaiting the prefixed reply
+  String response;               // response lines, newline separated
+
+  bool done() { return state >= MODEM_CMD_OK; }
+  bool ok() { return state == MODEM_CMD_OK; }
+};
+
+
+void ARDUINO_ISR_ATTR modemRingISR(void *arg);
 
 #define MODEM_MUTEX_TRACE(loc,...) __LEAF_DEBUG_AT__((loc), modem_mutex_trace_level, __VA_ARGS__)
 #define MODEM_CHAT_TRACE(loc,...) __LEAF_DEBUG_AT__((loc), modem_chat_trace_level, __VA_ARGS__)
@@ -81,6 +190,92 @@ protected:
   int modem_urc_probe_interval = 10000;
   unsigned long last_urc_probe = 0;
 
+  // Port mutex contention, by codepoint
+  struct ModemMutexStats modem_port_stats[MODEM_MUTEX_STATS_MAX];
+  int modem_port_stats_count = 0;
+  volatile int modem_port_waiting[MODEM_PORT_PRIO_COUNT] = {0};
+  portMUX_TYPE modem_port_waiting_lock = portMUX_INITIALIZER_UNLOCKED;  // waiters come from several tasks
+  codepoint_t modem_port_holder = undisclosed_location;
+  struct ModemMutexStats *modem_port_holder_stats = NULL;
+  unsigned long modem_port_taken_us = 0;
+  int modem_port_poll_wait_ms = 2000;
+
+  // Command engine state
+  QueueHandle_t modem_cmd_queue = NULL;
+  struct ModemCommand *volatile modem_cmd_active = NULL;
+  ModemLineRing modem_rx_ring{MODEM_RX_LINE_MAX};
+  bool modem_rx_expect_final = false;  // a reply was cut short, its result code is still to come
+  unsigned long modem_rx_expect_final_until = 0;
+  String modem_rx_trailing_prefix;
+  int modem_rx_body_left = 0;          // an SMS body is being read: bytes to come, or -1 for one line
+  bool modem_rx_body_urc = false;      // ...and it belongs to the last stashed URC
+  volatile bool modem_idle_probe_pending = false;
+  volatile bool modem_idle_probe_failed = false;
+  String modem_urc_backlog[MODEM_URC_BACKLOG];
+  int modem_urc_count = 0;
+  SemaphoreHandle_t modem_urc_mutex = NULL;   // guards the backlog once there is a service task
+  void modemUrcLock() { if (modem_urc_mutex) xSemaphoreTake(modem_urc_mutex, portMAX_DELAY); }
+  void modemUrcUnlock() { if (modem_urc_mutex) xSemaphoreGive(modem_urc_mutex); }
+
+  // Event driven servicing: UART receive or an RI edge wakes the service
+  // task, which polls the engine and stashes URCs.  The handlers for
+  // those URCs act on leaf state that belongs to the loop task, so they
+  // are dispatched from loop() (see modemDispatchURC).  Without a wake
+  // source for received data (eg. an injected stream) the task falls
+  // back to polling every modem_service_poll_msec.  Off unless
+  // MODEM_SERVICE_TASK or ip_modem_service_task asks for it.
+  bool modem_service_task = MODEM_SERVICE_TASK;
+  TaskHandle_t modem_service_handle = NULL;
+  HardwareSerial *modem_uart = NULL;
+  bool modem_rx_event = false;
+  int modem_service_idle_msec = MODEM_SERVICE_IDLE_MSEC;
+  int modem_service_poll_msec = 100;
+  unsigned long modem_last_rx = 0;
+
+  // Cost of servicing the modem, whichever task does it
+  volatile unsigned long modem_wake_rx = 0;
+  volatile unsigned long modem_wake_ri = 0;
+  unsigned long modem_wake_timeout = 0;
+  unsigned long modem_poll_count = 0;
+  unsigned long modem_poll_busy = 0;     // poll found another task using the modem
+  unsigned long modem_poll_us = 0;       // time in poll, excluding URC handlers
+  unsigned long modem_poll_hold_us = 0;  // port mutex held by poll and probe
+  unsigned long modem_probe_count = 0;
+  unsigned long modem_stats_since = 0;
+
+  static bool modemIsFinalResult(const char *line, bool *ok_r);
+  static void modemIdleProbeDone(struct ModemCommand *c, void *ctx);
+  bool modemIsResponse(struct ModemCommand *c, const char *line);
+  void modemCommandStart(struct ModemCommand *c);
+  void modemCommandComplete(struct ModemCommand *c, int state);
+  void modemCommandFinish(codepoint_t where=undisclosed_location);
+  void modemRxPoll();
+  // The synchronous readers (modemGetReply and friends) take whatever
+  // modemRxPoll left in the line ring before reading the stream
+  int modemInputAvailable() { return modem_rx_ring.length() + modem_stream->available(); }
+  int modemInputRead()
+  {
+    char c;
+    if (modem_rx_ring.get(&c, 1)) return (unsigned char)c;
+    return modem_stream->read();
+  }
+  void modemRxLine(const char *line);
+  void modemRxExpectFinal(struct ModemCommand *c);
+  void modemRxBodyExpect(const char *line, bool urc);
+  bool modemRxBodyLine(struct ModemCommand *c, const char *line);
+  void modemStashURC(const char *line);
+  void modemStashURCBody(const char *line);
+  void modemDispatchURC();
+  int modemServiceWaitTime();
+  struct ModemMutexStats *modemPortStats(codepoint_t where);
+  static int modemMutexBucket(unsigned long usec);
+  void modemPortWaited(struct ModemMutexStats *s, bool acquired, unsigned long wait_us);
+  void modemPortTaken(codepoint_t where, struct ModemMutexStats *s);
+  bool modemPortOutranked(int priority);
+  void modemPortLogWaiters(codepoint_t where);
+  bool modemTakePortMutex(codepoint_t where, TickType_t timeout, bool quiet);
+  friend void modemRingISR(void *arg);
+
   virtual bool modemCheckURC();
   virtual bool modemProcessURC(String Message) {
     DumpHex(L_ALERT, "Unsolicited Response Code not handled: ", (const uint8_t *)Message.c_str(), Message.length());
@@ -119,8 +314,33 @@ public:
   void modemInstallKeySetter(void (*cb)(bool)) { modem_set_key_cb=cb; }
   void modemInstallSleepSetter(void (*cb)(bool)) {modem_set_sleep_cb=cb;}
 
-  bool modemWaitPortMutex(codepoint_t where = undisclosed_location, bool quiet=false, int timeout=0);
-  bool modemHoldPortMutex(codepoint_t where = undisclosed_location, TickType_t timeout=0, bool quiet=false);
+  bool modemWaitPortMutex(codepoint_t where = undisclosed_location, bool quiet=false, int timeout=0, int priority=MODEM_PORT_PRIO_NORMAL);
+  bool modemHoldPortMutex(codepoint_t where = undisclosed_location, TickType_t timeout=0, bool quiet=false, int priority=MODEM_PORT_PRIO_NORMAL);
+  bool modemWaitPortForPoll(codepoint_t where, bool *release_r);
+  bool modemPortIsMine() {
+#if MODEM_USE_MUTEX
+    return modem_port_mutex && (xSemaphoreGetMutexHolder(modem_port_mutex) == xTaskGetCurrentTaskHandle());
+#else
+    return true;
+#endif
+  }
+  bool modemPortIsHeld() {
+#if MODEM_USE_MUTEX
+    return modem_port_mutex && (xSemaphoreGetMutexHolder(modem_port_mutex) != NULL);
+#else
+    return false;
+#endif
+  }
+  void modemPortStatsReset() {
+    // entries stay put (waiters and the holder point at them), only the counts go
+    for (int i=0; i<modem_port_stats_count; i++) {
+      struct ModemMutexStats *s = modem_port_stats+i;
+      s->acquires = s->busy = s->deferred = 0;
+      s->wait_max_us = s->hold_max_us = s->hold_total_ms = 0;
+      memset(s->wait_hist, 0, sizeof(s->wait_hist));
+      memset(s->hold_hist, 0, sizeof(s->hold_hist));
+    }
+  }
   void modemReleasePortMutex(codepoint_t where = undisclosed_location) ;
 
   bool modemWaitBufferMutex(codepoint_t where = undisclosed_location) ;
@@ -140,10 +360,12 @@ public:
     return result;
   }
   int modemGetReply(char *buf=NULL, int buf_max=-1, int timeout=-1, int max_lines=1, int max_chars=0, codepoint_t where = undisclosed_location, bool flush=true);
+  int modemGetLineOrPrompt(char *buf, int buf_max, int timeout=-1, codepoint_t where = undisclosed_location);
 
   bool modemSendExpect(const char *cmd, const char *expect, char *buf=NULL, int buf_max=0, int timeout=-1, int max_lines=1, codepoint_t where=undisclosed_location, bool flush=true);
   String modemQuery(const char *cmd, const char *expect="", int timeout=-1, codepoint_t where=undisclosed_location);
   String modemQuery(String cmd, int timeout=-1, codepoint_t where=undisclosed_location);
+  bool modemQueryFields(const char *cmd, const char *expect, ModemFieldTokenizer *fields_r, int timeout=-1, codepoint_t where=undisclosed_location);
   bool modemSendCmd(int timeout, codepoint_t where, const char *fmt, ...); // expects OK
   bool modemSendCmd(codepoint_t where, const char *fmt, ...); // expects OK
 
@@ -177,7 +399,32 @@ public:
     return modemSetParameter(verb, parameter, value1+",\""+value2+"\",\""+value3+"\"",CODEPOINT(where));
   }
 
-  int modemReadToBuffer(cbuf *buf, size_t size, codepoint_t where=undisclosed_location);
+  int modemReadBulk(uint8_t *buf, size_t size, int timeout=-1, codepoint_t where=undisclosed_location);
+  int modemReadToBuffer(IpRxQueue *buf, size_t size, codepoint_t where=undisclosed_location);
+
+  bool modemCommandRun(struct ModemCommand *c, bool flush=true);
+  bool modemCommandSubmit(struct ModemCommand *c);
+  bool modemCommandSubmit(const char *cmd, modem_command_cb_t cb, void *cb_ctx=NULL, int timeout=-1);
+  bool modemCommandPending() {
+    return modem_cmd_active || (modem_cmd_queue && uxQueueMessagesWaiting(modem_cmd_queue));
+  }
+  bool modemPoll();
+
+  void modemSetRingPin(int8_t pin, byte idle_level=HIGH) { pin_ri = pin; level_ri = idle_level; }
+  bool modemServiceStart();
+  bool modemServiceRunning() { return modem_service_handle != NULL; }
+  bool modemOnServiceTask() { return modem_service_handle && (xTaskGetCurrentTaskHandle() == modem_service_handle); }
+  void modemServiceWake() {
+    if (modem_service_handle && (xTaskGetCurrentTaskHandle() != modem_service_handle)) {
+      xTaskNotifyGive(modem_service_handle);
+    }
+  }
+  virtual void modemService();
+  void modemServiceStatsReset() {
+    modem_wake_rx = modem_wake_ri = modem_wake_timeout = 0;
+    modem_poll_count = modem_poll_busy = modem_poll_us = modem_poll_hold_us = modem_probe_count = 0;
+    modem_stats_since = millis();
+  }
 
   void modemChat(Stream *console_stream=&Serial, bool echo = false);
 };
@@ -247,6 +494,7 @@ bool TraitModem::modemSetup()
     uart->begin(uart_baud,uart_options, pin_rx, pin_tx);
 
     modem_stream = uart;
+    modem_uart = uart;
     //LEAF_DEBUG("uart ready");
     wdtReset(HERE);
   }
@@ -479,7 +727,88 @@ void TraitModem::modemPulseKey(int duration)
 }
 
 
-bool TraitModem::modemHoldPortMutex(codepoint_t where,TickType_t timeout, bool quiet)
+//
+// Find (or make) the contention statistics for a codepoint.  The table
+// is small and fixed, codepoints beyond its size share the last slot.
+//
+struct ModemMutexStats *TraitModem::modemPortStats(codepoint_t where)
+{
+  if (!where.file) return NULL;
+  for (int i=0; i<modem_port_stats_count; i++) {
+    struct ModemMutexStats *s = modem_port_stats+i;
+    if ((s->line == where.line) && ((s->file == where.file) || (strcmp(s->file, where.file)==0))) {
+      return s;
+    }
+  }
+  vTaskSuspendAll();
+  struct ModemMutexStats *s = modem_port_stats+(MODEM_MUTEX_STATS_MAX-1);
+  if (modem_port_stats_count < MODEM_MUTEX_STATS_MAX) {
+    s = modem_port_stats+modem_port_stats_count;
+    memset(s, 0, sizeof(*s));
+    s->file = where.file;
+    s->func = where.func;
+    s->line = where.line;
+    ++modem_port_stats_count;
+  }
+  xTaskResumeAll();
+  return s;
+}
+
+int TraitModem::modemMutexBucket(unsigned long usec)
+{
+  // buckets are <1ms, <4ms, <16ms ... <4096ms, and longer
+  unsigned long ms = usec/1000;
+  unsigned long limit = 1;
+  int b = 0;
+  while ((b < MODEM_MUTEX_HIST_BUCKETS-1) && (ms >= limit)) {
+    ++b;
+    limit *= 4;
+  }
+  return b;
+}
+
+void TraitModem::modemPortWaited(struct ModemMutexStats *s, bool acquired, unsigned long wait_us)
+{
+  if (!s) return;
+  if (acquired) {
+    ++s->acquires;
+  }
+  else {
+    ++s->busy;
+  }
+  if (wait_us || !acquired) {
+    ++s->wait_hist[modemMutexBucket(wait_us)];
+    if (wait_us > s->wait_max_us) s->wait_max_us = wait_us;
+  }
+}
+
+void TraitModem::modemPortTaken(codepoint_t where, struct ModemMutexStats *s)
+{
+  modem_port_holder = where;
+  modem_port_holder_stats = s;
+  modem_port_taken_us = micros();
+}
+
+bool TraitModem::modemPortOutranked(int priority)
+{
+  for (int p=priority+1; p<MODEM_PORT_PRIO_COUNT; p++) {
+    if (modem_port_waiting[p]) return true;
+  }
+  return false;
+}
+
+void TraitModem::modemPortLogWaiters(codepoint_t where)
+{
+  LEAF_WARN_AT(CODEPOINT(modem_port_holder), "Modem port is held here (for %lums)", (micros()-modem_port_taken_us)/1000);
+  for (int i=0; i<modem_port_stats_count; i++) {
+    struct ModemMutexStats *s = modem_port_stats+i;
+    if (s->waiting) {
+      LEAF_WARN_AT(where, "Modem port is awaited by %s:%d (%d waiting)", s->func, s->line, s->waiting);
+    }
+  }
+}
+
+bool TraitModem::modemTakePortMutex(codepoint_t where,TickType_t timeout, bool quiet)
 {
 #if MODEM_USE_MUTEX
   LEAF_ENTER(L_TRACE);
@@ -520,7 +849,32 @@ bool TraitModem::modemHoldPortMutex(codepoint_t where,TickType_t timeout, bool q
 #endif
 }
 
-bool TraitModem::modemWaitPortMutex(codepoint_t where, bool quiet, int timeout)
+bool TraitModem::modemHoldPortMutex(codepoint_t where,TickType_t timeout, bool quiet, int priority)
+{
+#if MODEM_USE_MUTEX
+  LEAF_ENTER(L_TRACE);
+  if (modem_cmd_active && modem_cmd_active->async && modemPortIsMine()) {
+    // This task holds the port on behalf of a queued command, see it
+    // through before the port changes hands (the mutex is not recursive)
+    modemCommandFinish(where);
+  }
+  struct ModemMutexStats *stats = modemPortStats(where);
+  if (modemPortOutranked(priority)) {
+    // somebody more important is waiting, let them go first
+    if (stats) ++stats->deferred;
+    LEAF_RETURN(false);
+  }
+  unsigned long start = micros();
+  bool got = modemTakePortMutex(where, timeout, quiet);
+  modemPortWaited(stats, got, micros()-start);
+  if (got) modemPortTaken(where, stats);
+  LEAF_RETURN(got);
+#else
+  return true;
+#endif
+}
+
+bool TraitModem::modemWaitPortMutex(codepoint_t where, bool quiet, int timeout, int priority)
 {
 #if MODEM_USE_MUTEX
   LEAF_ENTER(L_TRACE);
@@ -534,19 +888,44 @@ bool TraitModem::modemWaitPortMutex(codepoint_t where, bool quiet, int timeout)
       timeout = 5000;
     }
   }
-  static codepoint_t last_port_acquire = undisclosed_location;
   int wait_total=0;
   int wait_ms = 100;
   if (modem_disabled) {
     LEAF_RETURN(false);
   }
+  if (modem_cmd_active && modem_cmd_active->async && modemPortIsMine()) {
+    // see modemHoldPortMutex
+    modemCommandFinish(where);
+  }
+
+  struct ModemMutexStats *stats = modemPortStats(where);
+  bool deferred = false;
+  bool got = false;
+  unsigned long start = micros();
+  portENTER_CRITICAL(&modem_port_waiting_lock);
+  if (stats) ++stats->waiting;
+  ++modem_port_waiting[priority];
+  portEXIT_CRITICAL(&modem_port_waiting_lock);
 
   while (1) {
     wdtReset(HERE);
-    if (modemHoldPortMutex(CODEPOINT(where) ,wait_ms * portTICK_PERIOD_MS, quiet)) {
-      // successful acquire (hold function will log TAKE)
-      last_port_acquire = where;
-      LEAF_RETURN(true);
+    if (modemPortOutranked(priority)) {
+      // somebody more important is waiting, stand aside
+      deferred = true;
+      vTaskDelay(1);
+      wait_total += portTICK_PERIOD_MS;
+      if (wait_total > timeout) break;
+      continue;
+    }
+    if (modemTakePortMutex(CODEPOINT(where) ,wait_ms * portTICK_PERIOD_MS, quiet)) {
+      if (!modemPortOutranked(priority)) {
+	got = true;
+	break;
+      }
+      // somebody more important turned up while we waited, hand it over
+      xSemaphoreGive(modem_port_mutex);
+      deferred = true;
+      continue;
     }
     wait_total += wait_ms;
     wait_ms += 100;
@@ -554,28 +933,73 @@ bool TraitModem::modemWaitPortMutex(codepoint_t where, bool quiet, int timeout)
       break;
     }
     LEAF_NOTICE_AT(where, "Have been waiting %dms for modem port mutex", wait_total);
-    LEAF_NOTICE_AT(last_port_acquire, "This is the point of last port mutex acquisition");
     if (mutex_deadlock_limit && (wait_total > mutex_deadlock_limit)) {
       LEAF_ALERT_AT(where, "DEADLOCK detected in modemWaitPortMutex");
+      modemPortLogWaiters(where);
       modemReleasePortMutex(CODEPOINT(where));
     }
+    else {
+      LEAF_NOTICE_AT(modem_port_holder, "This is the point of port mutex acquisition (held %lums)", (micros()-modem_port_taken_us)/1000);
+    }
     yield();
   }
-  LEAF_RETURN(false);
+
+  portENTER_CRITICAL(&modem_port_waiting_lock);
+  --modem_port_waiting[priority];
+  if (stats) {
+    --stats->waiting;
+    if (deferred) ++stats->deferred;
+  }
+  portEXIT_CRITICAL(&modem_port_waiting_lock);
+  modemPortWaited(stats, got, micros()-start);
+  if (got) modemPortTaken(where, stats);
+  LEAF_RETURN(got);
 #else
   return true;
 #endif
 }
 
+//
+// Periodic housekeeping (GPS, signal) takes the port at low priority so
+// that it queues behind publishes and socket data.  Returns false if the
+// poll should be skipped this time, otherwise *release_r says whether the
+// caller must release the port afterward.
+//
+bool TraitModem::modemWaitPortForPoll(codepoint_t where, bool *release_r)
+{
+  *release_r = false;
+  if (modemPortIsMine()) {
+    // already ours, eg. polled from within a transaction
+    return true;
+  }
+  if (!modemWaitPortMutex(CODEPOINT(where), true, modem_port_poll_wait_ms, MODEM_PORT_PRIO_POLL)) {
+    return false;
+  }
+  *release_r = true;
+  return true;
+}
+
 void TraitModem::modemReleasePortMutex(codepoint_t where)
 {
 #if MODEM_USE_MUTEX
   LEAF_ENTER(L_TRACE);
+  struct ModemMutexStats *holder = modemPortIsMine()?modem_port_holder_stats:NULL;
+  unsigned long held = micros() - modem_port_taken_us;
   if (xSemaphoreGive(modem_port_mutex) != pdTRUE) {
     LEAF_ALERT_AT(where, "Modem port mutex release failed");
   }
   else {
     MODEM_MUTEX_TRACE(where, "<GIVE portMutex");
+    if (holder) {
+      ++holder->hold_hist[modemMutexBucket(held)];
+      holder->hold_total_ms += held/1000;
+      if (held > holder->hold_max_us) holder->hold_max_us = held;
+    }
+    if (modemCommandPending()) {
+      // commands that queued behind the port are the service task's to
+      // start now (held URCs wait for the next loop())
+      modemServiceWake();
+    }
   }
   LEAF_VOID_RETURN;
 #endif
@@ -684,6 +1108,10 @@ void TraitModem::modemFlushInput(codepoint_t where)
       DumpHex(0, "", (const uint8_t *)discard, d);
     }
   }
+  modem_rx_ring.clear();
+  // whatever remained of an earlier reply went with it
+  modem_rx_expect_final = false;
+  modem_rx_body_left = 0;
 }
 
 bool TraitModem::modemSend(const char *cmd, codepoint_t where)
@@ -717,8 +1145,8 @@ int TraitModem::modemGetReply(char *buf, int buf_max, int timeout, int max_lines
   while ((!done) && (now <= timebox)) {
     wdtReset(HERE);
 
-    while (!done && modem_stream->available()) {
-      char c = modem_stream->read();
+    while (!done && modemInputAvailable()) {
+      char c = modemInputRead();
       if (trace) {
 	if ((c <= ' ') || (c>'~')) {
 	  DBGPRINTF("0x%02x\n", (int)c);
@@ -782,32 +1210,111 @@ int TraitModem::modemGetReply(char *buf, int buf_max, int timeout, int max_lines
   return count;
 }
 
-int TraitModem::modemReadToBuffer(cbuf *buf, size_t size, codepoint_t where)
+//
+// Read one non-empty line, or a bare '>' data prompt, leaving any input
+// that follows in place (for callers that keep several commands in
+// flight).  Returns the length read, or zero on timeout.
+//
+// precondition: hold port mutex
+//
+int TraitModem::modemGetLineOrPrompt(char *buf, int buf_max, int timeout, codepoint_t where)
 {
-  int got = 0;
-  while (size && (!buf->full())) {
-    if (modem_stream->available()) {
-      char c = modem_stream->read();
+  if (timeout < 0) timeout = modem_timeout_default;
+  unsigned long start = millis();
+  int count = 0;
+  buf[0] = '\0';
 
-      if (modemDoTrace()) {
-	if ((c <= ' ') || (c>'~')) {
-	  DBGPRINTF("0x%02x\n", (int)c);
-	}
-	else {
-	  DBGPRINTLN(c);
-	}
-      }
+  while ((millis() - start) <= (unsigned long)timeout) {
+    wdtReset(HERE);
+    if (!modemInputAvailable()) {
+      yield();
+      continue;
+    }
+    char c = modemInputRead();
+    if (c == '\r') continue;
+    if (c == '\n') {
+      if (count == 0) continue;
+      MODEM_CHAT_TRACE(where, "modemGetLineOrPrompt RCVD[%s] (%dms)", buf, (int)(millis()-start));
+      if (do_chat_log && parent) parent->fslog(HERE, IP_LOG_FILE, "<%s", buf);
+      return count;
+    }
+    if ((count == 0) && (c == ' ')) continue;
+    buf[count++] = c;
+    buf[count] = '\0';
+    if ((count == 1) && (c == '>')) {
+      MODEM_CHAT_TRACE(where, "modemGetLineOrPrompt RCVD prompt (%dms)", (int)(millis()-start));
+      return count;
+    }
+    if (count >= buf_max-1) {
+      LEAF_ALERT_AT(where, "modemGetLineOrPrompt: buffer full");
+      return count;
+    }
+  }
+  if (count) {
+    LEAF_NOTICE_AT(where, "modemGetLineOrPrompt: timeout with partial line [%s]", buf);
+  }
+  return 0;
+}
+
+//
+// Read a binary payload of known size straight into the caller's buffer,
+// a block at a time.  Gives up after timeout ms with no data arriving.
+//
+int TraitModem::modemReadBulk(uint8_t *buf, size_t size, int timeout, codepoint_t where)
+{
+  if (timeout < 0) timeout = modem_timeout_default;
+  unsigned long last_rx = millis();
+  // anything modemRxPoll already took from the stream comes first
+  size_t got = modem_rx_ring.get((char *)buf, size);
 
-      buf->write(c);
-      got++;
-      size--;
+  while (got < size) {
+    wdtReset(HERE);
+    int avail = modem_stream->available();
+    if (avail <= 0) {
+      if ((millis() - last_rx) >= (unsigned long)timeout) {
+	LEAF_WARN_AT(CODEPOINT(where), "modemReadBulk timeout after %d/%d bytes", (int)got, (int)size);
+	break;
+      }
+      vTaskDelay(1);
+      continue;
+    }
+    size_t n = size - got;
+    if (n > (size_t)avail) n = avail;
+    if (modem_uart && ((Stream *)modem_uart == modem_stream)) {
+      // the UART driver copies out of its ring in one go
+      n = modem_uart->read(buf+got, n);
     }
+    else {
+      n = modem_stream->readBytes((char *)buf+got, n);
+    }
+    got += n;
+    last_rx = millis();
   }
-  MODEM_CHAT_TRACE(where, "modemReadToBuffer received %d bytes", got);
-  char dump_buf[512];
-  int len = buf->peek(dump_buf, sizeof(dump_buf));
-  DumpHex(modem_chat_trace_level, "modemReadToBuffer", dump_buf, len);
+  if (got) modem_last_rx = last_rx;
+  MODEM_CHAT_TRACE(where, "modemReadBulk received %d/%d bytes", (int)got, (int)size);
+  return got;
+}
 
+//
+// Read up to size bytes straight into the free space of a receive queue,
+// stopping early if the queue fills (the caller decides what to do with
+// the rest).
+//
+int TraitModem::modemReadToBuffer(IpRxQueue *buf, size_t size, codepoint_t where)
+{
+  int got = 0;
+  while (size) {
+    uint8_t *p;
+    int n = buf->reserve(&p);
+    if (n == 0) break;
+    if (n > (int)size) n = size;
+    n = modemReadBulk(p, n, -1, CODEPOINT(where));
+    buf->commit(n);
+    if (n <= 0) break;
+    got += n;
+    size -= n;
+  }
+  MODEM_CHAT_TRACE(where, "modemReadToBuffer received %d bytes", got);
   return got;
 }
 
@@ -817,9 +1324,6 @@ bool TraitModem::modemSendExpect(const char *cmd, const char *expect, char *buf,
   LEAF_ENTER(L_DEBUG);
 
   if (timeout < 0) timeout = modem_timeout_default;
-  if (flush) {
-    modemFlushInput(HERE);
-  }
   unsigned long start = millis();
   if (expect && strlen(expect)) {
     MODEM_CHAT_TRACE(where, "modemSendExpect SEND[%s] EXPECT[%s]", cmd?cmd:"", expect?expect:"");
@@ -829,14 +1333,29 @@ bool TraitModem::modemSendExpect(const char *cmd, const char *expect, char *buf,
   }
 
   bool result = true;
-  if (cmd) {
-    modemSend(cmd);
-  }
   if (!buf) {
     buf = modem_response_buf;
     buf_max = modem_response_max;
   }
-  int count = modemGetReply(buf, buf_max, timeout, max_lines, 0, where, flush);
+  int count;
+  if (cmd) {
+    struct ModemCommand c;
+    c.cmd = cmd;
+    c.timeout = timeout;
+    // callers count the blank line that leads a V1 response as a line
+    c.max_lines = (max_lines > 1)?max_lines-1:1;
+    if (expect && (expect[0]=='+')) {
+      c.prefix = expect;
+      int colon = c.prefix.indexOf(':');
+      if (colon > 0) c.prefix.remove(colon);
+    }
+    modemCommandRun(&c, flush);
+    strlcpy(buf, c.response.c_str(), buf_max);
+    count = strlen(buf);
+  }
+  else {
+    count = modemGetReply(buf, buf_max, timeout, max_lines, 0, where, flush);
+  }
   if (expect) {
     int expect_len = strlen(expect);
     if (count >= expect_len) {
@@ -922,6 +1441,19 @@ String TraitModem::modemQuery(String cmd, int timeout, codepoint_t where)
   return String(modem_response_buf);
 }
 
+// Like modemQuery, but hands back the response fields in place rather
+// than copying the response into a String.
+//
+// precondition: hold buffer mutex for as long as the fields are in use
+bool TraitModem::modemQueryFields(const char *cmd, const char *expect, ModemFieldTokenizer *fields_r, int timeout, codepoint_t where)
+{
+  if (!modemSendExpect(cmd, expect, modem_response_buf, modem_response_max, timeout, 1, CODEPOINT(where))) {
+    return false;
+  }
+  if (fields_r) *fields_r = ModemFieldTokenizer(modem_response_buf);
+  return true;
+}
+
 
 
 bool TraitModem::modemSendCmd(int timeout, codepoint_t where, const char *fmt, ...)
@@ -954,8 +1486,9 @@ bool TraitModem::modemSendExpectInt(const char *cmd, const char *expect, int *va
   if (timeout < 0) timeout = modem_timeout_default;
   modemWaitBufferMutex(HERE/*CODEPOINT(where)*/);
   modemSendExpect(cmd, expect, modem_response_buf, modem_response_max, timeout, lines, CODEPOINT(where), flush);
-  if (strspn(modem_response_buf,"0123456789")>0) {
-    if (value_r) *value_r = atoi(modem_response_buf);
+  ModemToken value(modem_response_buf);
+  if (value.len && isdigit(value.ptr[0])) {
+    if (value_r) *value_r = value.toInt();
     result = true;
   }
   modemReleaseBufferMutex(HERE/*CODEPOINT(where)*/);
@@ -968,6 +1501,10 @@ bool TraitModem::modemSendExpectInlineInt(const char *cmd, const char *expect, i
   if (timeout < 0) timeout = modem_timeout_default;
   MODEM_CHAT_TRACE(where, "modemSendExpectInlineInt SEND[%s] EXPECT[%s] (timeout %dms)", cmd?cmd:"", expect?expect:"", timeout);
   modemWaitBufferMutex(HERE/*CODEPOINT(where)*/);
+  // absorb anything outstanding (URCs are held for dispatch), so that
+  // the reply is not confused with earlier input
+  modemRxPoll();
+  modem_rx_ring.clear();
   modemSend(cmd);
   int count = modemGetReply(modem_response_buf, modem_response_max, timeout, 0, strlen(expect), where, /*NO flush*/false);
   if (count == 0) {
@@ -987,21 +1524,25 @@ bool TraitModem::modemSendExpectInlineInt(const char *cmd, const char *expect, i
   while ((!done) && (now <= timebox)) {
     wdtReset(HERE);
 
-    while (!done && modem_stream->available()) {
-      char c = modem_stream->read();
+    while (!done && modemInputAvailable()) {
+      char c = modemInputRead();
       now = millis();
       wdtReset(HERE);
 
-      if (c==delimiter) {
+      if ((c==delimiter) || ((c=='\n') && count)) {
+	// a reply that carries no data (eg. "+CARECV: 0") ends at the line
 	done=true;
-	len = atoi(modem_response_buf);
+	len = ModemToken(modem_response_buf, count).toInt(-1);
 	MODEM_CHAT_TRACE(where, "modemSendExpectInlineInt got size marker %d", len);
 	if (value_r) *value_r = len;
 	continue;
       }
+      if (c=='\r') continue;
 
-      modem_response_buf[count++]=c;
-      modem_response_buf[count]='\0';
+      if (count < modem_response_max-1) {
+	modem_response_buf[count++]=c;
+	modem_response_buf[count]='\0';
+      }
     }
   }
   modemReleaseBufferMutex(CODEPOINT(where));
@@ -1023,28 +1564,16 @@ bool TraitModem::modemSendExpectIntField(const char *cmd, const char *expect, in
   modemWaitBufferMutex(HERE/*CODEPOINT(where)*/);
   modemSendExpect(cmd, expect, modem_response_buf, modem_response_max, timeout, 1, CODEPOINT(where), flush);
 
-  char *pos = modem_response_buf;
-  int field = 1;
-
-  while (field < field_num) {
-    pos = strchr(pos, separator);
-    if (!pos) {
-      LEAF_ALERT("Field %d not found (exhausted at %d)", field_num, field);
-      modemReleaseBufferMutex(CODEPOINT(where));
-      return false;
-    }
-    ++pos;
-    ++field;
-    LEAF_NOTICE("Field %d == [%s]", field, pos);
-  }
-  LEAF_NOTICE("Selected field is [%s]", pos);
-  char *end;
-  if (end = strchr(pos, separator)) {
-    *end = '\0';
+  ModemFieldTokenizer fields(modem_response_buf, -1, separator);
+  ModemToken field;
+  if (!fields.field(field_num, &field)) {
+    LEAF_ALERT("Field %d not found", field_num);
+    modemReleaseBufferMutex(CODEPOINT(where));
+    return false;
   }
-  LEAF_NOTICE("Trimmed field is [%s]", pos);
+  LEAF_INFO("Selected field %d is [%.*s]", field_num, field.len, field.ptr);
 
-  if (value_r) *value_r = atoi(pos);
+  if (value_r) *value_r = field.toInt();
   modemReleaseBufferMutex(CODEPOINT(where));
   return true;
 }
@@ -1059,39 +1588,16 @@ String TraitModem::modemSendExpectQuotedField(const char *cmd, const char *expec
 
   modemSendExpect(cmd, expect, modem_response_buf, modem_response_max, timeout, 1, CODEPOINT(where));
 
-  char *pos = modem_response_buf;
-  char *next;
-  int field = 1;
-
-  while (field < field_num) {
-    pos = strchr(pos, separator);
-    ++field;
-    if (!pos) {
-      LEAF_ALERT("Field %d not found (exhausted at %d)", field_num, field);
-      modemReleaseBufferMutex(CODEPOINT(where));
-      return String("");
-    }
-    ++pos;
-  }
-
-  if (*pos == '"') {
-    // quoted field, ends at the next quote
-    pos++;
-    next=strchr(pos, '"');
-    if (!next) {
-      LEAF_ALERT("Quote mismatch");
-      modemReleaseBufferMutex(CODEPOINT(where));
-      return String("");
-    }
-    *next = '\0';
-  }
-  else {
-    // unquoted string, ends at the next separator
-    next = strchr(pos, separator);
-    if (next) *next = '\0';
+  ModemFieldTokenizer fields(modem_response_buf, -1, separator);
+  ModemToken field;
+  if (!fields.field(field_num, &field)) {
+    LEAF_ALERT("Field %d not found", field_num);
+    modemReleaseBufferMutex(CODEPOINT(where));
+    return String("");
   }
+  String result = field.toString();
   modemReleaseBufferMutex(CODEPOINT(where));
-  return String(pos);
+  return result;
 }
 
 bool TraitModem::modemSendExpectIntPair(const char *cmd, const char *expect, int *value_r, int *value2_r,int timeout, int lines, codepoint_t where)
@@ -1100,11 +1606,11 @@ bool TraitModem::modemSendExpectIntPair(const char *cmd, const char *expect, int
   bool result = false;
   modemWaitBufferMutex(HERE/*CODEPOINT(where)*/);
   modemSendExpect(cmd, expect, modem_response_buf, modem_response_max, timeout, lines, CODEPOINT(where));
-  char *comma = strchr(modem_response_buf, ',');
-  if (comma) {
-    *comma++='\0';
-    if (value_r) *value_r = atoi(modem_response_buf);
-    if (value2_r) *value2_r = atoi(comma);
+  ModemFieldTokenizer fields(modem_response_buf);
+  ModemToken first, second;
+  if (fields.next(&first) && fields.next(&second)) {
+    if (value_r) *value_r = first.toInt();
+    if (value2_r) *value2_r = second.toInt();
     result = true;
   }
   else {
@@ -1124,9 +1630,9 @@ int TraitModem::modemGetReplyOfSize(char *resp, int size, int timeout, int trace
   unsigned long now;
   int got = 0;
 
-  modem_stream->setTimeout(timeout);
   do {
-    int p = modem_stream->readBytes(resp+got, size);
+    long left = (long)((start+timeout) - millis());
+    int p = modemReadBulk((uint8_t *)resp+got, size-got, (left>0)?left:1, CODEPOINT(where));
     //resp[got+p]='\0';
     if (trace>=0) {
       __LEAF_DEBUG__(trace, "getReplyOfSize got %d/%d bytes", p,size);
@@ -1178,8 +1684,8 @@ void TraitModem::modemChat(Stream *console_stream, bool echo)
       if (echo) console_stream->write(c);
       modem_stream->write(c);
     }
-    if (modem_stream->available()) {
-      char d = modem_stream->read();
+    if (modemInputAvailable()) {
+      char d = modemInputRead();
       console_stream->write(d);
     }
 #ifndef ESP8266
@@ -1190,90 +1696,634 @@ void TraitModem::modemChat(Stream *console_stream, bool echo)
   modemReleasePortMutex(HERE);
 }
 
-bool TraitModem::modemCheckURC()
+//
+// Command engine
+//
+
+bool TraitModem::modemIsFinalResult(const char *line, bool *ok_r)
 {
-  static unsigned long last_urc_log = 0;
-  int level = L_TRACE;
-  if (!last_urc_log || (millis() > (last_urc_log + 30000))) {
-    last_urc_log=millis();
-    level= L_INFO;
+  static const char *fail_results[] = {
+    "ERROR", "+CME ERROR", "+CMS ERROR", "NO CARRIER", "BUSY", "NO ANSWER", "NO DIALTONE", NULL
+  };
+  if (strcmp(line, "OK")==0) {
+    *ok_r = true;
+    return true;
+  }
+  for (int i=0; fail_results[i]; i++) {
+    if (strncmp(line, fail_results[i], strlen(fail_results[i]))==0) {
+      *ok_r = false;
+      return true;
+    }
   }
-  LEAF_ENTER(level);
+  return false;
+}
 
-/*
-  if ((millis()-modem_last_cmd) < 1000) {
-    // the modem was recently sent a command, stay out of its way
-    LEAF_TRACE("modemCheckURC: suppressed mid transaction");
-    return false;
-  }
-*/
+bool TraitModem::modemIsResponse(struct ModemCommand *c, const char *line)
+{
+  static const char *plain_urcs[] = {
+    "RDY", "SMS Ready", "Call Ready", "NORMAL POWER DOWN", "UNDER-VOLTAGE", "OVER-VOLTAGE", "$G", NULL
+  };
 
-  int avail = 0;
-  do {
-    //
-    // don't call wait here, do hold with no timeout, because URC check can+should be
-    // delayed if the modem is in the middle of some other operation
-    //
-    if (!modemHoldPortMutex(HERE, 0, true)) {
-      if (!modem_disabled) {
-	LEAF_DEBUG("modemCheckURC: modem is busy");
-      }
-      // somebody else is talking to the modem right now
-      LEAF_BOOL_RETURN(false);
-    }
-    avail = modem_stream->available();
-    if (avail == 0) {
-      // There's no input from the modem.  This is probably fine but
-      // check if it is awake just in case the little blighter has gone to sleep on us
-      unsigned long now = millis();
-      modemReleasePortMutex(HERE);
-      if (modem_probe_at_urc && (now > (last_urc_probe + modem_urc_probe_interval))) {
-	last_urc_probe = now;
-	modemProbe(HERE, MODEM_PROBE_QUICK);
-      }
-      continue;
+  if ((line[0] == '+') || (line[0] == '*')) {
+    // An extended result belongs to the command only if it carries the
+    // command's own prefix, otherwise it is unsolicited
+    return (c->prefix.length()==0) || (strncmp(line, c->prefix.c_str(), c->prefix.length())==0);
+  }
+  for (int i=0; plain_urcs[i]; i++) {
+    if (strncmp(line, plain_urcs[i], strlen(plain_urcs[i]))==0) {
+      return false;
     }
+  }
+  return true;
+}
 
-    LEAF_INFO("Modem avail = %d", avail);
-    modem_response_buf[0]='\0';
-    wdtReset(HERE);
+// precondition: hold port mutex (and for async commands, keep it until complete)
+void TraitModem::modemCommandStart(struct ModemCommand *c)
+{
+  if (c->timeout < 0) c->timeout = modem_timeout_default;
+  if ((c->prefix.length()==0) && c->cmd.startsWith("AT+")) {
+    int end = 3;
+    while ((end < (int)c->cmd.length()) && isalnum(c->cmd[end])) ++end;
+    c->prefix = c->cmd.substring(2, end);
+  }
+  c->response = "";
+  c->lines = 0;
+  c->ok_deferred = false;
+  c->state = MODEM_CMD_ACTIVE;
+  c->start = millis();
+  c->deadline = c->start + c->timeout;
+  modem_cmd_active = c;
+  modem_rx_expect_final = false;
+  modem_rx_body_left = 0;
+  modemSend(c->cmd.c_str(), HERE);
+}
 
-    int count = modemGetReply(modem_response_buf, modem_response_max,-1,1,0,HERE,false);
+void TraitModem::modemCommandComplete(struct ModemCommand *c, int state)
+{
+  c->state = state;
+  if (modem_cmd_active == c) modem_cmd_active = NULL;
+
+  if (state == MODEM_CMD_TIMEOUT) {
+    LEAF_NOTICE("Modem command timeout [%s] (%dms)", c->cmd.c_str(), (int)(millis()-c->start));
+    // the modem may yet answer, do not mistake its result code for the next command's
+    modemRxExpectFinal(c);
+  }
+  else {
+    LEAF_DEBUG("Modem command complete [%s] => %d (%dms, %d lines)", c->cmd.c_str(), state, (int)(millis()-c->start), c->lines);
+  }
+
+  bool async = c->async;
+  if (c->cb) c->cb(c, c->cb_ctx);
+  if (c->dispose) delete c;
+  if (async) {
+    // the port was held for the duration of the command
     modemReleasePortMutex(HERE);
-    if (count==1 && modem_response_buf[0]=='\0') {
-      // Got a weird null
-      LEAF_INFO("Got a weird NUL from the modem");
-      break;
+  }
+}
+
+// Run the active queued command to completion.
+// precondition: this task holds the port on behalf of the command
+void TraitModem::modemCommandFinish(codepoint_t where)
+{
+  struct ModemCommand *c = modem_cmd_active;
+  if (!c) return;
+  MODEM_CHAT_TRACE(where, "modemCommandFinish [%s]", c->cmd.c_str());
+  while (modem_cmd_active == c) {
+    wdtReset(HERE);
+    modemRxPoll();
+    if ((modem_cmd_active == c) && ((long)(millis() - c->deadline) >= 0)) {
+      modemCommandComplete(c, MODEM_CMD_TIMEOUT);
     }
     else {
-      LEAF_INFO("Got modem reply of %d bytes", count);
-      if (getDebugLevel()>=L_INFO) {
-	DumpHex(L_ALERT, "Here's what we got", modem_response_buf, count);
+      yield();
+    }
+  }
+}
+
+//
+// Consume whatever the modem has sent, one line at a time.  Returns as
+// soon as a synchronous command completes, so that any binary data that
+// follows its response is left for the caller.
+//
+void TraitModem::modemRxPoll()
+{
+  if (!modem_stream) return;
+
+  while (1) {
+    if (modem_stream->available()) {
+      modem_last_rx = millis();
+      modem_rx_ring.fill(modem_stream, -1, true);
+    }
+    ModemToken line;
+    if (!modem_rx_ring.getLine(&line)) break;
+    while ((line.len > 0) && (line.ptr[0] == ' ')) {
+      // trailing space of a '> ' prompt
+      line = line.sub(1);
+    }
+    if (line.len == 0) continue;  // the blank line that leads a V1 response
+    struct ModemCommand *cmd = modem_cmd_active;
+    modemRxLine(line.ptr);
+    if (cmd && !cmd->async && cmd->done()) return;
+  }
+
+  // a prompt is not followed by a newline, so is what remains
+  if ((modem_rx_ring.at(0) == '>') && (modem_rx_ring.length() <= 2) &&
+      modem_cmd_active && modem_cmd_active->data) {
+    struct ModemCommand *cmd = modem_cmd_active;
+    MODEM_CHAT_TRACE(HERE, "modemRxPoll RCVD prompt, sending %d bytes", (int)cmd->data_len);
+    modem_rx_ring.clear();
+    modemSendRaw(cmd->data, cmd->data_len, HERE);
+    cmd->data = NULL;
+  }
+}
+
+void TraitModem::modemRxLine(const char *line)
+{
+  struct ModemCommand *c = modem_cmd_active;
+  bool ok;
+
+  if (c) {
+    MODEM_CHAT_TRACE(HERE, "modemRxLine RCVD[%s] (%dms, line %d/%d)", line, (int)(millis()-c->start), c->lines+1, c->max_lines);
+  }
+  else {
+    MODEM_CHAT_TRACE(HERE, "modemRxLine RCVD[%s]", line);
+  }
+  if (do_chat_log && parent) parent->fslog(HERE, IP_LOG_FILE, "<%s", line);
+
+  if (c && (c->lines == 0) && (c->cmd == line)) {
+    // command echo (modem has not yet been told ATE0)
+    return;
+  }
+
+  if (modem_rx_body_left && modemRxBodyLine(c, line)) {
+    return;
+  }
+
+  if (modem_rx_expect_final && ((long)(millis() - modem_rx_expect_final_until) >= 0)) {
+    // its result code was consumed elsewhere (or never came)
+    modem_rx_expect_final = false;
+  }
+
+  if (modemIsFinalResult(line, &ok)) {
+    if (c) {
+      if (c->response.length()) c->response += '\n';
+      c->response += line;
+      c->lines++;
+      if (ok && c->max_lines && c->prefix.length() && (c->lines < c->max_lines)) {
+	// some commands (eg SHREAD) say OK first and then deliver
+	// their prefixed reply, keep listening for it
+	c->ok_deferred = true;
+	return;
       }
+      modemCommandComplete(c, ok?MODEM_CMD_OK:MODEM_CMD_ERROR);
+    }
+    else if (modem_rx_expect_final) {
+      modem_rx_expect_final = false;
     }
+    else {
+      LEAF_INFO("Stray result code [%s], somebody didn't clean up", line);
+    }
+    return;
+  }
 
-    // Strip off any leading OKs
-    while ((count > 4) && (strncmp(modem_response_buf, "OK\r\n", 4)==0)) {
-      memmove(modem_response_buf, modem_response_buf+4, count+1);
-      count -= 4;
+  if (c && modemIsResponse(c, line)) {
+    if (c->response.length()) c->response += '\n';
+    c->response += line;
+    c->lines++;
+    if (c->ok_deferred && c->prefix.length() && (strncmp(line, c->prefix.c_str(), c->prefix.length())==0)) {
+      // the reply that followed an early OK, anything after it is payload
+      modemCommandComplete(c, MODEM_CMD_OK);
+    }
+    else if (c->max_lines && (c->lines >= c->max_lines)) {
+      // caller wants no more, the result code that follows is surplus
+      // (a synchronous caller reads anything after this line itself)
+      modemRxExpectFinal(c);
+      modemCommandComplete(c, MODEM_CMD_OK);
+    }
+    else {
+      modemRxBodyExpect(line, false);
     }
+    return;
+  }
+
+  if (!c && modem_rx_expect_final && modem_rx_trailing_prefix.length() &&
+      (strncmp(line, modem_rx_trailing_prefix.c_str(), modem_rx_trailing_prefix.length())==0)) {
+    LEAF_DEBUG("Discard surplus response line [%s]", line);
+    modemRxBodyExpect(line, false);
+    return;
+  }
+
+  modemStashURC(line);
+  modemRxBodyExpect(line, true);
+}
+
+// The remainder of a command's reply will turn up unannounced, for a while
+void TraitModem::modemRxExpectFinal(struct ModemCommand *c)
+{
+  modem_rx_expect_final = true;
+  modem_rx_expect_final_until = millis() + c->timeout;
+  modem_rx_trailing_prefix = c->prefix;
+}
+
+//
+// A message header (+CMGR, +CMGL or a +CMT delivery) is followed by the
+// message body, which may contain anything, including lines that look
+// like responses.  With AT+CSDH=1 the header ends with the body length,
+// otherwise the body is one line.
+//
+void TraitModem::modemRxBodyExpect(const char *line, bool urc)
+{
+  static const struct { const char *prefix; int fields; } headers[] = {
+    {"+CMGR: ", 10}, {"+CMGL: ", 7}, {"+CMT: ", 10}, {NULL, 0}
+  };
+  for (int i=0; headers[i].prefix; i++) {
+    int plen = strlen(headers[i].prefix);
+    if (strncmp(line, headers[i].prefix, plen) != 0) continue;
+    ModemFieldTokenizer fields(line+plen);
+    ModemToken field;
+    int count = 0;
+    while (fields.next(&field)) ++count;
+    modem_rx_body_left = (count >= headers[i].fields)?field.toInt(-1):-1;
+    if (modem_rx_body_left == 0) return;
+    if (modem_rx_body_left < 0) modem_rx_body_left = -1;
+    modem_rx_body_urc = urc;
+    return;
+  }
+}
+
+//
+// Take a line of a message body, without classifying it.  Returns false
+// if the line is in fact the result code that ends the reply (the count
+// of body bytes can be short, since blank lines never reach us).
+//
+bool TraitModem::modemRxBodyLine(struct ModemCommand *c, const char *line)
+{
+  int len = strlen(line);
+  bool ok;
+  if ((modem_rx_body_left > 0) && (modem_rx_body_left < len+1) && modemIsFinalResult(line, &ok)) {
+    modem_rx_body_left = 0;
+    return false;
+  }
+  if (modem_rx_body_left > 0) {
+    // lines within a body end with LF alone
+    modem_rx_body_left -= len+1;
+    if (modem_rx_body_left < 0) modem_rx_body_left = 0;
+  }
+  else {
+    modem_rx_body_left = 0;
+  }
 
-    if (strlen(modem_response_buf) == 0) {
-      // this is whitespace that a previous interaction ought to have ceonsumed
-      LEAF_INFO("Hmmn, URC is empty after whitespace strip, somebody didn't clean up");
+  if (c) {
+    if (c->response.length()) c->response += '\n';
+    c->response += line;
+  }
+  else if (modem_rx_body_urc) {
+    modemStashURCBody(line);
+  }
+  else {
+    LEAF_DEBUG("Discard surplus message body [%s]", line);
+  }
+  return true;
+}
+
+void TraitModem::modemStashURC(const char *line)
+{
+  modemUrcLock();
+  if (modem_urc_count >= MODEM_URC_BACKLOG) {
+    LEAF_WARN("URC backlog full, discarding [%s]", modem_urc_backlog[0].c_str());
+    for (int i=1; i<MODEM_URC_BACKLOG; i++) modem_urc_backlog[i-1] = modem_urc_backlog[i];
+    --modem_urc_count;
+  }
+  modem_urc_backlog[modem_urc_count++] = line;
+  modemUrcUnlock();
+}
+
+// Append a line of message body to the URC that announced it
+void TraitModem::modemStashURCBody(const char *line)
+{
+  modemUrcLock();
+  if (modem_urc_count) {
+    String &urc = modem_urc_backlog[modem_urc_count-1];
+    urc += '\n';
+    urc += line;
+  }
+  modemUrcUnlock();
+}
+
+// precondition: do not hold port mutex (URC handlers may talk to the modem)
+//
+// With a service task, URC handlers run on the loop task only (they
+// connect, disconnect, route SMS commands and feed the GNSS parser), the
+// service task leaves the backlog for loop() to dispatch.
+//
+void TraitModem::modemDispatchURC()
+{
+  if (modemOnServiceTask()) {
+    return;
+  }
+  while (1) {
+    String urc;
+    modemUrcLock();
+    if (modem_urc_count &&
+	!((modem_urc_count == 1) && modem_rx_body_left && modem_rx_body_urc)) {
+      // (the last one waits if its message body is still arriving)
+      urc = modem_urc_backlog[0];
+      for (int i=1; i<modem_urc_count; i++) modem_urc_backlog[i-1] = modem_urc_backlog[i];
+      modem_urc_backlog[--modem_urc_count] = "";
     }
-    else if (strcmp(modem_response_buf, "OK")==0) {
-      // this is a response a previous interaction ought to have consumed
-      LEAF_INFO("Hmmn, URC is merely a stray \"OK\", someobody didn't clean up");
+    modemUrcUnlock();
+    if (!urc.length()) break;
+    LEAF_INFO("Dispatch URC [%s]", urc.c_str());
+    modemProcessURC(urc);
+  }
+}
+
+//
+// Run a command to completion in the calling task.   Any queued command
+// that is already talking to the modem is allowed to finish first.
+//
+// precondtion: hold buffer mutex
+//
+bool TraitModem::modemCommandRun(struct ModemCommand *c, bool flush)
+{
+  unsigned long start = millis();
+  if (c->timeout < 0) c->timeout = modem_timeout_default;
+
+  while (modem_cmd_active) {
+    wdtReset(HERE);
+    if (modem_cmd_active->async && modemPortIsMine()) {
+      modemCommandFinish(HERE);
+    }
+    else if ((millis() - start) > (unsigned long)c->timeout) {
+      LEAF_WARN("Modem engine busy with [%s], cannot send [%s]", modem_cmd_active->cmd.c_str(), c->cmd.c_str());
+      c->state = MODEM_CMD_TIMEOUT;
+      return false;
     }
     else {
-      modemProcessURC(String(modem_response_buf));
+      vTaskDelay(1);
+    }
+  }
+
+  if (flush) {
+    // absorb anything outstanding (URCs are held for dispatch)
+    modemRxPoll();
+    modem_rx_ring.clear();
+  }
+  c->async = false;
+  modemCommandStart(c);
+  while (!c->done()) {
+    wdtReset(HERE);
+    modemRxPoll();
+    if (!c->done() && ((long)(millis() - c->deadline) >= 0)) {
+      modemCommandComplete(c, MODEM_CMD_TIMEOUT);
+    }
+    else if (!c->done()) {
+      yield();
+    }
+  }
+  return c->ok();
+}
+
+bool TraitModem::modemCommandSubmit(struct ModemCommand *c)
+{
+  if (!modem_cmd_queue) {
+    modem_cmd_queue = xQueueCreate(MODEM_COMMAND_QUEUE_SIZE, sizeof(struct ModemCommand *));
+    if (!modem_cmd_queue) {
+      LEAF_ALERT("Modem command queue create failed");
+      return false;
+    }
+  }
+  c->async = true;
+  c->state = MODEM_CMD_QUEUED;
+  if (xQueueSend(modem_cmd_queue, &c, 0) != pdTRUE) {
+    LEAF_WARN("Modem command queue full, dropping [%s]", c->cmd.c_str());
+    c->state = MODEM_CMD_IDLE;
+    return false;
+  }
+  LEAF_DEBUG("Modem command queued [%s]", c->cmd.c_str());
+  modemServiceWake();
+  return true;
+}
+
+bool TraitModem::modemCommandSubmit(const char *cmd, modem_command_cb_t cb, void *cb_ctx, int timeout)
+{
+  struct ModemCommand *c = new ModemCommand();
+  c->cmd = cmd;
+  c->cb = cb;
+  c->cb_ctx = cb_ctx;
+  c->timeout = timeout;
+  c->dispose = true;
+  if (!modemCommandSubmit(c)) {
+    delete c;
+    return false;
+  }
+  return true;
+}
+
+//
+// Advance the command engine: consume input, expire a queued command
+// whose deadline has passed, start the next queued command, and finally
+// hand any unsolicited lines to modemProcessURC.
+//
+// Returns false if some other task is busy with the modem.
+//
+bool TraitModem::modemPoll()
+{
+  struct ModemCommand *c = modem_cmd_active;
+  bool holding = false;
+  unsigned long start = micros();
+  unsigned long held = 0;
+
+  ++modem_poll_count;
+  if (c) {
+    if (!c->async || !modemPortIsMine()) {
+      // somebody else is talking to the modem right now
+      ++modem_poll_busy;
+      return false;
     }
-  } while (avail > 0);
+  }
+  else {
+    //
+    // don't call wait here, do hold with no timeout, because a poll can+should be
+    // delayed if the modem is in the middle of some other operation
+    //
+    if (!modemHoldPortMutex(HERE, 0, true)) {
+      ++modem_poll_busy;
+      return false;
+    }
+    holding = true;
+    held = micros();
+  }
+
+  modemRxPoll();
+  c = modem_cmd_active;
+  if (c && ((long)(millis() - c->deadline) >= 0)) {
+    modemCommandComplete(c, MODEM_CMD_TIMEOUT);
+  }
+
+  if (!modem_cmd_active && modem_cmd_queue && uxQueueMessagesWaiting(modem_cmd_queue)) {
+    if (!holding) {
+      holding = modemHoldPortMutex(HERE, 0, true);
+      if (holding) held = micros();
+    }
+    struct ModemCommand *next = NULL;
+    if (holding && (xQueueReceive(modem_cmd_queue, &next, 0) == pdTRUE)) {
+      // the port now belongs to the command until it completes
+      modemCommandStart(next);
+      modem_poll_hold_us += micros() - held;
+      holding = false;
+    }
+  }
+
+  if (holding) {
+    modem_poll_hold_us += micros() - held;
+    modemReleasePortMutex(HERE);
+  }
+  modem_poll_us += micros() - start;
+  modemDispatchURC();
+  return true;
+}
+
+void TraitModem::modemIdleProbeDone(struct ModemCommand *c, void *ctx)
+{
+  TraitModem *modem = (TraitModem *)ctx;
+  if (!c->ok()) modem->modem_idle_probe_failed = true;
+  modem->modem_idle_probe_pending = false;
+}
+
+bool TraitModem::modemCheckURC()
+{
+  LEAF_ENTER(L_TRACE);
+
+  bool idle = !modemCommandPending() && modem_stream && !modem_stream->available();
+  if (!modemPoll()) {
+    if (!modem_disabled) {
+      LEAF_DEBUG("modemCheckURC: modem is busy");
+    }
+    LEAF_BOOL_RETURN(false);
+  }
+
+  unsigned long now = millis();
+  if (modem_idle_probe_failed) {
+    // the queued probe got no answer, try harder (this waits on the modem)
+    unsigned long start = micros();
+    modem_idle_probe_failed = false;
+    modemProbe(HERE, MODEM_PROBE_QUICK);
+    modem_poll_hold_us += micros() - start;
+  }
+  else if (idle && modem_probe_at_urc && !modem_idle_probe_pending &&
+      (now > (modem_last_rx + modem_urc_probe_interval)) &&
+      (now > (last_urc_probe + modem_urc_probe_interval))) {
+    // There's been no input from the modem for a while.  This is probably fine but
+    // check if it is awake just in case the little blighter has gone to sleep on us
+    last_urc_probe = now;
+    ++modem_probe_count;
+    modem_idle_probe_pending = true;
+    if (!modemCommandSubmit("AT", modemIdleProbeDone, this)) {
+      modem_idle_probe_pending = false;
+    }
+  }
 
   LEAF_BOOL_RETURN(true);
 }
 
+//
+// How long the service task may sleep: until woken by the modem, or
+// until the active command times out or an idle probe falls due.
+//
+int TraitModem::modemServiceWaitTime()
+{
+  int wait = modem_rx_event?modem_service_idle_msec:modem_service_poll_msec;
+  unsigned long now = millis();
+
+  struct ModemCommand *c = modem_cmd_active;
+  if (c) {
+    long left = (long)(c->deadline - now);
+    if (left < wait) wait = (left > 0)?left:1;
+  }
+  if (modem_probe_at_urc && modem_present && !modem_disabled && !modem_idle_probe_pending) {
+    unsigned long due = max(modem_last_rx, last_urc_probe) + modem_urc_probe_interval;
+    long left = (long)(due - now) + 1;
+    // an overdue probe that could not be sent (modem busy) is retried at
+    // the poll interval, not in a tight loop
+    if (left <= 0) left = modem_service_poll_msec;
+    if (left < wait) wait = left;
+  }
+  return wait;
+}
+
+void TraitModem::modemService()
+{
+  if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(modemServiceWaitTime())) == 0) {
+    ++modem_wake_timeout;
+  }
+  if (!modem_present || modem_disabled) {
+    // nothing to probe, don't come straight back for it
+    last_urc_probe = millis();
+    return;
+  }
+  if (!modemCheckURC()) {
+    // the port is busy, whoever has it is talking to the modem anyway
+    last_urc_probe = millis();
+  }
+}
+
+static void modem_service_loop(void *args)
+{
+  TraitModem *modem = (TraitModem *)args;
+  while (1) {
+    modem->modemService();
+  }
+}
+
+void ARDUINO_ISR_ATTR modemRingISR(void *arg)
+{
+  TraitModem *modem = (TraitModem *)arg;
+  BaseType_t woken = pdFALSE;
+  ++modem->modem_wake_ri;
+  if (modem->modem_service_handle) vTaskNotifyGiveFromISR(modem->modem_service_handle, &woken);
+  if (woken) portYIELD_FROM_ISR();
+}
+
+bool TraitModem::modemServiceStart()
+{
+  LEAF_ENTER(L_NOTICE);
+  if (modem_service_handle) {
+    LEAF_BOOL_RETURN(true);
+  }
+
+  char task_name[32];
+  snprintf(task_name, sizeof(task_name), "%s_modem", getNameStr());
+  LEAF_NOTICE("Create modem service task %s", task_name);
+  modemServiceStatsReset();
+  if (!modem_urc_mutex) modem_urc_mutex = xSemaphoreCreateMutex();
+  if (xTaskCreateUniversal(&modem_service_loop, task_name, MODEM_SERVICE_STACK_SIZE, this, 1,
+			   &modem_service_handle, ARDUINO_RUNNING_CORE) != pdPASS) {
+    LEAF_ALERT("Modem service task create failed, modem will be polled from loop");
+    modem_service_handle = NULL;
+    LEAF_BOOL_RETURN(false);
+  }
+
+  if (pin_ri >= 0) {
+    LEAF_NOTICE("Modem ring indicator on pin %d wakes the service task", (int)pin_ri);
+    pinMode(pin_ri, INPUT_PULLUP);
+    attachInterruptArg(pin_ri, modemRingISR, this, (level_ri==HIGH)?FALLING:RISING);
+  }
+#if ESP_ARDUINO_VERSION >= ESP_ARDUINO_VERSION_VAL(2,0,5)
+  if (modem_uart && (modem_uart == modem_stream)) {
+    modem_uart->onReceive([this](){
+      ++modem_wake_rx;
+      modemServiceWake();
+    });
+    modem_rx_event = true;
+  }
+#endif
+  if (!modem_rx_event) {
+    LEAF_NOTICE("No receive event for this modem stream, servicing every %dms", modem_service_poll_msec);
+  }
+
+  LEAF_BOOL_RETURN(true);
+}
 
 #endif
 // local Variables:
@@ -11,7 +11,9 @@ public:
   }
   
 protected:
-  bool changed;
+  bool changed = false;
+  bool report_deferred = false;
+  bool report_skipped = false;  // a change the policy suppressed, sent at the next interval
 
   unsigned long last_sample = 0;
   unsigned long last_report = 0;
@@ -36,21 +38,37 @@ protected:
     if ((last_sample == 0) ||
 	((sample_interval_ms + last_sample) <= now)
       ) {
-      // time to take a new sample
-      changed = poll();
+      // time to take a new sample (a change stays pending until it is reported)
+      if (poll()) {
+	changed = true;
+	report_skipped = false;
+      }
       last_sample = now;
       TRACE("Set last_sample to %lu", now);
     }
     
     if ( (last_report == 0) ||
-	 changed ||
-	 ((report_interval_sec > 0) && ((last_report + report_interval_sec * 1000) <= now))
+	 (changed && !report_skipped) ||
+	 ((report_interval_sec > 0) && ((last_report + pubsub_report_interval(report_interval_sec) * 1000) <= now))
       ) {
       // Publish a report every N seconds, or if changed by more than d%
+      // (unless the reporting policy says to hold off)
+      int policy = pubsub_report_policy(PUBSUB_CLASS_TELEMETRY, report_deferred);
+      report_deferred = (policy == PUBSUB_REPORT_DEFER);
+      if (report_deferred) {
+	// leave changed set, and ask again next time around
+	return;
+      }
+      last_report = now;
+      if (policy != PUBSUB_REPORT_NOW) {
+	// suppressed: keep the change, to be reported in the next slot
+	report_skipped = true;
+	return;
+      }
       DEBUG("Publishing status");
       status_pub();
-      last_report = now;
       changed = false;
+      report_skipped = false;
     }
 
     LEAVE;